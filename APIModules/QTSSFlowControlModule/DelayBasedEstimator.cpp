@@ -0,0 +1,143 @@
+/*
+    File:       DelayBasedEstimator.cpp
+
+    Contains:   Implementation of DelayBasedEstimator
+*/
+
+#include <math.h>
+
+#include "DelayBasedEstimator.h"
+
+static const Float64 kDelaySmoothing = 0.6;     // weight of the previous smoothed delay
+static const Float64 kInitialThreshold = 12.5;
+static const Float64 kMinThreshold = 6;
+static const Float64 kMaxThreshold = 100;
+static const Float64 kThresholdUp = 0.1;        // per report, GCC's k_u and k_d for sparse samples
+static const Float64 kThresholdDown = 0.01;
+static const Float64 kMaxThresholdStep = 15;    // jumps above this don't move the threshold
+static const Float64 kDecreaseFactor = 0.85;
+static const Float64 kIncreasePerSec = 1.08;
+static const Float64 kMaxAboveSendRate = 1.5;   // an application limited sender doesn't prove more
+
+DelayBasedEstimator::DelayBasedEstimator()
+    : fSmoothedDelay(0),
+      fNumSamples(0),
+      fNextSample(0),
+      fSlope(0),
+      fThreshold(kInitialThreshold),
+      fNumOverusing(0),
+      fUsage(kNormal),
+      fTargetBitRate(0),
+      fLastUpdateTime(0) {
+}
+
+void DelayBasedEstimator::OnReceiverReport(SInt64 inCurrentTime, SInt64 inDelay, UInt8 inFractionLost,
+                                           UInt32 inSendBitRate) {
+  this->UpdateTrend(inCurrentTime, inDelay);
+  this->DetectUsage();
+  this->UpdateTarget(inCurrentTime, inFractionLost, inSendBitRate);
+}
+
+void DelayBasedEstimator::UpdateTrend(SInt64 inCurrentTime, SInt64 inDelay) {
+  if (fNumSamples == 0)
+    fSmoothedDelay = (Float64) inDelay;
+  else
+    fSmoothedDelay = kDelaySmoothing * fSmoothedDelay + (1 - kDelaySmoothing) * (Float64) inDelay;
+
+  fSampleTimes[fNextSample] = inCurrentTime;
+  fSampleDelays[fNextSample] = fSmoothedDelay;
+  fNextSample = (fNextSample + 1) % kTrendWindow;
+  if (fNumSamples < kTrendWindow)
+    fNumSamples++;
+
+  if (fNumSamples < 3) {
+    fSlope = 0;
+    return;
+  }
+
+  // least squares slope of the smoothed delay over the window, x in seconds
+  SInt64 theFirstTime = fSampleTimes[(fNextSample + kTrendWindow - fNumSamples) % kTrendWindow];
+  Float64 theMeanX = 0, theMeanY = 0;
+  for (UInt32 x = 0; x < fNumSamples; x++) {
+    theMeanX += (Float64) (fSampleTimes[x] - theFirstTime) / 1000;
+    theMeanY += fSampleDelays[x];
+  }
+  theMeanX /= fNumSamples;
+  theMeanY /= fNumSamples;
+
+  Float64 theNumerator = 0, theDenominator = 0;
+  for (UInt32 x = 0; x < fNumSamples; x++) {
+    Float64 theX = (Float64) (fSampleTimes[x] - theFirstTime) / 1000 - theMeanX;
+    theNumerator += theX * (fSampleDelays[x] - theMeanY);
+    theDenominator += theX * theX;
+  }
+
+  fSlope = (theDenominator > 0) ? theNumerator / theDenominator : 0;
+}
+
+void DelayBasedEstimator::DetectUsage() {
+  Float64 theSlope = fSlope;
+
+  if (theSlope > fThreshold) {
+    // one report may be a burst, two in a row or a steep one is a queue
+    fNumOverusing++;
+    fUsage = (fNumOverusing >= 2 || theSlope > 2 * fThreshold) ? kOverusing : kNormal;
+  } else {
+    fNumOverusing = 0;
+    fUsage = (theSlope < -fThreshold) ? kUnderusing : kNormal;
+  }
+
+  // the threshold follows the slope, slowly down so a steady queue still shows
+  Float64 theError = fabs(theSlope) - fThreshold;
+  if (theError <= kMaxThresholdStep) {
+    fThreshold += theError * (theError > 0 ? kThresholdUp : kThresholdDown);
+    if (fThreshold < kMinThreshold)
+      fThreshold = kMinThreshold;
+    else if (fThreshold > kMaxThreshold)
+      fThreshold = kMaxThreshold;
+  }
+}
+
+void DelayBasedEstimator::UpdateTarget(SInt64 inCurrentTime, UInt8 inFractionLost, UInt32 inSendBitRate) {
+  if (inSendBitRate == 0)
+    return; // nothing sent lately, nothing learned
+
+  if (fTargetBitRate == 0) {
+    fTargetBitRate = inSendBitRate;
+    fLastUpdateTime = inCurrentTime;
+    return;
+  }
+
+  Float64 theTarget = fTargetBitRate;
+  Float64 theElapsedSecs = (Float64) (inCurrentTime - fLastUpdateTime) / 1000;
+  if (theElapsedSecs > 1)
+    theElapsedSecs = 1;
+  fLastUpdateTime = inCurrentTime;
+
+  switch (fUsage) {
+    case kOverusing:
+      theTarget = kDecreaseFactor * (theTarget < inSendBitRate ? theTarget : inSendBitRate);
+      break;
+
+    case kUnderusing:
+      break; // the queue drains, hold
+
+    case kNormal:
+      theTarget *= pow(kIncreasePerSec, theElapsedSecs);
+      if (theTarget > kMaxAboveSendRate * inSendBitRate)
+        theTarget = kMaxAboveSendRate * inSendBitRate;
+      break;
+  }
+
+  // above 10% loss the delay signal came too late, cut by half the loss
+  if (inFractionLost > 26) {
+    Float64 theLossCap = inSendBitRate * (1 - 0.5 * inFractionLost / 256.0);
+    if (theTarget > theLossCap)
+      theTarget = theLossCap;
+  }
+
+  if (theTarget < kMinBitRate)
+    theTarget = kMinBitRate;
+
+  fTargetBitRate = (UInt32) theTarget;
+}
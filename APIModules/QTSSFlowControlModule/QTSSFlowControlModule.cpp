@@ -30,8 +30,12 @@
 
 #include <stdio.h>
 
+#include <CF/Core/Time.h>
+
 #include "QTSSFlowControlModule.h"
 #include "QTSSModuleUtils.h"
+#include "RTCPPacket.h"
+#include "DelayBasedEstimator.h"
 
 //Turns on printfs that are useful for debugging
 #define FLOW_CONTROL_DEBUGGING 0
@@ -41,6 +45,7 @@
 static QTSS_AttributeID sNumLossesAboveTolAttr = qtssIllegalAttrID;
 static QTSS_AttributeID sNumLossesBelowTolAttr = qtssIllegalAttrID;
 static QTSS_AttributeID sNumWorsesAttr = qtssIllegalAttrID;
+static QTSS_AttributeID sEstimatorAttr = qtssIllegalAttrID;
 
 // STATIC VARIABLES
 
@@ -55,6 +60,7 @@ static UInt32 sDefaultLossThickTolerance = 5;
 static UInt32 sDefaultLossesToThick = 6;
 static UInt32 sDefaultWorsesToThin = 2;
 static bool sDefaultModuleEnabled = true;
+static bool sDefaultDelayBasedEnabled = true;
 
 // Current values for preferences
 static UInt32 sLossThinTolerance = 30;
@@ -63,10 +69,27 @@ static UInt32 sLossThickTolerance = 5;
 static UInt32 sLossesToThick = 6;
 static UInt32 sWorsesToThin = 2;
 static bool sModuleEnabled = true;
+static bool sDelayBasedEnabled = true;
 
 // Server preference we respect
 static bool sDisableThinning = false;
 
+// After thinning a stream isn't thickened for this long. A thicken that thins
+// again soon doubles it, so a client at its limit stops flapping.
+static const SInt64 kMinThickHoldMsec = 4000;
+static const SInt64 kMaxThickHoldMsec = 64000;
+
+// Delay based control of one client session
+struct SessionEstimator {
+  explicit SessionEstimator(QTSS_RTPStreamObject inStream)
+      : fStream(inStream), fLastThinTime(0), fLastThickTime(0), fThickHoldMsec(kMinThickHoldMsec) {}
+
+  QTSS_RTPStreamObject fStream; // the reports used, delays of two streams don't compare
+  DelayBasedEstimator fEstimator;
+  SInt64 fLastThinTime;
+  SInt64 fLastThickTime;
+  SInt64 fThickHoldMsec;
+};
 
 // FUNCTION PROTOTYPES
 
@@ -76,7 +99,10 @@ static QTSS_Error Register(QTSS_Register_Params *inParams);
 static QTSS_Error Initialize(QTSS_Initialize_Params *inParams);
 static QTSS_Error RereadPrefs();
 static QTSS_Error ProcessRTCPPacket(QTSS_RTCPProcess_Params *inParams);
+static QTSS_Error DestroySession(QTSS_ClientSessionClosing_Params *inParams);
 static void InitializeDictionaryItems(QTSS_RTPStreamObject inStream);
+static SessionEstimator *UpdateEstimator(QTSS_RTCPProcess_Params *inParams, SInt64 inCurrentTime, bool *outNewReport);
+static bool CanThicken(SessionEstimator *inState, QTSS_ClientSessionObject inSession, SInt64 inCurrentTime);
 
 QTSS_Error QTSSFlowControlModule_Main(void *inPrivateArgs) {
   return _stublibrary_main(inPrivateArgs, QTSSFlowControlModuleDispatch);
@@ -89,6 +115,7 @@ QTSS_Error QTSSFlowControlModuleDispatch(QTSS_Role inRole,
     case QTSS_Initialize_Role: return Initialize(&inParamBlock->initParams);
     case QTSS_RereadPrefs_Role: return RereadPrefs();
     case QTSS_RTCPProcess_Role: return ProcessRTCPPacket(&inParamBlock->rtcpProcessParams);
+    case QTSS_ClientSessionClosing_Role: return DestroySession(&inParamBlock->clientSessionClosingParams);
     default: break;
   }
   return QTSS_NoErr;
@@ -99,7 +126,7 @@ QTSS_Error Register(QTSS_Register_Params *inParams) {
   (void) QTSS_AddRole(QTSS_Initialize_Role);
   (void) QTSS_AddRole(QTSS_RTCPProcess_Role);
   (void) QTSS_AddRole(QTSS_RereadPrefs_Role);
-
+  (void) QTSS_AddRole(QTSS_ClientSessionClosing_Role);
 
   // Add other attributes
   static char *sNumLossesAboveToleranceName = "QTSSFlowControlModuleLossAboveTol";
@@ -115,6 +142,10 @@ QTSS_Error Register(QTSS_Register_Params *inParams) {
   (void) QTSS_AddStaticAttribute(qtssRTPStreamObjectType, sNumGettingWorsesName, NULL, qtssAttrDataTypeUInt32);
   (void) QTSS_IDForAttr(qtssRTPStreamObjectType, sNumGettingWorsesName, &sNumWorsesAttr);
 
+  static char *sEstimatorName = "QTSSFlowControlModuleEstimator";
+  (void) QTSS_AddStaticAttribute(qtssClientSessionObjectType, sEstimatorName, NULL, qtssAttrDataTypeVoidPointer);
+  (void) QTSS_IDForAttr(qtssClientSessionObjectType, sEstimatorName, &sEstimatorAttr);
+
   // Tell the server our name!
   static char *sModuleName = "QTSSFlowControlModule";
   ::strcpy(inParams->outModuleName, sModuleName);
@@ -173,6 +204,13 @@ QTSS_Error RereadPrefs() {
                                 &sDefaultModuleEnabled,
                                 sizeof(sDefaultModuleEnabled));
 
+  QTSSModuleUtils::GetAttribute(sPrefs,
+                                "flow_control_delay_based_enabled",
+                                qtssAttrDataTypeBool16,
+                                &sDelayBasedEnabled,
+                                &sDefaultDelayBasedEnabled,
+                                sizeof(sDefaultDelayBasedEnabled));
+
   UInt32 len = sizeof(sDisableThinning);
   (void) QTSS_GetValue(sServerPrefs,
                        qtssPrefsDisableThinning,
@@ -235,9 +273,19 @@ QTSS_Error ProcessRTCPPacket(QTSS_RTCPProcess_Params *inParams) {
 
   //More bandwidth will be served if the client reports "getting better"
 
+  //With flow_control_delay_based_enabled, less bandwidth will also be served as soon
+  //as the round trips of the receiver reports grow (see DelayBasedEstimator), and
+  //none of the above serves more until the estimate has room for it.
+
   //If the initial values of our dictionary items aren't yet in, put them in.
   InitializeDictionaryItems(inParams->inRTPStream);
 
+  SInt64 theCurrentTime = QTSS_Milliseconds();
+  bool isNewReport = false;
+  SessionEstimator *theEstimator = NULL;
+  if (sDelayBasedEnabled)
+    theEstimator = UpdateEstimator(inParams, theCurrentTime, &isNewReport);
+
   QTSS_RTPStreamObject theStream = inParams->inRTPStream;
 
   bool ratchetMore = false;
@@ -380,6 +428,21 @@ QTSS_Error ProcessRTCPPacket(QTSS_RTCPProcess_Params *inParams) {
   if ((uint16Ptr != NULL) && (theLen == sizeof(UInt16)) && (*uint16Ptr > 0))
     ratchetMore = true;
 
+  //A queue building up on the path thins before the losses show up
+  if (isNewReport && (theEstimator->fEstimator.GetUsage() == DelayBasedEstimator::kOverusing)) {
+#if FLOW_CONTROL_DEBUGGING
+    s_printf("Round trip growing %f msec/sec. Ratcheting less\n", theEstimator->fEstimator.GetDelaySlope());
+#endif
+    ratchetLess = true;
+  }
+
+  if (ratchetMore && !ratchetLess && (theEstimator != NULL) && !CanThicken(theEstimator, inParams->inClientSession, theCurrentTime)) {
+#if FLOW_CONTROL_DEBUGGING
+    s_printf("Target bit rate %"   _U32BITARG_   " has no room. Not ratcheting more\n", theEstimator->fEstimator.GetTargetBitRate());
+#endif
+    ratchetMore = false;
+  }
+
   //For clearing out counts below
   UInt32 zero = 0;
 
@@ -405,6 +468,16 @@ QTSS_Error ProcessRTCPPacket(QTSS_RTCPProcess_Params *inParams) {
       numQualityLevels = *uint32Ptr;
 
     if ((ratchetLess) && (curQuality < numQualityLevels)) {
+      if (theEstimator != NULL) {
+        // thinned again right after a thicken: wait longer next time
+        if (theCurrentTime - theEstimator->fLastThickTime < 2 * theEstimator->fThickHoldMsec) {
+          theEstimator->fThickHoldMsec *= 2;
+          if (theEstimator->fThickHoldMsec > kMaxThickHoldMsec)
+            theEstimator->fThickHoldMsec = kMaxThickHoldMsec;
+        } else
+          theEstimator->fThickHoldMsec = kMinThickHoldMsec;
+        theEstimator->fLastThinTime = theCurrentTime;
+      }
       curQuality++;
       if (curQuality
           > 1) // v3.0.1=v2.0.1 make level 2 means key frames in the file or max if reflected.
@@ -415,6 +488,8 @@ QTSS_Error ProcessRTCPPacket(QTSS_RTCPProcess_Params *inParams) {
                            &curQuality,
                            sizeof(curQuality));
     } else if ((ratchetMore) && (curQuality > 0)) {
+      if (theEstimator != NULL)
+        theEstimator->fLastThickTime = theCurrentTime;
       curQuality--;
       if (curQuality
           > 1)  // v3.0.1=v2.0.1 make level 2 means key frames in the file or max if reflected.
@@ -530,3 +605,91 @@ void InitializeDictionaryItems(QTSS_RTPStreamObject inStream) {
                          sizeof(theValueLen));
   }
 }
+
+QTSS_Error DestroySession(QTSS_ClientSessionClosing_Params *inParams) {
+  SessionEstimator *theEstimator = NULL;
+  UInt32 theLen = sizeof(theEstimator);
+  QTSS_Error theErr = QTSS_GetValue(inParams->inClientSession, sEstimatorAttr, 0, &theEstimator, &theLen);
+  if ((theErr == QTSS_NoErr) && (theEstimator != NULL))
+    delete theEstimator;
+
+  return QTSS_NoErr;
+}
+
+SessionEstimator *UpdateEstimator(QTSS_RTCPProcess_Params *inParams, SInt64 inCurrentTime, bool *outNewReport) {
+  *outNewReport = false;
+
+  SessionEstimator *theEstimator = NULL;
+  UInt32 theLen = sizeof(theEstimator);
+  QTSS_Error theErr = QTSS_GetValue(inParams->inClientSession, sEstimatorAttr, 0, &theEstimator, &theLen);
+  if ((theErr != QTSS_NoErr) || (theEstimator == NULL)) {
+    // the first stream to report is the one followed
+    theEstimator = new SessionEstimator(inParams->inRTPStream);
+    (void) QTSS_SetValue(inParams->inClientSession, sEstimatorAttr, 0, &theEstimator, sizeof(theEstimator));
+  }
+
+  if (theEstimator->fStream != inParams->inRTPStream)
+    return theEstimator;
+
+  // find the receiver report in the compound packet
+  UInt8 *thePacketPtr = (UInt8 *) inParams->inRTCPPacketData;
+  UInt32 thePacketLen = inParams->inRTCPPacketDataLen;
+  while (thePacketLen > 0) {
+    RTCPPacket theRTCPPacket;
+    if (!theRTCPPacket.ParsePacket(thePacketPtr, thePacketLen))
+      break;
+
+    if (theRTCPPacket.GetPacketType() == RTCPPacket::kReceiverPacketType) {
+      RTCPReceiverPacket theReport;
+      if (!theReport.ParseReport(thePacketPtr, thePacketLen) || (theReport.GetReportCount() == 0))
+        break;
+
+      UInt32 theLSR = theReport.GetLastSenderReportTime(0);
+      if (theLSR == 0)
+        break; // no SR seen yet
+
+      // round trip in 1/65536 sec, signed: a reflected SR's clock may be ahead of ours
+      UInt32 theNow = (UInt32) (CF::Core::Time::TimeMilli_To_1900Fixed64Secs(inCurrentTime) >> 16);
+      SInt32 theDiff = (SInt32) (theNow - theLSR - theReport.GetLastSenderReportDelay(0));
+      SInt64 theDelay = ((SInt64) theDiff * 1000) / 65536;
+
+      UInt32 theSendBitRate = 0;
+      theLen = sizeof(theSendBitRate);
+      (void) QTSS_GetValue(inParams->inClientSession, qtssCliSesCurrentBitRate, 0, &theSendBitRate, &theLen);
+
+      theEstimator->fEstimator.OnReceiverReport(inCurrentTime, theDelay, theReport.GetFractionLostPackets(0), theSendBitRate);
+
+      UInt32 theTarget = theEstimator->fEstimator.GetTargetBitRate();
+      (void) QTSS_SetValue(inParams->inClientSession, qtssCliSesTargetBitRate, 0, &theTarget, sizeof(theTarget));
+#if FLOW_CONTROL_DEBUGGING
+      s_printf("RR delay %" _64BITARG_ "d, target bit rate %" _U32BITARG_ "\n", theDelay, theTarget);
+#endif
+      *outNewReport = true;
+      break;
+    }
+
+    UInt32 theRTCPLen = (theRTCPPacket.GetPacketLength() * 4) + 4;
+    if (theRTCPLen > thePacketLen)
+      break;
+    thePacketPtr += theRTCPLen;
+    thePacketLen -= theRTCPLen;
+  }
+
+  return theEstimator;
+}
+
+bool CanThicken(SessionEstimator *inState, QTSS_ClientSessionObject inSession, SInt64 inCurrentTime) {
+  if (inState->fEstimator.GetUsage() != DelayBasedEstimator::kNormal)
+    return false;
+
+  if (inCurrentTime - inState->fLastThinTime < inState->fThickHoldMsec)
+    return false;
+
+  // the target must have shown room above what is sent now, 25% is about one level
+  UInt32 theTarget = inState->fEstimator.GetTargetBitRate();
+  UInt32 theSendBitRate = 0;
+  UInt32 theLen = sizeof(theSendBitRate);
+  (void) QTSS_GetValue(inSession, qtssCliSesCurrentBitRate, 0, &theSendBitRate, &theLen);
+
+  return (theTarget == 0) || ((UInt64) theTarget * 4 >= (UInt64) theSendBitRate * 5);
+}
@@ -0,0 +1,80 @@
+/*
+    File:       DelayBasedEstimator.h
+
+    Contains:   Delay gradient bandwidth estimate of the path to one client,
+                after GCC (draft-ietf-rmcat-gcc).
+
+                Every RTCP receiver report gives a round trip from its LSR and
+                DLSR. A growing round trip means a queue builds up somewhere
+                on the path before the first packet is lost, so the slope of
+                the smoothed delay over the last reports is compared against
+                an adaptive threshold. The target bit rate follows an AIMD
+                controller: multiplicative increase while the path is normal,
+                back to 85% of the send rate on overuse, and capped by the
+                reported loss.
+
+                The SR a reflected client answers may carry the broadcaster's
+                clock. A constant offset drops out of the slope, so the delay
+                is only ever used relative to earlier reports.
+*/
+
+#ifndef _DELAYBASEDESTIMATOR_H_
+#define _DELAYBASEDESTIMATOR_H_
+
+#include <CF/Types.h>
+
+class DelayBasedEstimator {
+ public:
+
+  enum Usage {
+    kNormal = 0,
+    kOverusing = 1,
+    kUnderusing = 2
+  };
+
+  DelayBasedEstimator();
+
+  ~DelayBasedEstimator() = default;
+
+  // Feeds the first report block of a receiver report.
+  // inDelay: arrival time - LSR - DLSR in msec, any constant offset
+  // inFractionLost: the fraction lost of the block, in 1/256
+  // inSendBitRate: what the server currently sends to the client
+  void OnReceiverReport(SInt64 inCurrentTime, SInt64 inDelay, UInt8 inFractionLost, UInt32 inSendBitRate);
+
+  // 0 until the first report with a send bit rate
+  UInt32 GetTargetBitRate() { return fTargetBitRate; }
+
+  Usage GetUsage() { return fUsage; }
+
+  Float64 GetDelaySlope() { return fSlope; }
+
+ private:
+
+  enum {
+    kTrendWindow = 8,         // reports in the delay slope
+    kMinBitRate = 32000       // keeps audio going
+  };
+
+  void UpdateTrend(SInt64 inCurrentTime, SInt64 inDelay);
+
+  void DetectUsage();
+
+  void UpdateTarget(SInt64 inCurrentTime, UInt8 inFractionLost, UInt32 inSendBitRate);
+
+  Float64 fSmoothedDelay;
+  SInt64 fSampleTimes[kTrendWindow];
+  Float64 fSampleDelays[kTrendWindow];
+  UInt32 fNumSamples;
+  UInt32 fNextSample;
+
+  Float64 fSlope;             // msec of queueing delay gained per second
+  Float64 fThreshold;         // adaptive, in msec per second
+  UInt32 fNumOverusing;       // reports in a row above the threshold
+  Usage fUsage;
+
+  UInt32 fTargetBitRate;
+  SInt64 fLastUpdateTime;
+};
+
+#endif //_DELAYBASEDESTIMATOR_H_
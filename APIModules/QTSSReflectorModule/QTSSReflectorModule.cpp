@@ -40,6 +40,7 @@
 
 #include "RTPSessionOutput.h"
 #include "SDPSourceInfo.h"
+#include "RTCPFeedbackPacket.h"
 
 #include "SDPUtils.h"
 #include <SDPCache.h>
@@ -91,7 +92,7 @@ static QTSS_AttributeID sRTPInfoWaitTimeAttr = qtssIllegalAttrID;
 // STATIC DATA
 
 // ref to the prefs dictionary object
-static RefTable *sSessionMap = nullptr;
+static ShardedRefTable *sSessionMap = nullptr;
 static const StrPtrLen kCacheControlHeader("no-cache");
 static QTSS_PrefsObject sServerPrefs = nullptr;
 static QTSS_ServerObject sServer = nullptr;
@@ -108,6 +109,7 @@ static bool sDefaultRTPInfoDisabled = false;
 static bool sAnnounceEnabled = true;
 static bool sDefaultAnnounceEnabled = true;
 static bool sBroadcastPushEnabled = true;
+static const UInt32 kMaxPushedPackets = 64; // packets handed to ReflectorStream::PushPackets at once
 static bool sDefaultBroadcastPushEnabled = true;
 static bool sAllowDuplicateBroadcasts = false;
 static bool sDefaultAllowDuplicateBroadcasts = false;
@@ -228,6 +230,8 @@ static QTSS_Error RereadPrefs();
 
 static QTSS_Error ProcessRTPData(QTSS_IncomingData_Params *inParams);
 
+static QTSS_Error ProcessRTCPPacket(QTSS_RTCPProcess_Params *inParams);
+
 static QTSS_Error ReflectorAuthorizeRTSPRequest(QTSS_StandardRTSP_Params *inParams);
 
 static bool InfoPortsOK(QTSS_StandardRTSP_Params *inParams, SDPSourceInfo *theInfo, StrPtrLen *inPath);
@@ -271,6 +275,7 @@ QTSS_Error QTSSReflectorModuleDispatch(QTSS_Role inRole, QTSS_RoleParamPtr inPar
     case QTSS_Shutdown_Role:             return Shutdown();
     case QTSS_RTSPAuthorize_Role:        return ReflectorAuthorizeRTSPRequest(&inParams->rtspRequestParams);
     case QTSS_Interval_Role:             return IntervalRole();
+    case QTSS_RTCPProcess_Role:          return ProcessRTCPPacket(&inParams->rtcpProcessParams);
     case Easy_GetDeviceStream_Role:      return GetDeviceStream(&inParams->easyGetDeviceStreamParams);
     default:break;
   }
@@ -287,6 +292,7 @@ QTSS_Error Register(QTSS_Register_Params *inParams) {
   (void) QTSS_AddRole(QTSS_RTSPAuthorize_Role);
   (void) QTSS_AddRole(QTSS_RereadPrefs_Role);
   (void) QTSS_AddRole(QTSS_RTSPRoute_Role);
+  (void) QTSS_AddRole(QTSS_RTCPProcess_Role);
   (void) QTSS_AddRole(Easy_GetDeviceStream_Role);
 
   // Add text messages attributes
@@ -578,6 +584,92 @@ QTSS_Error IntervalRole() { // not used
   return QTSS_NoErr;
 }
 
+/**
+ * queue the generic NACKs of a player on its output, the reflector sender
+ * resends them from the packet ring on its next pass. PLI/FIR are merged on
+ * the ReflectorStream and go to the broadcaster as one PLI.
+ *
+ * @note this runs on the RTCP thread with the client session locked, it must
+ *       not touch the packet ring or the stream's bucket mutex
+ */
+QTSS_Error ProcessRTCPPacket(QTSS_RTCPProcess_Params *inParams) {
+  bool doNacks = ReflectorStream::GetNackRetransmitsPerSec() > 0;
+  bool doKeyFrameRequests = ReflectorStream::GetKeyFrameRequestIntervalMSec() > 0;
+  if (!doNacks && !doKeyFrameRequests) return QTSS_NoErr;
+
+  RTPSessionOutput **theOutput = nullptr;
+  UInt32 theLen = 0;
+  QTSS_Error theErr = QTSS_GetValuePtr(inParams->inClientSession, sOutputAttr, 0, (void **) &theOutput, &theLen);
+  if ((theErr != QTSS_NoErr) || (theLen != sizeof(RTPSessionOutput *)) || (*theOutput == nullptr))
+    return QTSS_NoErr; // not a reflector player
+
+  void **theStreamCookie = nullptr;
+  theErr = QTSS_GetValuePtr(inParams->inRTPStream, sStreamCookieAttr, 0, (void **) &theStreamCookie, &theLen);
+  if ((theErr != QTSS_NoErr) || (theLen != sizeof(void *)) || (*theStreamCookie == nullptr))
+    return QTSS_NoErr;
+
+  auto *theStream = (ReflectorStream *) *theStreamCookie; // the cookie is the pointer of ReflectorStream
+  auto *thePacketData = (UInt8 *) inParams->inRTCPPacketData;
+  UInt32 theDataLen = inParams->inRTCPPacketDataLen;
+  UInt16 theSeqNums[ReflectorOutput::kMaxPendingRetransmits];
+
+  // walk the compound packet, feedback usually follows a receiver report
+  while (theDataLen > 0) {
+    RTCPPacket thePacket;
+    if (!thePacket.ParsePacket(thePacketData, theDataLen)) break;
+
+    UInt32 thePacketLen = (thePacket.GetPacketLength() * 4) + RTCPPacket::kRTCPHeaderSizeInBytes;
+    if (thePacketLen > theDataLen) break;
+
+    RTCPNackPacket theNack;
+    RTCPPliPacket thePli;
+    RTCPFirPacket theFir;
+    if (doNacks && theNack.ParseNackPacket(thePacketData, thePacketLen)) {
+      UInt32 theNumSeqNums = theNack.GetLostSeqNums(theSeqNums, ReflectorOutput::kMaxPendingRetransmits);
+      (*theOutput)->RequestRetransmits(theStream, theNack.GetMediaSSRC(), theSeqNums, theNumSeqNums);
+    } else if (doKeyFrameRequests && thePli.ParsePliPacket(thePacketData, thePacketLen)) {
+      theStream->RequestKeyFrame(thePli.GetMediaSSRC());
+    } else if (doKeyFrameRequests && theFir.ParseFirPacket(thePacketData, thePacketLen)
+        && theFir.GetNumEntries() > 0) {
+      theStream->RequestKeyFrame(theFir.GetSSRC(0)); // one source per stream
+    }
+
+    thePacketData += thePacketLen;
+    theDataLen -= thePacketLen;
+  }
+
+  return QTSS_NoErr;
+}
+
+/**
+ * RTP channel handler of a pushed stream, bound in DoPlay. RTSPSession passes the
+ * frames straight to it, without the RTP session lookup, the RTSPIncomingData role
+ * and the attribute lookups of ProcessRTPData.
+ */
+static void PushInterleavedFrames(void *inCookie, UInt8 inChannel, char *inFrames, UInt32 inFramesLen) {
+  auto *theStream = (ReflectorStream *) inCookie;
+  auto isRTCP = static_cast<bool>(inChannel & 1U);
+
+  StrPtrLen thePackets[kMaxPushedPackets];
+  UInt32 theNumPackets = 0;
+
+  for (UInt32 theOffset = 0; theOffset + 4 <= inFramesLen;) {
+    UInt16 rtpPacketLen;
+    memcpy(&rtpPacketLen, &inFrames[theOffset + 2], 2);
+    rtpPacketLen = ntohs(rtpPacketLen);
+    if (theOffset + 4 + rtpPacketLen > inFramesLen) break;
+
+    if (theNumPackets == kMaxPushedPackets) {
+      theStream->PushPackets(thePackets, theNumPackets, isRTCP);
+      theNumPackets = 0;
+    }
+    thePackets[theNumPackets++].Set(&inFrames[theOffset + 4], rtpPacketLen);
+    theOffset += 4 + rtpPacketLen;
+  }
+
+  theStream->PushPackets(thePackets, theNumPackets, isRTCP);
+}
+
 /**
  * process RTP data from RTSP Interleaved Frame
  */
@@ -631,49 +723,58 @@ QTSS_Error ProcessRTPData(QTSS_IncomingData_Params *inParams) {
      * @see RTSPSession::HandleIncomingDataPacket
      *
      */
-    char *packetData = inParams->inPacketData;
-
-    UInt8 packetChannel;
-    packetChannel = (UInt8) packetData[1];
+    // RTSPSession hands over all frames of a read at once. Frames in a row
+    // for the same stream go to ReflectorStream::PushPackets together.
+    StrPtrLen thePackets[kMaxPushedPackets];
+    UInt32 theNumPackets = 0;
+    ReflectorStream *theRunStream = nullptr;
+    bool theRunIsRTCP = false;
 
-    UInt16 rtpPacketLen;
-    memcpy(&rtpPacketLen, &packetData[2], 2);
-    rtpPacketLen = ntohs(rtpPacketLen);
+    for (UInt32 theOffset = 0; theOffset + 4 <= inParams->inPacketLen;) {
+      char *packetData = inParams->inPacketData + theOffset;
 
-    char *rtpPacket = &packetData[4]; // 剥离 Interleaved Header
+      UInt8 packetChannel;
+      packetChannel = (UInt8) packetData[1];
 
-    DEBUG_LOG(DEBUG_REFLECTOR_MODULE,
-              "QTSSReflectorModule.cpp:ProcessRTPData channel=%u theSoureInfo=%" _U32BITARG_ " packetLen=%" _U32BITARG_ " packetDatalen=%u\n",
-              (UInt16) packetChannel, theSoureInfo, inParams->inPacketLen, rtpPacketLen);
+      UInt16 rtpPacketLen;
+      memcpy(&rtpPacketLen, &packetData[2], 2);
+      rtpPacketLen = ntohs(rtpPacketLen);
+      theOffset += rtpPacketLen + 4;
+      if (theOffset > inParams->inPacketLen) break;
 
-    UInt32 inIndex = packetChannel >> 1U; // one stream per every 2 channels rtcp channel handled below
-    if (inIndex < numStreams) {
-      ReflectorStream *theStream = theSession->GetStreamByIndex(inIndex);
-      if (theStream == nullptr) return QTSS_Unimplemented;
-      auto isRTCP = static_cast<bool>(packetChannel & 1U);
+      char *rtpPacket = &packetData[4]; // 剥离 Interleaved Header
 
-      if (1) {
-        SourceInfo::StreamInfo *theStreamInfo = theStream->GetStreamInfo();
-        UInt16 serverReceivePort = theStreamInfo->fPort;
+      DEBUG_LOG(DEBUG_REFLECTOR_MODULE,
+                "QTSSReflectorModule.cpp:ProcessRTPData channel=%u theSoureInfo=%" _U32BITARG_ " packetLen=%" _U32BITARG_ " packetDatalen=%u\n",
+                (UInt16) packetChannel, theSoureInfo, inParams->inPacketLen, rtpPacketLen);
 
-        if (isRTCP) serverReceivePort++;
+      UInt32 inIndex = packetChannel >> 1U; // one stream per every 2 channels rtcp channel handled below
+      if (inIndex >= numStreams) continue;
 
-        // TODO(james): localServerAddr
-        DEBUG_LOG(0,
-                  "QTSSReflectorModule.cpp:ProcessRTPData Send RTSP packet channel=%u to UDP localServerAddr=%" _U32BITARG_ " serverReceivePort=%" _U32BITARG_ " packetDataLen=%u \n",
-                  (UInt16) packetChannel, theStream->GetSocketPair()->GetSocketA()->GetLocalAddr(), serverReceivePort, rtpPacketLen);
-      }
+      ReflectorStream *theStream = theSession->GetStreamByIndex(inIndex);
+      if (theStream == nullptr) continue;
+      auto isRTCP = static_cast<bool>(packetChannel & 1U);
 
       // 将 packet 转交给 ReflectorStream，随后跟 ReflectorSocket 的处理逻辑归并为一
-      theStream->PushPacket(rtpPacket, rtpPacketLen, isRTCP);
+      if ((theNumPackets == kMaxPushedPackets) || (theStream != theRunStream) || (isRTCP != theRunIsRTCP)) {
+        if (theRunStream != nullptr) theRunStream->PushPackets(thePackets, theNumPackets, theRunIsRTCP);
+        theNumPackets = 0;
+        theRunStream = theStream;
+        theRunIsRTCP = isRTCP;
+      }
+      thePackets[theNumPackets++].Set(rtpPacket, rtpPacketLen);
     }
+
+    if (theRunStream != nullptr) theRunStream->PushPackets(thePackets, theNumPackets, theRunIsRTCP);
   }
 
   return theErr;
 }
 
 QTSS_Error ProcessRTSPRequest(QTSS_StandardRTSP_Params *inParams) {
-  Core::MutexLocker locker(sSessionMap->GetMutex()); //operating on sOutputAttr
+  // sOutputAttr is only touched under the client session mutex, which the
+  // RTSPSession holds while this role runs. The session map shards are locked
+  // where a path is looked up.
 
   DEBUG_LOG(DEBUG_REFLECTOR_MODULE,
             "QTSSReflectorModule:ProcessRTSPRequest inClientSession=%p\n",
@@ -1340,10 +1441,6 @@ ReflectorSession *FindOrCreateSession(StrPtrLen *inName, QTSS_StandardRTSP_Param
             "QTSSReflectorModule:FindOrCreateSession inClientSession=%p isPash=%d\n",
             inParams->inClientSession, isPush);
 
-  Core::MutexLocker locker(sSessionMap->GetMutex());
-  DEBUG_LOG(DEBUG_REFLECTOR_MODULE,
-            "QTSSReflectorModule:FindOrCreateSession lock sSessionMap success\n");
-
   // Check if broadcast is allowed before doing anything else
   // At this point we know it is a definitely a reflector session
   // It is either incoming automatic broadcast setup or a client setup to view broadcast
@@ -1358,6 +1455,11 @@ ReflectorSession *FindOrCreateSession(StrPtrLen *inName, QTSS_StandardRTSP_Param
 
   StrPtrLen inPath(theStreamName);
 
+  // only the shard of inPath, sessions of other paths are set up in parallel
+  Core::MutexLocker locker(sSessionMap->GetMutex(&inPath));
+  DEBUG_LOG(DEBUG_REFLECTOR_MODULE,
+            "QTSSReflectorModule:FindOrCreateSession lock sSessionMap success\n");
+
   Ref *theSessionRef = sSessionMap->Resolve(&inPath);
   ReflectorSession *theSession = nullptr;
 
@@ -1642,6 +1744,11 @@ QTSS_Error DoSetup(QTSS_StandardRTSP_Params *inParams) {
       return QTSSModuleUtils::SendErrorResponse(inParams->inRTSPRequest, qtssClientBadRequest, 0);
     }
 
+    // keyframe requests of the players go back over this stream
+    auto *theReflectorStream = (ReflectorStream *) theSession->GetStreamCookie(theTrackID);
+    if (theReflectorStream != nullptr)
+      theReflectorStream->SetBroadcasterRTPStream(newStream);
+
     // send the setup response
     (void) QTSS_AppendRTSPHeader(inParams->inRTSPRequest, qtssCacheControlHeader, kCacheControlHeader.Ptr, kCacheControlHeader.Len);
     (void) QTSS_SendStandardRTSPResponse(inParams->inRTSPRequest, newStream, 0);
@@ -1829,6 +1936,18 @@ QTSS_Error DoPlay(QTSS_StandardRTSP_Params *inParams, ReflectorSession *inSessio
     //	 return QTSSModuleUtils::SendErrorResponse(inParams->inRTSPRequest, qtssClientBadRequest, 0);
     //}
 
+    // RTP over the RTSP connection goes straight to the streams from now on. The
+    // server unbinds the channels before ClientSessionClosing removes the session.
+    // RTCP keeps going through ProcessRTPData, so the RTP stream still sees it.
+    if (sBroadcastPushEnabled) {
+      for (UInt32 x = 0; (x < inSession->GetNumStreams()) && ((x << 1U) < 256); x++) {
+        ReflectorStream *theStream = inSession->GetStreamByIndex(x);
+        if (theStream != nullptr)
+          (void) QTSS_SetIncomingDataHandler(inParams->inRTSPSession, inParams->inClientSession, x << 1U,
+                                             PushInterleavedFrames, theStream);
+      }
+    }
+
     KeepSession(inParams->inRTSPRequest, true);
     DEBUG_LOG(DEBUG_REFLECTOR_MODULE,
               "QTSSReflectorModule.cpp:DoPlay (PUSH) inRTSPSession=%p inClientSession=%p\n",
@@ -1843,6 +1962,11 @@ QTSS_Error DoPlay(QTSS_StandardRTSP_Params *inParams, ReflectorSession *inSessio
 
     (*theOutput)->InitializeStreams();
 
+    // the output starts with the cached GOP at line rate and then follows the live packets,
+    // instead of replaying the whole buffer at real time
+    if (ReflectorGOPCache::IsEnabled())
+      (*theOutput)->SetBufferDelay(0);
+
     // Tell the session what the bitrate of this reflection is. This is nice for logging,
     // it also allows the server to scale the TCP buffer size appropriately if we are
     // interleaving the data over TCP. This must be set before calling QTSS_Play so the
@@ -1923,24 +2047,28 @@ bool KillSession(StrPtrLen *sdpPathStr, bool killClients) {
 void KillCommandPathInList() {
   char filePath[128] = "";
   ResizeableStringFormatter commandPath((char *) filePath, sizeof(filePath)); // ResizeableStringFormatter is safer and more efficient than StringFormatter for most paths.
-  Core::MutexLocker locker(sSessionMap->GetMutex());
-
-  for (RefHashTableIter theIter(sSessionMap->GetHashTable()); !theIter.IsDone(); theIter.Next()) {
-    Ref *theRef = theIter.GetCurrent();
-    if (theRef == nullptr) continue;
-
-    commandPath.Reset();
-    commandPath.Put(*(theRef->GetString()));
-    commandPath.Put(sSDPKillSuffix);
-    commandPath.PutTerminator();
-
-    char *theCommandPath = commandPath.GetBufPtr();
-    QTSS_Object outFileObject;
-    QTSS_Error err = QTSS_OpenFileObject(theCommandPath, qtssOpenFileNoFlags, &outFileObject);
-    if (err == QTSS_NoErr) {
-      (void) QTSS_CloseFileObject(outFileObject);
-      ::unlink(theCommandPath);
-      KillSession(theRef->GetString(), true);
+
+  for (UInt32 theShard = 0; theShard < sSessionMap->GetNumShards(); theShard++) {
+    RefTable *theTable = sSessionMap->GetShard(theShard);
+    Core::MutexLocker locker(theTable->GetMutex());
+
+    for (RefHashTableIter theIter(theTable->GetHashTable()); !theIter.IsDone(); theIter.Next()) {
+      Ref *theRef = theIter.GetCurrent();
+      if (theRef == nullptr) continue;
+
+      commandPath.Reset();
+      commandPath.Put(*(theRef->GetString()));
+      commandPath.Put(sSDPKillSuffix);
+      commandPath.PutTerminator();
+
+      char *theCommandPath = commandPath.GetBufPtr();
+      QTSS_Object outFileObject;
+      QTSS_Error err = QTSS_OpenFileObject(theCommandPath, qtssOpenFileNoFlags, &outFileObject);
+      if (err == QTSS_NoErr) {
+        (void) QTSS_CloseFileObject(outFileObject);
+        ::unlink(theCommandPath);
+        KillSession(theRef->GetString(), true);
+      }
     }
   }
 }
@@ -1950,8 +2078,6 @@ QTSS_Error DestroySession(QTSS_ClientSessionClosing_Params *inParams) {
   ReflectorOutput *outputPtr = nullptr;
   ReflectorSession *theSession = nullptr;
 
-  Core::MutexLocker locker(sSessionMap->GetMutex());
-
   UInt32 theLen = sizeof(theSession);
   QTSS_Error theErr = QTSS_GetValue(inParams->inClientSession, sClientBroadcastSessionAttr, 0, &theSession, &theLen);
   DEBUG_LOG(DEBUG_REFLECTOR_MODULE,
@@ -1959,6 +2085,9 @@ QTSS_Error DestroySession(QTSS_ClientSessionClosing_Params *inParams) {
             (UInt32)sClientBroadcastSessionAttr, theSession, theErr);
 
   if (theSession != nullptr) { // 推送端
+    // FindOrCreateSession of the same path may be looking at the source info
+    Core::MutexLocker locker(sSessionMap->GetMutex(theSession->GetRef()->GetString()));
+
     ReflectorSession *deletedSession = nullptr;
     theErr = QTSS_SetValue(inParams->inClientSession, sClientBroadcastSessionAttr, 0, &deletedSession, sizeof(deletedSession));
 
@@ -2010,6 +2139,9 @@ void RemoveOutput(ReflectorOutput *inOutput, ReflectorSession *theSession, bool
   // 对ReflectorSession的引用继续处理,包括推送端和客户端
   Assert(theSession);
   if (theSession != nullptr) {
+    // the refcount check and UnRegister must be atomic against Resolve of the same path
+    Core::MutexLocker locker(sSessionMap->GetMutex(theSession->GetRef()->GetString()));
+
     if (inOutput != nullptr) {
       // ReflectorSession移除客户端
       theSession->RemoveOutput(inOutput, true);
@@ -2055,7 +2187,10 @@ void RemoveOutput(ReflectorOutput *inOutput, ReflectorSession *theSession, bool
       }
     }
   }
-  delete inOutput;
+
+  // the last output snapshot of the streams deletes it
+  if (inOutput != nullptr)
+    inOutput->Release();
 }
 
 bool AcceptSession(QTSS_StandardRTSP_Params *inParams) {
@@ -2228,12 +2363,11 @@ QTSS_Error GetDeviceStream(Easy_GetDeviceStream_Params *inParams) {
 
   if (inParams->inDevice && inParams->inStreamType == easyRTSPType) {
 
-    Core::MutexLocker locker(sSessionMap->GetMutex());
-
     char theStreamName[QTSS_MAX_NAME_LENGTH] = {0};
     sprintf(theStreamName, "%s%s%d", inParams->inDevice, EASY_KEY_SPLITER, inParams->inChannel);
 
     StrPtrLen inPath(theStreamName);
+    Core::MutexLocker locker(sSessionMap->GetMutex(&inPath));
 
     Ref *theSessionRef = sSessionMap->Resolve(&inPath);
     ReflectorSession *theSession = nullptr;
@@ -2258,4 +2392,45 @@ QTSS_Error GetDeviceStream(Easy_GetDeviceStream_Params *inParams) {
   }
 
   return theErr;
-}
\ No newline at end of file
+}
+
+void QTSSReflectorModule_GetMetrics(QTSSReflectorMetricsProc inProc, void *inCookie) {
+  if (sSessionMap == nullptr) // not initialized yet
+    return;
+
+  QTSSReflectorMetrics theMetrics;
+
+  // a registered session can't be deleted while its shard is locked
+  for (UInt32 theShard = 0; theShard < sSessionMap->GetNumShards(); theShard++) {
+    RefTable *theTable = sSessionMap->GetShard(theShard);
+    Core::MutexLocker locker(theTable->GetMutex());
+
+    for (RefHashTableIter theIter(theTable->GetHashTable()); !theIter.IsDone(); theIter.Next()) {
+      Ref *theRef = theIter.GetCurrent();
+      auto *theSession = (ReflectorSession *) theRef->GetObject();
+
+      ::memset(&theMetrics, 0, sizeof(theMetrics));
+      theMetrics.fSessionName = theRef->GetString();
+      theMetrics.fTrackID = -1;
+      theMetrics.fNumOutputs = theSession->GetNumOutputs();
+      theMetrics.fBitRate = theSession->GetBitRate();
+      inProc(&theMetrics, inCookie);
+
+      if (theSession->GetSourceInfo() == nullptr)
+        continue;
+
+      for (UInt32 x = 0; x < theSession->GetNumStreams(); x++) {
+        ReflectorStream *theStream = theSession->GetStreamByIndex(x);
+        if (theStream == nullptr)
+          continue;
+
+        theMetrics.fTrackID = (SInt32) theStream->GetStreamInfo()->fTrackID;
+        theStream->GetOutputLag(&theMetrics.fNumOutputs, &theMetrics.fNumOutputsBehind, &theMetrics.fMaxOutputLag);
+        theMetrics.fBitRate = theStream->GetBitRate();
+        theMetrics.fPacketCount = theStream->GetPacketCount();
+        theStream->GetHistograms(&theMetrics.fHistograms);
+        inProc(&theMetrics, inCookie);
+      }
+    }
+  }
+}
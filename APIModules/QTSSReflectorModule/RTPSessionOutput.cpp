@@ -71,7 +71,9 @@ static QTSS_AttributeID sLastRTCPTransmitAttr = qtssIllegalAttrID;
 
 RTPSessionOutput::RTPSessionOutput(QTSS_ClientSessionObject inClientSession, ReflectorSession *inReflectorSession,
                                    QTSS_Object serverPrefs, QTSS_AttributeID inCookieAddrID)
-    : fClientSession(inClientSession),
+    : fNumPacers(0),
+      fNumThinners(0),
+      fClientSession(inClientSession),
       fReflectorSession(inReflectorSession),
       fCookieAttrID(inCookieAddrID),
       fBufferDelayMSecs(ReflectorStream::sOverBufferInMsec),
@@ -79,7 +81,8 @@ RTPSessionOutput::RTPSessionOutput(QTSS_ClientSessionObject inClientSession, Ref
       fIsUDP(false),
       fTransportInitialized(false),
       fMustSynch(true),
-      fPreFilter(true) {
+      fPreFilter(true),
+      fWroteSinceFlush(false) {
   // create a bookmark for each stream we'll reflect
   this->InitializeBookmarks(inReflectorSession->GetNumStreams());
 }
@@ -225,7 +228,7 @@ bool RTPSessionOutput::IsUDP() {
  * 根据 seq 过滤 packet
  * @return  true if the packet will be drop, otherwise is false.
  */
-bool RTPSessionOutput::FilterPacket(QTSS_RTPStreamObject *theStreamPtr, StrPtrLen *inPacket) {
+bool RTPSessionOutput::FilterPacket(QTSS_RTPStreamObject *theStreamPtr, ReflectorPacket *inPacket) {
   UInt32 *packetCountPtr = nullptr;
   UInt32 theLen = 0;
 
@@ -242,7 +245,7 @@ bool RTPSessionOutput::FilterPacket(QTSS_RTPStreamObject *theStreamPtr, StrPtrLe
   if (QTSS_NoErr != QTSS_GetValue(*theStreamPtr, qtssRTPStrFirstSeqNumber, 0, &firstSeqNum, &theLen))
     return true;
 
-  UInt16 seqnum = this->GetPacketSeqNumber(inPacket);
+  UInt16 seqnum = inPacket->GetPacketRTPSeqNum(); // parsed at ingest
   if (seqnum < firstSeqNum) {
     //printf("RTPSessionOutput::FilterPacket don't send packet = %u < first=%lu\n", seqnum, firstSeqNum);
     return true;
@@ -468,16 +471,19 @@ RTPSessionOutput::TrackRTPPackets(QTSS_RTPStreamObject *theStreamPtr,
   if (!(inFlags & qtssWriteFlagsIsRTP))
     return QTSS_NoErr;
 
-  ReflectorPacket packetContainer;
-  packetContainer.SetPacketData(inPacketStrPtr->Ptr, inPacketStrPtr->Len, false);
+  if (inPacketStrPtr->Len < 12)
+    return QTSS_NoErr;
+
+  // read the header in place, no need to copy the packet
+  auto *rtpHeader = reinterpret_cast<RTPFixedHeader *>(inPacketStrPtr->Ptr);
   SInt64 *theTimePtr = NULL;
   UInt32 theLen = 0;
 
   if (QTSS_NoErr != QTSS_GetValuePtr(*theStreamPtr, sFirstRTPArrivalTimeAttr, 0, (void **) &theTimePtr, &theLen)) {
-    UInt32 theSSRC = packetContainer.GetSSRC();
+    UInt32 theSSRC = ntohl(rtpHeader->ssrc);
     (void) QTSS_SetValue(*theStreamPtr, sStreamSSRCAttr, 0, &theSSRC, sizeof(theSSRC));
 
-    UInt32 rtpTime = packetContainer.GetPacketRTPTime();
+    UInt32 rtpTime = ntohl(rtpHeader->ts);
     writeErr = QTSS_SetValue(*theStreamPtr, sFirstRTPTimeStampAttr, 0, &rtpTime, sizeof(rtpTime));
     Assert(writeErr == QTSS_NoErr);
 
@@ -505,7 +511,7 @@ RTPSessionOutput::TrackRTPPackets(QTSS_RTPStreamObject *theStreamPtr,
 
     UInt32 *theSSRCPtr = 0;
     (void) QTSS_GetValuePtr(*theStreamPtr, sStreamSSRCAttr, 0, (void **) &theSSRCPtr, &theLen);
-    if (*theSSRCPtr != packetContainer.GetSSRC()) {
+    if (*theSSRCPtr != ntohl(rtpHeader->ssrc)) {
 
       (void) QTSS_RemoveValue(*theStreamPtr, sFirstRTPArrivalTimeAttr, 0);
       (void) QTSS_RemoveValue(*theStreamPtr, sFirstRTPTimeStampAttr, 0);
@@ -539,14 +545,22 @@ RTPSessionOutput::TrackPackets(QTSS_RTPStreamObject *theStreamPtr, StrPtrLen *in
 }
 
 QTSS_Error RTPSessionOutput::
-WritePacket(StrPtrLen *inPacket, void *inStreamCookie, UInt32 inFlags, SInt64 packetLatenessInMSec,
-            SInt64 *timeToSendThisPacketAgain, UInt64 *packetIDPtr, SInt64 *arrivalTimeMSecPtr, bool firstPacket) {
+WritePacket(ReflectorPacket *inReflectorPacket, void *inStreamCookie, UInt32 inFlags, SInt64 packetLatenessInMSec,
+            SInt64 *timeToSendThisPacketAgain, bool firstPacket, bool *outWritten) {
   QTSS_RTPSessionState *theState = nullptr;
   UInt32 theLen = 0;
   QTSS_Error writeErr = QTSS_NoErr;
   SInt64 currentTime = Core::Time::Milliseconds();
 
-  if (inPacket == nullptr || inPacket->Len == 0)
+  if (inReflectorPacket == nullptr)
+    return QTSS_NoErr;
+
+  // the packet data lives in the shared pool buffer, never copied per output
+  StrPtrLen *inPacket = inReflectorPacket->GetPacketPtr();
+  UInt64 *packetIDPtr = &inReflectorPacket->fStreamCountID;
+  SInt64 *arrivalTimeMSecPtr = &inReflectorPacket->fTimeArrived;
+
+  if (inPacket->Ptr == nullptr || inPacket->Len == 0)
     return QTSS_NoErr;
 
   (void) QTSS_GetValuePtr(fClientSession, qtssCliSesState, 0, (void **) &theState, &theLen);
@@ -562,18 +576,30 @@ WritePacket(StrPtrLen *inPacket, void *inStreamCookie, UInt32 inFlags, SInt64 pa
     // 找到和 ReflectorStream 相关联的 RTPStream 对象
     // RTPStream 对象在 QTSSReflectorModule::DoSetup 调用的 QTSS_AddRTPStream 函数里创建。
     if (this->PacketMatchesStream(inStreamCookie, theStreamPtr)) {
-      if ((inFlags & qtssWriteFlagsIsRTP) && this->FilterPacket(theStreamPtr, inPacket))
+      if ((inFlags & qtssWriteFlagsIsRTP) && this->FilterPacket(theStreamPtr, inReflectorPacket))
         return QTSS_NoErr; // keep looking at packets
 
       if (this->PacketAlreadySent(theStreamPtr, inFlags, packetIDPtr))
         return QTSS_NoErr; // keep looking at packets
 
+      if ((inFlags & qtssWriteFlagsIsRTP) && this->PacketShouldBeThinned(theStreamPtr, inReflectorPacket, inStreamCookie)) {
+        (void) QTSS_SetValue(*theStreamPtr, sLastRTPPacketIDAttr, 0, packetIDPtr, sizeof(UInt64));
+        return QTSS_NoErr; // the whole frame goes
+      }
+
       if (!this->PacketReadyToSend(theStreamPtr, &currentTime, inFlags, packetIDPtr, timeToSendThisPacketAgain)) {
         //s_printf("QTSS_WouldBlock\n");
         return QTSS_WouldBlock; // stop not ready to send packets now
       }
 
 
+      // hold back what the bucket of this stream doesn't cover yet
+      StreamPacer *thePacer = (inFlags & qtssWriteFlagsIsRTP) ? this->GetPacer(inStreamCookie, currentTime) : nullptr;
+      if (thePacer != nullptr && thePacer->fTokens < 0) {
+        *timeToSendThisPacketAgain = currentTime + (-thePacer->fTokens + thePacer->fBytesPerSec - 1) / thePacer->fBytesPerSec;
+        return QTSS_WouldBlock;
+      }
+
       // TrackPackets below is for re-writing the rtcps we don't use it right now-- shouldn't need to
       // (void) this->TrackPackets(theStreamPtr, inPacket, &currentTime,inFlags,  &packetLatenessInMSec, timeToSendThisPacketAgain, packetIDPtr,arrivalTimeMSecPtr);
 
@@ -588,14 +614,19 @@ WritePacket(StrPtrLen *inPacket, void *inStreamCookie, UInt32 inFlags, SInt64 pa
       }
 
       // 实际上调用的是 RTPStream::Write 函数, 通过 UDP Socket 发送音视频流。
-      writeErr = QTSS_Write(*theStreamPtr, &thePacket, inPacket->Len, nullptr, inFlags | qtssWriteFlagsWriteBurstBegin);
+      // qtssWriteFlagsBufferData: UDP sends join the UDPSendBatch of ReflectPackets, the
+      // packet data stays in the sender queue until the batch is flushed
+      writeErr = QTSS_Write(*theStreamPtr, &thePacket, inPacket->Len, nullptr,
+                            inFlags | qtssWriteFlagsWriteBurstBegin | qtssWriteFlagsBufferData);
+      fWroteSinceFlush = true;
       if (writeErr == QTSS_WouldBlock) {
         //s_printf("QTSS_Write == QTSS_WouldBlock\n");
         //
         // We are flow controlled. See if we know when flow control will be lifted and report that
         *timeToSendThisPacketAgain = thePacket.suggestedWakeupTime;
 
-        if (firstPacket) {
+        // an output without buffer delay (GOP burst) stays without one
+        if (firstPacket && fBufferDelayMSecs > 0) {
           fBufferDelayMSecs = static_cast<UInt32>(currentTime - *arrivalTimeMSecPtr);
           //s_printf("firstPacket fBufferDelayMSecs =%lu \n", fBufferDelayMSecs);
         }
@@ -605,6 +636,13 @@ WritePacket(StrPtrLen *inPacket, void *inStreamCookie, UInt32 inFlags, SInt64 pa
           fLastIntervalMilliSec = 5;
         fLastPacketTransmitTime = currentTime;
 
+        if (writeErr == QTSS_NoErr)
+          *outWritten = true;
+
+        // may go below 0, a packet larger than the bucket still gets out
+        if (thePacer != nullptr)
+          thePacer->fTokens -= (SInt64) inPacket->Len * 1000;
+
         if (inFlags & qtssWriteFlagsIsRTP) {
           (void) QTSS_SetValue(*theStreamPtr, sLastRTPPacketIDAttr, 0, packetIDPtr, sizeof(UInt64));
         } else if (inFlags & qtssWriteFlagsIsRTCP) {
@@ -632,6 +670,75 @@ WritePacket(StrPtrLen *inPacket, void *inStreamCookie, UInt32 inFlags, SInt64 pa
   return writeErr;
 }
 
+RTPSessionOutput::StreamPacer *RTPSessionOutput::GetPacer(void *inStreamCookie, SInt64 inCurrentTime) {
+  UInt32 theWindow = ReflectorStream::GetPacingWindowMSec();
+  if (theWindow == 0)
+    return nullptr;
+
+  // the cookie is the ReflectorStream, unknown until its first bit rate average
+  UInt32 theBitRate = static_cast<ReflectorStream *>(inStreamCookie)->GetBitRate();
+  if (theBitRate == 0)
+    return nullptr;
+
+  StreamPacer *thePacer = nullptr;
+  for (UInt32 x = 0; x < fNumPacers; x++) {
+    if (fPacers[x].fStreamCookie == inStreamCookie) {
+      thePacer = &fPacers[x];
+      break;
+    }
+  }
+
+  UInt32 theBytesPerSec = (UInt32) ((UInt64) theBitRate / 8 * kPacingRatePercent / 100);
+  SInt64 theBucketSize = (SInt64) theBytesPerSec * theWindow; // bytes/sec * msec = 1/1000 bytes
+
+  if (thePacer == nullptr) {
+    if (fNumPacers == kMaxPacedStreams)
+      return nullptr;
+    thePacer = &fPacers[fNumPacers++];
+    thePacer->fStreamCookie = inStreamCookie;
+    thePacer->fTokens = theBucketSize; // start full
+    thePacer->fRefillTime = inCurrentTime;
+  }
+
+  // follow the bit rate, it is averaged every kBitRateAvgIntervalInMilSecs
+  thePacer->fBytesPerSec = theBytesPerSec > 0 ? theBytesPerSec : 1;
+
+  if (inCurrentTime > thePacer->fRefillTime) {
+    thePacer->fTokens += (inCurrentTime - thePacer->fRefillTime) * thePacer->fBytesPerSec;
+    if (thePacer->fTokens > theBucketSize)
+      thePacer->fTokens = theBucketSize;
+    thePacer->fRefillTime = inCurrentTime;
+  }
+
+  return thePacer;
+}
+
+QTSS_Error RTPSessionOutput::RetransmitPacket(ReflectorPacket *inReflectorPacket, void *inStreamCookie) {
+  StrPtrLen *inPacket = inReflectorPacket->GetPacketPtr();
+  if (inPacket->Ptr == nullptr || inPacket->Len == 0)
+    return QTSS_NoErr;
+
+  QTSS_RTPStreamObject *theStreamPtr = nullptr;
+  UInt32 theLen = 0;
+  for (UInt32 z = 0; QTSS_GetValuePtr(fClientSession, qtssCliSesStreamObjects, z, (void **) &theStreamPtr, &theLen) == QTSS_NoErr; z++) {
+    if (!this->PacketMatchesStream(inStreamCookie, theStreamPtr))
+      continue;
+
+    // only what this client was sent, a NACK can't ask for the future nor for a thinned frame
+    if (!this->PacketAlreadySent(theStreamPtr, qtssWriteFlagsIsRTP, &inReflectorPacket->fStreamCountID)
+        || this->PacketWasThinned(inReflectorPacket, inStreamCookie))
+      return QTSS_NoErr;
+
+    QTSS_PacketStruct thePacket;
+    thePacket.packetData = inPacket->Ptr;
+    thePacket.packetTransmitTime = Core::Time::Milliseconds();
+
+    return QTSS_Write(*theStreamPtr, &thePacket, inPacket->Len, nullptr, qtssWriteFlagsIsRTP);
+  }
+
+  return QTSS_NoErr;
+}
+
 UInt16 RTPSessionOutput::GetPacketSeqNumber(StrPtrLen *inPacket) {
   if (inPacket->Len < 4) return 0;
 
@@ -648,128 +755,99 @@ void RTPSessionOutput::SetPacketSeqNumber(StrPtrLen *inPacket, UInt16 inSeqNumbe
   rtpHeader->seq = htons(inSeqNumber);
 }
 
-// this routine is not used
-bool RTPSessionOutput::PacketShouldBeThinned(QTSS_RTPStreamObject inStream,
-                                             StrPtrLen *inPacket) {
-  return false; // function is disabled.
-
-  static UInt16 sZero = 0;
-  //This function determines whether the packet should be dropped.
-  //It also adjusts the sequence number if necessary
+/**
+ * 按整帧丢弃 H.264/H.265 视频, 不会发出残缺的帧
+ * @return  true if the packet will be drop, otherwise is false.
+ */
+bool RTPSessionOutput::PacketShouldBeThinned(QTSS_RTPStreamObject *theStreamPtr, ReflectorPacket *inPacket,
+                                             void *inStreamCookie) {
+  // the cookie is the ReflectorStream, other formats have no frame info
+  if (!static_cast<ReflectorStream *>(inStreamCookie)->IsH26xVideo())
+    return false;
 
-  if (inPacket->Len < 4)
+  bool *thinningDisabledPtr = nullptr;
+  UInt32 theLen = 0;
+  (void) QTSS_GetValuePtr(*theStreamPtr, qtssRTPStrThinningDisabled, 0, (void **) &thinningDisabledPtr, &theLen);
+  if (thinningDisabledPtr != nullptr && theLen == sizeof(bool) && *thinningDisabledPtr)
     return false;
 
-  UInt16 curSeqNum = this->GetPacketSeqNumber(inPacket);
-  UInt32 *curQualityLevel = NULL;
-  UInt16 *nextSeqNum = NULL;
-  UInt16 *theSeqNumOffset = NULL;
-  SInt64 *lastChangeTime = NULL;
+  // set by the flow control module, it goes past the number of levels for "lowest"
+  UInt32 theQualityLevel = ReflectorSession::kNormalQuality;
+  UInt32 *qualityLevelPtr = nullptr;
+  (void) QTSS_GetValuePtr(*theStreamPtr, qtssRTPStrQualityLevel, 0, (void **) &qualityLevelPtr, &theLen);
+  if (qualityLevelPtr != nullptr && theLen == sizeof(UInt32))
+    theQualityLevel = *qualityLevelPtr;
 
-  UInt32 theLen = 0;
-  (void) QTSS_GetValuePtr(inStream,
-                          qtssRTPStrQualityLevel,
-                          0,
-                          (void **) &curQualityLevel,
-                          &theLen);
-  if ((curQualityLevel == NULL) || (theLen != sizeof(UInt32)))
+  StreamThinner *theThinner = this->GetThinner(inStreamCookie);
+  if (theThinner == nullptr)
     return false;
-  (void) QTSS_GetValuePtr(inStream,
-                          sNextSeqNumAttr,
-                          0,
-                          (void **) &nextSeqNum,
-                          &theLen);
-  if ((nextSeqNum == NULL) || (theLen != sizeof(UInt16))) {
-    nextSeqNum = &sZero;
-    (void) QTSS_SetValue(inStream,
-                         sNextSeqNumAttr,
-                         0,
-                         nextSeqNum,
-                         sizeof(UInt16));
-  }
-  (void) QTSS_GetValuePtr(inStream,
-                          sSeqNumOffsetAttr,
-                          0,
-                          (void **) &theSeqNumOffset,
-                          &theLen);
-  if ((theSeqNumOffset == NULL) || (theLen != sizeof(UInt16))) {
-    theSeqNumOffset = &sZero;
-    (void) QTSS_SetValue(inStream,
-                         sSeqNumOffsetAttr,
-                         0,
-                         theSeqNumOffset,
-                         sizeof(UInt16));
-  }
-  UInt16 newSeqNumOffset = *theSeqNumOffset;
-
-  (void) QTSS_GetValuePtr(inStream,
-                          sLastQualityChangeAttr,
-                          0,
-                          (void **) &lastChangeTime,
-                          &theLen);
-  if ((lastChangeTime == NULL) || (theLen != sizeof(SInt64))) {
-    static SInt64 startTime = 0;
-    lastChangeTime = &startTime;
-    (void) QTSS_SetValue(inStream,
-                         sLastQualityChangeAttr,
-                         0,
-                         lastChangeTime,
-                         sizeof(SInt64));
-  }
 
-  SInt64 timeNow = Core::Time::Milliseconds();
-  if (*lastChangeTime == 0 || *curQualityLevel == 0)
-    *lastChangeTime = timeNow;
-
-  if (*curQualityLevel > 0
-      && ((*lastChangeTime + 30000) < timeNow)) // 30 seconds between reductions
-  {
-    *curQualityLevel -=
-        1; // reduce quality value.  If we quality doesn't change then we may have hit some steady state which we can't get out of without thinning or increasing the quality
-    *lastChangeTime = timeNow;
-    //s_printf("RTPSessionOutput set quality to %"   _U32BITARG_   "\n",*curQualityLevel);
+  if (theThinner->fFrameEnded || theThinner->fFrameTime != inPacket->GetPacketRTPTime()) {
+    theThinner->fFrameTime = inPacket->GetPacketRTPTime();
+
+    if (inPacket->IsKeyFrameStart())
+      theThinner->fWaitForKeyFrame = false;
+    else if (theQualityLevel >= ReflectorSession::kKeyFramesOnlyQuality)
+      theThinner->fWaitForKeyFrame = true;
+
+    theThinner->fDropFrame = theThinner->fWaitForKeyFrame
+        || (theQualityLevel >= ReflectorSession::kNoDisposableQuality && inPacket->IsDisposable());
+  } else if (theThinner->fDropFrame) {
+    // the frame began with parameter sets or with NRI 0 units (AUD, SEI) ahead of its slices
+    if (inPacket->IsKeyFrameStart()) {
+      theThinner->fWaitForKeyFrame = false;
+      theThinner->fDropFrame = false;
+    } else if (!theThinner->fWaitForKeyFrame && !inPacket->IsDisposable()) {
+      theThinner->fDropFrame = false;
+    }
   }
+  theThinner->fFrameEnded = inPacket->IsMarker();
 
-  //Check to see if we need to drop to audio only
-  if ((*curQualityLevel >= ReflectorSession::kAudioOnlyQuality) &&
-      (*nextSeqNum == 0)) {
-#if REFLECTOR_THINNING_DEBUGGING || RTP_SESSION_DEBUGGING
-    s_printf(" *** Reflector Dropping to audio only *** \n");
-#endif
-    //All we need to do in this case is mark the sequence number of the first dropped packet
-    (void) QTSS_SetValue(inStream,
-                         sNextSeqNumAttr,
-                         0,
-                         &curSeqNum,
-                         sizeof(UInt16));
-    *lastChangeTime = timeNow;
-  }
+  UInt16 theSeqNum = inPacket->GetPacketRTPSeqNum() % kThinnedSeqNumWindow;
+  if (theThinner->fDropFrame)
+    theThinner->fThinned[theSeqNum / 32] |= (1U << (theSeqNum % 32));
+  else
+    theThinner->fThinned[theSeqNum / 32] &= ~(1U << (theSeqNum % 32));
 
+  return theThinner->fDropFrame;
+}
 
-  //Check to see if we can reinstate video
-  if ((*curQualityLevel == ReflectorSession::kNormalQuality)
-      && (*nextSeqNum != 0)) {
-    //Compute the offset amount for each subsequent sequence number. This offset will
-    //alter the sequence numbers so that they increment normally (providing the illusion to the
-    //client that there are no missing packets)
-    newSeqNumOffset = (*theSeqNumOffset) + (curSeqNum - (*nextSeqNum));
-    (void) QTSS_SetValue(inStream,
-                         sSeqNumOffsetAttr,
-                         0,
-                         &newSeqNumOffset,
-                         sizeof(UInt16));
-    (void) QTSS_SetValue(inStream, sNextSeqNumAttr, 0, &sZero, sizeof(UInt16));
+bool RTPSessionOutput::PacketWasThinned(ReflectorPacket *inPacket, void *inStreamCookie) {
+  for (UInt32 x = 0; x < fNumThinners; x++) {
+    if (fThinners[x].fStreamCookie == inStreamCookie) {
+      UInt16 theSeqNum = inPacket->GetPacketRTPSeqNum() % kThinnedSeqNumWindow;
+      return (fThinners[x].fThinned[theSeqNum / 32] & (1U << (theSeqNum % 32))) != 0;
+    }
   }
 
-  //tell the caller whether to drop this packet or not.
-  if (*curQualityLevel >= ReflectorSession::kAudioOnlyQuality)
-    return true;
-  else {
-    //Adjust the sequence number of the current packet based on the offset, if any
-    curSeqNum -= newSeqNumOffset;
-    this->SetPacketSeqNumber(inPacket, curSeqNum);
-    return false;
+  return false;
+}
+
+RTPSessionOutput::StreamThinner *RTPSessionOutput::GetThinner(void *inStreamCookie) {
+  for (UInt32 x = 0; x < fNumThinners; x++) {
+    if (fThinners[x].fStreamCookie == inStreamCookie)
+      return &fThinners[x];
   }
+
+  if (fNumThinners == kMaxThinnedStreams)
+    return nullptr;
+
+  StreamThinner *theThinner = &fThinners[fNumThinners++];
+  ::memset(theThinner, 0, sizeof(StreamThinner));
+  theThinner->fStreamCookie = inStreamCookie;
+  theThinner->fFrameEnded = true; // the first packet starts a frame
+  return theThinner;
+}
+
+void RTPSessionOutput::Flush() {
+  if (!fWroteSinceFlush)
+    return;
+  fWroteSinceFlush = false;
+
+  QTSS_RTPStreamObject *theStreamPtr = nullptr;
+  UInt32 theLen = 0;
+  for (UInt32 z = 0; QTSS_GetValuePtr(fClientSession, qtssCliSesStreamObjects, z, (void **) &theStreamPtr, &theLen) == QTSS_NoErr; z++)
+    (void) QTSS_Flush(*theStreamPtr); // RTPStream::Flush, a no-op for UDP streams
 }
 
 void RTPSessionOutput::TearDown() {
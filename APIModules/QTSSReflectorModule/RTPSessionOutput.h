@@ -55,10 +55,16 @@ class RTPSessionOutput : public ReflectorOutput {
   // This writes the packet out to the proper QTSS_RTPStreamObject.
   // If this function returns QTSS_WouldBlock, timeToSendThisPacketAgain will
   // be set to # of msec in which the packet can be sent, or -1 if unknown
-  QTSS_Error WritePacket(CF::StrPtrLen *inPacketData, void *inStreamCookie, UInt32 inFlags, SInt64 packetLatenessInMSec,
-                         SInt64 *timeToSendThisPacketAgain, UInt64 *packetIDPtr, SInt64 *arrivalTimeMSec, bool firstPacket) override;
+  QTSS_Error WritePacket(ReflectorPacket *inPacket, void *inStreamCookie, UInt32 inFlags, SInt64 packetLatenessInMSec,
+                         SInt64 *timeToSendThisPacketAgain, bool firstPacket, bool *outWritten) override;
   void TearDown() override;
 
+  // Sends what the batched TCP writes of WritePacket queued on the RTSP connection
+  void Flush() override;
+
+  // Writes an RTP packet this client already got once more, right away
+  QTSS_Error RetransmitPacket(ReflectorPacket *inPacket, void *inStreamCookie) override;
+
   SInt64 GetReflectorSessionInitTime() { return fReflectorSession->GetInitTimeMS(); }
 
   bool IsUDP() override;
@@ -69,6 +75,58 @@ class RTPSessionOutput : public ReflectorOutput {
 
  private:
 
+  //
+  // PACING
+  //
+  // With reflector_pacing_window_msec set every RTP stream of the client gets a
+  // token bucket filled at kPacingRatePercent of the stream's measured bit rate
+  // and holding one window of it, so a keyframe leaves in window sized slices
+  // instead of back-to-back.
+
+  enum {
+    kMaxPacedStreams = 8,     // further streams are sent unpaced
+    kPacingRatePercent = 200
+  };
+
+  struct StreamPacer {
+    void *fStreamCookie;
+    UInt32 fBytesPerSec;
+    SInt64 fTokens;           // in 1/1000 bytes, a 1 msec refill never rounds to 0
+    SInt64 fRefillTime;
+  };
+
+  // the refilled bucket of inStreamCookie, nullptr if it is not paced
+  StreamPacer *GetPacer(void *inStreamCookie, SInt64 inCurrentTime);
+
+  StreamPacer fPacers[kMaxPacedStreams];
+  UInt32 fNumPacers;
+
+  //
+  // THINNING
+  //
+  // H.264/H.265 video follows qtssRTPStrQualityLevel by whole frames, see
+  // ReflectorSession::kNoDisposableQuality. The frame a packet belongs to is
+  // decided at its first packet, a new RTP timestamp or the packet after a marker.
+
+  enum {
+    kMaxThinnedStreams = 8,   // further streams are never thinned
+    kThinnedSeqNumWindow = 1024
+  };
+
+  struct StreamThinner {
+    void *fStreamCookie;
+    UInt32 fFrameTime;
+    bool fFrameEnded;         // the last packet had the marker bit
+    bool fDropFrame;
+    bool fWaitForKeyFrame;    // a reference frame was dropped
+    UInt32 fThinned[kThinnedSeqNumWindow / 32]; // bit per seq num, a NACK for these is ignored
+  };
+
+  StreamThinner *GetThinner(void *inStreamCookie);
+
+  StreamThinner fThinners[kMaxThinnedStreams];
+  UInt32 fNumThinners;
+
   QTSS_ClientSessionObject fClientSession;
   ReflectorSession *fReflectorSession;
   QTSS_AttributeID fCookieAttrID; // is sStreamCookieAttr that defined in QTSSReflectorModule
@@ -78,11 +136,13 @@ class RTPSessionOutput : public ReflectorOutput {
   bool fTransportInitialized;
   bool fMustSynch;
   bool fPreFilter;
+  bool fWroteSinceFlush;    // a TCP stream may hold references to packets
 
   UInt16 GetPacketSeqNumber(CF::StrPtrLen *inPacket);
   void SetPacketSeqNumber(CF::StrPtrLen *inPacket, UInt16 inSeqNumber);
-  bool PacketShouldBeThinned(QTSS_RTPStreamObject inStream, CF::StrPtrLen *inPacket);
-  bool FilterPacket(QTSS_RTPStreamObject *theStreamPtr, CF::StrPtrLen *inPacket);
+  bool PacketShouldBeThinned(QTSS_RTPStreamObject *theStreamPtr, ReflectorPacket *inPacket, void *inStreamCookie);
+  bool PacketWasThinned(ReflectorPacket *inPacket, void *inStreamCookie);
+  bool FilterPacket(QTSS_RTPStreamObject *theStreamPtr, ReflectorPacket *inPacket);
 
   UInt32 GetPacketRTPTime(CF::StrPtrLen *packetStrPtr);
   inline bool PacketMatchesStream(void *inStreamCookie, QTSS_RTPStreamObject *theStreamPtr);
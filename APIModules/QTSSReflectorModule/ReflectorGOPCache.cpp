@@ -0,0 +1,91 @@
+/*
+    File:       ReflectorGOPCache.cpp
+
+    Contains:   Implementation of ReflectorGOPCache
+*/
+
+#include "ReflectorGOPCache.h"
+#include "ReflectorStream.h"
+
+#ifndef DEBUG_REFLECTOR_STREAM
+#define DEBUG_REFLECTOR_STREAM 0
+#else
+#undef  DEBUG_REFLECTOR_STREAM
+#define DEBUG_REFLECTOR_STREAM 1
+#endif
+
+bool ReflectorGOPCache::sEnabled = true;
+UInt32 ReflectorGOPCache::sMaxBytes = 4 * 1024 * 1024;
+UInt32 ReflectorGOPCache::sMaxFrames = 300;
+
+ReflectorGOPCache::ReflectorGOPCache(ReflectorPacketRing *inRing)
+    : fRing(inRing),
+      fStartIndex(ReflectorPacketRing::kInvalidIndex),
+      fNumBytes(0),
+      fNumFrames(0),
+      fStartRTPTime(0) {
+}
+
+void ReflectorGOPCache::SetLimits(bool enabled, UInt32 inMaxBytes, UInt32 inMaxFrames) {
+  sEnabled = enabled;
+  sMaxBytes = inMaxBytes;
+  sMaxFrames = inMaxFrames;
+}
+
+void ReflectorGOPCache::Start(UInt64 inIndex) {
+  ReflectorPacket *thePacket = fRing->Get(inIndex);
+  if (thePacket == nullptr)
+    return;
+
+  // SPS, PPS and the IDR of one access unit share their RTP timestamp, the GOP starts at the first of them
+  if (this->GetStartIndex() != ReflectorPacketRing::kInvalidIndex && fNumFrames == 1
+      && thePacket->GetPacketRTPTime() == fStartRTPTime) {
+    this->Append(thePacket);
+    return;
+  }
+
+  this->Clear();
+
+  thePacket->fNeededByOutput = true; // 锁定关键帧不会被Remove
+  fNumBytes = thePacket->GetPacketPtr()->Len;
+  fNumFrames = 1;
+  fStartRTPTime = thePacket->GetPacketRTPTime();
+  fRing->AddKeyFrame(inIndex);
+
+  fStartIndex.store(inIndex, std::memory_order_release);
+}
+
+void ReflectorGOPCache::Append(ReflectorPacket *inPacket) {
+  if (this->GetStartIndex() == ReflectorPacketRing::kInvalidIndex)
+    return;
+
+  fNumBytes += inPacket->GetPacketPtr()->Len;
+  if (inPacket->IsFrameStart())
+    fNumFrames++;
+
+  // without the cache the key frame stays pinned until the next one, as it always did
+  if (!sEnabled)
+    return;
+
+  if ((sMaxBytes > 0 && fNumBytes > sMaxBytes) || (sMaxFrames > 0 && fNumFrames > sMaxFrames)) {
+    DEBUG_LOG(DEBUG_REFLECTOR_STREAM,
+              "ReflectorGOPCache::Append GOP over limit bytes=%" _U32BITARG_ " frames=%" _U32BITARG_ ", dropped\n",
+              fNumBytes, fNumFrames);
+    this->Clear();
+  }
+}
+
+void ReflectorGOPCache::Clear() {
+  UInt64 theStartIndex = this->GetStartIndex();
+  if (theStartIndex == ReflectorPacketRing::kInvalidIndex)
+    return;
+
+  // let RemoveOldPackets age the GOP out like any other packets
+  ReflectorPacket *thePacket = fRing->Get(theStartIndex);
+  if (thePacket != nullptr)
+    thePacket->fNeededByOutput = false;
+
+  fStartIndex.store(ReflectorPacketRing::kInvalidIndex, std::memory_order_release);
+  fNumBytes = 0;
+  fNumFrames = 0;
+}
@@ -0,0 +1,214 @@
+/*
+    File:       ReflectorPacketPool.cpp
+
+    Contains:   Implementation of ReflectorPacketPool / ReflectorPacketBuffer
+*/
+
+#include <cstring>
+#include <new>
+
+#include "ReflectorPacketPool.h"
+
+using namespace CF;
+
+static_assert(sizeof(ReflectorPacketBuffer) <= ReflectorPacketBuffer::kHeaderSize,
+              "ReflectorPacketBuffer header does not fit kHeaderSize");
+
+/**
+ * 连续内存块，ReflectorPacketBuffer 依次切分自 fData
+ */
+class ReflectorPacketSlab {
+ public:
+
+  explicit ReflectorPacketSlab(ReflectorPacketPool *inPool)
+      : fPool(inPool), fRefCount(0), fUsed(0), fQueueElem() {
+    fQueueElem.SetEnclosingObject(this);
+  }
+
+  ReflectorPacketPool *fPool;
+  std::atomic_uint fRefCount; // live buffers, plus 1 while it is the pool's current slab
+  UInt32 fUsed;
+  QueueElem fQueueElem;
+
+  alignas(ReflectorPacketBuffer::kAlignment) char fData[ReflectorPacketPool::kSlabSize];
+};
+
+static inline UInt32 AlignedSize(UInt32 inLen) {
+  return (inLen + ReflectorPacketBuffer::kAlignment - 1) & ~(UInt32) (ReflectorPacketBuffer::kAlignment - 1);
+}
+
+void ReflectorPacketBuffer::Release() {
+  if (fRefCount.fetch_sub(1) == 1)
+    fSlab->fPool->ReleaseBuffer(this);
+}
+
+ReflectorPacketPool::ReflectorPacketPool()
+    : fCurrentSlab(nullptr),
+      fNumSlabs(0),
+      fMaxSlabs(0),
+      fDetached(false),
+      fNumBuffers(0),
+      fBytesInUse(0) {
+}
+
+ReflectorPacketPool::~ReflectorPacketPool() {
+  Assert(fCurrentSlab == nullptr);
+  Assert(fNumBuffers == 0);
+
+  while (fFreeSlabs.GetLength() > 0) {
+    auto *theSlab = (ReflectorPacketSlab *) fFreeSlabs.DeQueue()->GetEnclosingObject();
+    delete theSlab;
+  }
+}
+
+/**
+ * 所有者放弃该池，最后一个缓冲区释放时池自行销毁
+ */
+void ReflectorPacketPool::Detach() {
+  this->RetireCurrentSlab();
+
+  bool shouldDelete;
+  {
+    Core::MutexLocker locker(&fMutex);
+    fDetached = true;
+    shouldDelete = (fFreeSlabs.GetLength() == fNumSlabs);
+  }
+
+  if (shouldDelete)
+    delete this;
+}
+
+char *ReflectorPacketPool::Reserve(UInt32 inMaxLen) {
+  UInt32 theNeeded = ReflectorPacketBuffer::kHeaderSize + inMaxLen;
+  if (theNeeded > kSlabSize)
+    return nullptr;
+
+  if (fCurrentSlab != nullptr && (kSlabSize - fCurrentSlab->fUsed) < theNeeded)
+    this->RetireCurrentSlab();
+
+  if (fCurrentSlab == nullptr) {
+    fCurrentSlab = this->GetFreeSlab();
+    fCurrentSlab->fRefCount.fetch_add(1);
+  }
+
+  return &fCurrentSlab->fData[fCurrentSlab->fUsed] + ReflectorPacketBuffer::kHeaderSize;
+}
+
+ReflectorPacketBuffer *ReflectorPacketPool::Commit(UInt32 inLen) {
+  Assert(fCurrentSlab != nullptr);
+  if (fCurrentSlab == nullptr || inLen == 0)
+    return nullptr;
+
+  return this->CommitSlot(&fCurrentSlab->fData[fCurrentSlab->fUsed] + ReflectorPacketBuffer::kHeaderSize, inLen);
+}
+
+UInt32 ReflectorPacketPool::GetSlotStride(UInt32 inMaxLen) {
+  return AlignedSize(ReflectorPacketBuffer::kHeaderSize + inMaxLen);
+}
+
+char *ReflectorPacketPool::ReserveSlots(UInt32 inCount, UInt32 inMaxLen) {
+  Assert(inCount > 0);
+
+  // every slot but the last is a full stride, so committed buffers never reach the next slot
+  return this->Reserve((inCount - 1) * GetSlotStride(inMaxLen) + inMaxLen);
+}
+
+ReflectorPacketBuffer *ReflectorPacketPool::CommitSlot(char *inSlot, UInt32 inLen) {
+  Assert(fCurrentSlab != nullptr);
+  if (fCurrentSlab == nullptr || inLen == 0)
+    return nullptr;
+
+  char *theTail = &fCurrentSlab->fData[fCurrentSlab->fUsed] + ReflectorPacketBuffer::kHeaderSize;
+  Assert(inSlot >= theTail);
+  if (inSlot != theTail)
+    ::memmove(theTail, inSlot, inLen);
+
+  UInt32 theSize = AlignedSize(ReflectorPacketBuffer::kHeaderSize + inLen);
+  Assert(fCurrentSlab->fUsed + ReflectorPacketBuffer::kHeaderSize + inLen <= kSlabSize);
+
+  auto *theBuffer = new(&fCurrentSlab->fData[fCurrentSlab->fUsed]) ReflectorPacketBuffer(fCurrentSlab, inLen);
+  fCurrentSlab->fRefCount.fetch_add(1);
+  fCurrentSlab->fUsed += theSize; // kSlabSize is aligned too, so this never passes the end
+
+  fNumBuffers.fetch_add(1);
+  fBytesInUse.fetch_add(inLen);
+
+  return theBuffer;
+}
+
+ReflectorPacketBuffer *ReflectorPacketPool::Acquire(char *inData, UInt32 inLen) {
+  char *theData = this->Reserve(inLen);
+  if (theData == nullptr)
+    return nullptr;
+
+  if (inLen > 0)
+    ::memcpy(theData, inData, inLen);
+
+  return this->Commit(inLen);
+}
+
+void ReflectorPacketPool::GetStats(Stats *outStats) {
+  Core::MutexLocker locker(&fMutex);
+  outStats->fNumSlabs = fNumSlabs;
+  outStats->fNumFreeSlabs = fFreeSlabs.GetLength();
+  outStats->fNumBuffers = fNumBuffers;
+  outStats->fBytesInUse = fBytesInUse;
+  outStats->fBytesAllocated = fNumSlabs * kSlabSize;
+  outStats->fMaxSlabs = fMaxSlabs;
+}
+
+ReflectorPacketSlab *ReflectorPacketPool::GetFreeSlab() {
+  Core::MutexLocker locker(&fMutex);
+  if (fFreeSlabs.GetLength() > 0)
+    return (ReflectorPacketSlab *) fFreeSlabs.DeQueue()->GetEnclosingObject();
+
+  fNumSlabs++;
+  if (fNumSlabs > fMaxSlabs)
+    fMaxSlabs = fNumSlabs;
+
+  return new ReflectorPacketSlab(this);
+}
+
+/**
+ * 放弃当前正在填充的 slab，其余空间随最后一个缓冲区释放一起回收
+ */
+void ReflectorPacketPool::RetireCurrentSlab() {
+  ReflectorPacketSlab *theSlab = fCurrentSlab;
+  if (theSlab == nullptr)
+    return;
+
+  fCurrentSlab = nullptr;
+  if (theSlab->fRefCount.fetch_sub(1) == 1)
+    this->RecycleSlab(theSlab);
+}
+
+void ReflectorPacketPool::ReleaseBuffer(ReflectorPacketBuffer *inBuffer) {
+  ReflectorPacketSlab *theSlab = inBuffer->fSlab;
+
+  fNumBuffers.fetch_sub(1);
+  fBytesInUse.fetch_sub(inBuffer->fLength);
+  inBuffer->~ReflectorPacketBuffer();
+
+  if (theSlab->fRefCount.fetch_sub(1) == 1)
+    this->RecycleSlab(theSlab);
+}
+
+void ReflectorPacketPool::RecycleSlab(ReflectorPacketSlab *inSlab) {
+  bool shouldDelete;
+  {
+    Core::MutexLocker locker(&fMutex);
+    inSlab->fUsed = 0;
+
+    if (fFreeSlabs.GetLength() < kMaxFreeSlabs && !fDetached) {
+      fFreeSlabs.EnQueue(&inSlab->fQueueElem);
+    } else {
+      fNumSlabs--;
+      delete inSlab;
+    }
+
+    shouldDelete = fDetached && (fFreeSlabs.GetLength() == fNumSlabs);
+  }
+
+  if (shouldDelete)
+    delete this;
+}
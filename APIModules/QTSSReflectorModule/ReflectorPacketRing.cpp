@@ -0,0 +1,154 @@
+/*
+    File:       ReflectorPacketRing.cpp
+
+    Contains:   Implementation of ReflectorPacketRing
+*/
+
+#include <string.h>
+
+#include "ReflectorPacketRing.h"
+#include "ReflectorStream.h"
+
+const UInt64 ReflectorPacketRing::kInvalidIndex;
+
+ReflectorPacketRing::ReflectorPacketRing()
+    : fSlots(nullptr),
+      fHead(1),
+      fTail(1),
+      fKeyFrameHead(0),
+      fNumKeyFrames(0) {
+  auto *theSlots = new SlotArray;
+  theSlots->fSlots = new ReflectorPacket *[kInitialCapacity];
+  theSlots->fCapacity = kInitialCapacity;
+  theSlots->fRetired = nullptr;
+  ::memset(theSlots->fSlots, 0, sizeof(ReflectorPacket *) * kInitialCapacity);
+  fSlots = theSlots;
+}
+
+ReflectorPacketRing::~ReflectorPacketRing() {
+  Assert(this->IsEmpty());
+
+  SlotArray *theSlots = fSlots;
+  while (theSlots != nullptr) {
+    SlotArray *theRetired = theSlots->fRetired;
+    delete[] theSlots->fSlots;
+    delete theSlots;
+    theSlots = theRetired;
+  }
+}
+
+UInt64 ReflectorPacketRing::LowerBoundTimeArrived(SInt64 inTimeArrived) {
+  UInt64 theLow = this->GetHeadIndex();
+  UInt64 theHigh = this->GetTailIndex();
+
+  while (theLow < theHigh) {
+    UInt64 theMiddle = theLow + (theHigh - theLow) / 2;
+    if (this->Get(theMiddle)->GetTimeArrived() < inTimeArrived)
+      theLow = theMiddle + 1;
+    else
+      theHigh = theMiddle;
+  }
+
+  return theLow;
+}
+
+UInt64 ReflectorPacketRing::FindSeqNum(UInt32 inSSRC, UInt16 inSeqNum) {
+  if (this->IsEmpty())
+    return kInvalidIndex;
+
+  UInt64 theHead = this->GetHeadIndex();
+  UInt64 theNewest = this->GetTailIndex() - 1;
+
+  // in order arrival puts it this far behind the newest packet
+  auto theDistance = (UInt16) (this->Get(theNewest)->GetPacketRTPSeqNum() - inSeqNum);
+  UInt64 theGuess = theNewest - theHead >= theDistance ? theNewest - theDistance : theHead;
+
+  for (UInt64 theOffset = 0; theOffset <= kSeqNumSearchWindow; theOffset++) {
+    if (theGuess + theOffset <= theNewest) {
+      ReflectorPacket *thePacket = this->Get(theGuess + theOffset);
+      if (thePacket->GetPacketRTPSeqNum() == inSeqNum && thePacket->GetSSRC() == inSSRC)
+        return theGuess + theOffset;
+    }
+    if (theOffset > 0 && theGuess >= theHead + theOffset) {
+      ReflectorPacket *thePacket = this->Get(theGuess - theOffset);
+      if (thePacket->GetPacketRTPSeqNum() == inSeqNum && thePacket->GetSSRC() == inSSRC)
+        return theGuess - theOffset;
+    }
+  }
+
+  return kInvalidIndex;
+}
+
+void ReflectorPacketRing::Grow() {
+  SlotArray *theOldSlots = fSlots.load(std::memory_order_relaxed);
+  UInt32 theOldMask = theOldSlots->fCapacity - 1;
+
+  auto *theSlots = new SlotArray;
+  theSlots->fCapacity = theOldSlots->fCapacity * 2;
+  theSlots->fSlots = new ReflectorPacket *[theSlots->fCapacity];
+  theSlots->fRetired = theOldSlots;
+  ::memset(theSlots->fSlots, 0, sizeof(ReflectorPacket *) * theSlots->fCapacity);
+
+  UInt32 theMask = theSlots->fCapacity - 1;
+  for (UInt64 i = this->GetHeadIndex(); i < this->GetTailIndex(); i++)
+    theSlots->fSlots[i & theMask] = theOldSlots->fSlots[i & theOldMask];
+
+  fSlots.store(theSlots, std::memory_order_release);
+}
+
+UInt64 ReflectorPacketRing::PushBack(ReflectorPacket *inPacket) {
+  Assert(!this->IsFull());
+
+  SlotArray *theSlots = fSlots.load(std::memory_order_relaxed);
+  UInt64 theIndex = fTail.load(std::memory_order_relaxed);
+  theSlots->fSlots[theIndex & (theSlots->fCapacity - 1)] = inPacket;
+  fTail.store(theIndex + 1, std::memory_order_release); // publishes the packet
+
+  return theIndex;
+}
+
+ReflectorPacket *ReflectorPacketRing::PopFront() {
+  if (this->IsEmpty())
+    return nullptr;
+
+  SlotArray *theSlots = fSlots.load(std::memory_order_relaxed);
+  UInt64 theIndex = fHead.load(std::memory_order_relaxed);
+  ReflectorPacket *&theSlot = theSlots->fSlots[theIndex & (theSlots->fCapacity - 1)];
+  ReflectorPacket *thePacket = theSlot;
+  theSlot = nullptr;
+  fHead.store(theIndex + 1, std::memory_order_release);
+
+  return thePacket;
+}
+
+void ReflectorPacketRing::ExpireKeyFrames() {
+  while (fNumKeyFrames > 0 && fKeyFrames[fKeyFrameHead] < this->GetHeadIndex()) {
+    fKeyFrameHead = (fKeyFrameHead + 1) % kMaxKeyFrames;
+    fNumKeyFrames--;
+  }
+}
+
+void ReflectorPacketRing::AddKeyFrame(UInt64 inIndex) {
+  this->ExpireKeyFrames();
+
+  if (fNumKeyFrames == kMaxKeyFrames) { // forget the oldest one
+    fKeyFrameHead = (fKeyFrameHead + 1) % kMaxKeyFrames;
+    fNumKeyFrames--;
+  }
+
+  fKeyFrames[(fKeyFrameHead + fNumKeyFrames) % kMaxKeyFrames] = inIndex;
+  fNumKeyFrames++;
+}
+
+UInt32 ReflectorPacketRing::GetKeyFramesFrom(UInt64 inIndex, UInt64 *outIndexes, UInt32 inMaxIndexes) {
+  this->ExpireKeyFrames();
+
+  UInt32 theCount = 0;
+  for (UInt32 i = 0; i < fNumKeyFrames && theCount < inMaxIndexes; i++) {
+    UInt64 theIndex = fKeyFrames[(fKeyFrameHead + i) % kMaxKeyFrames];
+    if (theIndex >= inIndex)
+      outIndexes[theCount++] = theIndex;
+  }
+
+  return theCount;
+}
@@ -239,6 +239,9 @@ void ReflectorSession::RemoveOutput(ReflectorOutput *inOutput, bool isClient) {
       fStreamArray[y]->DecEyeCount();
   }
 
+  // send loops may still hold a snapshot with this output, make them skip it
+  inOutput->Detach();
+
   if (fNumOutputs == 0) {
     this->SetNoneOutputStartTimeMS();
     QTSS_RoleParams theParams;
@@ -261,6 +264,7 @@ void ReflectorSession::RemoveSessionFromOutput(QTSS_ClientSessionObject inSessio
   for (UInt32 x = 0; x < fSourceInfo->GetNumStreams(); x++) {
     ((ReflectorSocket *) fStreamArray[x]->GetSocketPair()->GetSocketA())->RemoveBroadcasterSession(inSession);
     ((ReflectorSocket *) fStreamArray[x]->GetSocketPair()->GetSocketB())->RemoveBroadcasterSession(inSession);
+    fStreamArray[x]->SetBroadcasterRTPStream(nullptr); // its streams go away with the session
   }
   fBroadcasterSession = nullptr;
 }
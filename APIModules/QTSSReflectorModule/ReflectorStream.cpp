@@ -30,11 +30,20 @@
 
 #include <CF/Net/Socket/SocketUtils.h>
 
+#if __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#endif
+
 #include "ReflectorStream.h"
 #include "H264Packet.h"
+#include "H265Packet.h"
 #include "QTSSModuleUtils.h"
 #include "RTCPPacket.h"
+#include "RTCPFeedbackPacket.h"
 #include "ReflectorSession.h"
+#include "UDPSendBatch.h"
 
 #ifndef DEBUG_REFLECTOR_STREAM
 #define DEBUG_REFLECTOR_STREAM 0
@@ -58,6 +67,18 @@ static UInt32 sDefaultBucketDelayInMsec = 73;
 static bool sDefaultUsePacketReceiveTime = false;
 static UInt32 sDefaultMaxFuturePacketTimeSec = 60;
 static UInt32 sDefaultFirstPacketOffsetMsec = 500;
+static bool sDefaultUseRecvMmsg = true;
+static bool sDefaultUseSendMmsg = true;
+static bool sDefaultUseUDPGSO = false;
+static bool sDefaultUseTCPWriteV = true;
+static UInt32 sDefaultNumFanoutShards = 1;
+static bool sDefaultUseGOPCache = true;
+static UInt32 sDefaultGOPCacheMaxKBytes = 4096;
+static UInt32 sDefaultGOPCacheMaxFrames = 300;
+static UInt32 sDefaultNackRetransmitsPerSec = 100;
+static UInt32 sDefaultKeyFrameRequestIntervalMSec = 1000;
+static UInt32 sDefaultPacingWindowMSec = 0;
+static const UInt32 kMaxFanoutShards = 32;
 
 UInt32 ReflectorStream::sBucketSize = 16;
 UInt32 ReflectorStream::sOverBufferInMsec = 10000; // more or less what the client over buffer will be
@@ -69,6 +90,17 @@ UInt32 ReflectorStream::sOverBufferInSec = 10;
 UInt32 ReflectorStream::sBucketDelayInMsec = 73;
 bool   ReflectorStream::sUsePacketReceiveTime = false;
 UInt32 ReflectorStream::sFirstPacketOffsetMsec = 500;
+bool   ReflectorStream::sUseRecvMmsg = true;
+bool   ReflectorStream::sUseSendMmsg = true;
+bool   ReflectorStream::sUseUDPGSO = false;
+bool   ReflectorStream::sUseTCPWriteV = true;
+UInt32 ReflectorStream::sNumFanoutShards = 1;
+bool   ReflectorStream::sUseGOPCache = true;
+UInt32 ReflectorStream::sGOPCacheMaxKBytes = 4096;
+UInt32 ReflectorStream::sGOPCacheMaxFrames = 300;
+UInt32 ReflectorStream::sNackRetransmitsPerSec = 100;
+UInt32 ReflectorStream::sKeyFrameRequestIntervalMSec = 1000;
+UInt32 ReflectorStream::sPacingWindowMSec = 0;
 
 UInt32 ReflectorStream::sRelocatePacketAgeMSec = 1000;
 
@@ -106,6 +138,61 @@ void ReflectorStream::Initialize(QTSS_ModulePrefsObject inPrefs) {
                                 &ReflectorStream::sFirstPacketOffsetMsec, &sDefaultFirstPacketOffsetMsec,
                                 sizeof(sDefaultFirstPacketOffsetMsec));
 
+  QTSSModuleUtils::GetAttribute(inPrefs, "reflector_batch_receive", qtssAttrDataTypeBool16,
+                                &ReflectorStream::sUseRecvMmsg, &sDefaultUseRecvMmsg,
+                                sizeof(sDefaultUseRecvMmsg));
+
+  QTSSModuleUtils::GetAttribute(inPrefs, "reflector_batch_send", qtssAttrDataTypeBool16,
+                                &ReflectorStream::sUseSendMmsg, &sDefaultUseSendMmsg,
+                                sizeof(sDefaultUseSendMmsg));
+
+  QTSSModuleUtils::GetAttribute(inPrefs, "reflector_udp_gso", qtssAttrDataTypeBool16,
+                                &ReflectorStream::sUseUDPGSO, &sDefaultUseUDPGSO,
+                                sizeof(sDefaultUseUDPGSO));
+
+  QTSSModuleUtils::GetAttribute(inPrefs, "reflector_batch_send_tcp", qtssAttrDataTypeBool16,
+                                &ReflectorStream::sUseTCPWriteV, &sDefaultUseTCPWriteV,
+                                sizeof(sDefaultUseTCPWriteV));
+
+  QTSSModuleUtils::GetAttribute(inPrefs, "reflector_fanout_shards", qtssAttrDataTypeUInt32,
+                                &ReflectorStream::sNumFanoutShards, &sDefaultNumFanoutShards,
+                                sizeof(sDefaultNumFanoutShards));
+  if (ReflectorStream::sNumFanoutShards == 0)
+    ReflectorStream::sNumFanoutShards = 1;
+  else if (ReflectorStream::sNumFanoutShards > kMaxFanoutShards)
+    ReflectorStream::sNumFanoutShards = kMaxFanoutShards;
+
+  QTSSModuleUtils::GetAttribute(inPrefs, "reflector_gop_cache", qtssAttrDataTypeBool16,
+                                &ReflectorStream::sUseGOPCache, &sDefaultUseGOPCache,
+                                sizeof(sDefaultUseGOPCache));
+
+  QTSSModuleUtils::GetAttribute(inPrefs, "reflector_gop_cache_max_kbytes", qtssAttrDataTypeUInt32,
+                                &ReflectorStream::sGOPCacheMaxKBytes, &sDefaultGOPCacheMaxKBytes,
+                                sizeof(sDefaultGOPCacheMaxKBytes));
+
+  QTSSModuleUtils::GetAttribute(inPrefs, "reflector_gop_cache_max_frames", qtssAttrDataTypeUInt32,
+                                &ReflectorStream::sGOPCacheMaxFrames, &sDefaultGOPCacheMaxFrames,
+                                sizeof(sDefaultGOPCacheMaxFrames));
+
+  QTSSModuleUtils::GetAttribute(inPrefs, "reflector_nack_retransmits_per_sec", qtssAttrDataTypeUInt32,
+                                &ReflectorStream::sNackRetransmitsPerSec, &sDefaultNackRetransmitsPerSec,
+                                sizeof(sDefaultNackRetransmitsPerSec));
+
+  QTSSModuleUtils::GetAttribute(inPrefs, "reflector_keyframe_request_interval_msec", qtssAttrDataTypeUInt32,
+                                &ReflectorStream::sKeyFrameRequestIntervalMSec, &sDefaultKeyFrameRequestIntervalMSec,
+                                sizeof(sDefaultKeyFrameRequestIntervalMSec));
+
+  QTSSModuleUtils::GetAttribute(inPrefs, "reflector_pacing_window_msec", qtssAttrDataTypeUInt32,
+                                &ReflectorStream::sPacingWindowMSec, &sDefaultPacingWindowMSec,
+                                sizeof(sDefaultPacingWindowMSec));
+
+  ReflectorGOPCache::SetLimits(ReflectorStream::sUseGOPCache,
+                               ReflectorStream::sGOPCacheMaxKBytes * 1024, ReflectorStream::sGOPCacheMaxFrames);
+
+  UDPSendBatch::SetSendMmsgEnabled(ReflectorStream::sUseSendMmsg);
+  UDPSendBatch::SetGSOEnabled(ReflectorStream::sUseUDPGSO);
+  UDPSendBatch::SetInterleavedEnabled(ReflectorStream::sUseTCPWriteV);
+
   ReflectorStream::sOverBufferInMsec = sOverBufferInSec * 1000;
   ReflectorStream::sMaxFuturePacketMSec = sMaxFuturePacketSec * 1000;
   ReflectorStream::sMaxPacketAgeMSec = (UInt32) (sOverBufferInMsec * 10); // allow a little time before deleting.
@@ -124,14 +211,21 @@ ReflectorStream::ReflectorStream(SourceInfo::StreamInfo *inInfo)
       fSockets(nullptr),
       fRTPSender(nullptr, qtssWriteFlagsIsRTP),
       fRTCPSender(nullptr, qtssWriteFlagsIsRTCP),
-      fOutputArray(nullptr),
+      fOutputs(nullptr),
+      fNumOutputReaders(0),
+      fRetiredOutputs(nullptr),
       fStreamFormat(kStreamFormatUnknown),
       fNumBuckets(kMinNumBuckets),
       fNumElements(0),
+      fOutputMutex(),
       fBucketMutex(),
 
       fDestRTCPAddr(0),
       fDestRTCPPort(0),
+      fBroadcasterRTPStream(nullptr),
+      fKeyFrameRequestPending(false),
+      fKeyFrameRequestSSRC(0),
+      fLastKeyFrameRequestTime(0),
 
       fCurrentBitRate(0),
       fLastBitRateSample(Core::Time::Milliseconds()), // don't calculate our first bit rate until kBitRateAvgIntervalInMilSecs has passed!
@@ -275,8 +369,6 @@ ReflectorStream::ReflectorStream(SourceInfo::StreamInfo *inInfo)
     fDestRTCPAddr = fStreamInfo.fDestIPAddr;
     fDestRTCPPort = static_cast<UInt16>(fStreamInfo.fPort + 1);
   }
-
-  pkeyFrameCache = new CKeyFrameCache(MAX_CACHE_SIZE);
 }
 
 ReflectorStream::~ReflectorStream() {
@@ -289,6 +381,9 @@ ReflectorStream::~ReflectorStream() {
     ((ReflectorSocket *) fSockets->GetSocketA())->RemoveSender(&fRTPSender);
     ((ReflectorSocket *) fSockets->GetSocketB())->RemoveSender(&fRTCPSender);
 
+    // and the fan-out shards are done with the outputs before they go away
+    fRTPSender.StopShards();
+
     //leave the multicast group. Because this socket is shared amongst several
     //potential multicasts, we don't want to remain a member of a stale multicast
     if (Net::SocketUtils::IsMulticastIPAddr(fStreamInfo.fDestIPAddr)) {
@@ -302,48 +397,169 @@ ReflectorStream::~ReflectorStream() {
       sSocketPool.DestructUDPSocketPair(fSockets);
   }
 
-  // 释放关键帧缓冲区
-  if (pkeyFrameCache) {
-    delete pkeyFrameCache;
-    pkeyFrameCache = nullptr;
+  //delete every client Bucket, a send loop may still hold the last snapshot
+  this->ReleaseRetiredOutputs();
+  fOutputs.load()->Release();
+}
+
+ReflectorOutputSnapshot::Bucket::Bucket(UInt32 inBucketSize, Bucket *inCopyFrom)
+    : fRefCount(1),
+      fBucketSize(inBucketSize),
+      fOutputs(new ReflectorOutput *[inBucketSize]) {
+  for (UInt32 x = 0; x < fBucketSize; x++) {
+    fOutputs[x] = inCopyFrom != nullptr ? inCopyFrom->fOutputs[x] : nullptr;
+    if (fOutputs[x] != nullptr)
+      fOutputs[x]->AddRef();
   }
+}
 
-  //delete every client Bucket
-  for (UInt32 y = 0; y < fNumBuckets; y++)
-    delete[] fOutputArray[y];
-  delete[] fOutputArray;
+ReflectorOutputSnapshot::Bucket::~Bucket() {
+  for (UInt32 x = 0; x < fBucketSize; x++) {
+    if (fOutputs[x] != nullptr)
+      fOutputs[x]->Release();
+  }
+  delete[] fOutputs;
 }
 
-void ReflectorStream::AllocateBucketArray(UInt32 inNumBuckets) {
-  Bucket *oldArray = fOutputArray;
-  // allocate the 2-dimensional array
-  fOutputArray = new Bucket[inNumBuckets];
-  for (UInt32 x = 0; x < inNumBuckets; x++) {
-    fOutputArray[x] = new ReflectorOutput *[sBucketSize];
-    ::memset(fOutputArray[x], 0, sizeof(ReflectorOutput *) * sBucketSize);
-  }
-
-  // copy over the old information if there was an old array
-  if (oldArray != nullptr) {
-    Assert(inNumBuckets > fNumBuckets);
-    for (UInt32 y = 0; y < fNumBuckets; y++) {
-      ::memcpy(fOutputArray[y], oldArray[y], sBucketSize * sizeof(ReflectorOutput *));
-      delete[] oldArray[y];
+void ReflectorOutputSnapshot::ReleaseBucket(Bucket *inBucket) {
+  if (inBucket != nullptr && inBucket->fRefCount.fetch_sub(1) == 1)
+    delete inBucket;
+}
+
+ReflectorOutputSnapshot::ReflectorOutputSnapshot(UInt32 inNumBuckets, UInt32 inBucketSize,
+                                                 ReflectorOutputSnapshot *inCopyFrom)
+    : fRefCount(1),
+      fNumBuckets(inNumBuckets),
+      fBucketSize(inBucketSize),
+      fBuckets(new Bucket *[inNumBuckets]),
+      fNextRetired(nullptr) {
+  ::memset(fBuckets, 0, sizeof(Bucket *) * inNumBuckets);
+
+  // share the buckets of the old array if there was one
+  if (inCopyFrom != nullptr) {
+    Assert(inNumBuckets >= inCopyFrom->fNumBuckets && inBucketSize == inCopyFrom->fBucketSize);
+    for (UInt32 x = 0; x < inCopyFrom->fNumBuckets; x++) {
+      fBuckets[x] = inCopyFrom->fBuckets[x];
+      if (fBuckets[x] != nullptr)
+        fBuckets[x]->fRefCount.fetch_add(1);
     }
-    delete[] oldArray;
   }
-  fNumBuckets = inNumBuckets;
+}
+
+ReflectorOutputSnapshot::~ReflectorOutputSnapshot() {
+  for (UInt32 x = 0; x < fNumBuckets; x++)
+    ReleaseBucket(fBuckets[x]);
+  delete[] fBuckets;
+}
+
+void ReflectorOutputSnapshot::SetOutput(UInt32 inBucket, UInt32 inMember, ReflectorOutput *inOutput) {
+  // buckets are only shared by fOutputMutex holders and released by readers,
+  // a count of 1 can't go up again
+  Bucket *&theBucket = fBuckets[inBucket];
+  if (theBucket == nullptr || theBucket->fRefCount.load() > 1) {
+    Bucket *theCopy = new Bucket(fBucketSize, theBucket);
+    ReleaseBucket(theBucket);
+    theBucket = theCopy;
+  }
+
+  ReflectorOutput *&theSlot = theBucket->fOutputs[inMember];
+  if (inOutput != nullptr)
+    inOutput->AddRef();
+  if (theSlot != nullptr)
+    theSlot->Release();
+  theSlot = inOutput;
+}
+
+ReflectorOutputSnapshot *ReflectorStream::GetOutputSnapshot() {
+  // PublishOutputs doesn't release a snapshot while a reader is between the load
+  // and the AddRef, which takes a few instructions. fOutputMutex is not needed.
+  fNumOutputReaders.fetch_add(1);
+  ReflectorOutputSnapshot *theOutputs = fOutputs.load();
+  theOutputs->AddRef();
+  fNumOutputReaders.fetch_sub(1);
+  return theOutputs;
+}
+
+void ReflectorStream::GetOutputLag(UInt32 *outNumOutputs, UInt32 *outNumBehind, UInt64 *outMaxLag) {
+  *outNumOutputs = 0;
+  *outNumBehind = 0;
+  *outMaxLag = 0;
+
+  ReflectorPacketRing *theRing = &fRTPSender.fPacketRing;
+  UInt64 theTail = theRing->GetTailIndex();
+
+  ReflectorOutputSnapshot *theOutputs = this->GetOutputSnapshot();
+  for (UInt32 bucketIndex = 0; bucketIndex < theOutputs->GetNumBuckets(); bucketIndex++) {
+    for (UInt32 bucketMemberIndex = 0; bucketMemberIndex < sBucketSize; bucketMemberIndex++) {
+      ReflectorOutput *theOutput = theOutputs->GetOutput(bucketIndex, bucketMemberIndex);
+      if (theOutput == nullptr)
+        continue;
+
+      (*outNumOutputs)++;
+
+      // outputs that keep up have no bookmark, they get every new packet
+      UInt64 theIndex = theOutput->PeekBookMarkedPacket(theRing);
+      if (theIndex == 0 || theIndex >= theTail)
+        continue;
+
+      (*outNumBehind)++;
+      if (theTail - theIndex > *outMaxLag)
+        *outMaxLag = theTail - theIndex;
+    }
+  }
+  theOutputs->Release();
+}
+
+void ReflectorStream::GetHistograms(QTSServerStats::Histograms *outHistograms) {
+  outHistograms->fSendLatency.Clear();
+  outHistograms->fSendLatency.Add(fSendLatency);
+  outHistograms->fSendPassMicros.Clear();
+  outHistograms->fSendPassMicros.Add(fSendPassMicros);
+  outHistograms->fWouldBlocks.Clear();
+  outHistograms->fWouldBlocks.Add(fWouldBlocks);
+}
+
+void ReflectorStream::PublishOutputs(ReflectorOutputSnapshot *inOutputs) {
+  ReflectorOutputSnapshot *oldOutputs = fOutputs.exchange(inOutputs);
+  fNumBuckets = inOutputs->GetNumBuckets();
+
+  // a reader may have loaded the old one and not referenced it yet
+  if (oldOutputs != nullptr) {
+    oldOutputs->fNextRetired = fRetiredOutputs;
+    fRetiredOutputs = oldOutputs;
+  }
+  this->ReleaseRetiredOutputs();
+}
+
+void ReflectorStream::ReleaseRetiredOutputs() {
+  // a reader that comes in after this check loads a newer snapshot, kept for the
+  // next publish otherwise
+  if (fNumOutputReaders.load() != 0)
+    return;
+
+  while (fRetiredOutputs != nullptr) {
+    ReflectorOutputSnapshot *theOutputs = fRetiredOutputs;
+    fRetiredOutputs = theOutputs->fNextRetired;
+    theOutputs->Release(); // freed by the last send loop still walking it
+  }
+}
+
+void ReflectorStream::AllocateBucketArray(UInt32 inNumBuckets) {
+  ReflectorOutputSnapshot *theOutputs = fOutputs.load(std::memory_order_relaxed);
+  Assert(theOutputs == nullptr || inNumBuckets > fNumBuckets);
+  this->PublishOutputs(new ReflectorOutputSnapshot(inNumBuckets, sBucketSize, theOutputs));
 }
 
 SInt32 ReflectorStream::FindBucket() {
-  // If we need more buckets, allocate them.
+  // If we need more buckets, the caller grows the array to hold this one.
   if (fNumElements == (sBucketSize * fNumBuckets))
-    this->AllocateBucketArray(fNumBuckets * 2);
+    return (SInt32) fNumBuckets;
 
   // find the first open spot in the array
+  ReflectorOutputSnapshot *theOutputs = fOutputs.load(std::memory_order_relaxed);
   for (SInt32 putInThisBucket = 0; (UInt32) putInThisBucket < fNumBuckets; putInThisBucket++) {
     for (UInt32 y = 0; y < sBucketSize; y++)
-      if (fOutputArray[putInThisBucket][y] == nullptr)
+      if (theOutputs->GetOutput(putInThisBucket, y) == nullptr)
         return putInThisBucket;
   }
   Assert(0);
@@ -351,13 +567,14 @@ SInt32 ReflectorStream::FindBucket() {
 }
 
 SInt32 ReflectorStream::AddOutput(ReflectorOutput *inOutput, SInt32 putInThisBucket) {
-  Core::MutexLocker locker(&fBucketMutex);
+  Core::MutexLocker locker(&fOutputMutex);
+  ReflectorOutputSnapshot *theOutputs = fOutputs.load(std::memory_order_relaxed);
 
 #if DEBUG
   // We should never be adding an output twice to a stream
   for (UInt32 dOne = 0; dOne < fNumBuckets; dOne++)
       for (UInt32 dTwo = 0; dTwo < sBucketSize; dTwo++)
-          Assert(fOutputArray[dOne][dTwo] != inOutput);
+          Assert(theOutputs->GetOutput(dOne, dTwo) != inOutput);
 #endif
   if (inOutput != nullptr) {
     inOutput->setNewFlag(true);
@@ -369,12 +586,16 @@ SInt32 ReflectorStream::AddOutput(ReflectorOutput *inOutput, SInt32 putInThisBuc
 
   Assert(putInThisBucket >= 0);
 
-  if (fNumBuckets <= (UInt32) putInThisBucket)
-    this->AllocateBucketArray(putInThisBucket * 2);
+  // a bucket past the end is empty, the array grows with the same publish
+  bool isNewBucket = fNumBuckets <= (UInt32) putInThisBucket;
+  UInt32 theNumBuckets = isNewBucket ? (UInt32) putInThisBucket * 2 : fNumBuckets;
 
   for (UInt32 y = 0; y < sBucketSize; y++) {
-    if (fOutputArray[putInThisBucket][y] == nullptr) {
-      fOutputArray[putInThisBucket][y] = inOutput;
+    if (isNewBucket || theOutputs->GetOutput(putInThisBucket, y) == nullptr) {
+      // copy on write, send loops keep walking the snapshot they already have
+      auto *theNewOutputs = new ReflectorOutputSnapshot(theNumBuckets, sBucketSize, theOutputs);
+      theNewOutputs->SetOutput(putInThisBucket, y, inOutput);
+      this->PublishOutputs(theNewOutputs);
 
       DEBUG_LOG(DEBUG_REFLECTOR_STREAM,
                 "Adding new output(%p) to stream(%p) bucket:%" _S32BITARG_ ", index:%" _S32BITARG_ "\nnum buckets:%u bucketSize: %u \n",
@@ -389,15 +610,18 @@ SInt32 ReflectorStream::AddOutput(ReflectorOutput *inOutput, SInt32 putInThisBuc
 }
 
 void ReflectorStream::RemoveOutput(ReflectorOutput *inOutput) {
-  Core::MutexLocker locker(&fBucketMutex);
+  Core::MutexLocker locker(&fOutputMutex);
+  ReflectorOutputSnapshot *theOutputs = fOutputs.load(std::memory_order_relaxed);
   Assert(fNumElements > 0);
 
   //look at all the indexes in the array
   for (UInt32 x = 0; x < fNumBuckets; x++) {
     for (UInt32 y = 0; y < sBucketSize; y++) {
       //The array may have blank spaces!
-      if (fOutputArray[x][y] == inOutput) {
-        fOutputArray[x][y] = nullptr;//just clear out the pointer
+      if (theOutputs->GetOutput(x, y) == inOutput) {
+        auto *theNewOutputs = new ReflectorOutputSnapshot(fNumBuckets, sBucketSize, theOutputs);
+        theNewOutputs->SetOutput(x, y, nullptr);//just clear out the pointer
+        this->PublishOutputs(theNewOutputs);
 
         DEBUG_LOG(DEBUG_REFLECTOR_STREAM,
                   "Removing output(%p) from stream(%p) bucket:%" _S32BITARG_ ", index:%" _S32BITARG_ "\n",
@@ -413,14 +637,17 @@ void ReflectorStream::RemoveOutput(ReflectorOutput *inOutput) {
 
 void ReflectorStream::TearDownAllOutputs() {
 
-  Core::MutexLocker locker(&fBucketMutex);
+  ReflectorOutputSnapshot *theOutputs = this->GetOutputSnapshot();
 
   //look at all the indexes in the array
-  for (UInt32 x = 0; x < fNumBuckets; x++) {
+  for (UInt32 x = 0; x < theOutputs->GetNumBuckets(); x++) {
     for (UInt32 y = 0; y < sBucketSize; y++) {
-      ReflectorOutput *theOutputPtr = fOutputArray[x][y];
+      ReflectorOutput *theOutputPtr = theOutputs->GetOutput(x, y);
       //The array may have blank spaces!
       if (theOutputPtr != nullptr) {
+        Core::MutexLocker locker(&theOutputPtr->fMutex);
+        if (theOutputPtr->IsDetached()) continue; // already removed, the snapshot is older
+
         theOutputPtr->TearDown();
 
         DEBUG_LOG(DEBUG_REFLECTOR_STREAM,
@@ -429,6 +656,8 @@ void ReflectorStream::TearDownAllOutputs() {
       }
     }
   }
+
+  theOutputs->Release();
 }
 
 QTSS_Error ReflectorStream::
@@ -548,6 +777,8 @@ void ReflectorStream::DetectStreamFormat() {
   if (fStreamInfo.fPayloadType == qtssVideoPayloadType) {
     if (fStreamInfo.fPayloadName.Equal("H264/90000")) {  // h.264 payload 固定为 H264/90000
       fStreamFormat = kStreamFormatVideoH264;
+    } else if (fStreamInfo.fPayloadName.Equal("H265/90000") || fStreamInfo.fPayloadName.Equal("HEVC/90000")) {
+      fStreamFormat = kStreamFormatVideoH265;
     } else {
       fStreamFormat = kStreamFormatVideo;
     }
@@ -574,11 +805,55 @@ void ReflectorStream::SendReceiverReport() {
   (void) fSockets->GetSocketB()->SendTo(fDestRTCPAddr, fDestRTCPPort, fReceiverReportBuffer, fReceiverReportSize);
 }
 
+void ReflectorStream::SetBroadcasterRTPStream(QTSS_RTPStreamObject inStream) {
+  Core::MutexLocker locker(&fKeyFrameRequestMutex);
+  fBroadcasterRTPStream = inStream;
+}
+
+void ReflectorStream::RequestKeyFrame(UInt32 inMediaSSRC) {
+  Core::MutexLocker locker(&fKeyFrameRequestMutex);
+  fKeyFrameRequestSSRC = inMediaSSRC; // the newest loss wins, it is one source anyway
+  fKeyFrameRequestPending = true;
+}
+
 /**
- * 将 Packet 转发给相应的 ReflectorSocket 进行处理
+ * 向推流端请求关键帧
+ *
+ * Called by the RTP sender on every send pass, so a request waits for the next
+ * packet of the broadcast at most. A UDP source gets the PLI on the address
+ * receiver reports go to, an RTSP interleaved source on its RTCP channel.
  */
-void ReflectorStream::PushPacket(char *packet, UInt32 packetLen, bool isRTCP) {
-  if (packetLen <= 0) return;
+void ReflectorStream::SendKeyFrameRequest(SInt64 inCurrentTime) {
+  if (!fKeyFrameRequestPending) return;
+
+  Core::MutexLocker locker(&fKeyFrameRequestMutex);
+  if (inCurrentTime < fLastKeyFrameRequestTime + sKeyFrameRequestIntervalMSec)
+    return; // the last one is still on its way, the encoder answers both with one keyframe
+
+  UInt8 thePli[RTCPPliPacket::kPliPacketSizeInBytes];
+  UInt32 theSenderSSRC = ntohl(((UInt32 *) fReceiverReportBuffer)[1]); // our RR ssrc
+  RTCPPliPacket::WritePliPacket(thePli, theSenderSSRC, fKeyFrameRequestSSRC);
+
+  if (fDestRTCPAddr != 0) {
+    (void) fSockets->GetSocketB()->SendTo(fDestRTCPAddr, fDestRTCPPort, thePli, sizeof(thePli));
+  } else if (fBroadcasterRTPStream != nullptr) {
+    QTSS_PacketStruct thePacket;
+    thePacket.packetData = thePli;
+    thePacket.packetTransmitTime = inCurrentTime;
+    // the session is busy, try again on the next pass
+    if (QTSS_Write(fBroadcasterRTPStream, &thePacket, sizeof(thePli), nullptr, qtssWriteFlagsIsRTCP) != QTSS_NoErr)
+      return;
+  }
+
+  fLastKeyFrameRequestTime = inCurrentTime;
+  fKeyFrameRequestPending = false;
+}
+
+/**
+ * 将一次读到的 Packet 转发给相应的 ReflectorSocket 进行处理
+ */
+void ReflectorStream::PushPackets(CF::StrPtrLen *inPackets, UInt32 inNumPackets, bool isRTCP) {
+  if (inNumPackets == 0) return;
 
   ReflectorSocket *theSocket;
   if (isRTCP) {
@@ -587,38 +862,79 @@ void ReflectorStream::PushPacket(char *packet, UInt32 packetLen, bool isRTCP) {
     theSocket = (ReflectorSocket *) fSockets->GetSocketA();
   }
 
-  //s_printf("ReflectorStream::PushPacket %s packetlen = %"   _U32BITARG_   "\n", isRTCP ? "RTCP" : "RTP", packetLen);
-  ReflectorPacket *thePacket = theSocket->GetPacket();
-  if (thePacket == nullptr) {
-    //s_printf("ReflectorStream::PushPacket %s GetPacket() is NULL\n", isRTCP ? "RTCP" : "RTP");
-    return;
+  Core::MutexLocker locker(theSocket->GetDemuxer()->GetMutex());
+
+  SInt64 theCurrentTime = Core::Time::Milliseconds();
+  for (UInt32 i = 0; i < inNumPackets; i++) {
+    if (inPackets[i].Len == 0) continue;
+
+    ReflectorPacketBuffer *theBuffer = theSocket->GetPacketPool()->Acquire(inPackets[i].Ptr, inPackets[i].Len);
+    if (theBuffer == nullptr) continue;
+
+    ReflectorPacket *thePacket = theSocket->GetPacket();
+    thePacket->SetPacketBuffer(theBuffer, isRTCP);
+    theSocket->ProcessPacket(theCurrentTime, thePacket, 0, 0);
   }
 
-  Core::MutexLocker locker(theSocket->GetDemuxer()->GetMutex());
-  thePacket->SetPacketData(packet, packetLen, isRTCP);
-  theSocket->ProcessPacket(Core::Time::Milliseconds(), thePacket, 0, 0);
   theSocket->Signal(Thread::Task::kIdleEvent);
 }
 
+void ReflectorStream::GetPacketPoolStats(ReflectorPacketPool::Stats *outStats) {
+  ::memset(outStats, 0, sizeof(ReflectorPacketPool::Stats));
+  if (fSockets == nullptr) return;
+
+  // RTP and RTCP sockets have their own pool
+  for (auto *theSocket : {(ReflectorSocket *) fSockets->GetSocketA(), (ReflectorSocket *) fSockets->GetSocketB()}) {
+    ReflectorPacketPool::Stats theStats;
+    theSocket->GetPacketPool()->GetStats(&theStats);
+    outStats->fNumSlabs += theStats.fNumSlabs;
+    outStats->fNumFreeSlabs += theStats.fNumFreeSlabs;
+    outStats->fNumBuffers += theStats.fNumBuffers;
+    outStats->fBytesInUse += theStats.fBytesInUse;
+    outStats->fBytesAllocated += theStats.fBytesAllocated;
+    outStats->fMaxSlabs += theStats.fMaxSlabs;
+  }
+}
+
 ReflectorSender::ReflectorSender(ReflectorStream *inStream, UInt32 inWriteFlag)
     : fStream(inStream),
       fWriteFlag(inWriteFlag),
-      fFirstNewPacketInQueue(nullptr),
-      fFirstPacketInQueueForNewOutput(nullptr),
-      fKeyFrameStartPacketElementPointer(nullptr),
+      fFirstNewPacketInQueue(ReflectorPacketRing::kInvalidIndex),
+      fFirstPacketInQueueForNewOutput(ReflectorPacketRing::kInvalidIndex),
+      fGOPCache(&fPacketRing),
       fHasNewPackets(false),
       fNextTimeToRun(0),
       fLastRRTime(0),
-      fSocketQueueElem() {
+      fSocketQueueElem(),
+      fShards(nullptr),
+      fNumShards(0),
+      fShardLockFailures(0) {
   fSocketQueueElem.SetEnclosingObject(this);
 }
 
 ReflectorSender::~ReflectorSender() {
+  this->StopShards();
+
   // dequeue and delete every buffer
-  while (fPacketQueue.GetLength() > 0) {
-    auto *packet = (ReflectorPacket *) fPacketQueue.DeQueue()->GetEnclosingObject();
-    delete packet;
-  }
+  while (!fPacketRing.IsEmpty())
+    delete fPacketRing.PopFront();
+}
+
+UInt64 ReflectorSender::EnQueuePacket(ReflectorPacket *thePacket) {
+  // a new RTP timestamp starts a frame
+  ReflectorPacket *thePrevious = fPacketRing.Get(fPacketRing.GetTailIndex() - 1);
+  thePacket->fInfo.fIsFrameStart =
+      (thePrevious == nullptr) || (thePrevious->GetPacketRTPTime() != thePacket->GetPacketRTPTime());
+
+  if (fPacketRing.IsFull())
+    fPacketRing.Grow(); // readers keep the old slots, no need to stop them
+
+
+  UInt64 theIndex = fPacketRing.PushBack(thePacket);
+  if (fFirstNewPacketInQueue == ReflectorPacketRing::kInvalidIndex)
+    fFirstNewPacketInQueue = theIndex;
+
+  return theIndex;
 }
 
 /**
@@ -645,11 +961,7 @@ UInt32 ReflectorSender::GetOldestPacketRTPTime(bool *foundPtr) {
   if (foundPtr != nullptr)
     *foundPtr = false;
   Core::MutexLocker locker(&fStream->fBucketMutex);
-  QueueElem *packetElem = this->GetClientBufferStartPacket();
-  if (packetElem == nullptr)
-    return 0;
-
-  auto thePacket = (ReflectorPacket *) packetElem->GetEnclosingObject();
+  ReflectorPacket *thePacket = fPacketRing.Get(this->GetClientBufferStartPacket());
   if (thePacket == nullptr)
     return 0;
 
@@ -665,12 +977,7 @@ UInt16 ReflectorSender::GetFirstPacketRTPSeqNum(bool *foundPtr) {
 
   UInt16 resultSeqNum = 0;
   Core::MutexLocker locker(&fStream->fBucketMutex);
-  QueueElem *packetElem = this->GetClientBufferStartPacket();
-
-  if (packetElem == nullptr)
-    return 0;
-
-  auto *thePacket = (ReflectorPacket *) packetElem->GetEnclosingObject();
+  ReflectorPacket *thePacket = fPacketRing.Get(this->GetClientBufferStartPacket());
   if (thePacket == nullptr)
     return 0;
 
@@ -682,29 +989,18 @@ UInt16 ReflectorSender::GetFirstPacketRTPSeqNum(bool *foundPtr) {
   return resultSeqNum;
 }
 
-QueueElem *ReflectorSender::GetClientBufferNextPacketTime(UInt32 inRTPTime) {
-
-  QueueIter qIter(&fPacketQueue);// start at oldest packet in q
-  QueueElem *requestedPacket = nullptr;
-  QueueElem *elem = nullptr;
-
-  while (!qIter.IsDone()) { // start at oldest packet in q
-    elem = qIter.GetCurrent();
-
-    if (requestedPacket == nullptr)
-      requestedPacket = elem;
+UInt64 ReflectorSender::GetClientBufferNextPacketTime(UInt32 inRTPTime) {
+  // start at oldest packet in q, return it if no packet has a later time
+  UInt64 requestedPacket = fPacketRing.IsEmpty() ? ReflectorPacketRing::kInvalidIndex : fPacketRing.GetHeadIndex();
 
-    if (requestedPacket == nullptr)
-      break;
-
-    auto *thePacket = (ReflectorPacket *) elem->GetEnclosingObject();
+  for (UInt64 index = fPacketRing.GetHeadIndex(); index < fPacketRing.GetTailIndex(); index++) {
+    ReflectorPacket *thePacket = fPacketRing.Get(index);
     Assert(thePacket);
 
     if (thePacket->GetPacketRTPTime() > inRTPTime) {
-      requestedPacket = elem; // return the first packet we have that has a later time
+      requestedPacket = index; // return the first packet we have that has a later time
       break; // found the packet we need: done processing
     }
-    qIter.Next();
   }
 
   return requestedPacket;
@@ -712,21 +1008,12 @@ QueueElem *ReflectorSender::GetClientBufferNextPacketTime(UInt32 inRTPTime) {
 
 bool ReflectorSender::GetFirstRTPTimePacket(UInt16 *outSeqNumPtr, UInt32 *outRTPTimePtr, SInt64 *outArrivalTimePtr) {
   Core::MutexLocker locker(&fStream->fBucketMutex);
-  QueueElem *packetElem =
-      this->GetClientBufferStartPacketOffset(ReflectorStream::sFirstPacketOffsetMsec);
-
-  if (packetElem == nullptr)
-    return false;
-
-  auto *thePacket = (ReflectorPacket *) packetElem->GetEnclosingObject();
+  ReflectorPacket *thePacket =
+      fPacketRing.Get(this->GetClientBufferStartPacketOffset(ReflectorStream::sFirstPacketOffsetMsec));
   if (thePacket == nullptr)
     return false;
 
-  packetElem = GetClientBufferNextPacketTime(thePacket->GetPacketRTPTime());
-  if (packetElem == nullptr)
-    return false;
-
-  thePacket = (ReflectorPacket *) packetElem->GetEnclosingObject();
+  thePacket = fPacketRing.Get(GetClientBufferNextPacketTime(thePacket->GetPacketRTPTime()));
   if (thePacket == nullptr)
     return false;
 
@@ -744,11 +1031,14 @@ bool ReflectorSender::GetFirstRTPTimePacket(UInt16 *outSeqNumPtr, UInt32 *outRTP
 
 bool ReflectorSender::GetFirstPacketInfo(UInt16 *outSeqNumPtr, UInt32 *outRTPTimePtr, SInt64 *outArrivalTimePtr) {
   Core::MutexLocker locker(&fStream->fBucketMutex);
-  QueueElem *packetElem = this->GetClientBufferStartPacketOffset(ReflectorStream::sFirstPacketOffsetMsec);
 
-  if (packetElem == NULL) return false;
+  // a new output starts with the cached GOP, RTP-Info must not make it filter those packets out
+  ReflectorPacket *thePacket = nullptr;
+  if (ReflectorGOPCache::IsEnabled())
+    thePacket = fPacketRing.Get(fGOPCache.GetStartIndex());
 
-  auto *thePacket = (ReflectorPacket *) packetElem->GetEnclosingObject();
+  if (thePacket == nullptr)
+    thePacket = fPacketRing.Get(this->GetClientBufferStartPacketOffset(ReflectorStream::sFirstPacketOffsetMsec));
   if (thePacket == NULL) return false;
 
   if (outSeqNumPtr) *outSeqNumPtr = thePacket->GetPacketRTPSeqNum();
@@ -784,6 +1074,8 @@ void ReflectorSender::ReflectRelayPackets(SInt64 *ioWakeupTime, Queue *inFreeQue
 #endif
 
   SInt64 currentTime = Core::Time::Milliseconds();
+  SInt64 theStartMicros = Core::Time::Microseconds();
+  UInt32 theNumWouldBlocks = 0;
 
   //make sure to reset these state variables
   fHasNewPackets = false;
@@ -795,68 +1087,46 @@ void ReflectorSender::ReflectRelayPackets(SInt64 *ioWakeupTime, Queue *inFreeQue
     fStream->SendReceiverReport();
 #if DEBUG_REFLECTOR_STREAM > 2
     printQueueLenOnExit = true;
-    printf("fPacketQueue len %li\n", (SInt32)fPacketQueue.GetLength());
+    printf("fPacketRing len %li\n", (SInt32)fPacketRing.GetLength());
 #endif
   }
 
-  //the rest of this function must be atomic write the ReflectorSession, because
-  //it involves iterating through the RTPSession array, which isn't thread safe
-  Core::MutexLocker locker(&fStream->fBucketMutex);
+  // the outputs are walked in a snapshot, joins and leaves don't wait for this pass
+  ReflectorOutputSnapshot *theOutputs = fStream->GetOutputSnapshot();
 
   // Check to see if we should update the session's bitrate average
-  if ((fStream->fLastBitRateSample + ReflectorStream::kBitRateAvgIntervalInMilSecs) < currentTime) {
-    unsigned int intervalBytes = fStream->fBytesSentInThisInterval;
-    //(void)atomic_sub(&fStream->fBytesSentInThisInterval, intervalBytes);
-    fStream->fBytesSentInThisInterval.fetch_sub(intervalBytes);
-
-    // Multiply by 1000 to convert from milliseconds to seconds, and by 8 to convert from bytes to bits
-    Float32 bps = (Float32) (intervalBytes * 8) / (Float32) (currentTime - fStream->fLastBitRateSample);
-    bps *= 1000;
-    fStream->fCurrentBitRate = (UInt32) bps;
-
-    // Don't check again for awhile!
-    fStream->fLastBitRateSample = currentTime;
+  {
+    Core::MutexLocker locker(&fStream->fBucketMutex);
+    if ((fStream->fLastBitRateSample + ReflectorStream::kBitRateAvgIntervalInMilSecs) < currentTime) {
+      unsigned int intervalBytes = fStream->fBytesSentInThisInterval;
+      //(void)atomic_sub(&fStream->fBytesSentInThisInterval, intervalBytes);
+      fStream->fBytesSentInThisInterval.fetch_sub(intervalBytes);
+
+      // Multiply by 1000 to convert from milliseconds to seconds, and by 8 to convert from bytes to bits
+      Float32 bps = (Float32) (intervalBytes * 8) / (Float32) (currentTime - fStream->fLastBitRateSample);
+      bps *= 1000;
+      fStream->fCurrentBitRate = (UInt32) bps;
+
+      // Don't check again for awhile!
+      fStream->fLastBitRateSample = currentTime;
+    }
   }
 
-  for (UInt32 bucketIndex = 0; bucketIndex < fStream->fNumBuckets; bucketIndex++) {
+  for (UInt32 bucketIndex = 0; bucketIndex < theOutputs->GetNumBuckets(); bucketIndex++) {
     for (UInt32 bucketMemberIndex = 0; bucketMemberIndex < fStream->sBucketSize; bucketMemberIndex++) {
-      ReflectorOutput *theOutput = fStream->fOutputArray[bucketIndex][bucketMemberIndex];
-
-      if (theOutput != NULL) {
-        SInt32 availBookmarksPosition = -1;    // -1 == invalid position
-        QueueElem *packetElem = NULL;
-        UInt32 curBookmark = 0;
-
-        Assert(curBookmark < theOutput->fNumBookmarks);
+      ReflectorOutput *theOutput = theOutputs->GetOutput(bucketIndex, bucketMemberIndex);
+      if (theOutput == NULL) continue;
 
+      Core::MutexLocker locker2(&theOutput->fMutex);
+      if (!theOutput->IsDetached()) {
         // see if we've bookmarked a held packet for this Sender in this Output
-        while (curBookmark < theOutput->fNumBookmarks) {
-          QueueElem *bookmarkedElem = theOutput->fBookmarkedPacketsElemsArray[curBookmark];
-
-          if (bookmarkedElem) {   // there may be holes in this array
-            if (bookmarkedElem->IsMember(fPacketQueue)) {
-              // this packet was previously bookmarked for this specific queue
-              // remove if from the bookmark list and use it
-              // to jump ahead into the Sender's over all packet queue
-              theOutput->fBookmarkedPacketsElemsArray[curBookmark] = NULL;
-              availBookmarksPosition = curBookmark;
-              packetElem = bookmarkedElem;
-              break;
-            }
-
-          } else {
-            availBookmarksPosition = curBookmark;
-          }
-
-          curBookmark++;
-
-        }
-
-        Assert(availBookmarksPosition != -1);
+        UInt64 packetIndex = theOutput->GetBookMarkedPacket(&fPacketRing);
+        if (!fPacketRing.Contains(packetIndex))
+          packetIndex = ReflectorPacketRing::kInvalidIndex;
 
 #if DEBUG_REFLECTOR_STREAM > 1
-        if (packetElem)	{ // show 'em what we got johnny
-            ReflectorPacket* 	thePacket = (ReflectorPacket*)packetElem->GetEnclosingObject();
+        if (packetIndex != ReflectorPacketRing::kInvalidIndex)	{ // show 'em what we got johnny
+            ReflectorPacket* 	thePacket = fPacketRing.Get(packetIndex);
             printf("Bookmarked packet time: %li, packetSeq %i\n", (SInt32)thePacket->fTimeArrived, DGetPacketSeqNumber(&thePacket->fPacketPtr));
         }
 #endif
@@ -865,12 +1135,12 @@ void ReflectorSender::ReflectRelayPackets(SInt64 *ioWakeupTime, Queue *inFreeQue
         // so show it the first new packet we have in this sender.
         // ( since TCP flow control may delay the sending of packets, this may not
         // be the same as the first packet in the queue
-        if (packetElem == NULL) {
-          packetElem = fFirstNewPacketInQueue;
+        if (packetIndex == ReflectorPacketRing::kInvalidIndex) {
+          packetIndex = fFirstNewPacketInQueue;
 
 #if DEBUG_REFLECTOR_STREAM > 1
-          if (packetElem) { // show 'em what we got johnny
-              ReflectorPacket* 	thePacket = (ReflectorPacket*)packetElem->GetEnclosingObject();
+          if (packetIndex != ReflectorPacketRing::kInvalidIndex) { // show 'em what we got johnny
+              ReflectorPacket* 	thePacket = fPacketRing.Get(packetIndex);
               printf("1st new packet from Sender sess 0x%lx time: %li, packetSeq %i\n", (SInt32)theOutput, (SInt32)thePacket->fTimeArrived, DGetPacketSeqNumber(&thePacket->fPacketPtr));
           } else {
               printf("no new packets\n");
@@ -878,14 +1148,14 @@ void ReflectorSender::ReflectRelayPackets(SInt64 *ioWakeupTime, Queue *inFreeQue
 #endif
         }
 
-        QueueIter qIter(&fPacketQueue, packetElem);  // starts from beginning if packetElem == NULL, else from packetElem
+        // starts from beginning if packetIndex is invalid, else from packetIndex
+        if (!fPacketRing.Contains(packetIndex))
+          packetIndex = fPacketRing.GetHeadIndex();
 
         bool dodBookmarkPacket = false;
 
-        while (!qIter.IsDone()) {
-          packetElem = qIter.GetCurrent();
-
-          ReflectorPacket *thePacket = (ReflectorPacket *) packetElem->GetEnclosingObject();
+        for (; packetIndex < fPacketRing.GetTailIndex(); packetIndex++) {
+          ReflectorPacket *thePacket = fPacketRing.Get(packetIndex);
           QTSS_Error err = QTSS_NoErr;
 
 #if DEBUG_REFLECTOR_STREAM > 2
@@ -903,18 +1173,20 @@ void ReflectorSender::ReflectRelayPackets(SInt64 *ioWakeupTime, Queue *inFreeQue
 #endif
 
             SInt64 timeToSendPacket = -1;
-            err = theOutput->WritePacket(&thePacket->fPacketPtr, fStream, fWriteFlag, packetLateness, &timeToSendPacket, NULL, NULL, false);
+            bool theWritten = false;
+            err = theOutput->WritePacket(thePacket, fStream, fWriteFlag, packetLateness, &timeToSendPacket, false,
+                                         &theWritten);
 
             if (err == QTSS_WouldBlock) {
+              theNumWouldBlocks++;
 #if DEBUG_REFLECTOR_STREAM > 2
               printf("EAGAIN bookmark: %li, packetSeq %i\n", (SInt32)packetLateness, DGetPacketSeqNumber(&thePacket->fPacketPtr));
 #endif
               // tag it and bookmark it
               thePacket->fNeededByOutput = true;
 
-              Assert(availBookmarksPosition != -1);
-              if (availBookmarksPosition != -1)
-                theOutput->fBookmarkedPacketsElemsArray[availBookmarksPosition] = packetElem;
+              bool didBookmark = theOutput->SetBookMarkPacket(&fPacketRing, packetIndex);
+              Assert(didBookmark);
 
               dodBookmarkPacket = true;
 
@@ -924,46 +1196,42 @@ void ReflectorSender::ReflectRelayPackets(SInt64 *ioWakeupTime, Queue *inFreeQue
               if (timeToSendPacket == -1)
                 this->SetNextTimeToRun( 5); // keep in synch with delay on would block for on-demand lower is better for high-bit rate movies.
 
+            } else if (theWritten && fWriteFlag == qtssWriteFlagsIsRTP && thePacket->TakeLatencySample()) {
+              // relays write straight to the socket, there is no batch to wait for
+              fStream->RecordSendLatency(Core::Time::Milliseconds() - thePacket->fTimeArrived);
             }
           } else {
             if (thePacket->fNeededByOutput)    // optimization: if the packet is already marked, another Output has been through this already
               break;
             thePacket->fNeededByOutput = true;
           }
-
-          qIter.Next();
         }
 
       }
     }
   }
 
-  // reset our first new packet bookmark
-  fFirstNewPacketInQueue = nullptr;
+  theOutputs->Release();
+  fStream->RecordSendPass(Core::Time::Microseconds() - theStartMicros, theNumWouldBlocks);
 
-  // iterate one more through the senders queue to clear out
-  // the unneeded packets
-  QueueIter removeIter(&fPacketQueue);
-  while (!removeIter.IsDone()) {
-    QueueElem *elem = removeIter.GetCurrent();
-    Assert(elem);
-
-    //at this point, move onto the next queue element, because we may be altering
-    //the queue itself in the code below
-    removeIter.Next();
+  // reset our first new packet bookmark
+  fFirstNewPacketInQueue = ReflectorPacketRing::kInvalidIndex;
 
-    auto *thePacket = (ReflectorPacket *) elem->GetEnclosingObject();
-    Assert(thePacket);
+  // readers on other threads must not see packets go away
+  Core::MutexLocker locker(&fStream->fBucketMutex);
 
-    if (!thePacket->fNeededByOutput) {
-      thePacket->fNeededByOutput = true;
-      fPacketQueue.Remove(elem);
-      inFreeQueue->EnQueue(elem);
-    } else {   // reset for next call to ReflectPackets
-      thePacket->fNeededByOutput = false;
-    }
+  // iterate one more through the senders queue to clear out the unneeded packets.
+  // The ring can only drop from the front, the rest waits until the needed packets are sent.
+  while (!fPacketRing.IsEmpty() && !fPacketRing.GetOldest()->fNeededByOutput) {
+    ReflectorPacket *thePacket = fPacketRing.PopFront();
+    thePacket->Reset();
+    inFreeQueue->EnQueue(&thePacket->fQueueElem);
   }
 
+  // reset for next call to ReflectPackets
+  for (UInt64 index = fPacketRing.GetHeadIndex(); index < fPacketRing.GetTailIndex(); index++)
+    fPacketRing.Get(index)->fNeededByOutput = false;
+
   //Don't forget that the caller also wants to know when we next want to run
   if (*ioWakeupTime == 0)
     *ioWakeupTime = fNextTimeToRun;
@@ -974,7 +1242,7 @@ void ReflectorSender::ReflectRelayPackets(SInt64 *ioWakeupTime, Queue *inFreeQue
 
 #if DEBUG_REFLECTOR_STREAM > 2
   if (printQueueLenOnExit)
-      printf("EXIT fPacketQueue len %li\n", (SInt32)fPacketQueue.GetLength());
+      printf("EXIT fPacketRing len %li\n", (SInt32)fPacketRing.GetLength());
 #endif
 }
 
@@ -1022,74 +1290,83 @@ void ReflectorSender::ReflectPackets(SInt64 *ioWakeupTime, Queue *inFreeQueue) {
     fStream->SendReceiverReport();
   }
 
-  // the rest of this function must be atomic write the ReflectorSession, because
-  // it involves iterating through the RTPSession array, which isn't thread safe
-  Core::MutexLocker locker(&fStream->fBucketMutex);
+  // a player asked for a keyframe
+  if (fWriteFlag == qtssWriteFlagsIsRTP)
+    fStream->SendKeyFrameRequest(currentTime);
 
   // Check to see if we should update the session's bit-rate average
-  fStream->UpdateBitRate(currentTime);
+  {
+    Core::MutexLocker locker(&fStream->fBucketMutex);
+    fStream->UpdateBitRate(currentTime);
+  }
 
   // 视频数据流，最好直接定位到第一个关键帧起始包这样出视频的时间会更快一些
-  if (fKeyFrameStartPacketElementPointer) {
-    fFirstPacketInQueueForNewOutput = fKeyFrameStartPacketElementPointer;
+  // the GOP cache start when there is one, the new output bursts it and goes on live
+  UInt64 theGOPStartIndex = fGOPCache.GetStartIndex();
+  if (fPacketRing.Contains(theGOPStartIndex)) {
+    fFirstPacketInQueueForNewOutput = theGOPStartIndex;
   } else {
-    // where to start new clients in the q
-    fFirstPacketInQueueForNewOutput = this->GetClientBufferStartPacketOffset(0);
+    // where to start new clients in the q, at a key frame of the buffer window when
+    // the GOP cache is off or dropped its GOP for being too big
+    fFirstPacketInQueueForNewOutput = this->GetClientBufferStartPacketOffset(0, true);
   }
 
 #if (0) //test code 
-  if (NULL != fFirstPacketInQueueForNewOutput)
-      printf("ReflectorSender::ReflectPackets SET first packet fFirstPacketInQueueForNewOutput %d \n", DGetPacketSeqNumber(&((ReflectorPacket*)(fFirstPacketInQueueForNewOutput->GetEnclosingObject()))->fPacketPtr));
+  ReflectorPacket* thePacket = fPacketRing.Get(fFirstPacketInQueueForNewOutput);
+  if (NULL != thePacket)
+      printf("ReflectorSender::ReflectPackets SET first packet fFirstPacketInQueueForNewOutput %d \n", DGetPacketSeqNumber(&thePacket->fPacketPtr));
 
-  ReflectorPacket* thePacket = NULL;
-  if (fFirstPacketInQueueForNewOutput != NULL)
-      thePacket = (ReflectorPacket*)fFirstPacketInQueueForNewOutput->GetEnclosingObject();
   if (thePacket == NULL) {
       printf("fFirstPacketInQueueForNewOutput is NULL \n");
   }
 #endif
 
-  bool firstPacket;
-
-  // 我们在 QTSSReflectorModule::DoSetup 里面看到, 对于一个 ReflectorSession 的每一个
-  // ReflectorStream, 都调用了 AddOutput 添加了一个 RTPSessionOutput 对象。
-  // 在开启 n 个窗口同时播放同一个 sdp 文件的情况下, 会有 n 个 theOutput 对应 n 个 RTPStream,
-  // 依次通过这 n 个 theOutput 发送 RTP 数据。
-  for (UInt32 bucketIndex = 0; bucketIndex < fStream->fNumBuckets; bucketIndex++) {
-    for (UInt32 bucketMemberIndex = 0; bucketMemberIndex < ReflectorStream::sBucketSize; bucketMemberIndex++) {
-      ReflectorOutput *theOutput = fStream->fOutputArray[bucketIndex][bucketMemberIndex];
-      if (theOutput == nullptr || !theOutput->IsPlaying()) continue;
+  if (fWriteFlag == qtssWriteFlagsIsRTP && fNumShards == 0 && ReflectorStream::sNumFanoutShards > 1)
+    this->StartShards();
+
+  if (fNumShards > 0) {
+    // the shards may be walking the ring, only expire while none of them is.
+    // At high fan-out some shard is nearly always busy, so after a few misses
+    // wait for the passes in progress rather than let the ring grow.
+    bool haveShards = this->TryLockShards();
+    if (!haveShards && ++fShardLockFailures >= kMaxShardLockFailures) {
+      this->LockShards();
+      haveShards = true;
+    }
 
+    if (haveShards) {
+      fShardLockFailures = 0;
       {
-        Core::MutexLocker locker2(&theOutput->fMutex);
-
-        // 返回既在 fBookmarkedPacketsElemsArray 数组同时属于 fPacketQueue 的成员
-        QueueElem *packetElem = theOutput->GetBookMarkedPacket(&fPacketQueue);
-        if (packetElem == nullptr) { // should only be a new output
-          // everybody starts at the oldest packet in the buffer delay or uses a bookmark
-          packetElem = fFirstPacketInQueueForNewOutput;
-          firstPacket = true;
-          theOutput->setNewFlag(false); // how use?
-        } else {
-          firstPacket = false;
-        }
+        Core::MutexLocker locker(&fStream->fBucketMutex);
+        this->RemoveOldPackets(inFreeQueue);
+      }
+      this->UnlockShards();
+    }
 
-        // sBucketDelayInMsec 对应于配置文件中的 reflector_bucket_offset_delay_msec, 缺省值为 73.
-        SInt64 bucketDelay = ReflectorStream::sBucketDelayInMsec * (SInt64) bucketIndex;
-        packetElem = this->SendPacketsToOutput(theOutput, packetElem, currentTime, bucketDelay, firstPacket);
-        if (packetElem) { // 理论上不为 NULL
-          QueueElem *newElem = NeedRelocateBookMark(packetElem);
+    // each shard serves its buckets on whatever task thread picks it up, and
+    // schedules its own retries for blocked outputs
+    for (UInt32 shardIndex = 0; shardIndex < fNumShards; shardIndex++)
+      fShards[shardIndex]->Signal(Thread::Task::kStartEvent);
+  } else {
+    // the outputs are walked in a snapshot, joins and leaves (AddOutput/RemoveOutput)
+    // publish a new one instead of waiting for this pass, and no stream lock is held
+    // while writing. The packet ring is only changed on this thread.
+    ReflectorOutputSnapshot *theOutputs = fStream->GetOutputSnapshot();
+    {
+      // UDP sends of all outputs in this pass are collected and flushed together,
+      // they must go out before RemoveOldPackets recycles the packet data
+      UDPSendBatch theSendBatch;
+      this->ReflectToOutputs(theOutputs, 0, 1, currentTime, &fNextTimeToRun);
+    }
+    theOutputs->Release();
 
-          auto *thePacket = (ReflectorPacket *) newElem->GetEnclosingObject();
-          thePacket->fNeededByOutput = true;               // flag to prevent removal in RemoveOldPackets
-          (void) theOutput->SetBookMarkPacket(newElem);    // store a reference to the packet
-        }
-      }
+    {
+      // readers on other threads must not see packets go away
+      Core::MutexLocker locker(&fStream->fBucketMutex);
+      this->RemoveOldPackets(inFreeQueue);
     }
   }
-
-  this->RemoveOldPackets(inFreeQueue);
-  fFirstNewPacketInQueue = nullptr;
+  fFirstNewPacketInQueue = ReflectorPacketRing::kInvalidIndex;
 
   // Don't forget that the caller also wants to know when we next want to run
   // ReflectorSocket::Run 根据 *ioWakeupTime 来决定 idleTimer 的值。
@@ -1106,50 +1383,219 @@ void ReflectorSender::ReflectPackets(SInt64 *ioWakeupTime, Queue *inFreeQueue) {
 }
 
 /**
- * 将 Packet 序列写入 ReflectorOutput，直到队列为空或阻塞
+ * 向 inOutputs 中属于分片 inShardIndex 的各个 bucket 发送数据
+ *
+ * @param ioNextTimeToRun relative time to call us again in MSec, lowered when an output blocks
  */
-QueueElem *ReflectorSender::SendPacketsToOutput(ReflectorOutput *theOutput, QueueElem *currentPacket,
-                                                SInt64 currentTime, SInt64 bucketDelay, bool firstPacket) {
-  QueueElem *lastPacket = currentPacket;
-  QueueIter qIter(&fPacketQueue, currentPacket); // starts from beginning if currentPacket == NULL, else from currentPacket
+void ReflectorSender::ReflectToOutputs(ReflectorOutputSnapshot *inOutputs, UInt32 inShardIndex, UInt32 inNumShards,
+                                       SInt64 inCurrentTime, SInt64 *ioNextTimeToRun) {
+  UInt64 firstPacketForNewOutput = fFirstPacketInQueueForNewOutput;
+  bool firstPacket;
+  SInt64 theStartMicros = Core::Time::Microseconds();
+  UInt32 theNumWouldBlocks = 0;
+  LatencySamples theLatencySamples;
+  theLatencySamples.fNumSamples = 0;
 
+  // 我们在 QTSSReflectorModule::DoSetup 里面看到, 对于一个 ReflectorSession 的每一个
+  // ReflectorStream, 都调用了 AddOutput 添加了一个 RTPSessionOutput 对象。
+  // 在开启 n 个窗口同时播放同一个 sdp 文件的情况下, 会有 n 个 theOutput 对应 n 个 RTPStream,
+  // 依次通过这 n 个 theOutput 发送 RTP 数据。
+  for (UInt32 bucketIndex = inShardIndex; bucketIndex < inOutputs->GetNumBuckets(); bucketIndex += inNumShards) {
+    for (UInt32 bucketMemberIndex = 0; bucketMemberIndex < ReflectorStream::sBucketSize; bucketMemberIndex++) {
+      ReflectorOutput *theOutput = inOutputs->GetOutput(bucketIndex, bucketMemberIndex);
+      if (theOutput == nullptr) continue;
+
+      // only this viewer waits for a slow write, RemoveOutput detaches under this lock
+      Core::MutexLocker locker(&theOutput->fMutex);
+      if (theOutput->IsDetached() || !theOutput->IsPlaying()) continue;
+
+      if (fWriteFlag == qtssWriteFlagsIsRTP && ReflectorStream::sNackRetransmitsPerSec > 0)
+        this->RetransmitToOutput(theOutput, inCurrentTime);
+
+      // 返回 fBookmarkedPackets 数组中属于 fPacketRing 且尚未过期的位置
+      UInt64 packetIndex = theOutput->GetBookMarkedPacket(&fPacketRing);
+      if (!fPacketRing.Contains(packetIndex)) { // should only be a new output
+        // everybody starts at the oldest packet in the buffer delay or uses a bookmark
+        packetIndex = firstPacketForNewOutput;
+        firstPacket = true;
+        theOutput->setNewFlag(false); // how use?
+      } else {
+        firstPacket = false;
+      }
+
+      // sBucketDelayInMsec 对应于配置文件中的 reflector_bucket_offset_delay_msec, 缺省值为 73.
+      SInt64 bucketDelay = ReflectorStream::sBucketDelayInMsec * (SInt64) bucketIndex;
+      packetIndex = this->SendPacketsToOutput(theOutput, packetIndex, inCurrentTime, bucketDelay, firstPacket,
+                                              ioNextTimeToRun, &theNumWouldBlocks, &theLatencySamples);
+      theOutput->Flush();
+      if (packetIndex != ReflectorPacketRing::kInvalidIndex) { // 队列非空时不为 0
+        UInt64 newIndex = NeedRelocateBookMark(packetIndex);
+
+        ReflectorPacket *thePacket = fPacketRing.Get(newIndex);
+        thePacket->fNeededByOutput = true;                         // flag to prevent removal in RemoveOldPackets
+        (void) theOutput->SetBookMarkPacket(&fPacketRing, newIndex); // store a reference to the packet
+      }
+    }
+  }
+
+  // sends what is left in the batch, the caller's flush then finds it empty
+  this->RecordLatencySamples(&theLatencySamples);
+  fStream->RecordSendPass(Core::Time::Microseconds() - theStartMicros, theNumWouldBlocks);
+}
+
+/**
+ * 重传客户端通过 RTCP NACK 报告丢失的包
+ *
+ * The packets are written from fPacketRing as they are, the output's rate
+ * limit decides how many go out. Lost packets that already expired are skipped.
+ */
+void ReflectorSender::RetransmitToOutput(ReflectorOutput *theOutput, SInt64 inCurrentTime) {
+  UInt32 theSSRCs[ReflectorOutput::kMaxPendingRetransmits];
+  UInt16 theSeqNums[ReflectorOutput::kMaxPendingRetransmits];
+
+  UInt32 theCount = theOutput->TakeRetransmits(fStream, ReflectorStream::sNackRetransmitsPerSec, inCurrentTime,
+                                               theSSRCs, theSeqNums, ReflectorOutput::kMaxPendingRetransmits);
+  for (UInt32 i = 0; i < theCount; i++) {
+    UInt64 theIndex = fPacketRing.FindSeqNum(theSSRCs[i], theSeqNums[i]);
+    if (theIndex == ReflectorPacketRing::kInvalidIndex)
+      continue;
+
+    if (theOutput->RetransmitPacket(fPacketRing.Get(theIndex), fStream) == QTSS_WouldBlock)
+      break; // flow controlled, the client will ask again
+  }
+}
+
+SInt64 ReflectorSender::ReflectShard(UInt32 inShardIndex) {
+  SInt64 currentTime = Core::Time::Milliseconds();
+  SInt64 theNextTimeToRun = 1000;
+
+  ReflectorOutputSnapshot *theOutputs = fStream->GetOutputSnapshot();
+  {
+    UDPSendBatch theSendBatch; // this thread's own batch
+    this->ReflectToOutputs(theOutputs, inShardIndex, fNumShards, currentTime, &theNextTimeToRun);
+  }
+  theOutputs->Release();
+
+  // nobody blocked, the socket signals us again when packets arrive
+  if (theNextTimeToRun == 1000)
+    return 0;
+
+  return theNextTimeToRun;
+}
+
+void ReflectorSender::StartShards() {
+  fShards = new ReflectorShard *[ReflectorStream::sNumFanoutShards];
+  for (UInt32 shardIndex = 0; shardIndex < ReflectorStream::sNumFanoutShards; shardIndex++)
+    fShards[shardIndex] = new ReflectorShard(this, shardIndex);
+
+  fNumShards = ReflectorStream::sNumFanoutShards;
+}
+
+void ReflectorSender::StopShards() {
+  for (UInt32 shardIndex = 0; shardIndex < fNumShards; shardIndex++) {
+    ReflectorShard *theShard = fShards[shardIndex];
+    {
+      // waits for a pass in progress
+      Core::MutexLocker locker(&theShard->fMutex);
+      theShard->fSender = nullptr;
+    }
+    theShard->Signal(Thread::Task::kKillEvent); // deletes itself
+  }
+
+  delete[] fShards;
+  fShards = nullptr;
+  fNumShards = 0;
+}
+
+bool ReflectorSender::TryLockShards() {
+  for (UInt32 shardIndex = 0; shardIndex < fNumShards; shardIndex++) {
+    if (!fShards[shardIndex]->fMutex.TryLock()) {
+      while (shardIndex > 0)
+        fShards[--shardIndex]->fMutex.Unlock();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void ReflectorSender::LockShards() {
+  for (UInt32 shardIndex = 0; shardIndex < fNumShards; shardIndex++)
+    fShards[shardIndex]->fMutex.Lock();
+}
+
+void ReflectorSender::UnlockShards() {
+  for (UInt32 shardIndex = 0; shardIndex < fNumShards; shardIndex++)
+    fShards[shardIndex]->fMutex.Unlock();
+}
+
+ReflectorShard::ReflectorShard(ReflectorSender *inSender, UInt32 inShardIndex)
+    : Task(),
+      fSender(inSender),
+      fShardIndex(inShardIndex) {
+  this->SetTaskName("ReflectorShard");
+}
+
+SInt64 ReflectorShard::Run() {
+  EventFlags theEvents = this->GetEvents();
+  if (theEvents & kKillEvent) return -1;
+
+  Core::MutexLocker locker(&fMutex);
+  if (fSender == nullptr) return 0; // the kill event follows
+
+  return fSender->ReflectShard(fShardIndex);
+}
+
+/**
+ * 将 Packet 序列写入 ReflectorOutput，直到队列为空或阻塞
+ */
+UInt64 ReflectorSender::SendPacketsToOutput(ReflectorOutput *theOutput, UInt64 currentPacket,
+                                            SInt64 currentTime, SInt64 bucketDelay, bool firstPacket,
+                                            SInt64 *ioNextTimeToRun, UInt32 *ioNumWouldBlocks,
+                                            LatencySamples *ioLatencySamples) {
+  // starts from beginning if currentPacket is invalid, else from currentPacket
+  if (!fPacketRing.Contains(currentPacket))
+    currentPacket = fPacketRing.GetHeadIndex();
+
+  UInt64 lastPacket = ReflectorPacketRing::kInvalidIndex;
   UInt32 count = 0;
   QTSS_Error err = QTSS_NoErr;
-  while (!qIter.IsDone()) {
-    currentPacket = qIter.GetCurrent();
+  for (; currentPacket < fPacketRing.GetTailIndex(); currentPacket++) {
     lastPacket = currentPacket;
 
-    auto *thePacket = (ReflectorPacket *) currentPacket->GetEnclosingObject();
+    ReflectorPacket *thePacket = fPacketRing.Get(currentPacket);
     SInt64 packetLateness = bucketDelay;
     SInt64 timeToSendPacket = -1;
 
     //printf("packetLateness %qd, seq# %li\n", packetLateness, (SInt32) DGetPacketSeqNumber( &thePacket->fPacketPtr ) );
 
     // 实际上是调用 RTPSessionOutput::WritePacket
-    err = theOutput->WritePacket(&thePacket->fPacketPtr, fStream, fWriteFlag, packetLateness, &timeToSendPacket,
-                                 &thePacket->fStreamCountID, &thePacket->fTimeArrived, firstPacket);
+    bool theWritten = false;
+    err = theOutput->WritePacket(thePacket, fStream, fWriteFlag, packetLateness, &timeToSendPacket, firstPacket,
+                                 &theWritten);
 
     if (err == QTSS_WouldBlock) { // call us again in # ms to retry on an EAGAIN
+      (*ioNumWouldBlocks)++;
 
-      if ((timeToSendPacket > 0) && ((fNextTimeToRun + currentTime) > timeToSendPacket)) // blocked but we are scheduled to wake up later
-        fNextTimeToRun = timeToSendPacket - currentTime;
+      if ((timeToSendPacket > 0) && ((*ioNextTimeToRun + currentTime) > timeToSendPacket)) // blocked but we are scheduled to wake up later
+        *ioNextTimeToRun = timeToSendPacket - currentTime;
 
       if (theOutput->fLastIntervalMilliSec < 5)
         theOutput->fLastIntervalMilliSec = 5;
 
       if (timeToSendPacket < 0) { // blocked and we are behind
         //s_printf("fNextTimeToRun = theOutput->fLastIntervalMilliSec=%qd;\n", theOutput->fLastIntervalMilliSec); // Use the last packet interval
-        this->SetNextTimeToRun(theOutput->fLastIntervalMilliSec);
+        *ioNextTimeToRun = theOutput->fLastIntervalMilliSec;
       }
 
-      if (fNextTimeToRun > 100) { // don't wait that long
+      if (*ioNextTimeToRun > 100) { // don't wait that long
         //s_printf("fNextTimeToRun = %qd now 100;\n", fNextTimeToRun);
-        this->SetNextTimeToRun(100);
+        *ioNextTimeToRun = 100;
       }
 
-      if (fNextTimeToRun < 5) { // wait longer
+      if (*ioNextTimeToRun < 5) { // wait longer
         //s_printf("fNextTimeToRun = 5;\n");
-        this->SetNextTimeToRun(5);
+        *ioNextTimeToRun = 5;
       }
 
       if (theOutput->fLastIntervalMilliSec >= 100) // allow up to 1 second max -- allow some time for the socket to clear and don't go into a tight loop if the client is gone.
@@ -1162,86 +1608,100 @@ QueueElem *ReflectorSender::SendPacketsToOutput(ReflectorOutput *theOutput, Queu
       break;
     }
 
+    // only the first real write of a packet counts, not the bookmarked packet
+    // written again or a packet this output skips
+    if (theWritten && fWriteFlag == qtssWriteFlagsIsRTP && thePacket->TakeLatencySample()) {
+      if (ioLatencySamples->fNumSamples == LatencySamples::kMaxSamples)
+        this->RecordLatencySamples(ioLatencySamples);
+      ioLatencySamples->fTimeArrived[ioLatencySamples->fNumSamples++] = thePacket->fTimeArrived;
+    }
+
     count++;
-    qIter.Next();
   }
 
-  // 如果 WritePacket 返回为 QTSS_WouldBlock,则 lastPacket 不为空。
+  // 如果 WritePacket 返回为 QTSS_WouldBlock,则 lastPacket 为阻塞的包，否则为最后发送的包
   return lastPacket;
 }
 
+void ReflectorSender::RecordLatencySamples(LatencySamples *ioSamples) {
+  if (ioSamples->fNumSamples == 0)
+    return;
+
+  // TCP writes went out with each output's Flush, the datagrams leave with the batch
+  UDPSendBatch *theBatch = UDPSendBatch::GetCurrent();
+  if (theBatch != nullptr)
+    theBatch->Flush();
+
+  SInt64 theCurrentTime = Core::Time::Milliseconds();
+  for (UInt32 x = 0; x < ioSamples->fNumSamples; x++)
+    fStream->RecordSendLatency(theCurrentTime - ioSamples->fTimeArrived[x]);
+  ioSamples->fNumSamples = 0;
+}
+
 /**
- * 查找处于缓存期内，最早到达的数据包
+ * 查找处于缓存期内，最早到达的数据包, 到达时间单调递增, 二分查找
  *
  * @param offsetMsec 缓冲期缩短偏移
+ * @param needKeyFrameFirstPacket 返回缓存期内的第一个关键帧起始包, 没有则仍返回最早的包.
+ *        The key frame index is kept by the socket, only its thread may ask for this.
  */
-QueueElem *ReflectorSender::GetClientBufferStartPacketOffset(SInt64 offsetMsec, bool needKeyFrameFirstPacket) {
-  QueueIter qIter(&fPacketQueue);// start at oldest packet in q
+UInt64 ReflectorSender::GetClientBufferStartPacketOffset(SInt64 offsetMsec, bool needKeyFrameFirstPacket) {
   SInt64 theCurrentTime = Core::Time::Milliseconds();
-  QueueElem *oldestPacketInClientBufferTime = nullptr;
 
   // 这里的 sOverBufferInSec 对应配置文件中的 reflector_buffer_size_sec*1000
   if (offsetMsec > ReflectorStream::sOverBufferInMsec)
     offsetMsec = ReflectorStream::sOverBufferInMsec;
 
-  while (!qIter.IsDone()) { // start at oldest packet in q
-    QueueElem *elem = qIter.GetCurrent();
-    Assert(elem);
-    qIter.Next();
+  // packetDelay <= (sOverBufferInMsec - offsetMsec)
+  UInt64 oldestPacketInClientBufferTime =
+      fPacketRing.LowerBoundTimeArrived(theCurrentTime - (ReflectorStream::sOverBufferInMsec - offsetMsec));
 
-    auto *thePacket = (ReflectorPacket *) elem->GetEnclosingObject();
-    Assert(thePacket);
+  if (!fPacketRing.Contains(oldestPacketInClientBufferTime))
+    return ReflectorPacketRing::kInvalidIndex;
 
-    SInt64 packetDelay = theCurrentTime - thePacket->fTimeArrived;
-    if (packetDelay <= (ReflectorStream::sOverBufferInMsec - offsetMsec)) {
-      oldestPacketInClientBufferTime = &thePacket->fQueueElem;
-      break; // found the packet we need: done processing
-    }
-  }
+  // a player can only start decoding at a key frame
+  UInt64 theKeyFrameIndex = ReflectorPacketRing::kInvalidIndex;
+  if (needKeyFrameFirstPacket && fPacketRing.GetKeyFramesFrom(oldestPacketInClientBufferTime, &theKeyFrameIndex, 1) == 1)
+    return theKeyFrameIndex;
 
   return oldestPacketInClientBufferTime;
 }
 
 /**
- * Iterate through the senders queue to clear out packets.
+ * Clear out packets from the front of the senders ring.
  * Start at the oldest packet and walk forward to the newest packet
  */
 void ReflectorSender::RemoveOldPackets(Queue *inFreeQueue) {
-  QueueIter removeIter(&fPacketQueue);
   SInt64 theCurrentTime = Core::Time::Milliseconds();
 
   // sMaxPacketAgeMSec 对应于配置文件中 reflector_buffer_size_sec*10000, 缺省为 10s
   SInt64 currentMaxPacketDelay = ReflectorStream::sMaxPacketAgeMSec;
 
-  // walk q and remove packets that are too old
-  while (!removeIter.IsDone()) {
-    QueueElem *elem = removeIter.GetCurrent();
-    Assert(elem);
-
-    // at this point, move onto the next queue element, because we may be altering
-    // the queue itself in the code below
-    removeIter.Next();
+  // the ring only drops from the front, once a packet is kept all the following ones are kept as well
+  bool canRemove = true;
+  UInt64 theGOPStartIndex = fGOPCache.GetStartIndex();
 
-    auto *thePacket = (ReflectorPacket *) elem->GetEnclosingObject();
+  // walk q and remove packets that are too old
+  for (UInt64 index = fPacketRing.GetHeadIndex(); index < fPacketRing.GetTailIndex(); index++) {
+    ReflectorPacket *thePacket = fPacketRing.Get(index);
     Assert(thePacket);
     //printf("ReflectorSender::RemoveOldPackets Packet %d in queue is %qd milliseconds old\n", DGetPacketSeqNumber( &thePacket->fPacketPtr ) ,theCurrentTime - thePacket->fTimeArrived);
 
     SInt64 packetDelay = theCurrentTime - thePacket->fTimeArrived;
 
     // delete based on late tolerance and whether a client is blocked on the packet
-    if (!thePacket->fNeededByOutput && packetDelay > currentMaxPacketDelay) {
+    if (canRemove && !thePacket->fNeededByOutput && packetDelay > currentMaxPacketDelay
+        && index != theGOPStartIndex) {
       // not needed and older than our required buffer
+      fPacketRing.PopFront();
       thePacket->Reset();
-      fPacketQueue.Remove(elem);
-      inFreeQueue->EnQueue(elem);
+      inFreeQueue->EnQueue(&thePacket->fQueueElem);
     } else {
       // we want to keep all of these but we should reset the ones that should be aged out unless marked
       // as need the next time through reflect packets.
+      canRemove = false;
 
-      if (fKeyFrameStartPacketElementPointer) { // 关键帧不能被清理
-        auto *keyPacket = (ReflectorPacket *) (fKeyFrameStartPacketElementPointer->GetEnclosingObject());
-        if (keyPacket == thePacket) break;
-      }
+      if (index == theGOPStartIndex) break; // 关键帧不能被清理
 
       // 被 mark 的 packet 仅在本轮不会被清理，下一轮照常清理
       thePacket->fNeededByOutput = false; // mark not needed.. will be set next time through reflect packets
@@ -1254,80 +1714,45 @@ void ReflectorSender::RemoveOldPackets(Queue *inFreeQueue) {
 
 /**
  * if current packet over max packetAgeTime, we need relocate the BookMark to
- * the new fKeyFrameStartPacketElementPointer
+ * the start of the GOP cache
  *
  * @note
  *   1. 判断当前 Packet 是否已经超过了最大缓冲周期时间(不判断音/视频、I/P帧)
- *   2. 当时间超过了阀值, 查找最新的 fKeyFrameStartPacketElementPointer
- *   3. 返回最新的 fKeyFrameStartPacketElementPointer 做为最新的 BookMark
+ *   2. 当时间超过了阀值, 查找最新的关键帧 (GOP cache 的起始包)
+ *   3. 返回该关键帧做为最新的 BookMark
  */
-QueueElem *ReflectorSender::NeedRelocateBookMark(QueueElem *elem) {
-  Assert(elem);
+UInt64 ReflectorSender::NeedRelocateBookMark(UInt64 currentPacket) {
   SInt64 theCurrentTime = Core::Time::Milliseconds();
   SInt64 packetDelay = 0;
   SInt64 currentMaxPacketDelay = ReflectorStream::sRelocatePacketAgeMSec;
 
-  auto *thePacket = (ReflectorPacket *) elem->GetEnclosingObject();
+  ReflectorPacket *thePacket = fPacketRing.Get(currentPacket);
   Assert(thePacket);
 
   packetDelay = theCurrentTime - thePacket->fTimeArrived;
   if (packetDelay > currentMaxPacketDelay) {
     // fStream->fStreamFormat == ReflectorStream::kStreamFormatVideoH264 && IsKeyFrameFirstPacket(thePacket)
-    if (fKeyFrameStartPacketElementPointer) {
-      auto *keyPacket = (ReflectorPacket *) (fKeyFrameStartPacketElementPointer->GetEnclosingObject());
-      if (keyPacket->fTimeArrived > thePacket->fTimeArrived) {
-//        this->fStream->GetMyReflectorSession()->SetHasVideoKeyFrameUpdate(true);
-        return fKeyFrameStartPacketElementPointer;
-      }
+    UInt64 keyFrameIndex = fGOPCache.GetStartIndex(); // the socket may move it meanwhile
+    ReflectorPacket *keyPacket = fPacketRing.Get(keyFrameIndex);
+    if (keyPacket != nullptr && keyFrameIndex > currentPacket) {
+//      this->fStream->GetMyReflectorSession()->SetHasVideoKeyFrameUpdate(true);
+      return keyFrameIndex;
     }
   }
 
-  return elem;
-}
-
-QueueElem *ReflectorSender:: GetNewestKeyFrameFirstPacket(QueueElem *currentElem, SInt64 offsetMsec) {
-  //printf("[geyijun] GetNewestKeyFrameFirstPacket---------------->1\n");
-  SInt64 theCurrentTime = Core::Time::Milliseconds();
-  SInt64 packetDelay = 0;
-  QueueElem *requestedPacket = nullptr;
-  QueueIter qIter(&fPacketQueue, currentElem);
-  while (!qIter.IsDone()) { // start at oldest packet in q
-    QueueElem *elem = qIter.GetCurrent();
-    Assert(elem);
-    qIter.Next();
-
-    auto *thePacket = (ReflectorPacket *) elem->GetEnclosingObject();
-    if (thePacket == nullptr) break;
-
-    if (IsKeyFrameFirstPacket(thePacket)) {
-      requestedPacket = &thePacket->fQueueElem;
-      //printf("[geyijun]Maybe,GetNewestKeyFrameFirstPacket --->[%#x]\n",requestedPacket);
-
-      //
-      packetDelay = theCurrentTime - thePacket->fTimeArrived;
-      if (offsetMsec > ReflectorStream::sOverBufferInMsec)
-        offsetMsec = ReflectorStream::sOverBufferInMsec;
-      if (packetDelay <= (ReflectorStream::sOverBufferInMsec - offsetMsec)) {
-        break;
-      }
-    }
-  }
-  if (requestedPacket == NULL) {
-    printf("[geyijun]GetNewestKeyFrameFirstPacket --->[NotFound]\n");
-  } else {
-    printf("[geyijun]Final,GetNewestKeyFrameFirstPacket --->[%#x]\n", requestedPacket);
-  }
-  return requestedPacket;
+  return currentPacket;
 }
 
-
 /**
- * 判断当前RTP包是否为H.264 关键帧的第一个RTP包
- * 下面的写法可能不太严谨(仅针对H264 的情况，未考虑其他格式)
+ * 判断当前RTP包是否为H.264/H.265 关键帧的第一个RTP包
+ * 下面的写法可能不太严谨(仅针对H264/H265 的情况，未考虑其他格式)
  */
 bool ReflectorSender::IsKeyFrameFirstPacket(ReflectorPacket *thePacket) {
   Assert(thePacket);
   if (thePacket == nullptr) return false;
+  if (fStream->fStreamFormat == ReflectorStream::kStreamFormatVideoH265)
+    return this->IsH265KeyFrameFirstPacket(thePacket);
+
   if ((thePacket->fPacketPtr.Ptr != nullptr) && (thePacket->fPacketPtr.Len >= 20)) {
     auto *rtpHeader = reinterpret_cast<RTPFixedHeader*>(thePacket->fPacketPtr.Ptr);
     UInt32 rtpHeaderLen = sizeof(RTPFixedHeader) + rtpHeader->cc * sizeof(UInt32);
@@ -1374,6 +1799,7 @@ bool ReflectorSender::IsKeyFrameFirstPacket(ReflectorPacket *thePacket) {
       }
     }
 
+    thePacket->fInfo.fNALUType = naluType;
     if ((naluType == 5) || (naluType == 7) || (naluType == 8)) { // IDR/SPS/PPS
       return true;
     }
@@ -1381,6 +1807,91 @@ bool ReflectorSender::IsKeyFrameFirstPacket(ReflectorPacket *thePacket) {
   return false;
 }
 
+/**
+ * 判断当前RTP包是否为H.265 关键帧(含 VPS/SPS/PPS)的第一个RTP包
+ *
+ * @see  rfc7798(4.4)
+ */
+bool ReflectorSender::IsH265KeyFrameFirstPacket(ReflectorPacket *thePacket) {
+  StrPtrLen *thePacketPtr = thePacket->GetPacketPtr();
+  if (thePacketPtr->Ptr == nullptr || thePacketPtr->Len < sizeof(RTPFixedHeader))
+    return false;
+
+  auto *rtpHeader = reinterpret_cast<RTPFixedHeader *>(thePacketPtr->Ptr);
+  UInt32 rtpHeaderLen = sizeof(RTPFixedHeader) + rtpHeader->cc * sizeof(UInt32);
+  if (rtpHeader->x) { // skip the header extension, its length is in 32 bit words
+    if (thePacketPtr->Len < rtpHeaderLen + 4) return false;
+    auto *theExtLen = reinterpret_cast<UInt8 *>(&thePacketPtr->Ptr[rtpHeaderLen + 2]);
+    rtpHeaderLen += 4 + ((theExtLen[0] << 8U) | theExtLen[1]) * 4;
+  }
+
+  if (thePacketPtr->Len < rtpHeaderLen + sizeof(H265NALUHeader) + 1)
+    return false;
+
+  auto *payloadHeader = reinterpret_cast<H265NALUHeader *>(&thePacketPtr->Ptr[rtpHeaderLen]);
+  UInt8 naluType = payloadHeader->GetType();
+  if (naluType == kH265NALUAP) { // AP, the first aggregated NALU decides (no DONL, sprop-max-don-diff is 0)
+    // rtp header + payload header + nalu size
+    UInt32 naluOffset = rtpHeaderLen + sizeof(H265NALUHeader) + sizeof(UInt16);
+    if (thePacketPtr->Len < naluOffset + sizeof(H265NALUHeader)) return false;
+    naluType = reinterpret_cast<H265NALUHeader *>(&thePacketPtr->Ptr[naluOffset])->GetType();
+  } else if (naluType == kH265NALUFU) { // FU, only the start fragment
+    auto *fuHeader = reinterpret_cast<H265FUHeader *>(&thePacketPtr->Ptr[rtpHeaderLen + sizeof(H265NALUHeader)]);
+    if (!fuHeader->s) return false;
+    naluType = fuHeader->type;
+  } else if (naluType >= kH265NALUAP) { // PACI and unspecified types
+    return false;
+  }
+
+  thePacket->fInfo.fNALUType = naluType;
+  return (naluType >= kH265NALUBLAWLP && naluType <= kH265NALUCRA)
+      || naluType == kH265NALUVPS || naluType == kH265NALUSPS || naluType == kH265NALUPPS;
+}
+
+/**
+ * 判断当前RTP包是否可以丢弃(非参考帧), 整帧丢弃时用
+ *
+ * @see  rfc6184(5.3), rfc7798(1.1.4)
+ */
+bool ReflectorSender::IsDisposablePacket(ReflectorPacket *thePacket) {
+  StrPtrLen *thePacketPtr = thePacket->GetPacketPtr();
+  if (thePacketPtr->Ptr == nullptr || thePacketPtr->Len < sizeof(RTPFixedHeader))
+    return false;
+
+  auto *rtpHeader = reinterpret_cast<RTPFixedHeader *>(thePacketPtr->Ptr);
+  UInt32 rtpHeaderLen = sizeof(RTPFixedHeader) + rtpHeader->cc * sizeof(UInt32);
+  if (rtpHeader->x) { // skip the header extension, its length is in 32 bit words
+    if (thePacketPtr->Len < rtpHeaderLen + 4) return false;
+    auto *theExtLen = reinterpret_cast<UInt8 *>(&thePacketPtr->Ptr[rtpHeaderLen + 2]);
+    rtpHeaderLen += 4 + ((theExtLen[0] << 8U) | theExtLen[1]) * 4;
+  }
+
+  if (fStream->fStreamFormat == ReflectorStream::kStreamFormatVideoH264) {
+    if (thePacketPtr->Len < rtpHeaderLen + sizeof(NALUHeader))
+      return false;
+
+    // a STAP carries the highest NRI of its units, a FU indicator the NRI of the fragmented unit
+    auto *nalHeader = reinterpret_cast<NALUHeader *>(&thePacketPtr->Ptr[rtpHeaderLen]);
+    return nalHeader->type != 0 && nalHeader->nri == 0;
+  }
+
+  if (thePacketPtr->Len < rtpHeaderLen + sizeof(H265NALUHeader) + 1)
+    return false;
+
+  auto *payloadHeader = reinterpret_cast<H265NALUHeader *>(&thePacketPtr->Ptr[rtpHeaderLen]);
+  UInt8 naluType = payloadHeader->GetType();
+  if (naluType == kH265NALUAP) { // AP, the first aggregated NALU decides
+    UInt32 naluOffset = rtpHeaderLen + sizeof(H265NALUHeader) + sizeof(UInt16);
+    if (thePacketPtr->Len < naluOffset + sizeof(H265NALUHeader)) return false;
+    naluType = reinterpret_cast<H265NALUHeader *>(&thePacketPtr->Ptr[naluOffset])->GetType();
+  } else if (naluType == kH265NALUFU) { // every fragment has the type in its FU header
+    naluType = reinterpret_cast<H265FUHeader *>(&thePacketPtr->Ptr[rtpHeaderLen + sizeof(H265NALUHeader)])->type;
+  }
+
+  // TRAIL_N, TSA_N, STSA_N, RADL_N, RASL_N and the reserved _N types
+  return naluType <= kH265NALURSVVCLN14 && (naluType % 2) == 0;
+}
+
 void ReflectorSocketPool::SetUDPSocketOptions(Net::UDPSocketPair *inPair) {
   // Fix add ReuseAddr for compatibility with MPEG4IP broadcaster which likes to use the same sockets.
 
@@ -1434,6 +1945,8 @@ ReflectorSocket::ReflectorSocket()
       fFirstArrivalTime(0),
       fCurrentSSRC(0) {
 
+  fPacketPool = new ReflectorPacketPool();
+
   this->SetTaskName("ReflectorSocket");
   this->SetTask(this);
 
@@ -1450,6 +1963,10 @@ ReflectorSocket::~ReflectorSocket() {
     auto *packet = (ReflectorPacket *) fFreeQueue.DeQueue()->GetEnclosingObject();
     delete packet;
   }
+
+  // buffers still referenced elsewhere keep the pool alive until they are released
+  fPacketPool->Detach();
+  fPacketPool = nullptr;
 }
 
 void ReflectorSocket::AddSender(ReflectorSender *inSender) {
@@ -1471,7 +1988,7 @@ void ReflectorSocket::RemoveSender(ReflectorSender *inSender) {
  * 当 ReflectorSocket 接受到推流上来的数据后，会启动 Task。
  * 在 ReflectorSocket::Run() 中，遍历 fSenderQueue，并调用每个 Sender 的 ReflectPackets()
  * 在 ReflectorSender::ReflectPackets() 中，遍历与 fStream 相关联的 ReflectorOutput，并对 Output 调用 SendPacketsToOutput()
- * 在 ReflectorSender::SendPacketsToOutput() 中，遍历 fPacketQueue，并对每个 Packet 调用 Output 的 WritePacket()
+ * 在 ReflectorSender::SendPacketsToOutput() 中，遍历 fPacketRing，并对每个 Packet 调用 Output 的 WritePacket()
  * 在 RTPSessionOutput::WritePacket() 中，通过 StreamCookie 在与 Output 对应的 ClientSession 中找到正确的 RTPStream，
  *     调用 QTSS_Write() 将 Packet 通过 RTPStream 发送出去
  */
@@ -1572,29 +2089,27 @@ bool ReflectorSocket::FilterInvalidSSRCs(ReflectorPacket *thePacket) {
   return invalid;
 }
 
-void ReflectorSocket::BufferKeyFrame(ReflectorSender *theSender, ReflectorPacket *thePacket) {
-  //
-  // 对H264视频RTP包进行关键帧过滤，保存最新关键帧首个RTP包指针
+void ReflectorSocket::BufferKeyFrame(ReflectorSender *theSender, ReflectorPacket *thePacket, UInt64 thePacketIndex) {
+  // a stream outside of a session (reflector_bench) has no audio to keep in step
+  ReflectorSession *theSession = theSender->fStream->GetMyReflectorSession();
 
-  // 1. 判断是否为视频 H.264 RTP
-  if (theSender->fStream->fStreamFormat == ReflectorStream::kStreamFormatVideoH264) {
+  //
+  // 对H264/H265视频RTP包进行关键帧过滤，保存最新关键帧首个RTP包指针
 
-    // 2. 在这里判断上面插入的thePacket是否为关键帧起始RTP包，如果是，则记录thePacket->fQueueElem
-    if (theSender->IsKeyFrameFirstPacket(thePacket)) {
+  // 1. 判断是否为视频 H.264/H.265 RTP
+  if (theSender->fStream->fStreamFormat == ReflectorStream::kStreamFormatVideoH264
+      || theSender->fStream->fStreamFormat == ReflectorStream::kStreamFormatVideoH265) {
 
-      // 3. 取消原来的fKeyFrameStartPacketElementPointer
-      if (theSender->fKeyFrameStartPacketElementPointer) {
-        auto *oldKeyFramePacket = (ReflectorPacket *)
-            theSender->fKeyFrameStartPacketElementPointer->GetEnclosingObject();
-        oldKeyFramePacket->fNeededByOutput = false;
-      }
+    // 2. thePacket 是否为关键帧起始RTP包(入口处已解析)，如果是，则从它开始新的 GOP
+    if (thePacket->IsKeyFrameStart()) {
 
-      // 4. 设置最新的fKeyFrameStartPacketElementPointer
-      thePacket->fNeededByOutput = true; // 锁定关键帧不会被Remove
-      theSender->fKeyFrameStartPacketElementPointer = &thePacket->fQueueElem; // 更新最新的关键帧开始包
+      // 3. 放弃原来的 GOP，锁定新的关键帧不会被Remove
+      theSender->fGOPCache.Start(thePacketIndex);
 
-      // 5. 设置ReflectorSession标志位，Notify有新视频关键帧，提醒音频队列更新
-      theSender->fStream->GetMyReflectorSession()->SetHasVideoKeyFrameUpdate(true);
+      // 4. 设置ReflectorSession标志位，Notify有新视频关键帧，提醒音频队列更新
+      if (theSession != nullptr)
+        theSession->SetHasVideoKeyFrameUpdate(true);
+      return;
     }
   }
 
@@ -1603,22 +2118,18 @@ void ReflectorSocket::BufferKeyFrame(ReflectorSender *theSender, ReflectorPacket
 
   // 1. 判断是否为音频RTP且有视频关键帧更新Notify
   else if ((theSender->fStream->fStreamFormat & ReflectorStream::kStreamFormatAudio) &&
-      (theSender->fStream->GetMyReflectorSession()->HasVideoKeyFrameUpdate())) {
-
-    // 2. 取消原来音频的fKeyFrameStartPacketElementPointer
-    if (theSender->fKeyFrameStartPacketElementPointer) {
-      auto *oldKeyFramePacket = (ReflectorPacket *)
-          theSender->fKeyFrameStartPacketElementPointer->GetEnclosingObject();
-      oldKeyFramePacket->fNeededByOutput = false;
-    }
+      theSession != nullptr && theSession->HasVideoKeyFrameUpdate()) {
 
-    // 4. 设置最新的音频fKeyFrameStaretElementPointer
-    thePacket->fNeededByOutput = true; // 锁定关键帧不会被Remove
-    theSender->fKeyFrameStartPacketElementPointer = &thePacket->fQueueElem; // 更新最新的关键帧开始包
+    // 2. 音频从与视频关键帧同时到达的包开始新的 GOP
+    theSender->fGOPCache.Start(thePacketIndex);
 
-    // 5. 设置ReflectorSession标志位，Notify有新视频关键帧，提醒音频队列更新
-    theSender->fStream->GetMyReflectorSession()->SetHasVideoKeyFrameUpdate(false);
+    // 3. 设置ReflectorSession标志位，Notify有新视频关键帧，提醒音频队列更新
+    theSession->SetHasVideoKeyFrameUpdate(false);
+    return;
   }
+
+  // the rest of the GOP, dropped from the cache once it gets too big
+  theSender->fGOPCache.Append(thePacket);
 }
 
 /**
@@ -1639,11 +2150,18 @@ ProcessPacket(const SInt64 &inMilliseconds, ReflectorPacket *thePacket, UInt32 t
     }
   }
 
+  // decode the header once, every output reads the parsed fields
+  thePacket->ParseHeader();
+
   // Only reflect one SSRC stream at a time.
   // Pass the packet and whether it is an RTCP or RTP packet based on the port number.
   if (fFilterSSRCs) {
     // thePacket->fPacketPtr.Len is set to 0 for invalid SSRCs, and pass
-    if (this->FilterInvalidSSRCs(thePacket)) return;
+    if (this->FilterInvalidSSRCs(thePacket)) {
+      thePacket->Reset();
+      fFreeQueue.EnQueue(&thePacket->fQueueElem);
+      return;
+    }
   }
 
   if (thePacket->IsRTCP()) {
@@ -1656,6 +2174,7 @@ ProcessPacket(const SInt64 &inMilliseconds, ReflectorPacket *thePacket, UInt32 t
     if ((!theRTCPPacket.ParsePacket((UInt8 *) thePacket->fPacketPtr.Ptr, thePacket->fPacketPtr.Len)) ||
         (theRTCPPacket.GetPacketType() != RTCPSRPacket::kSRPacketType)) {
       // pretend as if we never got this packet
+      thePacket->Reset();
       fFreeQueue.EnQueue(&thePacket->fQueueElem);
 //      this->RequestEvent(EV_RM); // 不再接收 RTCP 包
       return;
@@ -1672,6 +2191,7 @@ ProcessPacket(const SInt64 &inMilliseconds, ReflectorPacket *thePacket, UInt32 t
   if (theSender == nullptr) {
     //UInt16* theSeqNumberP = (UInt16*)thePacket->fPacketPtr.Ptr;
     //s_printf("ReflectorSocket::ProcessPacket no sender found for packet! sequence number=%d\n",ntohs(theSeqNumberP[1]));
+    thePacket->Reset();
     fFreeQueue.EnQueue(&thePacket->fQueueElem); // don't process the packet
     return;
   }
@@ -1712,30 +2232,6 @@ ProcessPacket(const SInt64 &inMilliseconds, ReflectorPacket *thePacket, UInt32 t
   thePacket->fBucketsSeenThisPacket = 0;
   thePacket->fTimeArrived = inMilliseconds;
 
-  // Push to sender's packet queue
-  theSender->fPacketQueue.EnQueue(&thePacket->fQueueElem);
-  if (theSender->fFirstNewPacketInQueue == nullptr)
-    theSender->fFirstNewPacketInQueue = &thePacket->fQueueElem;
-  theSender->fHasNewPackets = true;
-
-  if (!thePacket->IsRTCP()) {
-    // 关键帧缓冲 for h.264
-    BufferKeyFrame(theSender, thePacket);
-
-    // don't check for duplicate packets, they may be needed to keep in sync.
-    // Because this is an RTP packet, make sure to atomic add this because
-    // multiple sockets can be adding to this variable simultaneously
-    theSender->fStream->fBytesSentInThisInterval.fetch_add(thePacket->fPacketPtr.Len);
-
-    //printf("ReflectorSocket::ProcessPacket received RTP id=%qu\n", thePacket->fStreamCountID);
-    theSender->fStream->SetHasFirstRTP(true);
-  } else {
-    //printf("ReflectorSocket::ProcessPacket received RTCP id=%qu\n", thePacket->fStreamCountID);
-    theSender->fStream->SetHasFirstRTCP(true);
-    theSender->fStream->SetFirst_RTCP_RTP_Time(thePacket->GetPacketRTPTime());
-    theSender->fStream->SetFirst_RTCP_Arrival_Time(thePacket->fTimeArrived);
-  }
-
   if (ReflectorStream::sUsePacketReceiveTime && thePacket->fPacketPtr.Len > 12) { // default is false
     UInt32 offset = thePacket->fPacketPtr.Len;
     char *theTag = thePacket->fPacketPtr.Ptr + offset - 12;
@@ -1766,16 +2262,44 @@ ProcessPacket(const SInt64 &inMilliseconds, ReflectorPacket *thePacket, UInt32 t
     }
   }
 
+  if (!thePacket->IsRTCP() && theSender->fStream->IsH26xVideo()) {
+    thePacket->fInfo.fIsKeyFrameStart = theSender->IsKeyFrameFirstPacket(thePacket);
+    thePacket->fInfo.fIsDisposable = theSender->IsDisposablePacket(thePacket);
+  }
+
+  // Push to sender's packet ring, the packet must not change after this, the
+  // fan-out shards may already be sending it
+  UInt64 thePacketIndex = theSender->EnQueuePacket(thePacket);
+  theSender->fHasNewPackets = true;
+
+  if (!thePacket->IsRTCP()) {
+    // 关键帧缓冲 for h.264
+    BufferKeyFrame(theSender, thePacket, thePacketIndex);
+
+    // don't check for duplicate packets, they may be needed to keep in sync.
+    // Because this is an RTP packet, make sure to atomic add this because
+    // multiple sockets can be adding to this variable simultaneously
+    theSender->fStream->fBytesSentInThisInterval.fetch_add(thePacket->fPacketPtr.Len);
+
+    //printf("ReflectorSocket::ProcessPacket received RTP id=%qu\n", thePacket->fStreamCountID);
+    theSender->fStream->SetHasFirstRTP(true);
+  } else {
+    //printf("ReflectorSocket::ProcessPacket received RTCP id=%qu\n", thePacket->fStreamCountID);
+    theSender->fStream->SetHasFirstRTCP(true);
+    theSender->fStream->SetFirst_RTCP_RTP_Time(thePacket->GetPacketRTPTime());
+    theSender->fStream->SetFirst_RTCP_Arrival_Time(thePacket->fTimeArrived);
+  }
+
   DEBUG_LOG(0,
             "ReflectorSocket::ProcessPacket %s#%" _U64BITARG_ " from time=%qd src addr=%x src port=%u packetlen=%" _U32BITARG_ "\n",
             thePacket->IsRTCP() ? "RTCP" : "RTP", thePacket->fStreamCountID, inMilliseconds, theRemoteAddr, theRemotePort, thePacket->fPacketPtr.Len);
 
   if (0) {//turn on / off buffer size checking --  pref can go here if we find we need to adjust this
     const UInt32 maxQSize = 4000;
-    if (theSender->fPacketQueue.GetLength() > maxQSize) { //don't grow memory too big
+    if (theSender->fPacketRing.GetLength() > maxQSize) { //don't grow memory too big
       char outMessage[256];
       sprintf(outMessage, "Packet Queue for port=%d qsize = %" _S32BITARG_ " hit max qSize=%" _U32BITARG_ "",
-              theRemotePort, theSender->fPacketQueue.GetLength(), maxQSize);
+              theRemotePort, theSender->fPacketRing.GetLength(), maxQSize);
       WarnV(false, outMessage);
     }
   }
@@ -1786,15 +2310,24 @@ void ReflectorSocket::GetIncomingData(const SInt64 &inMilliseconds) {
   UInt32 theRemoteAddr = 0;
   UInt16 theRemotePort = 0;
 
+#if __linux__
+  if (ReflectorStream::sUseRecvMmsg && this->GetIncomingDataBatch(inMilliseconds))
+    return;
+#endif
+
   // we use ET mode, get all the outstanding packets for this socket
   for (;;) {
     // get a packet off the free queue.
-    ReflectorPacket *thePacket = this->GetPacket();
+    ReflectorPacket *thePacket = this->GetFreePacket();
+
+    // 调用 ::recvfrom 直接把数据读进 packet pool, 之后所有 Output 共享这份数据
+    UInt32 theLen = 0;
+    char *theData = fPacketPool->Reserve(ReflectorPacket::kMaxReflectorPacketSize);
+    (void) this->RecvFrom(&theRemoteAddr, &theRemotePort, theData,
+                          ReflectorPacket::kMaxReflectorPacketSize, &theLen);
 
-    // 调用 ::recvfrom 从 socket 里读取数据到 thePacket 的缓冲区
-    thePacket->fPacketPtr.Len = 0;
-    (void) this->RecvFrom(&theRemoteAddr, &theRemotePort, thePacket->fPacketPtr.Ptr,
-                          ReflectorPacket::kMaxReflectorPacketSize, &thePacket->fPacketPtr.Len);
+    // if the port number of this socket is odd, this packet is an RTCP packet.
+    thePacket->SetPacketBuffer(fPacketPool->Commit(theLen), static_cast<bool>(this->GetLocalPort() & 1U));
 
     if (thePacket->fPacketPtr.Len == 0) {
       // put the packet back on the free queue, because we didn't actually get any data here.
@@ -1803,14 +2336,12 @@ void ReflectorSocket::GetIncomingData(const SInt64 &inMilliseconds) {
       break;  // no more packets on this socket!
     }
 
-    // if the port number of this socket is odd, this packet is an RTCP packet.
-    thePacket->fIsRTCP = static_cast<bool>(this->GetLocalPort() & 1U);
     DEBUG_LOG(0,
               "remote addr:%x, remote port:%u, local port:%u, isRTCP=%s\n",
               theRemoteAddr, theRemotePort, this->GetLocalPort(), thePacket->fIsRTCP ? "true" : "false");
 
     // 获取 Socket 对应的 Sender,对 Sender、thePacket 进行一系列设置,最终将 thePacket
-    // 挂入 Sender 的 fPacketQueue
+    // 挂入 Sender 的 fPacketRing
     this->ProcessPacket(inMilliseconds, thePacket, theRemoteAddr, theRemotePort);
 
     //s_printf("ReflectorSocket::GetIncomingData \n");
@@ -1819,11 +2350,96 @@ void ReflectorSocket::GetIncomingData(const SInt64 &inMilliseconds) {
 //  this->RequestEvent(EV_RE); // re watch EV_RE
 }
 
+#if __linux__
+/**
+ * 批量接收，一次 recvmmsg 读取至多 kRecvBatchSize 个数据包到 packet pool
+ *
+ * @return false if recvmmsg is not supported, the caller falls back to RecvFrom
+ */
+bool ReflectorSocket::GetIncomingDataBatch(const SInt64 &inMilliseconds) {
+  ReflectorPacket *thePackets[kRecvBatchSize];
+  struct mmsghdr theMsgs[kRecvBatchSize];
+  struct iovec theIovecs[kRecvBatchSize];
+  struct sockaddr_in theAddrs[kRecvBatchSize];
+
+  const UInt32 theStride = ReflectorPacketPool::GetSlotStride(ReflectorPacket::kMaxReflectorPacketSize);
+  // if the port number of this socket is odd, these are RTCP packets.
+  const bool isRTCP = static_cast<bool>(this->GetLocalPort() & 1U);
+
+  for (UInt32 i = 0; i < kRecvBatchSize; i++)
+    thePackets[i] = this->GetFreePacket();
+
+  // we use ET mode, get all the outstanding packets for this socket
+  for (;;) {
+    char *theSlots = fPacketPool->ReserveSlots(kRecvBatchSize, ReflectorPacket::kMaxReflectorPacketSize);
+
+    ::memset(theMsgs, 0, sizeof(theMsgs));
+    for (UInt32 i = 0; i < kRecvBatchSize; i++) {
+      theIovecs[i].iov_base = theSlots + i * theStride;
+      theIovecs[i].iov_len = ReflectorPacket::kMaxReflectorPacketSize;
+      theMsgs[i].msg_hdr.msg_iov = &theIovecs[i];
+      theMsgs[i].msg_hdr.msg_iovlen = 1;
+      theMsgs[i].msg_hdr.msg_name = &theAddrs[i];
+      theMsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    int theCount = ::recvmmsg(this->GetSocketFD(), theMsgs, kRecvBatchSize, MSG_DONTWAIT, nullptr);
+    if (theCount < 0) {
+      if (errno == ENOSYS) {
+        ReflectorStream::sUseRecvMmsg = false;
+        break; // thePackets go back to the free queue below
+      }
+      theCount = 0;
+    }
+
+    for (int i = 0; i < theCount; i++) {
+      ReflectorPacket *thePacket = thePackets[i];
+      thePacket->SetPacketBuffer(fPacketPool->CommitSlot(theSlots + i * theStride, theMsgs[i].msg_len), isRTCP);
+      thePackets[i] = nullptr;
+
+      if (thePacket->fPacketPtr.Len == 0) { // zero length datagram
+        fFreeQueue.EnQueue(&thePacket->fQueueElem);
+        continue;
+      }
+
+      UInt32 theRemoteAddr = ntohl(theAddrs[i].sin_addr.s_addr);
+      UInt16 theRemotePort = ntohs(theAddrs[i].sin_port);
+
+      DEBUG_LOG(0,
+                "remote addr:%x, remote port:%u, local port:%u, isRTCP=%s\n",
+                theRemoteAddr, theRemotePort, this->GetLocalPort(), isRTCP ? "true" : "false");
+
+      this->ProcessPacket(inMilliseconds, thePacket, theRemoteAddr, theRemotePort);
+    }
+
+    if (theCount < kRecvBatchSize)
+      break;  // no more packets on this socket!
+
+    // refill the used entries for the next round
+    for (UInt32 i = 0; i < kRecvBatchSize; i++) {
+      if (thePackets[i] == nullptr)
+        thePackets[i] = this->GetFreePacket();
+    }
+  }
+
+  for (UInt32 i = 0; i < kRecvBatchSize; i++) {
+    if (thePackets[i] != nullptr)
+      fFreeQueue.EnQueue(&thePackets[i]->fQueueElem);
+  }
+
+  return ReflectorStream::sUseRecvMmsg;
+}
+#endif
+
 /**
  * pop from fFreeQueue or new one.
  */
 ReflectorPacket *ReflectorSocket::GetPacket() {
   Core::MutexLocker locker(this->GetDemuxer()->GetMutex());
+  return this->GetFreePacket();
+}
+
+ReflectorPacket *ReflectorSocket::GetFreePacket() {
   if (fFreeQueue.GetLength() == 0)
     return new ReflectorPacket();
   else
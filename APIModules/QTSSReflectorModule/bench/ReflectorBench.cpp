@@ -0,0 +1,436 @@
+/*
+    File:       ReflectorBench.cpp
+
+    Contains:   reflector_bench, a fan-out microbenchmark of the reflector.
+
+                One H.264 ReflectorStream is fed a synthetic packet trace
+                (bit rate, frame rate, GOP length, keyframe size, packet
+                size) through ReflectorSocket::ProcessPacket, and its RTP
+                ReflectorSender reflects every frame to N synthetic outputs
+                that only count the packets, or write each of them to
+                /dev/null for the cost of a syscall per packet. No sockets,
+                RTSP sessions or task threads are involved, every frame is
+                one ReflectPackets pass on the calling thread with the
+                demuxer mutex held, as ReflectorSocket::Run does.
+
+                The trace runs in real time, packet ages drive the expiry
+                and the GOP cache as they do in the server. A pass that
+                takes longer than a frame interval delays the next frame.
+
+                Reported per number of outputs:
+                  packets written per second of pass time, ns per packet
+                  and output, pass time (demuxer mutex hold) p50/p99, the
+                  ingest hold of the demuxer mutex per frame and, on
+                  request, the hold of each output's mutex (-l) and the
+                  wait of a reader on the stream's bucket mutex (-r).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <CF/CF.h>
+
+#include "ReflectorStream.h"
+#include "LatencyHistogram.h"
+
+using namespace CF;
+
+struct BenchConfig {
+  std::vector<UInt32> fNumOutputs;
+  UInt32 fBitRateKbps;
+  UInt32 fFrameRate;
+  UInt32 fGOPFrames;
+  UInt32 fKeyFrameRatio; // a keyframe is this many times the size of the other frames
+  UInt32 fPacketSize;    // RTP packet size, the last packet of a frame is shorter
+  UInt32 fSeconds;
+  bool fWriteToNull;
+  bool fTimeOutputHolds;
+  bool fRunReader;
+};
+
+struct BenchResult {
+  UInt64 fNumPasses;
+  UInt64 fNumWrites;
+  UInt64 fPassNanos;
+  LatencyHistogram::Snapshot fPassHolds;   // usec
+  LatencyHistogram::Snapshot fIngestHolds; // usec
+  LatencyHistogram::Snapshot fOutputHolds; // nsec
+  LatencyHistogram::Snapshot fReaderWaits; // usec
+};
+
+static UInt64 NowNanos() {
+  return (UInt64) std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * 测试用 Output, counts what the sender writes to it
+ */
+class BenchOutput : public ReflectorOutput {
+ public:
+
+  BenchOutput(UInt64 *ioNumWrites, int inNullFD, LatencyHistogram *inHolds)
+      : fNumWrites(ioNumWrites), fNullFD(inNullFD), fHolds(inHolds), fFirstWriteNanos(0) {
+    this->InitializeBookmarks(1);
+  }
+
+  ~BenchOutput() override = default;
+
+  QTSS_Error WritePacket(ReflectorPacket *inPacket, void *inStreamCookie, UInt32 inFlags,
+                         SInt64 packetLatenessInMSec, SInt64 *timeToSendThisPacketAgain,
+                         bool firstPacket, bool *outWritten) override {
+    // fMutex is held from before the first write of the pass to after Flush
+    if (fHolds != nullptr && fFirstWriteNanos == 0)
+      fFirstWriteNanos = NowNanos();
+
+    if (fNullFD >= 0) {
+      StrPtrLen *thePacket = inPacket->GetPacketPtr();
+      (void) ::write(fNullFD, thePacket->Ptr, thePacket->Len);
+    }
+
+    (*fNumWrites)++;
+    *outWritten = true;
+    return QTSS_NoErr;
+  }
+
+  void Flush() override {
+    if (fFirstWriteNanos != 0) {
+      fHolds->Record(NowNanos() - fFirstWriteNanos);
+      fFirstWriteNanos = 0;
+    }
+  }
+
+  void TearDown() override {}
+
+  bool IsUDP() override { return true; }
+
+  bool IsPlaying() override { return true; }
+
+ private:
+
+  UInt64 *fNumWrites;    // shared by all outputs of a run, only the send loop writes it
+  int fNullFD;           // -1 to only count
+  LatencyHistogram *fHolds;
+  UInt64 fFirstWriteNanos;
+};
+
+/**
+ * 合成码流, H.264 in FU-A packets, one keyframe (NAL type 5) per GOP
+ */
+class BenchTrace {
+ public:
+
+  enum {
+    kRTPHeaderSize = 12,
+    kFUHeaderSize = 2,
+    kMaxPacketSize = 1500,
+    kPayloadType = 96,
+    kSSRC = 0x42454E43
+  };
+
+  explicit BenchTrace(const BenchConfig &inConfig) : fConfig(inConfig), fSeqNum(0) {
+    ::memset(fPacket, 0, sizeof(fPacket));
+
+    // the bytes of one GOP split into keyframe and other frames by their ratio
+    UInt64 theGOPBytes = (UInt64) inConfig.fBitRateKbps * 1000 / 8 * inConfig.fGOPFrames / inConfig.fFrameRate;
+    fFrameBytes = (UInt32) (theGOPBytes / (inConfig.fKeyFrameRatio + inConfig.fGOPFrames - 1));
+    if (fFrameBytes == 0)
+      fFrameBytes = 1;
+  }
+
+  // Hands the packets of frame inFrame to inSocket, call with its demuxer mutex held
+  UInt32 IngestFrame(ReflectorSocket *inSocket, UInt32 inFrame, SInt64 inArrivalTime) {
+    bool isKeyFrame = (inFrame % fConfig.fGOPFrames) == 0;
+    UInt32 theFrameBytes = isKeyFrame ? fFrameBytes * fConfig.fKeyFrameRatio : fFrameBytes;
+    UInt32 thePayloadSize = fConfig.fPacketSize - kRTPHeaderSize - kFUHeaderSize;
+    auto theRTPTime = (UInt32) ((UInt64) inFrame * 90000 / fConfig.fFrameRate);
+    UInt32 theNumPackets = 0;
+
+    for (UInt32 theOffset = 0; theOffset < theFrameBytes; theOffset += thePayloadSize) {
+      UInt32 theLen = theFrameBytes - theOffset < thePayloadSize ? theFrameBytes - theOffset : thePayloadSize;
+      bool isFirst = theOffset == 0;
+      bool isLast = theOffset + theLen >= theFrameBytes;
+
+      fPacket[0] = (char) 0x80;
+      fPacket[1] = (char) (kPayloadType | (isLast ? 0x80 : 0));
+      *(UInt16 *) &fPacket[2] = htons(fSeqNum++);
+      *(UInt32 *) &fPacket[4] = htonl(theRTPTime);
+      *(UInt32 *) &fPacket[8] = htonl(kSSRC);
+      fPacket[12] = (char) ((isKeyFrame ? 3 : 2) << 5 | 28); // FU indicator, NRI and FU-A
+      fPacket[13] = (char) ((isFirst ? 0x80 : 0) | (isLast ? 0x40 : 0) | (isKeyFrame ? 5 : 1));
+
+      UInt32 thePacketLen = kRTPHeaderSize + kFUHeaderSize + theLen;
+      ReflectorPacketBuffer *theBuffer = inSocket->GetPacketPool()->Acquire(fPacket, thePacketLen);
+      if (theBuffer == nullptr)
+        continue;
+
+      ReflectorPacket *thePacket = inSocket->GetPacket();
+      thePacket->SetPacketBuffer(theBuffer, false);
+      inSocket->ProcessPacket(inArrivalTime, thePacket, 0, 0);
+      theNumPackets++;
+    }
+
+    return theNumPackets;
+  }
+
+ private:
+
+  const BenchConfig &fConfig;
+  UInt32 fFrameBytes; // a frame other than the keyframe
+  UInt16 fSeqNum;
+  char fPacket[kMaxPacketSize];
+};
+
+static void RunBench(const BenchConfig &inConfig, UInt32 inNumOutputs, BenchResult *outResult) {
+  ::memset(outResult, 0, sizeof(BenchResult));
+
+  static char sPayloadName[] = "H264/90000";
+  StrPtrLen thePayloadName(sPayloadName);
+
+  SourceInfo::StreamInfo theInfo;
+  theInfo.fPayloadType = qtssVideoPayloadType;
+  theInfo.fPayloadName.Set(thePayloadName.GetAsCString(), thePayloadName.Len); // freed by ~StreamInfo
+  theInfo.fTimeScale = 90000;
+
+  auto *theStream = new ReflectorStream(&theInfo);
+  theStream->SetEnableBuffer(true);
+
+  // never bound or opened, only its demuxer, packet pool and ingest are used
+  auto *theSocket = new ReflectorSocket();
+  theSocket->SetSSRCFilter(false, 0);
+  ReflectorSender *theSender = theStream->GetRTPSender();
+  theSocket->AddSender(theSender);
+
+  int theNullFD = inConfig.fWriteToNull ? ::open("/dev/null", O_WRONLY) : -1;
+  UInt64 theNumWrites = 0;
+  LatencyHistogram theOutputHolds;
+
+  std::vector<BenchOutput *> theOutputs;
+  for (UInt32 x = 0; x < inNumOutputs; x++) {
+    auto *theOutput = new BenchOutput(&theNumWrites, theNullFD, inConfig.fTimeOutputHolds ? &theOutputHolds : nullptr);
+    theStream->AddOutput(theOutput, -1);
+    theOutputs.push_back(theOutput);
+  }
+
+  // a reader of the packet ring on another thread (GetFirstPacketInfo and the like)
+  std::atomic_bool theReaderStop(false);
+  LatencyHistogram theReaderWaits;
+  std::thread theReader;
+  if (inConfig.fRunReader) {
+    theReader = std::thread([&]() {
+      while (!theReaderStop.load()) {
+        UInt64 theStart = NowNanos();
+        {
+          Core::MutexLocker locker(theStream->GetMutex());
+          theReaderWaits.Record((NowNanos() - theStart) / 1000);
+        }
+        ::usleep(1000);
+      }
+    });
+  }
+
+  BenchTrace theTrace(inConfig);
+  LatencyHistogram thePassHolds;
+  LatencyHistogram theIngestHolds;
+  Queue theFreeQueue;
+
+  SInt64 theStartTime = Core::Time::Milliseconds();
+  UInt32 theNumFrames = inConfig.fSeconds * inConfig.fFrameRate;
+  for (UInt32 theFrame = 0; theFrame < theNumFrames; theFrame++) {
+    SInt64 theDueTime = theStartTime + (SInt64) theFrame * 1000 / inConfig.fFrameRate;
+    SInt64 theCurrentTime = Core::Time::Milliseconds();
+    if (theDueTime > theCurrentTime)
+      ::usleep((useconds_t) (theDueTime - theCurrentTime) * 1000);
+
+    UInt64 theIngestStart = NowNanos();
+    {
+      Core::MutexLocker locker(theSocket->GetDemuxer()->GetMutex());
+      (void) theTrace.IngestFrame(theSocket, theFrame, Core::Time::Milliseconds());
+    }
+    theIngestHolds.Record((NowNanos() - theIngestStart) / 1000);
+
+    UInt64 theWritesBefore = theNumWrites;
+    UInt64 thePassStart = NowNanos();
+    {
+      Core::MutexLocker locker(theSocket->GetDemuxer()->GetMutex());
+      SInt64 theWakeupTime = 0;
+      theSender->ReflectPackets(&theWakeupTime, &theFreeQueue);
+    }
+    UInt64 thePassNanos = NowNanos() - thePassStart;
+
+    thePassHolds.Record(thePassNanos / 1000);
+    outResult->fNumPasses++;
+    outResult->fPassNanos += thePassNanos;
+    outResult->fNumWrites += theNumWrites - theWritesBefore;
+
+    // expired packets, the socket would keep them for reuse
+    while (theFreeQueue.GetLength() > 0)
+      delete (ReflectorPacket *) theFreeQueue.DeQueue()->GetEnclosingObject();
+  }
+
+  if (inConfig.fRunReader) {
+    theReaderStop.store(true);
+    theReader.join();
+  }
+
+  outResult->fPassHolds.Clear();
+  outResult->fPassHolds.Add(thePassHolds);
+  outResult->fIngestHolds.Clear();
+  outResult->fIngestHolds.Add(theIngestHolds);
+  outResult->fOutputHolds.Clear();
+  outResult->fOutputHolds.Add(theOutputHolds);
+  outResult->fReaderWaits.Clear();
+  outResult->fReaderWaits.Add(theReaderWaits);
+
+  for (BenchOutput *theOutput : theOutputs) {
+    theStream->RemoveOutput(theOutput);
+    theOutput->Detach();
+    theOutput->Release();
+  }
+
+  theSocket->RemoveSender(theSender);
+  delete theStream;
+
+  // the socket is a task and goes away with a kill event, there are no task
+  // threads here to deliver it. The process ends soon anyway.
+
+  if (theNullFD >= 0)
+    ::close(theNullFD);
+}
+
+static void PrintResult(const BenchConfig &inConfig, UInt32 inNumOutputs, const BenchResult &inResult) {
+  Float64 thePassSecs = (Float64) inResult.fPassNanos / 1000000000;
+  Float64 thePacketsPerSec = thePassSecs > 0 ? (Float64) inResult.fNumWrites / thePassSecs : 0;
+  Float64 theNanosPerPacket = inResult.fNumWrites > 0 ? (Float64) inResult.fPassNanos / (Float64) inResult.fNumWrites : 0;
+
+  ::printf("%8" _U32BITARG_ " %8" _U64BITARG_ " %12" _U64BITARG_ " %12.0f %10.1f %8" _U64BITARG_ " %8" _U64BITARG_
+           " %8" _U64BITARG_ " %8" _U64BITARG_,
+           inNumOutputs, inResult.fNumPasses, inResult.fNumWrites, thePacketsPerSec, theNanosPerPacket,
+           inResult.fPassHolds.GetPercentile(50), inResult.fPassHolds.GetPercentile(99),
+           inResult.fIngestHolds.GetPercentile(99), inResult.fPassHolds.GetMax());
+
+  if (inConfig.fTimeOutputHolds)
+    ::printf(" %10" _U64BITARG_, inResult.fOutputHolds.GetPercentile(99));
+  else
+    ::printf(" %10s", "-");
+
+  if (inConfig.fRunReader)
+    ::printf(" %10" _U64BITARG_, inResult.fReaderWaits.GetPercentile(99));
+  else
+    ::printf(" %10s", "-");
+
+  ::printf("\n");
+}
+
+static void usage() {
+  ::printf("usage: reflector_bench [-o outputs] [-b kbps] [-f fps] [-g frames] [-k ratio] [-s bytes] [-t secs] [-n] [-l] [-r]\n");
+  ::printf("-o: comma separated numbers of outputs to run with, default 1,10,100,1000,10000\n");
+  ::printf("-b: bit rate of the trace in kbit/s, default 2000\n");
+  ::printf("-f: frames per second, default 25\n");
+  ::printf("-g: frames per GOP, default 50\n");
+  ::printf("-k: size of a keyframe relative to the other frames, default 8\n");
+  ::printf("-s: RTP packet size in bytes, default 1400\n");
+  ::printf("-t: seconds per number of outputs, default 5\n");
+  ::printf("-n: write every packet to /dev/null instead of only counting it\n");
+  ::printf("-l: time the hold of each output's mutex (adds two clock reads per output and pass)\n");
+  ::printf("-r: run a reader thread that locks the stream's bucket mutex every msec\n");
+  ::printf("-h: Prints usage\n");
+}
+
+static bool ParseOutputs(char *inList, std::vector<UInt32> *outNumOutputs) {
+  outNumOutputs->clear();
+  for (char *theItem = ::strtok(inList, ","); theItem != nullptr; theItem = ::strtok(nullptr, ",")) {
+    int theNumOutputs = ::atoi(theItem);
+    if (theNumOutputs <= 0)
+      return false;
+    outNumOutputs->push_back((UInt32) theNumOutputs);
+  }
+  return !outNumOutputs->empty();
+}
+
+// reflector_bench runs in the CxxFramework entry like edss2, but never starts its threads
+CF_Error CFInit(int argc, char **argv) {
+  BenchConfig theConfig;
+  theConfig.fNumOutputs = {1, 10, 100, 1000, 10000};
+  theConfig.fBitRateKbps = 2000;
+  theConfig.fFrameRate = 25;
+  theConfig.fGOPFrames = 50;
+  theConfig.fKeyFrameRatio = 8;
+  theConfig.fPacketSize = 1400;
+  theConfig.fSeconds = 5;
+  theConfig.fWriteToNull = false;
+  theConfig.fTimeOutputHolds = false;
+  theConfig.fRunReader = false;
+
+  int ch;
+  while ((ch = getopt(argc, argv, "o:b:f:g:k:s:t:nlrh")) != EOF) { // opt: means requires option arg
+    switch (ch) {
+      case 'o':
+        if (!ParseOutputs(optarg, &theConfig.fNumOutputs)) {
+          usage();
+          return CF_FatalError;
+        }
+        break;
+      case 'b':theConfig.fBitRateKbps = (UInt32) ::atoi(optarg);
+        break;
+      case 'f':theConfig.fFrameRate = (UInt32) ::atoi(optarg);
+        break;
+      case 'g':theConfig.fGOPFrames = (UInt32) ::atoi(optarg);
+        break;
+      case 'k':theConfig.fKeyFrameRatio = (UInt32) ::atoi(optarg);
+        break;
+      case 's':theConfig.fPacketSize = (UInt32) ::atoi(optarg);
+        break;
+      case 't':theConfig.fSeconds = (UInt32) ::atoi(optarg);
+        break;
+      case 'n':theConfig.fWriteToNull = true;
+        break;
+      case 'l':theConfig.fTimeOutputHolds = true;
+        break;
+      case 'r':theConfig.fRunReader = true;
+        break;
+      case 'h':usage();
+        return CF_ShuttingDown;
+      default:usage();
+        return CF_FatalError;
+    }
+  }
+
+  if (theConfig.fBitRateKbps == 0 || theConfig.fFrameRate == 0 || theConfig.fFrameRate > 1000
+      || theConfig.fGOPFrames == 0 || theConfig.fKeyFrameRatio == 0 || theConfig.fSeconds == 0
+      || theConfig.fPacketSize <= BenchTrace::kRTPHeaderSize + BenchTrace::kFUHeaderSize
+      || theConfig.fPacketSize > BenchTrace::kMaxPacketSize) {
+    usage();
+    return CF_FatalError;
+  }
+
+  ::printf("trace: %" _U32BITARG_ " kbit/s, %" _U32BITARG_ " fps, GOP %" _U32BITARG_ " frames, keyframe x%" _U32BITARG_
+           ", %" _U32BITARG_ " byte packets, %s outputs\n",
+           theConfig.fBitRateKbps, theConfig.fFrameRate, theConfig.fGOPFrames, theConfig.fKeyFrameRatio,
+           theConfig.fPacketSize, theConfig.fWriteToNull ? "/dev/null" : "counting");
+  ::printf("%8s %8s %12s %12s %10s %8s %8s %8s %8s %10s %10s\n",
+           "outputs", "passes", "writes", "pkts/s", "ns/pkt", "pass50us", "pass99us", "ingst99us", "passmax",
+           "outhld99ns", "rdwait99us");
+
+  for (UInt32 theNumOutputs : theConfig.fNumOutputs) {
+    BenchResult theResult;
+    RunBench(theConfig, theNumOutputs, &theResult);
+    PrintResult(theConfig, theNumOutputs, theResult);
+  }
+
+  // nothing to run in the framework afterwards
+  return CF_ShuttingDown;
+}
+
+CF_Error CFExit(CF_Error exitCode) {
+  return exitCode == CF_FatalError ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -34,10 +34,34 @@
 #define _QTSSREFLECTORMODULE_H_
 
 #include "QTSS.h"
+#include "QTSServerStats.h"
 
 extern "C"
 {
 EXPORT QTSS_Error QTSSReflectorModule_Main(void *inPrivateArgs);
 }
 
+/**
+ * The numbers of one reflector session (fTrackID < 0) or of one of its streams,
+ * for other modules to report (GET /metrics of QTSSWebDebugModule)
+ */
+struct QTSSReflectorMetrics {
+  CF::StrPtrLen *fSessionName;
+  SInt32 fTrackID;
+
+  UInt32 fNumOutputs;       // session: clients watching, stream: outputs with a bookmark
+  UInt32 fBitRate;          // ingest bits per second
+  UInt64 fPacketCount;      // stream: packets received from the source
+  UInt32 fNumOutputsBehind; // stream: outputs waiting on a bookmark in the RTP ring
+  UInt64 fMaxOutputLag;     // stream: most RTP packets one of those is behind
+
+  QTSServerStats::Histograms fHistograms; // stream: send path histograms
+};
+
+typedef void (*QTSSReflectorMetricsProc)(QTSSReflectorMetrics *inMetrics, void *inCookie);
+
+// Calls inProc for every registered session, then for each of its streams. The
+// session map shard is locked meanwhile, inProc must not call into the reflector.
+void QTSSReflectorModule_GetMetrics(QTSSReflectorMetricsProc inProc, void *inCookie);
+
 #endif //_QTSSREFLECTORMODULE_H_
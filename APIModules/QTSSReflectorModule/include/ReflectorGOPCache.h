@@ -0,0 +1,68 @@
+/*
+    File:       ReflectorGOPCache.h
+
+    Contains:   The newest group of pictures of a ReflectorSender: the key
+                frame start (SPS/PPS/IDR for H.264) and everything queued
+                after it. The packets stay in the sender's packet ring, the
+                cache only pins the start so RemoveOldPackets keeps them, and
+                counts what it holds so a long GOP can't pin the ring forever.
+
+                New outputs start at GetStartIndex() and get the cached GOP at
+                line rate (DoPlay drops their buffer delay), then go on with
+                the live packets, so the first picture shows up right away.
+
+                Start/Append/Clear are called by the sender's socket only,
+                GetStartIndex may be called from any thread.
+*/
+
+#ifndef __REFLECTOR_GOP_CACHE_H__
+#define __REFLECTOR_GOP_CACHE_H__
+
+#include <atomic>
+
+#include "QTSS.h"
+
+class ReflectorPacket;
+class ReflectorPacketRing;
+
+class ReflectorGOPCache {
+ public:
+
+  explicit ReflectorGOPCache(ReflectorPacketRing *inRing);
+
+  // Drops the current GOP and starts a new one at inIndex (a key frame start),
+  // unless inIndex is still part of the first frame of the current one
+  void Start(UInt64 inIndex);
+
+  // Counts a packet queued after the start, drops the GOP once it is over the limits
+  void Append(ReflectorPacket *inPacket);
+
+  void Clear();
+
+  // ReflectorPacketRing::kInvalidIndex if there is no GOP to start with
+  UInt64 GetStartIndex() { return fStartIndex.load(std::memory_order_acquire); }
+
+  UInt32 GetNumBytes() { return fNumBytes; }
+
+  UInt32 GetNumFrames() { return fNumFrames; }
+
+  // reflector_gop_cache, reflector_gop_cache_max_kbytes, reflector_gop_cache_max_frames,
+  // a limit of 0 means none
+  static void SetLimits(bool enabled, UInt32 inMaxBytes, UInt32 inMaxFrames);
+
+  static bool IsEnabled() { return sEnabled; }
+
+ private:
+
+  ReflectorPacketRing *fRing;
+  std::atomic<UInt64> fStartIndex;
+  UInt32 fNumBytes;
+  UInt32 fNumFrames;
+  UInt32 fStartRTPTime;
+
+  static bool sEnabled;
+  static UInt32 sMaxBytes;
+  static UInt32 sMaxFrames;
+};
+
+#endif //__REFLECTOR_GOP_CACHE_H__
@@ -37,31 +37,65 @@
 #ifndef __REFLECTOR_OUTPUT_H__
 #define __REFLECTOR_OUTPUT_H__
 
+#include <atomic>
+
 #include <CF/Core/Mutex.h>
 #include <CF/StrPtrLen.h>
 #include <CF/Queue.h>
 
 #include "QTSS.h"
 
+class ReflectorPacket;
+class ReflectorPacketRing;
+
 class ReflectorOutput {
  public:
 
   ReflectorOutput()
-      : fBookmarkedPacketsElemsArray(nullptr), fNumBookmarks(0), fAvailPosition(0),
-        fLastIntervalMilliSec(5), fLastPacketTransmitTime(0) {}
+      : fBookmarkedPackets(nullptr), fNumBookmarks(0),
+        fLastIntervalMilliSec(5), fLastPacketTransmitTime(0),
+        fNumRetransmits(0), fRetransmitTokens(0), fRetransmitRefillTime(0),
+        fRefCount(1), fDetached(false) {}
 
   virtual ~ReflectorOutput() {
-    if (fBookmarkedPacketsElemsArray) {
-      ::memset(fBookmarkedPacketsElemsArray, 0, sizeof(CF::QueueElem *) * fNumBookmarks);
-      delete[] fBookmarkedPacketsElemsArray;
-    }
+    delete[] fBookmarkedPackets;
+  }
+
+  //
+  // LIFETIME
+  //
+  // The ReflectorStreams publish their outputs in snapshots that the send loops
+  // walk without a stream lock, each snapshot holds a reference. The creator owns
+  // the first reference and gives it up with Release() instead of delete.
+
+  void AddRef() { fRefCount.fetch_add(1); }
+
+  void Release() {
+    if (fRefCount.fetch_sub(1) == 1)
+      delete this;
+  }
+
+  // Called once the output is out of every stream. Waits for a WritePacket
+  // in progress on this output only, after that the send loops skip it.
+  void Detach() {
+    CF::Core::MutexLocker locker(&fMutex);
+    fDetached = true;
   }
 
-  // an array of packet elements ( from fPacketQueue in ReflectorSender )
+  // call with fMutex held
+  bool IsDetached() { return fDetached; }
+
+  // a position in the packet ring of a ReflectorSender. The entry is claimed by one
+  // ring for the lifetime of the output and only written by that ring's send loop.
+  struct BookMark {
+    std::atomic<ReflectorPacketRing *> fRing; // nullptr for a free entry
+    std::atomic<UInt64> fIndex;               // 0 for no bookmark
+  };
+
+  // an array of packet positions ( in fPacketRing of ReflectorSender )
   // possibly one for each ReflectorSender that sends data to this ReflectorOutput
-  CF::QueueElem **fBookmarkedPacketsElemsArray;
+  BookMark *fBookmarkedPackets;
   UInt32 fNumBookmarks;
-  SInt32 fAvailPosition;
   QTSS_TimeVal fLastIntervalMilliSec;
   QTSS_TimeVal fLastPacketTransmitTime;
   CF::Core::Mutex fMutex;
@@ -94,27 +128,63 @@ class ReflectorOutput {
   //end add
 
 
-  inline CF::QueueElem *GetBookMarkedPacket(CF::Queue *thePacketQueue);
+  // Takes the bookmark of this ring out of the array, 0 if there is none.
+  // The index may have expired meanwhile, check it with ReflectorPacketRing::Contains.
+  inline UInt64 GetBookMarkedPacket(ReflectorPacketRing *thePacketRing);
 
-  inline bool SetBookMarkPacket(CF::QueueElem *thePacketElemPtr);
+  // The bookmark of this ring left in place, 0 if there is none. For statistics
+  // from other threads, the send loop may take or move it at any time.
+  inline UInt64 PeekBookMarkedPacket(ReflectorPacketRing *thePacketRing);
+
+  // false if every entry is claimed by other rings
+
+  inline bool SetBookMarkPacket(ReflectorPacketRing *thePacketRing, UInt64 thePacketIndex);
 
   /**
    * 将 Packet 通过 inStreamCookie 标记的 RTPStream 发送出去
    *
-   * @param inPacket  the packet contents
+   * @param inPacket  the packet, its data is shared by all outputs and must not be modified
    * @param inStreamCookie  the cookie of the stream to which it will be written
    * @param inFlags  the QTSS API write flags (qtssWriteFlagsIsRTP or qtssWriteFlagsIsRTCP)
    * @param packetLatenessInMSec  how many MSec's late this packet is in being delivered (<0 if its early)
+   * @param outWritten  set to true when the packet was written to the client, left alone when it
+   *                    was skipped (already sent, filtered, thinned) although QTSS_NoErr is returned
    *
    * @return QTSS_WouldBlock  timeToSendThisPacketAgain will be set to # of msec in which the packet can be sent
    * @return -1  unknown
    */
-  virtual QTSS_Error WritePacket(CF::StrPtrLen *inPacket, void *inStreamCookie, UInt32 inFlags,
+  virtual QTSS_Error WritePacket(ReflectorPacket *inPacket, void *inStreamCookie, UInt32 inFlags,
                                  SInt64 packetLatenessInMSec, SInt64 *timeToSendThisPacketAgain,
-                                 UInt64 *packetIDPtr, SInt64 *arrivalTimeMSec, bool firstPacket) = 0;
+                                 bool firstPacket, bool *outWritten) = 0;
 
   virtual void TearDown() = 0;
 
+  // Ends a run of WritePackets, called by the send loop with fMutex held before
+  // the packets can go away. Writes may keep references to the packets until then.
+  virtual void Flush() {}
+
+  //
+  // RETRANSMISSION
+  //
+  // Lost packets reported by the client (RTCP generic NACK) are queued here by
+  // the RTCP thread and re-sent by the send loop of the stream, straight from
+  // its packet ring.
+
+  enum {
+    kMaxPendingRetransmits = 64 // requests beyond this are dropped
+  };
+
+  // Queues the lost sequence numbers of the stream inStreamCookie, inSSRC is the media source
+  inline void RequestRetransmits(void *inStreamCookie, UInt32 inSSRC, const UInt16 *inSeqNums, UInt32 inNumSeqNums);
+
+  // Takes the queued requests of the stream that inMaxPerSec still allows for this
+  // client, the rest of the stream's requests are dropped. Returns the number taken.
+  inline UInt32 TakeRetransmits(void *inStreamCookie, UInt32 inMaxPerSec, SInt64 inCurrentTime,
+                                UInt32 *outSSRC, UInt16 *outSeqNums, UInt32 inMaxSeqNums);
+
+  // Sends an already sent packet again, call from the send loop with fMutex held
+  virtual QTSS_Error RetransmitPacket(ReflectorPacket *inPacket, void *inStreamCookie) { return QTSS_Unimplemented; }
+
   virtual bool IsUDP() = 0;
 
   virtual bool IsPlaying() = 0;
@@ -129,57 +199,147 @@ class ReflectorOutput {
     // need 2 bookmarks for each stream ( include RTCPs )
     UInt32 numBookmarks = numStreams * 2;
 
-    fBookmarkedPacketsElemsArray = new CF::QueueElem *[numBookmarks];
-    ::memset(fBookmarkedPacketsElemsArray, 0, sizeof(CF::QueueElem *) * (numBookmarks));
+    fBookmarkedPackets = new BookMark[numBookmarks];
+    for (UInt32 i = 0; i < numBookmarks; i++) {
+      fBookmarkedPackets[i].fRing = nullptr;
+      fBookmarkedPackets[i].fIndex = 0;
+    }
 
-    //DT("fBookmarkedPacketsElemsArray[-1] %p= %p", &fBookmarkedPacketsElemsArray[-1], fBookmarkedPacketsElemsArray[-1]);
     fNumBookmarks = numBookmarks;
   }
 
+ private:
+
+  inline BookMark *FindBookMark(ReflectorPacketRing *thePacketRing, bool claim);
+
+  struct Retransmit {
+    void *fStreamCookie;
+    UInt32 fSSRC;
+    UInt16 fSeqNum;
+  };
+
+  CF::Core::Mutex fRetransmitMutex; // protects the fields below, never held while sending
+  Retransmit fRetransmits[kMaxPendingRetransmits];
+  UInt32 fNumRetransmits;
+  UInt32 fRetransmitTokens; // token bucket of the per client rate limit
+  SInt64 fRetransmitRefillTime;
+
+  std::atomic_uint fRefCount;
+  bool fDetached; // protected by fMutex
 };
 
-bool ReflectorOutput::SetBookMarkPacket(CF::QueueElem *thePacketElemPtr) {
-  if (fAvailPosition != -1 && thePacketElemPtr) {
-    fBookmarkedPacketsElemsArray[fAvailPosition] = thePacketElemPtr;
+/**
+ * 查找属于该 ring 的书签，claim 为 true 时没有则原子地占用一个空位
+ */
+ReflectorOutput::BookMark *ReflectorOutput::FindBookMark(ReflectorPacketRing *thePacketRing, bool claim) {
+  Assert(thePacketRing != nullptr);
 
-    // 定位到另一个的可用位置
-    for (UInt32 i = 0; i < fNumBookmarks; i++) {
-      if (fBookmarkedPacketsElemsArray[i] == nullptr) {
-        fAvailPosition = i;
-        return true;
-      }
+  for (UInt32 curBookmark = 0; curBookmark < fNumBookmarks; curBookmark++) {
+    BookMark &bookmark = fBookmarkedPackets[curBookmark];
+    ReflectorPacketRing *theRing = bookmark.fRing.load(std::memory_order_acquire);
+    if (theRing == thePacketRing)
+      return &bookmark;
+
+    if (theRing == nullptr) { // entries are claimed in order, the rest are free too
+      if (!claim)
+        return nullptr;
+      if (bookmark.fRing.compare_exchange_strong(theRing, thePacketRing, std::memory_order_acq_rel)
+          || theRing == thePacketRing)
+        return &bookmark;
+      // lost the entry to another ring, keep looking
     }
   }
 
-  return false;
+  return nullptr;
 }
 
-CF::QueueElem *ReflectorOutput::GetBookMarkedPacket(CF::Queue *thePacketQueue) {
-  Assert(thePacketQueue != nullptr);
+bool ReflectorOutput::SetBookMarkPacket(ReflectorPacketRing *thePacketRing, UInt64 thePacketIndex) {
+  if (thePacketIndex == 0)
+    return false;
 
-  CF::QueueElem *packetElem = nullptr;
+  BookMark *bookmark = this->FindBookMark(thePacketRing, true);
+  if (bookmark == nullptr)
+    return false;
 
-  fAvailPosition = -1;
+  bookmark->fIndex.store(thePacketIndex, std::memory_order_release);
+  return true;
+}
 
+UInt64 ReflectorOutput::GetBookMarkedPacket(ReflectorPacketRing *thePacketRing) {
   // see if we've bookmarked a held packet for this Sender in this Output
-  for (UInt32 curBookmark = 0; curBookmark < fNumBookmarks; curBookmark++) {
-    CF::QueueElem *bookmarkedElem = fBookmarkedPacketsElemsArray[curBookmark];
-    if (bookmarkedElem) {  // there may be holes in this array
-      if (bookmarkedElem->IsMember(*thePacketQueue)) {
-        // this packet was previously bookmarked for this specific queue
-        // remove if from the bookmark list and use it
-        // to jump ahead into the Sender's over all packet queue
-        fBookmarkedPacketsElemsArray[curBookmark] = nullptr;
-        fAvailPosition = curBookmark;
-        packetElem = bookmarkedElem;
-        break;
-      }
-    } else {
-      fAvailPosition = curBookmark;
+  BookMark *bookmark = this->FindBookMark(thePacketRing, false);
+  if (bookmark == nullptr)
+    return 0;
+
+  // remove if from the bookmark list and use it
+  // to jump ahead into the Sender's over all packet ring
+  return bookmark->fIndex.exchange(0, std::memory_order_acq_rel);
+}
+
+UInt64 ReflectorOutput::PeekBookMarkedPacket(ReflectorPacketRing *thePacketRing) {
+  BookMark *bookmark = this->FindBookMark(thePacketRing, false);
+  if (bookmark == nullptr)
+    return 0;
+
+  return bookmark->fIndex.load(std::memory_order_acquire);
+}
+
+void ReflectorOutput::RequestRetransmits(void *inStreamCookie, UInt32 inSSRC,
+                                         const UInt16 *inSeqNums, UInt32 inNumSeqNums) {
+  CF::Core::MutexLocker locker(&fRetransmitMutex);
+
+  for (UInt32 i = 0; i < inNumSeqNums && fNumRetransmits < kMaxPendingRetransmits; i++) {
+    bool isPending = false;
+    for (UInt32 j = 0; j < fNumRetransmits && !isPending; j++)
+      isPending = fRetransmits[j].fStreamCookie == inStreamCookie && fRetransmits[j].fSeqNum == inSeqNums[i];
+    if (isPending) // clients repeat a NACK until the packet shows up
+      continue;
+
+    Retransmit &theRetransmit = fRetransmits[fNumRetransmits++];
+    theRetransmit.fStreamCookie = inStreamCookie;
+    theRetransmit.fSSRC = inSSRC;
+    theRetransmit.fSeqNum = inSeqNums[i];
+  }
+}
+
+UInt32 ReflectorOutput::TakeRetransmits(void *inStreamCookie, UInt32 inMaxPerSec, SInt64 inCurrentTime,
+                                        UInt32 *outSSRC, UInt16 *outSeqNums, UInt32 inMaxSeqNums) {
+  CF::Core::MutexLocker locker(&fRetransmitMutex);
+  if (fNumRetransmits == 0)
+    return 0;
+
+  // refill, a second worth of tokens at most
+  if (fRetransmitRefillTime == 0) {
+    fRetransmitTokens = inMaxPerSec;
+    fRetransmitRefillTime = inCurrentTime;
+  } else if (inCurrentTime > fRetransmitRefillTime) {
+    UInt64 theEarned = (UInt64) (inCurrentTime - fRetransmitRefillTime) * inMaxPerSec / 1000;
+    if (theEarned > 0) { // otherwise keep counting from the last refill
+      UInt64 theTokens = fRetransmitTokens + theEarned;
+      fRetransmitTokens = (UInt32) (theTokens < inMaxPerSec ? theTokens : inMaxPerSec);
+      fRetransmitRefillTime = inCurrentTime;
+    }
+  }
+
+  UInt32 theCount = 0;
+  UInt32 theNumKept = 0;
+  for (UInt32 i = 0; i < fNumRetransmits; i++) {
+    Retransmit &theRetransmit = fRetransmits[i];
+    if (theRetransmit.fStreamCookie != inStreamCookie) {
+      fRetransmits[theNumKept++] = theRetransmit; // another stream's, it takes its own
+      continue;
+    }
+
+    if (theCount < inMaxSeqNums && fRetransmitTokens > 0) {
+      outSSRC[theCount] = theRetransmit.fSSRC;
+      outSeqNums[theCount] = theRetransmit.fSeqNum;
+      theCount++;
+      fRetransmitTokens--;
     }
   }
+  fNumRetransmits = theNumKept;
 
-  return packetElem;
+  return theCount;
 }
 
 #endif //__REFLECTOR_OUTPUT_H__
@@ -0,0 +1,145 @@
+/*
+    File:       ReflectorPacketPool.h
+
+    Contains:   Slab backed, reference counted packet buffers shared by the
+                reflector ingest path and all of its outputs.
+
+                A packet is written once into a slab when it arrives (either
+                by recvfrom or by ReflectorStream::PushPackets), then every
+                ReflectorOutput reads the same bytes. Buffers are carved out
+                of a slab back to back, sized to the real packet length, so
+                a 200 byte audio packet costs 200 bytes, not 2 KB.
+
+                Packets age out of the sender queues roughly in arrival
+                order, so a slab is normally released as a whole and reused.
+*/
+
+#ifndef __REFLECTOR_PACKET_POOL_H__
+#define __REFLECTOR_PACKET_POOL_H__
+
+#include <atomic>
+
+#include <CF/Core/Mutex.h>
+#include <CF/Queue.h>
+
+#include "QTSS.h"
+
+class ReflectorPacketPool;
+class ReflectorPacketSlab;
+
+/**
+ * 引用计数的包缓冲区，头部之后紧跟包数据
+ *
+ * @note 入口处写入一次，之后只读，可被任意多个 Output 共享
+ */
+class ReflectorPacketBuffer {
+ public:
+
+  char *GetData() { return reinterpret_cast<char *>(this) + kHeaderSize; }
+
+  UInt32 GetLength() { return fLength; }
+
+  void AddRef() { fRefCount.fetch_add(1); }
+
+  // The last Release gives the space back to the owning slab.
+  void Release();
+
+  enum {
+    kAlignment = 16,
+    kHeaderSize = 32 // keep >= sizeof(ReflectorPacketBuffer) and a multiple of kAlignment
+  };
+
+ private:
+
+  ReflectorPacketBuffer(ReflectorPacketSlab *inSlab, UInt32 inLength)
+      : fSlab(inSlab), fLength(inLength), fRefCount(1) {}
+
+  ~ReflectorPacketBuffer() = default;
+
+  ReflectorPacketSlab *fSlab;
+  UInt32 fLength;
+  std::atomic_uint fRefCount;
+
+  friend class ReflectorPacketPool;
+};
+
+/**
+ * 包缓冲区池
+ *
+ * Reserve/Commit/Acquire must be serialized by the owner (the ReflectorSocket
+ * calls them with its demuxer mutex held). Release may happen on any thread.
+ *
+ * The owner never deletes the pool, it calls Detach() and the pool deletes
+ * itself once the last outstanding buffer has been released.
+ */
+class ReflectorPacketPool {
+ public:
+
+  enum {
+    kSlabSize = 64 * 1024,
+    kMaxFreeSlabs = 4 // free slabs kept around for reuse, the rest go back to the heap
+  };
+
+  struct Stats {
+    UInt32 fNumSlabs;       // slabs allocated
+    UInt32 fNumFreeSlabs;   // allocated but empty
+    UInt32 fNumBuffers;     // live packet buffers
+    UInt32 fBytesInUse;     // payload bytes held by live buffers
+    UInt32 fBytesAllocated; // fNumSlabs * kSlabSize
+    UInt32 fMaxSlabs;       // high water mark of fNumSlabs
+  };
+
+  ReflectorPacketPool();
+
+  void Detach();
+
+  // Returns a writable region of at least inMaxLen bytes, or nullptr if inMaxLen
+  // can never fit in a slab. Only the last reservation can be committed.
+  char *Reserve(UInt32 inMaxLen);
+
+  // Turns the first inLen bytes of the last reservation into a buffer with a
+  // reference count of 1. inLen == 0 abandons the reservation.
+  ReflectorPacketBuffer *Commit(UInt32 inLen);
+
+  // Reserves inCount receive slots of inMaxLen bytes each for a batched receive.
+  // Slot i starts at the returned pointer + i * GetSlotStride(inMaxLen).
+  char *ReserveSlots(UInt32 inCount, UInt32 inMaxLen);
+
+  // Commits inLen bytes received into inSlot. Slots must be committed in
+  // ascending order; the data is moved down next to the previous buffer so
+  // short packets don't hold on to a whole slot.
+  ReflectorPacketBuffer *CommitSlot(char *inSlot, UInt32 inLen);
+
+  static UInt32 GetSlotStride(UInt32 inMaxLen);
+
+  // Reserve + copy + Commit, for data that did not come from a reservation.
+  ReflectorPacketBuffer *Acquire(char *inData, UInt32 inLen);
+
+  void GetStats(Stats *outStats);
+
+ private:
+
+  ~ReflectorPacketPool();
+
+  ReflectorPacketSlab *GetFreeSlab();
+
+  void RetireCurrentSlab();
+
+  void ReleaseBuffer(ReflectorPacketBuffer *inBuffer);
+
+  void RecycleSlab(ReflectorPacketSlab *inSlab);
+
+  CF::Core::Mutex fMutex; // protects fFreeSlabs, fNumSlabs, fDetached
+  CF::Queue fFreeSlabs;
+  ReflectorPacketSlab *fCurrentSlab; // slab being filled, owned by the producer
+  UInt32 fNumSlabs;
+  UInt32 fMaxSlabs;
+  bool fDetached;
+
+  std::atomic_uint fNumBuffers;
+  std::atomic_uint fBytesInUse;
+
+  friend class ReflectorPacketBuffer;
+};
+
+#endif //__REFLECTOR_PACKET_POOL_H__
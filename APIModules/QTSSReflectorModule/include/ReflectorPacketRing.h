@@ -0,0 +1,121 @@
+/*
+    File:       ReflectorPacketRing.h
+
+    Contains:   Packet queue of a ReflectorSender. Packets live in a contiguous
+                ring of slots addressed by monotonically increasing 64 bit
+                indices, so a position in the stream (a bookmark, the newest
+                key frame, the first new packet) is just a number that stays
+                valid until the packet expires.
+
+                Arrival times only grow, so "first packet younger than X" is
+                a binary search, and key frame starts are kept in their own
+                small index.
+
+                Writers (ingest appends, expiry pops) are serialized by the
+                sender's socket. Readers on other threads (the fan-out
+                shards) may walk the ring while it is appended to or grown:
+                head and tail are atomic and a grown-out slot array is kept
+                until the ring goes away, so a reader never sees freed
+                slots. The owner must keep readers out while popping.
+*/
+
+#ifndef __REFLECTOR_PACKET_RING_H__
+#define __REFLECTOR_PACKET_RING_H__
+
+#include <atomic>
+
+#include "QTSS.h"
+
+class ReflectorPacket;
+
+class ReflectorPacketRing {
+ public:
+
+  enum {
+    kInitialCapacity = 1024, // power of 2
+    kMaxKeyFrames = 64,      // key frame starts remembered, oldest dropped first
+    kSeqNumSearchWindow = 16 // packets looked at on each side of the guess in FindSeqNum
+  };
+
+  // indices start at 1, so 0 never names a packet
+  static const UInt64 kInvalidIndex = 0;
+
+  ReflectorPacketRing();
+  ~ReflectorPacketRing(); // doesn't delete the packets, the owner pops them first
+
+  //
+  // ACCESSORS
+
+  // oldest packet in the ring
+  UInt64 GetHeadIndex() { return fHead.load(std::memory_order_acquire); }
+
+  // one past the newest packet
+  UInt64 GetTailIndex() { return fTail.load(std::memory_order_acquire); }
+
+  UInt32 GetLength() { return static_cast<UInt32>(this->GetTailIndex() - this->GetHeadIndex()); }
+
+  bool IsEmpty() { return this->GetLength() == 0; }
+
+  bool IsFull() { return this->GetLength() == fSlots.load(std::memory_order_relaxed)->fCapacity; }
+
+  bool Contains(UInt64 inIndex) { return inIndex >= this->GetHeadIndex() && inIndex < this->GetTailIndex(); }
+
+  // nullptr if the index has expired or not arrived yet
+  ReflectorPacket *Get(UInt64 inIndex) {
+    if (!this->Contains(inIndex))
+      return nullptr;
+
+    // loaded after the tail, so it holds every index below it
+    SlotArray *theSlots = fSlots.load(std::memory_order_acquire);
+    return theSlots->fSlots[inIndex & (theSlots->fCapacity - 1)];
+  }
+
+  ReflectorPacket *GetOldest() { return this->Get(this->GetHeadIndex()); }
+
+  // First index whose packet arrived at or after inTimeArrived, GetTailIndex() if none. O(log n)
+  UInt64 LowerBoundTimeArrived(SInt64 inTimeArrived);
+
+  // Index of the RTP packet with this ssrc and sequence number, kInvalidIndex if it has
+  // expired or never arrived. Guessed from the newest packet, a little reordering is fine.
+  UInt64 FindSeqNum(UInt32 inSSRC, UInt16 inSeqNum);
+
+  //
+  // MODIFIERS
+
+  // Doubles the capacity, readers keep using the old slots until they reload
+  void Grow();
+
+  // Appends the packet and returns its index, the ring must not be full
+  UInt64 PushBack(ReflectorPacket *inPacket);
+
+  // Removes and returns the oldest packet
+  ReflectorPacket *PopFront();
+
+  //
+  // KEY FRAME INDEX, writers only (it is not safe for the fan-out shards)
+
+  void AddKeyFrame(UInt64 inIndex);
+
+  // Key frame starts at or after inIndex, oldest first. Returns the number copied to outIndexes.
+  UInt32 GetKeyFramesFrom(UInt64 inIndex, UInt64 *outIndexes, UInt32 inMaxIndexes);
+
+ private:
+
+  void ExpireKeyFrames();
+
+  struct SlotArray {
+    ReflectorPacket **fSlots;
+    UInt32 fCapacity; // power of 2
+    SlotArray *fRetired; // older, smaller arrays that readers may still be using
+  };
+
+  std::atomic<SlotArray *> fSlots;
+  std::atomic<UInt64> fHead;
+  std::atomic<UInt64> fTail;
+
+  UInt64 fKeyFrames[kMaxKeyFrames]; // ring of key frame indices, ascending
+  UInt32 fKeyFrameHead;
+  UInt32 fNumKeyFrames;
+};
+
+#endif //__REFLECTOR_PACKET_RING_H__
@@ -163,11 +163,12 @@ class ReflectorSession : public CF::Thread::Task {
   // and therefore mux the cookie to the right output stream.
   void *GetStreamCookie(UInt32 inStreamID);
 
-  //Reflector quality levels:
+  //Reflector quality levels, H.264/H.265 video is thinned by whole frames:
   enum {
-    kAudioOnlyQuality = 1,      //UInt32
     kNormalQuality = 0,         //UInt32
-    kNumQualityLevels = 2       //UInt32
+    kNoDisposableQuality = 1,   //UInt32 drops the frames no other frame refers to
+    kKeyFramesOnlyQuality = 2,  //UInt32 and everything up to the next key frame
+    kNumQualityLevels = 3       //UInt32
   };
 
   SInt64 GetInitTimeMS() { return fInitTimeMS; }
@@ -34,6 +34,9 @@
 #ifndef _REFLECTOR_STREAM_H_
 #define _REFLECTOR_STREAM_H_
 
+#include <atomic>
+#include <cstring>
+
 #include <CF/Thread/IdleTask.h>
 #include <CF/Net/Socket/UDPSocket.h>
 #include <CF/Net/Socket/UDPSocketPool.h>
@@ -48,64 +51,116 @@
 #include "ReflectorOutput.h"
 
 #include "RTPProtocol.h"
-
-/*fantasy add this*/
-#include "KeyFrameCache.h"
+#include "ReflectorPacketPool.h"
+#include "ReflectorPacketRing.h"
+#include "ReflectorGOPCache.h"
+#include "QTSServerStats.h"
 
 //This will add some printfs that are useful for checking the thinning
 #define REFLECTOR_THINNING_DEBUGGING 0
-#define MAX_CACHE_SIZE  (1024*1024*2)
 
 //Define to use new potential workaround for NAT problems
 #define NAT_WORKAROUND 1
 
 class ReflectorPacket;
 class ReflectorSender;
+class ReflectorShard;
+class ReflectorOutputSnapshot;
 class ReflectorStream;
 class RTPSessionOutput;
 class ReflectorSession;
 
 
+/**
+ * 入口处解析一次的包头信息
+ *
+ * Filled by ReflectorSocket::ProcessPacket before the packet is queued, so
+ * the per-output code reads decoded fields instead of the raw header.
+ */
+struct ReflectorPacketInfo {
+  UInt32 fSSRC;
+  UInt32 fRTPTime;       // RTP timestamp, for an RTCP SR the RTP time of the report
+  UInt16 fSeqNum;        // RTP only
+  UInt8 fPayloadType;    // RTP only
+  UInt8 fNALUType;       // first NAL unit type starting in the packet (H.264/H.265), 0 if none
+  bool fMarker;          // RTP only
+  bool fIsKeyFrameStart; // first packet of a key frame (parameter sets or IDR/IRAP)
+  bool fIsFrameStart;    // first packet with this RTP timestamp in the sender's ring
+  bool fIsDisposable;    // no other frame refers to it (H.264 nal_ref_idc 0, H.265 sub-layer non-reference)
+};
+
 class ReflectorPacket {
  public:
 
-  ReflectorPacket() : fQueueElem() {
+  ReflectorPacket() : fQueueElem(), fPacketBuffer(nullptr) {
     fQueueElem.SetEnclosingObject(this);
     this->Reset();
   }
 
   /**
-   * make packet ready to reuse
+   * make packet ready to reuse, drop the reference of packet data
    * @note fQueueElem is always point to this
    */
   void Reset() {
     fBucketsSeenThisPacket = 0;
     fTimeArrived = 0;
-    fPacketPtr.Set(fPacketData, 0);
     fIsRTCP = false;
     fStreamCountID = 0;
     fNeededByOutput = false;
+    fLatencyRecorded = false;
+    ::memset(&fInfo, 0, sizeof(fInfo));
+    if (fPacketBuffer != nullptr) {
+      fPacketBuffer->Release();
+      fPacketBuffer = nullptr;
+    }
+    fPacketPtr.Set(nullptr, 0);
   }
 
-  ~ReflectorPacket() = default;
-
-  void SetPacketData(char *data, UInt32 len, bool isRTCP) {
-    Assert(kMaxReflectorPacketSize > len);
+  ~ReflectorPacket() { this->Reset(); }
 
-    if (len > kMaxReflectorPacketSize)
-      len = kMaxReflectorPacketSize;
-
-    if (len > 0)
-      memcpy(this->fPacketPtr.Ptr, data, len);
-    this->fPacketPtr.Len = len;
+  /**
+   * attach packet data, the packet takes over the caller's reference of inBuffer
+   */
+  void SetPacketBuffer(ReflectorPacketBuffer *inBuffer, bool isRTCP) {
+    Assert(fPacketBuffer == nullptr);
+
+    fPacketBuffer = inBuffer;
+    if (inBuffer != nullptr)
+      this->fPacketPtr.Set(inBuffer->GetData(), inBuffer->GetLength());
+    else
+      this->fPacketPtr.Set(nullptr, 0);
     this->fIsRTCP = isRTCP;
   }
 
+  ReflectorPacketBuffer *GetPacketBuffer() { return fPacketBuffer; }
+
+  CF::StrPtrLen *GetPacketPtr() { return &fPacketPtr; }
+
+  UInt64 GetStreamCountID() { return fStreamCountID; }
+
+  SInt64 GetTimeArrived() { return fTimeArrived; }
+
   bool IsRTCP() { return fIsRTCP; }
 
-  inline UInt32 GetPacketRTPTime();
-  inline UInt16 GetPacketRTPSeqNum();
-  inline UInt32 GetSSRC();
+  // Decodes the RTP/RTCP header into fInfo, called once at ingest
+  inline void ParseHeader();
+
+  ReflectorPacketInfo *GetInfo() { return &fInfo; }
+
+  UInt32 GetPacketRTPTime() { return fInfo.fRTPTime; }
+  UInt16 GetPacketRTPSeqNum() { Assert(!fIsRTCP); return fInfo.fSeqNum; }
+  UInt32 GetSSRC() { return fInfo.fSSRC; }
+  bool IsKeyFrameStart() { return fInfo.fIsKeyFrameStart; }
+  bool IsFrameStart() { return fInfo.fIsFrameStart; }
+  bool IsDisposable() { return fInfo.fIsDisposable; }
+  bool IsMarker() { return fInfo.fMarker; }
+
+  // true for the first output (of any shard) to write this packet, which records its send latency
+  bool TakeLatencySample() {
+    return !fLatencyRecorded.load(std::memory_order_relaxed)
+        && !fLatencyRecorded.exchange(true, std::memory_order_relaxed);
+  }
+
   inline SInt64 GetPacketNTPTime();
 
  private:
@@ -118,55 +173,46 @@ class ReflectorPacket {
   SInt64 fTimeArrived;
   UInt32 fBucketsSeenThisPacket;
   bool fIsRTCP; // the first field we set at beginning of ReflectorSocket::ProcessPacket
-  bool fNeededByOutput; // is this packet still needed for output?
+  ReflectorPacketInfo fInfo;
+  std::atomic_bool fNeededByOutput; // is this packet still needed for output? set by the fan-out shards too
+  std::atomic_bool fLatencyRecorded; // see TakeLatencySample
 
   CF::QueueElem fQueueElem;
 
-  CF::StrPtrLen fPacketPtr;
-  char fPacketData[kMaxReflectorPacketSize];
+  CF::StrPtrLen fPacketPtr; // points into fPacketBuffer, Len may be trimmed after ingest
+  ReflectorPacketBuffer *fPacketBuffer;
 
   friend class ReflectorSender;
   friend class ReflectorSocket;
   friend class RTPSessionOutput;
+  friend class ReflectorGOPCache;
 };
 
-UInt32 ReflectorPacket::GetSSRC() {
-  if (fPacketPtr.Ptr == nullptr) return 0;
+void ReflectorPacket::ParseHeader() {
+  ::memset(&fInfo, 0, sizeof(fInfo));
+  if (fPacketPtr.Ptr == nullptr) return;
 
-  auto *theSsrcPtr = (UInt32 *) fPacketPtr.Ptr;
+  auto *theHeader = (UInt32 *) fPacketPtr.Ptr;
 
   if (fIsRTCP) {
-    if (fPacketPtr.Len < 8) return 0;
-    return ntohl(theSsrcPtr[1]); // RTCP
+    if (fPacketPtr.Len >= 8)
+      fInfo.fSSRC = ntohl(theHeader[1]);
+    if (fPacketPtr.Len >= 20)
+      fInfo.fRTPTime = ntohl(theHeader[4]); // RTP timestamp of the SR
   } else {
-    if (fPacketPtr.Len < 12) return 0;
-    return ntohl(theSsrcPtr[2]); // RTP SSRC
+    if (fPacketPtr.Len >= 4) {
+      auto *theBytes = (UInt8 *) fPacketPtr.Ptr;
+      fInfo.fMarker = (theBytes[1] & 0x80) != 0;
+      fInfo.fPayloadType = static_cast<UInt8>(theBytes[1] & 0x7F);
+      fInfo.fSeqNum = ntohs(((UInt16 *) fPacketPtr.Ptr)[1]); //The RTP sequenc number is the second short of the packet
+    }
+    if (fPacketPtr.Len >= 8)
+      fInfo.fRTPTime = ntohl(theHeader[1]); //The RTP timestamp number is the second long of the packet
+    if (fPacketPtr.Len >= 12)
+      fInfo.fSSRC = ntohl(theHeader[2]);
   }
 }
 
-UInt32 ReflectorPacket::GetPacketRTPTime() {
-  if (fPacketPtr.Ptr == nullptr) return 0;
-
-  auto *theTimestampPtr = (UInt32 *) fPacketPtr.Ptr;
-
-  if (!fIsRTCP) {
-    //The RTP timestamp number is the second long of the packet
-    if (fPacketPtr.Len < 8) return 0;
-    return ntohl(theTimestampPtr[1]);
-  } else {
-    if (fPacketPtr.Len < 20) return 0;
-    return ntohl(theTimestampPtr[4]);
-  }
-}
-
-UInt16 ReflectorPacket::GetPacketRTPSeqNum() {
-  Assert(!fIsRTCP); // not a supported type
-
-  if (fPacketPtr.Ptr == nullptr || fPacketPtr.Len < 4 || fIsRTCP) return 0;
-
-  return ntohs(((UInt16 *) fPacketPtr.Ptr)[1]); //The RTP sequenc number is the second short of the packet
-}
-
 SInt64 ReflectorPacket::GetPacketNTPTime() {
   Assert(fIsRTCP); // not a supported type
 
@@ -212,12 +258,15 @@ class ReflectorSocket
     return (this->GetDemuxer()->GetHashTable()->GetNumEntries() > 0);
   }
 
-  void BufferKeyFrame(ReflectorSender *theSender, ReflectorPacket *thePacket);
+  void BufferKeyFrame(ReflectorSender *theSender, ReflectorPacket *thePacket, UInt64 thePacketIndex);
 
   void ProcessPacket(const SInt64 &inMilliseconds, ReflectorPacket *thePacket, UInt32 theRemoteAddr, UInt16 theRemotePort);
 
   ReflectorPacket *GetPacket();
 
+  // Packet data of this socket lives here, shared by every output
+  ReflectorPacketPool *GetPacketPool() { return fPacketPool; }
+
   SInt64 Run() override;
 
   void SetSSRCFilter(bool state, UInt32 timeoutSecs) {
@@ -229,11 +278,20 @@ class ReflectorSocket
 
   void GetIncomingData(const SInt64 &inMilliseconds);
 
+#if __linux__
+  // recvmmsg path, returns false if the kernel doesn't support it
+  bool GetIncomingDataBatch(const SInt64 &inMilliseconds);
+#endif
+
+  // pop from fFreeQueue or new one, the caller holds the demuxer mutex
+  ReflectorPacket *GetFreePacket();
+
   bool FilterInvalidSSRCs(ReflectorPacket *thePacket);
 
   //Number of packets to allocate when the socket is first created
   enum {
     kNumPreallocatedPackets = 20,   //UInt32
+    kRecvBatchSize = 16,            // datagrams per recvmmsg, 16 max size slots fit in one pool slab
     kRefreshBroadcastSessionIntervalMilliSecs = 10000,
     kSSRCTimeOut = 30000 // milliseconds before clearing the SSRC if no new ssrcs have come in
   };
@@ -241,6 +299,7 @@ class ReflectorSocket
   SInt64 fLastBroadcasterTimeOutRefresh;
 
   CF::Queue fFreeQueue;   // Queue of available ReflectorPackets
+  ReflectorPacketPool *fPacketPool;
   CF::Queue fSenderQueue; // Queue of senders
   SInt64 fSleepTime;
 
@@ -293,8 +352,37 @@ class ReflectorSender : public CF::Net::UDPDemuxerTask {
   // this is the old way of doing reflect packets. It is only here until the relay code can be cleaned up.
   void ReflectRelayPackets(SInt64 *ioWakeupTime, CF::Queue *inFreeQueue);
 
-  CF::QueueElem *SendPacketsToOutput(ReflectorOutput *theOutput, CF::QueueElem *currentPacket,
-                                     SInt64 currentTime, SInt64 bucketDelay, bool firstPacket);
+  // Arrival times of the RTP packets written for the first time in a pass, their
+  // send latency is recorded once the batched sends of the pass have gone out
+  struct LatencySamples {
+    enum {
+      kMaxSamples = 256 // recorded early when full
+    };
+    SInt64 fTimeArrived[kMaxSamples];
+    UInt32 fNumSamples;
+  };
+
+  // Flushes the thread's UDPSendBatch and records the samples, empties ioSamples
+  void RecordLatencySamples(LatencySamples *ioSamples);
+
+  // ioNumWouldBlocks is incremented when the output blocks. The first write of
+  // each packet (over all passes and shards) goes to ioLatencySamples.
+  UInt64 SendPacketsToOutput(ReflectorOutput *theOutput, UInt64 currentPacket,
+                             SInt64 currentTime, SInt64 bucketDelay, bool firstPacket,
+                             SInt64 *ioNextTimeToRun, UInt32 *ioNumWouldBlocks, LatencySamples *ioLatencySamples);
+
+  // Sends to the outputs of every bucket with bucketIndex % inNumShards == inShardIndex.
+  // ioNextTimeToRun is lowered (relative msec) when an output would block.
+  // Records the pass in the send pass histograms of the stream.
+  void ReflectToOutputs(ReflectorOutputSnapshot *inOutputs, UInt32 inShardIndex, UInt32 inNumShards,
+                        SInt64 inCurrentTime, SInt64 *ioNextTimeToRun);
+
+  // Re-sends the packets the output's client reported lost, called with theOutput->fMutex held
+  void RetransmitToOutput(ReflectorOutput *theOutput, SInt64 inCurrentTime);
+
+  // One pass of fan-out shard inShardIndex, called by ReflectorShard::Run.
+  // Returns the relative time to run again, 0 if only new packets need it.
+  SInt64 ReflectShard(UInt32 inShardIndex);
 
   UInt32 GetOldestPacketRTPTime(bool *foundPtr);
 
@@ -302,33 +390,43 @@ class ReflectorSender : public CF::Net::UDPDemuxerTask {
 
   bool GetFirstPacketInfo(UInt16 *outSeqNumPtr, UInt32 *outRTPTimePtr, SInt64 *outArrivalTimePtr);
 
-  CF::QueueElem *GetClientBufferNextPacketTime(UInt32 inRTPTime);
+  UInt64 GetClientBufferNextPacketTime(UInt32 inRTPTime);
 
   bool GetFirstRTPTimePacket(UInt16 *outSeqNumPtr, UInt32 *outRTPTimePtr, SInt64 *outArrivalTimePtr);
 
   void RemoveOldPackets(CF::Queue *inFreeQueue);
 
-  CF::QueueElem *GetClientBufferStartPacketOffset(SInt64 offsetMsec, bool needKeyFrameFirstPacket = false);
+  UInt64 GetClientBufferStartPacketOffset(SInt64 offsetMsec, bool needKeyFrameFirstPacket = false);
 
-  CF::QueueElem *GetClientBufferStartPacket() {
+  UInt64 GetClientBufferStartPacket() {
     return this->GetClientBufferStartPacketOffset(0);
   };
 
   // ->geyijyn@20150427
   // 关键帧索引及丢帧方案
-  CF::QueueElem *NeedRelocateBookMark(CF::QueueElem *currentElem);
-
-  CF::QueueElem *GetNewestKeyFrameFirstPacket(CF::QueueElem *currentElem, SInt64 offsetMsec);
+  UInt64 NeedRelocateBookMark(UInt64 currentPacket);
 
   bool IsKeyFrameFirstPacket(ReflectorPacket *thePacket);
 
+  // RFC 7798 packets: IRAP (16-21), VPS, SPS or PPS starting in this packet
+  bool IsH265KeyFrameFirstPacket(ReflectorPacket *thePacket);
+
+  // The NAL units in the packet can be dropped without breaking other frames:
+  // NRI 0 for H.264 (the FU indicator and STAP header carry it too), a _N
+  // VCL type for H.265
+  bool IsDisposablePacket(ReflectorPacket *thePacket);
+
   ReflectorStream *fStream;
   UInt32 fWriteFlag; // 标记 RTP/RTCP
 
-  CF::Queue fPacketQueue;
-  CF::QueueElem *fFirstNewPacketInQueue; // set in ReflectorSocket::ProcessPacket, and clear in ReflectorSender::ReflectPackets
-  CF::QueueElem *fFirstPacketInQueueForNewOutput;
-  CF::QueueElem *fKeyFrameStartPacketElementPointer; // 最新关键帧指针
+  // Appends the packet to fPacketRing and returns its index, called with the demuxer mutex held
+  UInt64 EnQueuePacket(ReflectorPacket *thePacket);
+
+  // packet positions below are indices into fPacketRing, 0 (ReflectorPacketRing::kInvalidIndex) for none
+  ReflectorPacketRing fPacketRing;
+  UInt64 fFirstNewPacketInQueue; // set in ReflectorSocket::ProcessPacket, and clear in ReflectorSender::ReflectPackets
+  std::atomic<UInt64> fFirstPacketInQueueForNewOutput; // read by the fan-out shards
+  ReflectorGOPCache fGOPCache; // 最新关键帧开始的 GOP, its start is pinned in fPacketRing
 
   //these serve as an optimization, keeping track of when this
   //sender needs to run so it doesn't run unnecessarily
@@ -349,10 +447,121 @@ class ReflectorSender : public CF::Net::UDPDemuxerTask {
 
   CF::QueueElem fSocketQueueElem;
 
+ private:
+
+  // fan-out shards, only the buffered RTP sender uses them
+  void StartShards();
+
+  // Kills the shards, they never touch this sender again once it returns
+  void StopShards();
+
+  // Try-locks every shard so RemoveOldPackets can run, false (nothing held) if one is busy
+  bool TryLockShards();
+
+  // Waits for the passes in progress, when try-locking keeps failing
+  void LockShards();
+
+  void UnlockShards();
+
+  enum {
+    kMaxShardLockFailures = 4 // busy shards skip expiry this many times at most
+  };
+
+  ReflectorShard **fShards;
+  UInt32 fNumShards;
+  UInt32 fShardLockFailures; // ReflectPackets calls in a row that could not expire
+
   friend class ReflectorSocket;
   friend class ReflectorStream;
 };
 
+/**
+ * 并行分发任务
+ *
+ * With reflector_fanout_shards > 1 the buckets of a buffered RTP stream are
+ * split across this many tasks, which the task threads run in parallel. All
+ * of them read the sender's packet ring; the socket still does ingest and
+ * expiry, and skips expiry while a shard is in the middle of a pass.
+ */
+class ReflectorShard : public CF::Thread::Task {
+ public:
+
+  ReflectorShard(ReflectorSender *inSender, UInt32 inShardIndex);
+
+  ~ReflectorShard() override = default;
+
+  SInt64 Run() override;
+
+ private:
+
+  CF::Core::Mutex fMutex; // held for a whole pass, and by the sender to lock the shard out
+  ReflectorSender *fSender; // nullptr once the sender is gone
+  UInt32 fShardIndex;
+
+  friend class ReflectorSender;
+};
+
+/**
+ * ReflectorStream 的输出数组快照
+ *
+ * AddOutput/RemoveOutput copy the current snapshot, change the copy and publish
+ * it; the send loops take a reference to whatever is published and walk it with
+ * no stream lock, so joins and leaves never wait for a send pass.
+ *
+ * A snapshot is an array of buckets that it shares with the snapshot it was
+ * copied from, a change copies only the bucket it touches. Every output in a
+ * bucket is referenced by it.
+ */
+class ReflectorOutputSnapshot {
+ public:
+
+  // a copy of inCopyFrom (may be nullptr) grown to inNumBuckets buckets
+  ReflectorOutputSnapshot(UInt32 inNumBuckets, UInt32 inBucketSize, ReflectorOutputSnapshot *inCopyFrom);
+
+  void AddRef() { fRefCount.fetch_add(1); }
+
+  void Release() {
+    if (fRefCount.fetch_sub(1) == 1)
+      delete this;
+  }
+
+  UInt32 GetNumBuckets() { return fNumBuckets; }
+
+  // the array may have holes
+  ReflectorOutput *GetOutput(UInt32 inBucket, UInt32 inMember) {
+    Bucket *theBucket = fBuckets[inBucket];
+    return theBucket != nullptr ? theBucket->fOutputs[inMember] : nullptr;
+  }
+
+  // only before the snapshot is published, copies the bucket if it is shared
+  void SetOutput(UInt32 inBucket, UInt32 inMember, ReflectorOutput *inOutput);
+
+ private:
+
+  // one bucket of outputs, never changed once a published snapshot holds it
+  struct Bucket {
+    Bucket(UInt32 inBucketSize, Bucket *inCopyFrom);
+    ~Bucket();
+
+    std::atomic_uint fRefCount;
+    UInt32 fBucketSize;
+    ReflectorOutput **fOutputs;
+  };
+
+  static void ReleaseBucket(Bucket *inBucket);
+
+  ~ReflectorOutputSnapshot();
+
+  std::atomic_uint fRefCount;
+  UInt32 fNumBuckets;
+  UInt32 fBucketSize;
+  Bucket **fBuckets; // fNumBuckets, nullptr for a bucket that never had an output
+
+  ReflectorOutputSnapshot *fNextRetired; // see ReflectorStream::PublishOutputs
+
+  friend class ReflectorStream;
+};
+
 /**
  * Inbound stream
  */
@@ -406,20 +615,72 @@ class ReflectorStream {
 
   void TearDownAllOutputs(); // causes a tear down and then a remove
 
+  // The outputs as currently published, the caller must Release() the snapshot.
+  // Never waits for AddOutput/RemoveOutput.
+  ReflectorOutputSnapshot *GetOutputSnapshot();
+
   // If the incoming data is RTSP interleaved, packets for this stream are identified
   // by channel numbers
   void SetRTPChannelNum(SInt16 inChannel) { fRTPChannel = inChannel; }
 
   void SetRTCPChannelNum(SInt16 inChannel) { fRTCPChannel = inChannel; }
 
-  void PushPacket(char *packet, UInt32 packetLen, bool isRTCP);
+  // Hands the pushed packets of one read to the socket, which is locked and woken up once
+  void PushPackets(CF::StrPtrLen *inPackets, UInt32 inNumPackets, bool isRTCP);
+
+  // The broadcaster's RTP stream of this track, keyframe requests go back over
+  // its RTCP channel when the source pushes over RTSP. nullptr when it leaves.
+  void SetBroadcasterRTPStream(QTSS_RTPStreamObject inStream);
+
+  // A player lost a keyframe (RTCP PLI/FIR). Requests are merged, the RTP sender
+  // sends at most one PLI to the broadcaster every sKeyFrameRequestIntervalMSec.
+  void RequestKeyFrame(UInt32 inMediaSSRC);
 
   //
   // ACCESSORS
   UInt32 GetBitRate() { return fCurrentBitRate; }
 
+  // packets received from the source so far, RTP and RTCP
+  UInt64 GetPacketCount() { return fPacketCount; }
+
+  // Walks the published outputs: how many there are, how many wait on a
+  // bookmark in the RTP packet ring, and the most packets one of those is behind
+  void GetOutputLag(UInt32 *outNumOutputs, UInt32 *outNumBehind, UInt64 *outMaxLag);
+
+  // Packet path histograms of this stream: the send latency of RTP packets,
+  // the passes of both senders
+  void GetHistograms(QTSServerStats::Histograms *outHistograms);
+
+  // msec from the arrival of a packet until its first write to a client went out
+  // (the UDP batch is flushed), also goes to the server totals. Once per packet.
+  void RecordSendLatency(SInt64 inMilliseconds) {
+    fSendLatency.Record(inMilliseconds > 0 ? (UInt64) inMilliseconds : 0);
+    QTSServerStats::AddSendLatency(inMilliseconds);
+  }
+
+  // one pass of ReflectToOutputs (or a relay pass), also goes to the server totals
+  void RecordSendPass(SInt64 inMicroseconds, UInt32 inNumWouldBlocks) {
+    fSendPassMicros.Record(inMicroseconds > 0 ? (UInt64) inMicroseconds : 0);
+    fWouldBlocks.Record(inNumWouldBlocks);
+    QTSServerStats::AddSendPass(inMicroseconds, inNumWouldBlocks);
+  }
+
+  // Occupancy of the packet pools of both sockets of this stream
+  void GetPacketPoolStats(ReflectorPacketPool::Stats *outStats);
+
   SourceInfo::StreamInfo *GetStreamInfo() { return &fStreamInfo; }
 
+  static UInt32 GetNackRetransmitsPerSec() { return sNackRetransmitsPerSec; }
+
+  static UInt32 GetKeyFrameRequestIntervalMSec() { return sKeyFrameRequestIntervalMSec; }
+
+  static UInt32 GetPacingWindowMSec() { return sPacingWindowMSec; }
+
+  // H.264/H.265 video, the only streams thinned by whole frames
+  bool IsH26xVideo() {
+    return fStreamFormat == kStreamFormatVideoH264 || fStreamFormat == kStreamFormatVideoH265;
+  }
+
   CF::Core::Mutex *GetMutex() { return &fBucketMutex; }
 
   void *GetStreamCookie() { return this; }
@@ -494,10 +755,20 @@ class ReflectorStream {
   // Sends an RTCP receiver report to the broadcast source
   void SendReceiverReport();
 
+  // Sends the pending keyframe request to the broadcast source once the interval allows
+  void SendKeyFrameRequest(SInt64 inCurrentTime);
+
   void AllocateBucketArray(UInt32 inNumBuckets);
 
+  // the first bucket with room, fNumBuckets when all are full
   SInt32 FindBucket();
 
+  // replaces fOutputs, call with fOutputMutex held
+  void PublishOutputs(ReflectorOutputSnapshot *inOutputs);
+
+  // releases the retired snapshots once no GetOutputSnapshot can still be loading them
+  void ReleaseRetiredOutputs();
+
   // Reflector sockets, retrieved from the socket pool
   CF::Net::UDPSocketPair *fSockets;
 
@@ -514,6 +785,7 @@ class ReflectorStream {
     kStreamFormatUnknown = 0x0000,
     kStreamFormatVideo   = 0x4000,
     kStreamFormatVideoH264,
+    kStreamFormatVideoH265,
     kStreamFormatAudio   = 0x8000,
   };
 
@@ -527,13 +799,21 @@ class ReflectorStream {
   };
 
   // BUCKET ARRAY
-  typedef ReflectorOutput **Bucket;
-  Bucket *fOutputArray; // ReflectorOutputs are kept in a 2-dimensional array, "Buckets"
+  // ReflectorOutputs are kept in a 2-dimensional array, "Buckets". Readers load
+  // the pointer without a lock, see GetOutputSnapshot.
+  std::atomic<ReflectorOutputSnapshot *> fOutputs;
+  std::atomic_uint fNumOutputReaders; // GetOutputSnapshot calls between load and AddRef
+  ReflectorOutputSnapshot *fRetiredOutputs; // replaced snapshots not released yet
 
   UInt32 fNumBuckets;        //Number of buckets currently
   UInt32 fNumElements;       //Number of reflector outputs in the array
 
-  //Bucket array can't be modified while we are sending packets.
+  // Serializes changes of the bucket array (fOutputs, fRetiredOutputs, fNumBuckets,
+  // fNumElements). Never held while sending packets, nor by readers.
+  CF::Core::Mutex fOutputMutex;
+
+  // Guards the sender packet rings against readers on other threads
+  // (GetFirstPacketInfo etc.) while they grow or drop packets.
   CF::Core::Mutex fBucketMutex;
 
   // RTCP RR information
@@ -545,11 +825,23 @@ class ReflectorStream {
   UInt32 fDestRTCPAddr; // remote addr
   UInt16 fDestRTCPPort; // remote port
 
+  // Keyframe requests from players, fKeyFrameRequestPending is polled per send pass
+  CF::Core::Mutex fKeyFrameRequestMutex;
+  QTSS_RTPStreamObject fBroadcasterRTPStream;
+  std::atomic_bool fKeyFrameRequestPending;
+  UInt32 fKeyFrameRequestSSRC;
+  SInt64 fLastKeyFrameRequestTime;
+
   // Used for calculating average bit rate
   UInt32 fCurrentBitRate;
   SInt64 fLastBitRateSample;
   std::atomic_uint fBytesSentInThisInterval; // 当前统计区间接收字节数
 
+  // Packet path histograms, recorded by the send loops of any thread
+  LatencyHistogram fSendLatency;    // msec, ingest to the first send of a packet
+  LatencyHistogram fSendPassMicros; // usec per ReflectToOutputs pass
+  LatencyHistogram fWouldBlocks;    // outputs blocked per pass
+
   // If incoming data is RTSP interleaved
   SInt16 fRTPChannel; //These will be -1 if not set to anything
   SInt16 fRTCPChannel;
@@ -574,14 +866,22 @@ class ReflectorStream {
   static UInt32 sBucketDelayInMsec;
   static bool sUsePacketReceiveTime;
   static UInt32 sFirstPacketOffsetMsec;
+  static bool sUseRecvMmsg; // batch receive on linux, cleared if the kernel lacks recvmmsg
+  static bool sUseSendMmsg;
+  static bool sUseUDPGSO;
+  static bool sUseTCPWriteV; // RTP over RTSP clients get one writev per send pass
+  static UInt32 sNumFanoutShards; // 1: every output is served by the socket task
+  static bool sUseGOPCache;
+  static UInt32 sGOPCacheMaxKBytes;
+  static UInt32 sGOPCacheMaxFrames;
+  static UInt32 sNackRetransmitsPerSec; // per client, 0 ignores RTCP NACKs
+  static UInt32 sKeyFrameRequestIntervalMSec; // 0 ignores RTCP PLI/FIR
+  static UInt32 sPacingWindowMSec; // burst allowed per RTP stream and client, 0 sends unpaced
 
   static UInt32 sRelocatePacketAgeMSec;
 
   friend class ReflectorSocket;
   friend class ReflectorSender;
-
- public:
-  CKeyFrameCache *pkeyFrameCache;
 };
 
 /**
@@ -600,9 +900,14 @@ void ReflectorStream::UpdateBitRate(SInt64 currentTime) {
     // Don't check again for awhile!
     fLastBitRateSample = currentTime;
 
+    ReflectorPacketPool::Stats poolStats;
+    this->GetPacketPoolStats(&poolStats);
+
     DEBUG_LOG(1,
-              "--- receive packets  stream@%p  sample time:%" _S64BITARG_ "  bit rate:%" _U32BITARG_ "\n",
-              this, fLastBitRateSample, fCurrentBitRate);
+              "--- receive packets  stream@%p  sample time:%" _S64BITARG_ "  bit rate:%" _U32BITARG_
+              "  pool buffers:%" _U32BITARG_ "  bytes:%" _U32BITARG_ "/%" _U32BITARG_ "\n",
+              this, fLastBitRateSample, fCurrentBitRate,
+              poolStats.fNumBuffers, poolStats.fBytesInUse, poolStats.fBytesAllocated);
   }
 }
 
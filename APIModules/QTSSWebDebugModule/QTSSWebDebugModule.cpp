@@ -27,16 +27,41 @@
 
     Contains:   Implements web debug module
 
+                GET /metrics answers with the server, pacer and reflector
+                statistics in the Prometheus text exposition format. It is
+                off by default (metrics_enabled) and only answers the
+                addresses in metrics_ip_allow_list, loopback by default,
+                since the stream paths it lists name devices and channels.
 
 */
 
+#include <CF/ResizeableStringFormatter.h>
+
 #include "QTSSWebDebugModule.h"
+#include "QTSSModuleUtils.h"
+#include "QTSServerInterface.h"
+#include "QTSSReflectorModule.h"
+
+using namespace CF;
 
 // STATIC DATA
 
 static QTSS_AttributeID sStateAttr = qtssIllegalAttrID;
 
+static QTSS_ModulePrefsObject sPrefs = NULL;
+
+static bool sMetricsEnabled = false;
+static bool sDefaultMetricsEnabled = false;
+
+static QTSS_AttributeID sMetricsIPAllowListID = qtssIllegalAttrID;
+static char *sMetricsIPAllowList = NULL;
+static char sLocalLoopBackAddress[] = "127.0.0.*";
+
 static CF::StrPtrLen sRequestHeader("GET /debug HTTP");
+static CF::StrPtrLen sMetricsRequestHeader("GET /metrics HTTP");
+
+static const char *sMetricsForbiddenResponse = "HTTP/1.0 403 Forbidden\r\nConnection: Close\r\nContent-Length: 0\r\n\r\n";
+static const char *sMetricsResponseHeader = "HTTP/1.0 200 OK\r\nConnection: Close\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %" _U32BITARG_ "\r\n\r\n";
 
 #if MEMORY_DEBUGGING
 static char*        sResponseHeader = "HTTP/1.0 200 OK\r\nServer: TimeShare/1.0\r\nConnection: Close\r\nContent-Type: text/html\r\n\r\n";
@@ -48,7 +73,11 @@ static char*        sResponseEnd = "</BODY></HTML>";
 QTSS_Error QTSSWebDebugModuleDispatch(QTSS_Role inRole,
                                       QTSS_RoleParamPtr inParams);
 static QTSS_Error Register(QTSS_Register_Params *inParams);
+static QTSS_Error Initialize(QTSS_Initialize_Params *inParams);
+static QTSS_Error RereadPrefs();
 static QTSS_Error Filter(QTSS_Filter_Params *inParams);
+static QTSS_Error SendMetrics(QTSS_Filter_Params *inParams);
+static bool AcceptMetricsClient(QTSS_Filter_Params *inParams);
 
 QTSS_Error QTSSWebDebugModule_Main(void *inPrivateArgs) {
   return _stublibrary_main(inPrivateArgs, QTSSWebDebugModuleDispatch);
@@ -58,6 +87,8 @@ QTSS_Error QTSSWebDebugModuleDispatch(QTSS_Role inRole,
                                       QTSS_RoleParamPtr inParams) {
   switch (inRole) {
     case QTSS_Register_Role: return Register(&inParams->regParams);
+    case QTSS_Initialize_Role: return Initialize(&inParams->initParams);
+    case QTSS_RereadPrefs_Role: return RereadPrefs();
     case QTSS_RTSPFilter_Role: return Filter(&inParams->rtspFilterParams);
   }
   return QTSS_NoErr;
@@ -65,6 +96,8 @@ QTSS_Error QTSSWebDebugModuleDispatch(QTSS_Role inRole,
 
 QTSS_Error Register(QTSS_Register_Params *inParams) {
   // Do role & attribute setup
+  (void) QTSS_AddRole(QTSS_Initialize_Role);
+  (void) QTSS_AddRole(QTSS_RereadPrefs_Role);
   (void) QTSS_AddRole(QTSS_RTSPFilter_Role);
 
   // Register an attribute
@@ -79,12 +112,42 @@ QTSS_Error Register(QTSS_Register_Params *inParams) {
   return QTSS_NoErr;
 }
 
+QTSS_Error Initialize(QTSS_Initialize_Params *inParams) {
+  QTSSModuleUtils::Initialize(inParams->inMessages, inParams->inServer, inParams->inErrorLogStream);
+  sPrefs = QTSSModuleUtils::GetModulePrefsObject(inParams->inModule);
+  return RereadPrefs();
+}
+
+QTSS_Error RereadPrefs() {
+  QTSSModuleUtils::GetAttribute(sPrefs, "metrics_enabled", qtssAttrDataTypeBool16,
+                                &sMetricsEnabled, &sDefaultMetricsEnabled, sizeof(sMetricsEnabled));
+
+  delete[] sMetricsIPAllowList;
+  sMetricsIPAllowList = QTSSModuleUtils::GetStringAttribute(sPrefs, "metrics_ip_allow_list", sLocalLoopBackAddress);
+  sMetricsIPAllowListID = QTSSModuleUtils::GetAttrID(sPrefs, "metrics_ip_allow_list");
+  return QTSS_NoErr;
+}
+
 QTSS_Error Filter(QTSS_Filter_Params *inParams) {
   UInt32 theLen = 0;
   char *theFullRequest = NULL;
   (void) QTSS_GetValuePtr(inParams->inRTSPRequest, qtssRTSPReqFullRequest, 0, (void **) &theFullRequest, &theLen);
 
-  if ((theFullRequest == NULL) || (theLen < sRequestHeader.Len))
+  if (theFullRequest == NULL)
+    return QTSS_NoErr;
+
+  if (sMetricsEnabled && (theLen >= sMetricsRequestHeader.Len) &&
+      (::memcmp(theFullRequest, sMetricsRequestHeader.Ptr, sMetricsRequestHeader.Len) == 0)) {
+    if (!AcceptMetricsClient(inParams)) {
+      bool theFalse = false;
+      (void) QTSS_SetValue(inParams->inRTSPRequest, qtssRTSPReqRespKeepAlive, 0, &theFalse, sizeof(theFalse));
+      (void) QTSS_Write(inParams->inRTSPRequest, sMetricsForbiddenResponse, ::strlen(sMetricsForbiddenResponse), &theLen, 0);
+      return QTSS_NoErr;
+    }
+    return SendMetrics(inParams);
+  }
+
+  if (theLen < sRequestHeader.Len)
     return QTSS_NoErr;
   if (::memcmp(theFullRequest, sRequestHeader.Ptr, sRequestHeader.Len) != 0)
     return QTSS_NoErr;
@@ -137,3 +200,281 @@ QTSS_Error Filter(QTSS_Filter_Params *inParams) {
 #endif
   return QTSS_NoErr;
 }
+
+//
+// METRICS
+//
+// Samples of one metric family must be written together, so the reflector
+// walk fills one buffer per family and they are appended in order.
+
+static void PutFamily(ResizeableStringFormatter *ioBuffer, const char *inName, const char *inType, const char *inHelp) {
+  // the exposition format ends lines with a bare LF
+  char theLine[256];
+  s_sprintf(theLine, "# HELP %s %s\n# TYPE %s %s\n", inName, inHelp, inName, inType);
+  ioBuffer->Put(theLine);
+}
+
+static void PutValue(ResizeableStringFormatter *ioBuffer, UInt64 inValue) {
+  char theValue[32];
+  s_sprintf(theValue, " %" _U64BITARG_ "\n", inValue);
+  ioBuffer->Put(theValue);
+}
+
+static void PutSample(ResizeableStringFormatter *ioBuffer, const char *inName, const char *inType,
+                      const char *inHelp, UInt64 inValue) {
+  PutFamily(ioBuffer, inName, inType, inHelp);
+  ioBuffer->Put((char *) inName);
+  PutValue(ioBuffer, inValue);
+}
+
+// label values escape backslash, double quote and line feed
+static void PutLabelValue(ResizeableStringFormatter *ioBuffer, StrPtrLen *inValue) {
+  for (UInt32 x = 0; x < inValue->Len; x++) {
+    char *theChar = &inValue->Ptr[x];
+    if (*theChar == '\\' || *theChar == '"')
+      ioBuffer->Put("\\");
+    if (*theChar == '\n') {
+      ioBuffer->Put("\\n");
+      continue;
+    }
+    ioBuffer->Put(theChar, 1);
+  }
+}
+
+static void PutSessionLabels(ResizeableStringFormatter *ioBuffer, const char *inName, StrPtrLen *inSession,
+                             SInt32 inTrackID, const char *inQuantile = nullptr) {
+  ioBuffer->Put((char *) inName);
+  ioBuffer->Put("{session=\"");
+  PutLabelValue(ioBuffer, inSession);
+  if (inTrackID >= 0) {
+    char theTrack[32];
+    s_sprintf(theTrack, "\",track=\"%" _S32BITARG_, inTrackID);
+    ioBuffer->Put(theTrack);
+  }
+  if (inQuantile != nullptr) {
+    ioBuffer->Put("\",quantile=\"");
+    ioBuffer->Put((char *) inQuantile);
+  }
+  ioBuffer->Put("\"}");
+}
+
+// The LatencyHistogram buckets up to the highest one in use, cumulative. A
+// bucket's upper bound is inclusive and integral, so it is the le of the bucket.
+static void PutHistogram(ResizeableStringFormatter *ioBuffer, const char *inName, const char *inHelp,
+                         const LatencyHistogram::Snapshot &inHistogram) {
+  PutFamily(ioBuffer, inName, "histogram", inHelp);
+
+  UInt32 theNumBuckets = 0;
+  for (UInt32 x = 0; x < LatencyHistogram::kNumBuckets; x++) {
+    if (inHistogram.fCounts[x] != 0)
+      theNumBuckets = x + 1;
+  }
+
+  UInt64 theCount = 0;
+  char theLine[128];
+  for (UInt32 x = 0; x < theNumBuckets; x++) {
+    theCount += inHistogram.fCounts[x];
+    s_sprintf(theLine, "%s_bucket{le=\"%" _U64BITARG_ "\"}", inName, LatencyHistogram::GetBucketUpperBound(x));
+    ioBuffer->Put(theLine);
+    PutValue(ioBuffer, theCount);
+  }
+  s_sprintf(theLine, "%s_bucket{le=\"+Inf\"}", inName);
+  ioBuffer->Put(theLine);
+  PutValue(ioBuffer, inHistogram.fCount);
+  s_sprintf(theLine, "%s_sum", inName);
+  ioBuffer->Put(theLine);
+  PutValue(ioBuffer, inHistogram.fSum);
+  s_sprintf(theLine, "%s_count", inName);
+  ioBuffer->Put(theLine);
+  PutValue(ioBuffer, inHistogram.fCount);
+}
+
+// A stream's histogram as a summary, all of the buckets for every stream would be too much
+static void PutStreamSummary(ResizeableStringFormatter *ioBuffer, const char *inName, StrPtrLen *inSession,
+                             SInt32 inTrackID, const LatencyHistogram::Snapshot &inHistogram) {
+  static const char *sQuantiles[] = {"0.5", "0.9", "0.99"};
+  static const Float64 sPercentiles[] = {50, 90, 99};
+
+  for (UInt32 x = 0; x < sizeof(sPercentiles) / sizeof(Float64); x++) {
+    PutSessionLabels(ioBuffer, inName, inSession, inTrackID, sQuantiles[x]);
+    PutValue(ioBuffer, inHistogram.GetPercentile(sPercentiles[x]));
+  }
+
+  char theName[128];
+  s_sprintf(theName, "%s_sum", inName);
+  PutSessionLabels(ioBuffer, theName, inSession, inTrackID);
+  PutValue(ioBuffer, inHistogram.fSum);
+  s_sprintf(theName, "%s_count", inName);
+  PutSessionLabels(ioBuffer, theName, inSession, inTrackID);
+  PutValue(ioBuffer, inHistogram.fCount);
+}
+
+static void WriteServerMetrics(ResizeableStringFormatter *ioBuffer) {
+  QTSServerInterface *theServer = QTSServerInterface::GetServer();
+  QTSServerStats::Totals theTotals = QTSServerInterface::GetStatsTotals();
+
+  PutSample(ioBuffer, "edss_rtp_sessions", "gauge", "Client sessions", theServer->GetNumRTPSessions());
+  PutSample(ioBuffer, "edss_rtp_playing_sessions", "gauge", "Client sessions playing", theServer->GetNumRTPPlayingSessions());
+  PutSample(ioBuffer, "edss_rtsp_sessions", "gauge", "RTSP connections", theServer->GetNumRTSPSessions());
+  PutSample(ioBuffer, "edss_rtsp_http_sessions", "gauge", "RTSP over HTTP connections", theServer->GetNumRTSPHTTPSessions());
+  PutSample(ioBuffer, "edss_rtp_sessions_total", "counter", "Client sessions since startup", theServer->GetTotalRTPSessions());
+  PutSample(ioBuffer, "edss_rtp_sent_bytes_total", "counter", "RTP bytes sent", theTotals.fRTPBytes);
+  PutSample(ioBuffer, "edss_rtp_sent_packets_total", "counter", "RTP packets sent", theTotals.fRTPPackets);
+  PutSample(ioBuffer, "edss_rtp_lost_packets_total", "counter", "RTP packets reported lost by clients", theTotals.fRTPPacketsLost);
+  PutSample(ioBuffer, "edss_rtp_bandwidth_bits", "gauge", "Current RTP bandwidth in bits per second", theServer->GetCurBandwidthInBits());
+  PutSample(ioBuffer, "edss_rtp_avg_bandwidth_bits", "gauge", "Average RTP bandwidth in bits per second", theServer->GetAvgBandwidthInBits());
+  PutSample(ioBuffer, "edss_rtp_packets_per_second", "gauge", "Current RTP packet rate", theServer->GetRTPPacketsPerSec());
+  PutSample(ioBuffer, "edss_cpu_percent", "gauge", "Server CPU use", (UInt64) theServer->GetCPUPercent());
+
+  // the buckets count packets, Prometheus wants them cumulative
+  const char *theName = "edss_rtp_packet_lateness_msec";
+  PutFamily(ioBuffer, theName, "histogram", "Lateness of sent RTP packets, early ones count in the first bucket");
+  UInt64 theCount = 0;
+  char theLine[128];
+  for (UInt32 x = 0; x < QTSServerStats::kNumLateBuckets; x++) {
+    theCount += theTotals.fLateBuckets[x];
+    if (x < QTSServerStats::kNumLateBuckets - 1)
+      s_sprintf(theLine, "%s_bucket{le=\"%" _S64BITARG_ "\"}", theName, QTSServerStats::kLateBucketBounds[x]);
+    else
+      s_sprintf(theLine, "%s_bucket{le=\"+Inf\"}", theName);
+    ioBuffer->Put(theLine);
+    PutValue(ioBuffer, theCount);
+  }
+  s_sprintf(theLine, "%s_sum %" _S64BITARG_ "\n%s_count", theName, theTotals.fTotalLate, theName);
+  ioBuffer->Put(theLine);
+  PutValue(ioBuffer, theCount);
+
+  QTSServerStats::Histograms theHistograms;
+  QTSServerStats::SumHistograms(&theHistograms);
+  PutHistogram(ioBuffer, "edss_reflector_send_latency_msec",
+               "Time from the arrival of a reflected RTP packet to its first send to a client", theHistograms.fSendLatency);
+  PutHistogram(ioBuffer, "edss_reflector_send_pass_usec",
+               "Time one reflector send pass over the outputs of a stream takes", theHistograms.fSendPassMicros);
+  PutHistogram(ioBuffer, "edss_reflector_send_pass_would_blocks",
+               "Flow controlled outputs per reflector send pass", theHistograms.fWouldBlocks);
+}
+
+static void WritePacerMetrics(ResizeableStringFormatter *ioBuffer) {
+  UInt32 theNumWheels = QTSServerInterface::GetNumPacerWheels();
+  if (theNumWheels == 0)
+    return;
+
+  ResizeableStringFormatter theRunTimes;
+  PutFamily(ioBuffer, "edss_pacer_sessions", "gauge", "Sessions on each pacing wheel, one wheel per short task thread");
+  PutFamily(&theRunTimes, "edss_pacer_run_seconds_total", "counter", "Time each pacing wheel spent sending");
+
+  char theLine[128];
+  for (UInt32 x = 0; x < theNumWheels; x++) {
+    UInt32 theNumSessions = 0;
+    UInt64 theRunMicros = 0;
+    QTSServerInterface::GetPacerWheelStats(x, &theNumSessions, &theRunMicros);
+
+    s_sprintf(theLine, "edss_pacer_sessions{wheel=\"%" _U32BITARG_ "\"} %" _U32BITARG_ "\n", x, theNumSessions);
+    ioBuffer->Put(theLine);
+    s_sprintf(theLine, "edss_pacer_run_seconds_total{wheel=\"%" _U32BITARG_ "\"} %.6f\n", x, (double) theRunMicros / 1000000);
+    theRunTimes.Put(theLine);
+  }
+
+  ioBuffer->Put(theRunTimes.GetBufPtr(), theRunTimes.GetBytesWritten());
+}
+
+enum {
+  kSessionOutputs = 0,
+  kSessionBitRate,
+  kStreamPackets,
+  kStreamBitRate,
+  kStreamOutputsBehind,
+  kStreamOutputLag,
+  kStreamSendLatency,
+  kStreamSendPass,
+  kStreamWouldBlocks,
+  kNumReflectorFamilies
+};
+
+static const char *sReflectorFamilies[kNumReflectorFamilies][3] = {
+    {"edss_reflector_outputs", "gauge", "Clients watching a pushed or pulled session"},
+    {"edss_reflector_bitrate_bits", "gauge", "Ingest bit rate of a session, averaged over 30 seconds"},
+    {"edss_reflector_stream_received_packets_total", "counter", "Packets received from the source of a stream"},
+    {"edss_reflector_stream_bitrate_bits", "gauge", "Ingest bit rate of a stream, averaged over 30 seconds"},
+    {"edss_reflector_stream_outputs_behind", "gauge", "Clients of a stream waiting on a bookmark in its packet ring"},
+    {"edss_reflector_stream_output_lag_packets", "gauge", "Most RTP packets a client of a stream is behind the newest one"},
+    {"edss_reflector_stream_send_latency_msec", "summary", "Time from the arrival of an RTP packet of a stream to its first send to a client"},
+    {"edss_reflector_stream_send_pass_usec", "summary", "Time one send pass over the outputs of a stream takes"},
+    {"edss_reflector_stream_send_pass_would_blocks", "summary", "Flow controlled outputs per send pass of a stream"}
+};
+
+// QTSSReflectorMetricsProc, inCookie is the array of family buffers
+static void PutReflectorMetrics(QTSSReflectorMetrics *inMetrics, void *inCookie) {
+  auto *theFamilies = (ResizeableStringFormatter *) inCookie;
+  StrPtrLen *theKey = inMetrics->fSessionName;
+  SInt32 theTrackID = inMetrics->fTrackID;
+
+  if (theTrackID < 0) {
+    PutSessionLabels(&theFamilies[kSessionOutputs], sReflectorFamilies[kSessionOutputs][0], theKey, -1);
+    PutValue(&theFamilies[kSessionOutputs], inMetrics->fNumOutputs);
+    PutSessionLabels(&theFamilies[kSessionBitRate], sReflectorFamilies[kSessionBitRate][0], theKey, -1);
+    PutValue(&theFamilies[kSessionBitRate], inMetrics->fBitRate);
+    return;
+  }
+
+  PutSessionLabels(&theFamilies[kStreamPackets], sReflectorFamilies[kStreamPackets][0], theKey, theTrackID);
+  PutValue(&theFamilies[kStreamPackets], inMetrics->fPacketCount);
+  PutSessionLabels(&theFamilies[kStreamBitRate], sReflectorFamilies[kStreamBitRate][0], theKey, theTrackID);
+  PutValue(&theFamilies[kStreamBitRate], inMetrics->fBitRate);
+  PutSessionLabels(&theFamilies[kStreamOutputsBehind], sReflectorFamilies[kStreamOutputsBehind][0], theKey, theTrackID);
+  PutValue(&theFamilies[kStreamOutputsBehind], inMetrics->fNumOutputsBehind);
+  PutSessionLabels(&theFamilies[kStreamOutputLag], sReflectorFamilies[kStreamOutputLag][0], theKey, theTrackID);
+  PutValue(&theFamilies[kStreamOutputLag], inMetrics->fMaxOutputLag);
+
+  PutStreamSummary(&theFamilies[kStreamSendLatency], sReflectorFamilies[kStreamSendLatency][0], theKey, theTrackID,
+                   inMetrics->fHistograms.fSendLatency);
+  PutStreamSummary(&theFamilies[kStreamSendPass], sReflectorFamilies[kStreamSendPass][0], theKey, theTrackID,
+                   inMetrics->fHistograms.fSendPassMicros);
+  PutStreamSummary(&theFamilies[kStreamWouldBlocks], sReflectorFamilies[kStreamWouldBlocks][0], theKey, theTrackID,
+                   inMetrics->fHistograms.fWouldBlocks);
+}
+
+static void WriteReflectorMetrics(ResizeableStringFormatter *ioBuffer) {
+  ResizeableStringFormatter theFamilies[kNumReflectorFamilies];
+  for (UInt32 x = 0; x < kNumReflectorFamilies; x++)
+    PutFamily(&theFamilies[x], sReflectorFamilies[x][0], sReflectorFamilies[x][1], sReflectorFamilies[x][2]);
+
+  QTSSReflectorModule_GetMetrics(PutReflectorMetrics, theFamilies);
+
+  for (UInt32 x = 0; x < kNumReflectorFamilies; x++)
+    ioBuffer->Put(theFamilies[x].GetBufPtr(), theFamilies[x].GetBytesWritten());
+}
+
+// loopback, or an address in metrics_ip_allow_list
+bool AcceptMetricsClient(QTSS_Filter_Params *inParams) {
+  char remoteAddress[20] = {0};
+  StrPtrLen theClientIPAddressStr(remoteAddress, sizeof(remoteAddress));
+  QTSS_Error err = QTSS_GetValue(
+      inParams->inRTSPSession, qtssRTSPSesRemoteAddrStr, 0, (void *) theClientIPAddressStr.Ptr, &theClientIPAddressStr.Len);
+  if (err != QTSS_NoErr)
+    return false;
+
+  if (IPComponentStr(&theClientIPAddressStr).IsLocal())
+    return true;
+
+  return QTSSModuleUtils::AddressInList(sPrefs, sMetricsIPAllowListID, &theClientIPAddressStr);
+}
+
+QTSS_Error SendMetrics(QTSS_Filter_Params *inParams) {
+  ResizeableStringFormatter theBody;
+  WriteServerMetrics(&theBody);
+  WritePacerMetrics(&theBody);
+  WriteReflectorMetrics(&theBody);
+
+  bool theFalse = false;
+  (void) QTSS_SetValue(inParams->inRTSPRequest, qtssRTSPReqRespKeepAlive, 0, &theFalse, sizeof(theFalse));
+
+  // the request object buffers the response, there is no flow control to handle
+  char theHeader[256];
+  s_sprintf(theHeader, sMetricsResponseHeader, theBody.GetBytesWritten());
+
+  UInt32 theLen = 0;
+  (void) QTSS_Write(inParams->inRTSPRequest, theHeader, ::strlen(theHeader), &theLen, 0);
+  (void) QTSS_Write(inParams->inRTSPRequest, theBody.GetBufPtr(), theBody.GetBytesWritten(), &theLen, 0);
+  return QTSS_NoErr;
+}
@@ -331,6 +331,11 @@ void QTSS_UnlockStdLib() {
   (sCallbacks->addr[kUnlockStdLibCallback])();
 }
 
+QTSS_Error QTSS_SetIncomingDataHandler(QTSS_RTSPSessionObject inRTSPSession, QTSS_ClientSessionObject inClientSession,
+                                       UInt32 inChannel, QTSS_IncomingDataHandlerPtr inHandler, void *inCookie) {
+  return (sCallbacks->addr[kSetIncomingDataHandlerCallback])(inRTSPSession, inClientSession, inChannel, inHandler, inCookie);
+}
+
 void *Easy_GetRTSPPushSessions() {
   return (void *) ((QTSS_CallbackPtrProcPtr) sCallbacks->addr[kGetRTSPPushSessionsCallback])();
 }
@@ -987,7 +987,15 @@ enum {
    */
   qtssCliSessLastRTSPBandwidth = 37,
 
-  qtssCliSesNumParams = 38
+  /**
+   * Bit rate the path to the client is estimated to carry, set by a flow
+   * control module. 0 if there is no estimate.
+   * @property read/write
+   * @property UInt32
+   */
+  qtssCliSesTargetBitRate = 38,
+
+  qtssCliSesNumParams = 39
 };
 typedef UInt32 QTSS_ClientSessionAttributes;
 
@@ -1865,7 +1873,46 @@ enum {
    * @see qtssPrefsRunNumThreads
    */
   qtssSvrNumThreads = 37,
-  qtssSvrNumParams = 38
+
+  /**
+   * Median time in msec between the arrival of a reflected RTP packet and its
+   * first send to a client (batched UDP sends flushed), over all packets since startup. The histogram behind
+   * it and the attributes below has 25% precision.
+   * @property read
+   * @property UInt32
+   */
+  qtssSvrSendLatencyP50 = 38,
+
+  /**
+   * 99th percentile of qtssSvrSendLatencyP50
+   * @property read
+   * @property UInt32
+   */
+  qtssSvrSendLatencyP99 = 39,
+
+  /**
+   * Largest of qtssSvrSendLatencyP50
+   * @property read
+   * @property UInt32
+   */
+  qtssSvrSendLatencyMax = 40,
+
+  /**
+   * 99th percentile of the time one reflector send pass over its outputs
+   * takes, in usec
+   * @property read
+   * @property UInt32
+   */
+  qtssSvrSendPassP99 = 41,
+
+  /**
+   * Outputs the reflector send passes found flow controlled (WouldBlock)
+   * since startup
+   * @property read
+   * @property UInt64
+   */
+  qtssSvrSendWouldBlocks = 42,
+  qtssSvrNumParams = 43
 };
 typedef UInt32 QTSS_ServerAttributes;
 
@@ -2508,7 +2555,28 @@ enum {
    */
   edssPrefsServiceOpenIPAddrs = 87,
 
-  qtssPrefsNumParams = 88
+  /**
+   * @alias "rtp_pacing_tick_msec"
+   * @property UInt32
+   * 0 gives every RTPSession its own timer again
+   */
+  qtssPrefsRTPPacingTickMsec = 88,
+
+  /**
+   * @alias "rtsp_push_buffer_size"
+   * @property UInt32
+   * input buffer of an RTSP connection after RECORD, 0 keeps the request buffer
+   */
+  qtssPrefsRTSPPushBufferSize = 89,
+
+  /**
+   * @alias "bandwidth_shed_max_sessions"
+   * @property UInt32
+   * most sessions disconnected per average bandwidth update over maximum_bandwidth
+   */
+  qtssPrefsBandwidthShedMaxSessions = 90,
+
+  qtssPrefsNumParams = 91
 };
 
 typedef UInt32 QTSS_PrefsAttributes;
@@ -2973,11 +3041,15 @@ typedef struct {
 typedef struct {
   QTSS_RTSPSessionObject inRTSPSession;
   QTSS_ClientSessionObject inClientSession;
-  char *inPacketData;
+  char *inPacketData;  // one or more complete '$' frames of inClientSession, back to back
   UInt32 inPacketLen;
 
 } QTSS_IncomingData_Params;
 
+// Takes the frames of a channel bound with QTSS_SetIncomingDataHandler, inFrames
+// holds one or more complete '$' frames of inChannel back to back
+typedef void (*QTSS_IncomingDataHandlerPtr)(void *inCookie, UInt8 inChannel, char *inFrames, UInt32 inFramesLen);
+
 typedef struct {
   QTSS_RTSPSessionObject inRTSPSession;
 } QTSS_RTSPSession_Params;
@@ -3854,6 +3926,24 @@ QTSS_Error QTSS_Authorize(QTSS_RTSPRequestObject inAuthRequestObject, char **out
 void QTSS_LockStdLib();
 void QTSS_UnlockStdLib();
 
+/**
+ * QTSS_SetIncomingDataHandler
+ *
+ * Interleaved frames arriving on inChannel of the RTSP session go straight to
+ * inHandler, without the RTP session lookup and the QTSS_RTSPIncomingData_Role,
+ * until inClientSession is torn down. inHandler runs on the RTSP session's thread.
+ *
+ * @param inRTSPSession    the RTSP session the client pushes on
+ * @param inClientSession  the client session inChannel belongs to, its RTSP session must be inRTSPSession
+ * @param inChannel        interleaved channel number, 0 - 255
+ * @param inHandler        called with inCookie for the frames, NULL unbinds the channel
+ * @param inCookie         passed to inHandler
+ *
+ * @return QTSS_NoErr, QTSS_BadArgument
+ */
+QTSS_Error QTSS_SetIncomingDataHandler(QTSS_RTSPSessionObject inRTSPSession, QTSS_ClientSessionObject inClientSession,
+                                       UInt32 inChannel, QTSS_IncomingDataHandlerPtr inHandler, void *inCookie);
+
 // Get HLS Sessions(json)
 void *Easy_GetRTSPPushSessions();
 
@@ -0,0 +1,96 @@
+/*
+    File:       LatencyHistogram.cpp
+
+    Contains:   Implementation of LatencyHistogram
+*/
+
+#include <string.h>
+
+#include "LatencyHistogram.h"
+
+// index of the highest bit set, inValue != 0
+static UInt32 HighestBit(UInt64 inValue) {
+#if defined(__GNUC__)
+  return 63 - (UInt32) __builtin_clzll(inValue);
+#else
+  UInt32 theBit = 0;
+  while (inValue >>= 1)
+    theBit++;
+  return theBit;
+#endif
+}
+
+UInt32 LatencyHistogram::GetBucketIndex(UInt64 inValue) {
+  if (inValue < kSubBuckets)
+    return (UInt32) inValue;
+
+  // the top kSubBucketBits + 1 bits pick the bucket, the rest is the error
+  UInt32 theMagnitude = HighestBit(inValue) - kSubBucketBits;
+  UInt32 theSubBucket = (UInt32) (inValue >> theMagnitude) & (kSubBuckets - 1);
+  UInt32 theIndex = kSubBuckets + theMagnitude * kSubBuckets + theSubBucket;
+  return theIndex < kNumBuckets ? theIndex : kNumBuckets - 1;
+}
+
+UInt64 LatencyHistogram::GetBucketUpperBound(UInt32 inIndex) {
+  if (inIndex < kSubBuckets)
+    return inIndex;
+
+  UInt32 theMagnitude = (inIndex - kSubBuckets) / kSubBuckets;
+  UInt64 theSubBucket = (inIndex - kSubBuckets) % kSubBuckets;
+  return ((kSubBuckets + theSubBucket + 1) << theMagnitude) - 1;
+}
+
+void LatencyHistogram::Reset() {
+  for (UInt32 x = 0; x < kNumBuckets; x++)
+    fCounts[x].store(0, std::memory_order_relaxed);
+  fSum.store(0, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Snapshot::Clear() {
+  ::memset(this, 0, sizeof(Snapshot));
+}
+
+void LatencyHistogram::Snapshot::Add(const LatencyHistogram &inHistogram) {
+  for (UInt32 x = 0; x < kNumBuckets; x++) {
+    UInt64 theCount = inHistogram.fCounts[x].load(std::memory_order_relaxed);
+    fCounts[x] += theCount;
+    fCount += theCount;
+  }
+  fSum += inHistogram.fSum.load(std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Snapshot::Add(const Snapshot &inSnapshot) {
+  for (UInt32 x = 0; x < kNumBuckets; x++)
+    fCounts[x] += inSnapshot.fCounts[x];
+  fCount += inSnapshot.fCount;
+  fSum += inSnapshot.fSum;
+}
+
+UInt64 LatencyHistogram::Snapshot::GetPercentile(Float64 inPercentile) const {
+  if (fCount == 0)
+    return 0;
+
+  // rank of the value asked for, 1 based
+  auto theRank = (UInt64) ((inPercentile / 100.0) * (Float64) fCount + 0.5);
+  if (theRank < 1)
+    theRank = 1;
+  if (theRank > fCount)
+    theRank = fCount;
+
+  UInt64 theSeen = 0;
+  for (UInt32 x = 0; x < kNumBuckets; x++) {
+    theSeen += fCounts[x];
+    if (theSeen >= theRank)
+      return GetBucketUpperBound(x);
+  }
+
+  return GetBucketUpperBound(kNumBuckets - 1);
+}
+
+UInt64 LatencyHistogram::Snapshot::GetMax() const {
+  for (UInt32 x = kNumBuckets; x > 0; x--) {
+    if (fCounts[x - 1] != 0)
+      return GetBucketUpperBound(x - 1);
+  }
+  return 0;
+}
@@ -896,3 +896,12 @@ void QTSSCallbacks::QTSS_LockStdLib() {
 void QTSSCallbacks::QTSS_UnlockStdLib() {
   ::GetStdLibMutex()->Unlock();
 }
+
+QTSS_Error QTSSCallbacks::QTSS_SetIncomingDataHandler(QTSS_RTSPSessionObject inRTSPSession, QTSS_ClientSessionObject inClientSession,
+                                                      UInt32 inChannel, QTSS_IncomingDataHandlerPtr inHandler, void *inCookie) {
+  if ((inRTSPSession == NULL) || (inClientSession == NULL) || (inChannel > 255))
+    return QTSS_BadArgument;
+
+  return ((RTSPSessionInterface *) inRTSPSession)->SetIncomingDataHandler((RTPSessionInterface *) inClientSession,
+                                                                          (UInt8) inChannel, inHandler, inCookie);
+}
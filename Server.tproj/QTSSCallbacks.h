@@ -158,6 +158,9 @@ class QTSSCallbacks {
   static void QTSS_LockStdLib();
   static void QTSS_UnlockStdLib();
 
+  static QTSS_Error QTSS_SetIncomingDataHandler(QTSS_RTSPSessionObject inRTSPSession, QTSS_ClientSessionObject inClientSession,
+                                                UInt32 inChannel, QTSS_IncomingDataHandlerPtr inHandler, void *inCookie);
+
   static void *Easy_GetRTSPPushSessions();
 };
 
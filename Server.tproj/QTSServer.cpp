@@ -73,9 +73,7 @@
 #include "QTSSPosixFileSysModule.h"
 #include "QTSSAccessModule.h"
 
-#if MEMORY_DEBUGGING
 #include "QTSSWebDebugModule.h"
-#endif
 
 #include "RTSPRequestInterface.h"
 #include "RTPSessionInterface.h"
@@ -219,8 +217,8 @@ bool QTSServer::Initialize(XMLPrefsParser *inPrefsSource, PrefsSource *inMessage
   //
   // CREATE GLOBAL OBJECTS
   fSocketPool = new RTPSocketPool();
-  fRTPMap = new RefTable(kRTPSessionMapSize);
-  fReflectorSessionMap = new RefTable(kReflectorSessionMapSize);
+  fRTPMap = new ShardedRefTable(kRTPSessionMapSize);
+  fReflectorSessionMap = new ShardedRefTable(kReflectorSessionMapSize);
 
   //
   // Load ERROR LOG module only. This is good in case there is a startup error.
@@ -682,11 +680,10 @@ void QTSServer::LoadCompiledInModules() {
 //        (void) AddModule(theRedisModule);
 //    }
 
-#if MEMORY_DEBUGGING
-  QTSSModule* theWebDebug = new QTSSModule("QTSSWebDebugModule");
-  (void)theWebDebug->SetupModule(&sCallbacks, &QTSSWebDebugModule_Main);
-  (void)AddModule(theWebDebug);
-#endif
+  // GET /metrics, and GET /debug with MEMORY_DEBUGGING
+  QTSSModule *theWebDebug = new QTSSModule("QTSSWebDebugModule");
+  (void) theWebDebug->SetupModule(&sCallbacks, &QTSSWebDebugModule_Main);
+  (void) AddModule(theWebDebug);
 
 #ifdef __MacOSX__
   QTSSModule* theQTSSDSAuthModule = new QTSSModule("QTSSDSAuthModule");
@@ -793,6 +790,8 @@ void QTSServer::InitCallbacks() {
   sCallbacks.addr[kLockStdLibCallback] = (QTSS_CallbackProcPtr) QTSSCallbacks::QTSS_LockStdLib;
   sCallbacks.addr[kUnlockStdLibCallback] = (QTSS_CallbackProcPtr) QTSSCallbacks::QTSS_UnlockStdLib;
 
+  sCallbacks.addr[kSetIncomingDataHandlerCallback] = (QTSS_CallbackProcPtr) QTSSCallbacks::QTSS_SetIncomingDataHandler;
+
 }
 
 void QTSServer::LoadModules(QTSServerPrefs *inPrefs) {
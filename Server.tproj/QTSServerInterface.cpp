@@ -39,6 +39,8 @@
 #include "QTSServerInterface.h"
 
 #include "RTPSessionInterface.h"
+#include "RTPSessionShedder.h"
+#include "RTPSessionPacer.h"
 #include "RTPPacketResender.h"
 #include "RTSPProtocol.h"
 
@@ -111,10 +113,10 @@ QTSSAttrInfoDict::AttrInfo  QTSServerInterface::sAttributes[] = {
     /* 13 */{"qtssRTPSvrCurConn", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead},
     /* 14 */{"qtssRTPSvrTotalConn", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead},
     /* 15 */{"qtssRTPSvrCurBandwidth", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead},
-    /* 16 */{"qtssRTPSvrTotalBytes", NULL, qtssAttrDataTypeUInt64, qtssAttrModeRead},
+    /* 16 */{"qtssRTPSvrTotalBytes", SumTotalRTPBytes, qtssAttrDataTypeUInt64, qtssAttrModeRead},
     /* 17 */{"qtssRTPSvrAvgBandwidth", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead},
     /* 18 */{"qtssRTPSvrCurPackets", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead},
-    /* 19 */{"qtssRTPSvrTotalPackets", NULL, qtssAttrDataTypeUInt64, qtssAttrModeRead},
+    /* 19 */{"qtssRTPSvrTotalPackets", SumTotalRTPPackets, qtssAttrDataTypeUInt64, qtssAttrModeRead},
     /* 20 */{"qtssSvrHandledMethods", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModeWrite | qtssAttrModePreempSafe},
     /* 21 */{"qtssSvrModuleObjects", NULL, qtssAttrDataTypeQTSS_Object, qtssAttrModeRead | qtssAttrModePreempSafe},
     /* 22 */{"qtssSvrStartupTime", NULL, qtssAttrDataTypeTimeVal, qtssAttrModeRead},
@@ -131,8 +133,13 @@ QTSSAttrInfoDict::AttrInfo  QTSServerInterface::sAttributes[] = {
     /* 33 */{"qtssSvrServerBuild", NULL, qtssAttrDataTypeCharArray, qtssAttrModeRead | qtssAttrModePreempSafe},
     /* 34 */{"qtssSvrServerPlatform", NULL, qtssAttrDataTypeCharArray, qtssAttrModeRead | qtssAttrModePreempSafe},
     /* 35 */{"qtssSvrRTSPServerComment", NULL, qtssAttrDataTypeCharArray, qtssAttrModeRead | qtssAttrModePreempSafe},
-    /* 36 */{"qtssSvrNumThinned", NULL, qtssAttrDataTypeSInt32, qtssAttrModeRead | qtssAttrModePreempSafe},
-    /* 37 */{"qtssSvrNumThreads", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModePreempSafe}
+    /* 36 */{"qtssSvrNumThinned", SumNumThinned, qtssAttrDataTypeSInt32, qtssAttrModeRead | qtssAttrModePreempSafe},
+    /* 37 */{"qtssSvrNumThreads", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModePreempSafe},
+    /* 38 */{"qtssSvrSendLatencyP50", GetSendLatencyP50, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModePreempSafe},
+    /* 39 */{"qtssSvrSendLatencyP99", GetSendLatencyP99, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModePreempSafe},
+    /* 40 */{"qtssSvrSendLatencyMax", GetSendLatencyMax, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModePreempSafe},
+    /* 41 */{"qtssSvrSendPassP99", GetSendPassP99, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModePreempSafe},
+    /* 42 */{"qtssSvrSendWouldBlocks", SumSendWouldBlocks, qtssAttrDataTypeUInt64, qtssAttrModeRead | qtssAttrModePreempSafe}
 };
 
 void QTSServerInterface::Initialize() {
@@ -197,10 +204,6 @@ QTSServerInterface::QTSServerInterface()
       fTotalRTPSessions(0),
       fTotalRTPBytes(0),
       fTotalRTPPackets(0),
-      fTotalRTPPacketsLost(0),
-      fPeriodicRTPBytes(0),
-      fPeriodicRTPPacketsLost(0),
-      fPeriodicRTPPackets(0),
       fCurrentRTPBandwidthInBits(0),
       fAvgRTPBandwidthInBits(0),
       fRTPPacketsPerSecond(0),
@@ -212,12 +215,15 @@ QTSServerInterface::QTSServerInterface()
       fSigTerm(false),
       fDebugLevel(0),
       fDebugOptions(0),
-      fMaxLate(0),
-      fTotalLate(0),
-      fCurrentMaxLate(0),
-      fTotalQuality(0),
+      fTotalLateBase(0),
+      fTotalQualityBase(0),
       fNumThinned(0),
-      fNumThreads(0) {
+      fNumThreads(0),
+      fSendLatencyP50(0),
+      fSendLatencyP99(0),
+      fSendLatencyMax(0),
+      fSendPassP99(0),
+      fSendWouldBlocks(0) {
   // 初始化 sModuleArray 数组、sNumModulesInRole 数组。
   for (UInt32 y = 0; y < QTSSModule::kNumRoles; y++) {
     sModuleArray[y] = NULL;
@@ -240,10 +246,8 @@ QTSServerInterface::QTSServerInterface()
   this->SetVal(qtssRTPSvrCurConn, &fNumRTPSessions, sizeof(fNumRTPSessions));
   this->SetVal(qtssRTPSvrTotalConn, &fTotalRTPSessions, sizeof(fTotalRTPSessions));
   this->SetVal(qtssRTPSvrCurBandwidth, &fCurrentRTPBandwidthInBits, sizeof(fCurrentRTPBandwidthInBits));
-  this->SetVal(qtssRTPSvrTotalBytes, &fTotalRTPBytes, sizeof(fTotalRTPBytes));
   this->SetVal(qtssRTPSvrAvgBandwidth, &fAvgRTPBandwidthInBits, sizeof(fAvgRTPBandwidthInBits));
   this->SetVal(qtssRTPSvrCurPackets, &fRTPPacketsPerSecond, sizeof(fRTPPacketsPerSecond));
-  this->SetVal(qtssRTPSvrTotalPackets, &fTotalRTPPackets, sizeof(fTotalRTPPackets));
   this->SetVal(qtssSvrStartupTime, &fStartupTime_UnixMilli, sizeof(fStartupTime_UnixMilli));
   this->SetVal(qtssSvrGMTOffsetInHrs, &fGMTOffset, sizeof(fGMTOffset));
   this->SetVal(qtssSvrCPULoadPercent, &fCPUPercent, sizeof(fCPUPercent));
@@ -252,7 +256,6 @@ QTSServerInterface::QTSServerInterface()
   this->SetVal(qtssSvrRTSPServerComment, sServerCommentStr.Ptr, sServerCommentStr.Len);
   this->SetVal(qtssSvrServerPlatform, sServerPlatformStr.Ptr, sServerPlatformStr.Len);
 
-  this->SetVal(qtssSvrNumThinned, &fNumThinned, sizeof(fNumThinned));
   this->SetVal(qtssSvrNumThreads, &fNumThreads, sizeof(fNumThreads));
 
   // NOTE:
@@ -276,12 +279,23 @@ void QTSServerInterface::LogError(QTSS_ErrorVerbosity inVerbosity, char *inBuffe
   }
 }
 
+UInt32 QTSServerInterface::GetNumPacerWheels() {
+  return RTPSessionPacer::GetNumWheels();
+}
+
+void QTSServerInterface::GetPacerWheelStats(UInt32 inWheel, UInt32 *outNumSessions, UInt64 *outRunMicros) {
+  RTPSessionPacer::GetWheelStats(inWheel, outNumSessions, outRunMicros);
+}
+
 void QTSServerInterface::KillAllRTPSessions() {
-  Core::MutexLocker locker(fRTPMap->GetMutex());
-  for (RefHashTableIter theIter(fRTPMap->GetHashTable()); !theIter.IsDone(); theIter.Next()) {
-    Ref *theRef = theIter.GetCurrent();
-    auto *theSession = (RTPSessionInterface *) theRef->GetObject();
-    theSession->Signal(Thread::Task::kKillEvent);
+  for (UInt32 theShard = 0; theShard < fRTPMap->GetNumShards(); theShard++) {
+    RefTable *theTable = fRTPMap->GetShard(theShard);
+    Core::MutexLocker locker(theTable->GetMutex());
+    for (RefHashTableIter theIter(theTable->GetHashTable()); !theIter.IsDone(); theIter.Next()) {
+      Ref *theRef = theIter.GetCurrent();
+      auto *theSession = (RTPSessionInterface *) theRef->GetObject();
+      theSession->Signal(Thread::Task::kKillEvent);
+    }
   }
 }
 
@@ -321,7 +335,8 @@ SetValueComplete(UInt32 inAttrIndex, QTSSDictionaryMap *inMap, UInt32 inValueInd
 }
 
 RTPStatsUpdaterTask::RTPStatsUpdaterTask()
-    : Task(), fLastBandwidthTime(0), fLastBandwidthAvg(0), fLastBytesSent(0) {
+    : Task(), fLastBandwidthTime(0), fLastBandwidthAvg(0), fLastBytesSent(0),
+      fLastTotalBytes(0), fLastTotalPackets(0) {
   this->SetTaskName("RTPStatsUpdaterTask");
   this->Signal(kStartEvent);
 }
@@ -361,25 +376,17 @@ SInt64 RTPStatsUpdaterTask::Run() {
 
   QTSServerInterface *theServer = QTSServerInterface::sServer;
 
+  // Fold the per thread counters first, the senders keep adding to them
+  // without any lock while we do.
+  QTSServerStats::Totals theTotals = QTSServerInterface::GetStatsTotals();
+  UInt64 periodicBytes = theTotals.fRTPBytes - fLastTotalBytes;
+  UInt64 periodicPackets = theTotals.fRTPPackets - fLastTotalPackets;
+  fLastTotalBytes = theTotals.fRTPBytes;
+  fLastTotalPackets = theTotals.fRTPPackets;
+
   // All of this must happen atomically write dictionary values we are manipulating
   Core::MutexLocker locker(&theServer->fMutex);
 
-  // First update total bytes. This must be done because total bytes is a 64 bit number,
-  // so no atomic functions can apply.
-  unsigned int periodicBytes = theServer->fPeriodicRTPBytes;
-  theServer->fPeriodicRTPBytes.fetch_sub(periodicBytes);
-  theServer->fTotalRTPBytes += periodicBytes;
-
-  // Same deal for packet totals
-  unsigned int periodicPackets = theServer->fPeriodicRTPPackets;
-  theServer->fPeriodicRTPPackets.fetch_sub(periodicPackets);
-  theServer->fTotalRTPPackets += periodicPackets;
-
-  // ..and for lost packet totals
-  unsigned int periodicPacketsLost = theServer->fPeriodicRTPPacketsLost;
-  theServer->fPeriodicRTPPacketsLost.fetch_sub(periodicPacketsLost);
-  theServer->fTotalRTPPacketsLost += periodicPacketsLost;
-
   SInt64 curTime = CF::Core::Time::Milliseconds();
 
   // for cpu percent
@@ -396,7 +403,7 @@ SInt64 RTPStatsUpdaterTask::Run() {
       return theServer->GetPrefs()->GetTotalBytesUpdateTimeInSecs() * 1000;
     }
 
-    UInt32 packetsPerSecond = periodicPackets;
+    auto packetsPerSecond = (UInt32) periodicPackets;
     UInt32 theTime = delta / 1000;
 
     // 设置theServer->fRTPPacketsPerSecond.(包流量)
@@ -433,7 +440,7 @@ SInt64 RTPStatsUpdaterTask::Run() {
   if ((fLastBandwidthAvg != 0) &&
       (curTime > (fLastBandwidthAvg + (theServer->GetPrefs()->GetAvgBandwidthUpdateTimeInSecs() * 1000)))) {
     auto delta = (UInt32) (curTime - fLastBandwidthAvg);
-    SInt64 bytesSent = theServer->fTotalRTPBytes - fLastBytesSent;
+    SInt64 bytesSent = theTotals.fRTPBytes - fLastBytesSent;
     Assert(bytesSent >= 0);
 
     // do the bandwidth computation using floating point divides
@@ -446,22 +453,32 @@ SInt64 RTPStatsUpdaterTask::Run() {
     theServer->fAvgRTPBandwidthInBits = (UInt32) bits;
 
     fLastBandwidthAvg = curTime;
-    fLastBytesSent = theServer->fTotalRTPBytes;
+    fLastBytesSent = theTotals.fRTPBytes;
 
-    // if the bandwidth is above the bandwidth setting, disconnect 1 user by sending them a BYE RTCP packet.
+    // if the bandwidth is above the bandwidth setting, disconnect the newest users,
+    // as many as should bring it back under the limit.
     // GetMaxKBitsBandwidth对应于配置文件中的maximum_bandwidth,缺省为 102400 K/s.
     SInt32 maxKBits = theServer->GetPrefs()->GetMaxKBitsBandwidth();
-    if ((maxKBits > -1) && (theServer->fAvgRTPBandwidthInBits > ((UInt32) maxKBits * 1024))) {
-      //we need to make sure that all of this happens atomically write the session map
-      Core::MutexLocker locker2(theServer->GetRTPSessionMap()->GetMutex());
-      RTPSessionInterface *theSession = this->GetNewestSession(theServer->fRTPMap);
-      if (theSession != nullptr)
-        if ((curTime - theSession->GetSessionCreateTime()) < theServer->GetPrefs()->GetSafePlayDurationInSecs() * 1000)
-          theSession->Signal(Thread::Task::kKillEvent);
+    UInt32 theMaxBits = (UInt32) maxKBits * 1024;
+    if ((maxKBits > -1) && (theServer->fAvgRTPBandwidthInBits > theMaxBits)) {
+      UInt32 theNumToShed = 1;
+      UInt32 theNumSessions = theServer->GetNumRTPSessions();
+      if (theNumSessions > 0) {
+        UInt32 theBitsPerSession = theServer->fAvgRTPBandwidthInBits / theNumSessions;
+        if (theBitsPerSession > 0)
+          theNumToShed = (theServer->fAvgRTPBandwidthInBits - theMaxBits + theBitsPerSession - 1) / theBitsPerSession;
+      }
+
+      UInt32 theMaxToShed = theServer->GetPrefs()->GetBandwidthShedMaxSessions();
+      if (theNumToShed > theMaxToShed)
+        theNumToShed = theMaxToShed;
+
+      SInt64 theSafePlayMsec = (SInt64) theServer->GetPrefs()->GetSafePlayDurationInSecs() * 1000;
+      (void) RTPSessionShedder::Shed(curTime, theSafePlayMsec, theNumToShed);
     }
   } else if (fLastBandwidthAvg == 0) {
     fLastBandwidthAvg = curTime;
-    fLastBytesSent = theServer->fTotalRTPBytes;
+    fLastBytesSent = theTotals.fRTPBytes;
   }
 
   (void) this->GetEvents(); // we must clear the event mask!
@@ -470,27 +487,6 @@ SInt64 RTPStatsUpdaterTask::Run() {
   return theServer->GetPrefs()->GetTotalBytesUpdateTimeInSecs() * 1000;
 }
 
-/**
- * @note Caller must lock down the RTP session map
- */
-RTPSessionInterface *RTPStatsUpdaterTask::GetNewestSession(RefTable *inRTPSessionMap) {
-  SInt64 theNewestPlayTime = 0;
-  RTPSessionInterface *theNewestSession = nullptr;
-
-  // use the session map to iterate through all the sessions, finding the most
-  // recently connected client
-  for (RefHashTableIter theIter(inRTPSessionMap->GetHashTable()); !theIter.IsDone(); theIter.Next()) {
-    Ref *theRef = theIter.GetCurrent();
-    auto theSession = (RTPSessionInterface *) theRef->GetObject();
-    Assert(theSession->GetSessionCreateTime() > 0);
-    if (theSession->GetSessionCreateTime() > theNewestPlayTime) {
-      theNewestPlayTime = theSession->GetSessionCreateTime();
-      theNewestSession = theSession;
-    }
-  }
-  return theNewestSession;
-}
-
 void *QTSServerInterface::CurrentUnixTimeMilli(QTSSDictionary *inServer, UInt32 *outLen) {
   auto *theServer = (QTSServerInterface *) inServer;
   theServer->fCurrentTime_UnixMilli = Core::Time::TimeMilli_To_UnixTimeMilli(Core::Time::Milliseconds());
@@ -578,4 +574,93 @@ QTSS_Error QTSSErrorLogStream::Write(void *inBuffer, UInt32 inLen, UInt32 *outLe
 
 void QTSSErrorLogStream::LogAssert(char *inMessage) {
   QTSServerInterface::LogError(qtssAssertVerbosity, inMessage);
-}
\ No newline at end of file
+}
+
+void *QTSServerInterface::SumTotalRTPBytes(QTSSDictionary *inServer, UInt32 *outLen) {
+  // Summed from the per thread counters each time it is read
+  auto *theServer = (QTSServerInterface *) inServer;
+
+  theServer->fTotalRTPBytes = QTSServerInterface::GetStatsTotals().fRTPBytes;
+
+  // Return the result
+  *outLen = sizeof(theServer->fTotalRTPBytes);
+  return &theServer->fTotalRTPBytes;
+}
+
+void *QTSServerInterface::SumTotalRTPPackets(QTSSDictionary *inServer, UInt32 *outLen) {
+  auto *theServer = (QTSServerInterface *) inServer;
+
+  theServer->fTotalRTPPackets = QTSServerInterface::GetStatsTotals().fRTPPackets;
+
+  // Return the result
+  *outLen = sizeof(theServer->fTotalRTPPackets);
+  return &theServer->fTotalRTPPackets;
+}
+
+void *QTSServerInterface::SumNumThinned(QTSSDictionary *inServer, UInt32 *outLen) {
+  auto *theServer = (QTSServerInterface *) inServer;
+
+  theServer->fNumThinned = QTSServerInterface::GetStatsTotals().fNumThinned;
+
+  // Return the result
+  *outLen = sizeof(theServer->fNumThinned);
+  return &theServer->fNumThinned;
+}
+
+// The histograms are summed over all the threads for each of these, they are
+// meant for the occasional status read, /metrics has the whole distribution.
+
+void *QTSServerInterface::GetSendLatencyP50(QTSSDictionary *inServer, UInt32 *outLen) {
+  auto *theServer = (QTSServerInterface *) inServer;
+
+  QTSServerStats::Histograms theHistograms;
+  QTSServerStats::SumHistograms(&theHistograms);
+  theServer->fSendLatencyP50 = (UInt32) theHistograms.fSendLatency.GetPercentile(50);
+
+  *outLen = sizeof(theServer->fSendLatencyP50);
+  return &theServer->fSendLatencyP50;
+}
+
+void *QTSServerInterface::GetSendLatencyP99(QTSSDictionary *inServer, UInt32 *outLen) {
+  auto *theServer = (QTSServerInterface *) inServer;
+
+  QTSServerStats::Histograms theHistograms;
+  QTSServerStats::SumHistograms(&theHistograms);
+  theServer->fSendLatencyP99 = (UInt32) theHistograms.fSendLatency.GetPercentile(99);
+
+  *outLen = sizeof(theServer->fSendLatencyP99);
+  return &theServer->fSendLatencyP99;
+}
+
+void *QTSServerInterface::GetSendLatencyMax(QTSSDictionary *inServer, UInt32 *outLen) {
+  auto *theServer = (QTSServerInterface *) inServer;
+
+  QTSServerStats::Histograms theHistograms;
+  QTSServerStats::SumHistograms(&theHistograms);
+  theServer->fSendLatencyMax = (UInt32) theHistograms.fSendLatency.GetMax();
+
+  *outLen = sizeof(theServer->fSendLatencyMax);
+  return &theServer->fSendLatencyMax;
+}
+
+void *QTSServerInterface::GetSendPassP99(QTSSDictionary *inServer, UInt32 *outLen) {
+  auto *theServer = (QTSServerInterface *) inServer;
+
+  QTSServerStats::Histograms theHistograms;
+  QTSServerStats::SumHistograms(&theHistograms);
+  theServer->fSendPassP99 = (UInt32) theHistograms.fSendPassMicros.GetPercentile(99);
+
+  *outLen = sizeof(theServer->fSendPassP99);
+  return &theServer->fSendPassP99;
+}
+
+void *QTSServerInterface::SumSendWouldBlocks(QTSSDictionary *inServer, UInt32 *outLen) {
+  auto *theServer = (QTSServerInterface *) inServer;
+
+  QTSServerStats::Histograms theHistograms;
+  QTSServerStats::SumHistograms(&theHistograms);
+  theServer->fSendWouldBlocks = theHistograms.fWouldBlocks.fSum;
+
+  *outLen = sizeof(theServer->fSendWouldBlocks);
+  return &theServer->fSendWouldBlocks;
+}
@@ -159,7 +159,10 @@ QTSServerPrefs::PrefInfo QTSServerPrefs::sPrefInfo[] = {
     {kDontAllowMultipleValues, "8554", NULL}, //rtsp_wan_port
     {kDontAllowMultipleValues, "rtmp://127.0.0.1/", NULL},    //nginx_rtmp_server
 
-    {kAllowMultipleValues, "", sOpen_IP_Addrs} //service_open_ip
+    {kAllowMultipleValues, "", sOpen_IP_Addrs}, //service_open_ip
+    {kDontAllowMultipleValues, "2", NULL}, //rtp_pacing_tick_msec
+    {kDontAllowMultipleValues, "262144", NULL}, //rtsp_push_buffer_size
+    {kDontAllowMultipleValues, "8", NULL} //bandwidth_shed_max_sessions
 };
 
 QTSSAttrInfoDict::AttrInfo QTSServerPrefs::sAttributes[] = {
@@ -255,7 +258,10 @@ QTSSAttrInfoDict::AttrInfo QTSServerPrefs::sAttributes[] = {
 
     /* 86 */{"nginx_rtmp_server", NULL, qtssAttrDataTypeCharArray, qtssAttrModeRead | qtssAttrModeWrite},
 
-    /* 87 */{"service_open_ip", NULL, qtssAttrDataTypeCharArray, qtssAttrModeRead | qtssAttrModeWrite}
+    /* 87 */{"service_open_ip", NULL, qtssAttrDataTypeCharArray, qtssAttrModeRead | qtssAttrModeWrite},
+    /* 88 */{"rtp_pacing_tick_msec", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModeWrite},
+    /* 89 */{"rtsp_push_buffer_size", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModeWrite},
+    /* 90 */{"bandwidth_shed_max_sessions", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModeWrite}
 };
 
 QTSServerPrefs::QTSServerPrefs(XMLPrefsParser *inPrefsSource, bool inWriteMissingPrefs)
@@ -330,7 +336,10 @@ QTSServerPrefs::QTSServerPrefs(XMLPrefsParser *inPrefsSource, bool inWriteMissin
       fAllowGuestAuthorizeDefault(true),
       fServiceLANPort(10008),
       fServiceWANPort(10008),
-      fRTSPWANPort(10554) {
+      fRTSPWANPort(10554),
+      fRTPPacingTickInMsec(2),
+      fRTSPPushBufferSize(262144),
+      fBandwidthShedMaxSessions(8) {
   SetupAttributes();
   RereadServerPreferences(inWriteMissingPrefs);
 }
@@ -421,6 +430,10 @@ void QTSServerPrefs::SetupAttributes() {
 
   this->SetVal(easyPrefsServiceWANIPAddr, &fRTSPWANAddr, sizeof(fRTSPWANAddr));
   this->SetVal(easyPrefsRTSPWANPort, &fRTSPWANPort, sizeof(fRTSPWANPort));
+
+  this->SetVal(qtssPrefsRTPPacingTickMsec, &fRTPPacingTickInMsec, sizeof(fRTPPacingTickInMsec));
+  this->SetVal(qtssPrefsRTSPPushBufferSize, &fRTSPPushBufferSize, sizeof(fRTSPPushBufferSize));
+  this->SetVal(qtssPrefsBandwidthShedMaxSessions, &fBandwidthShedMaxSessions, sizeof(fBandwidthShedMaxSessions));
 }
 
 void QTSServerPrefs::RereadServerPreferences(bool inWriteMissingPrefs) {
@@ -0,0 +1,100 @@
+/*
+    File:       QTSServerStats.cpp
+
+    Contains:   Implementation of QTSServerStats
+*/
+
+#include <string.h>
+
+#include "QTSServerStats.h"
+
+// static storage is zeroed before any thread runs
+QTSServerStats::PaddedShard QTSServerStats::sShards[kMaxShards];
+std::atomic_uint QTSServerStats::sNumShards(0);
+thread_local QTSServerStats::Shard *QTSServerStats::sThreadShard = nullptr;
+
+const SInt64 QTSServerStats::kLateBucketBounds[kNumLateBuckets - 1] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000
+};
+
+QTSServerStats::Shard *QTSServerStats::AttachShard() {
+  UInt32 theIndex = sNumShards.fetch_add(1);
+  if (theIndex >= kMaxShards) { // out of shards, share the last one
+    sNumShards.store(kMaxShards);
+    theIndex = kMaxShards - 1;
+  }
+
+  sThreadShard = &sShards[theIndex];
+  return sThreadShard;
+}
+
+static void UpdateMax(std::atomic<SInt64> &ioMax, SInt64 inValue) {
+  SInt64 theMax = ioMax.load(std::memory_order_relaxed);
+  while (inValue > theMax && !ioMax.compare_exchange_weak(theMax, inValue, std::memory_order_relaxed)) {}
+}
+
+void QTSServerStats::AddLate(SInt64 inMilliseconds) {
+  Shard *theShard = GetShard();
+  theShard->fTotalLate.fetch_add(inMilliseconds, std::memory_order_relaxed);
+  UpdateMax(theShard->fCurrentMaxLate, inMilliseconds);
+  UpdateMax(theShard->fMaxLate, inMilliseconds);
+
+  UInt32 theBucket = 0;
+  while (theBucket < kNumLateBuckets - 1 && inMilliseconds > kLateBucketBounds[theBucket])
+    theBucket++;
+  theShard->fLateBuckets[theBucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void QTSServerStats::Sum(Totals *outTotals) {
+  ::memset(outTotals, 0, sizeof(Totals));
+
+  UInt32 theNumShards = sNumShards.load();
+  if (theNumShards > kMaxShards)
+    theNumShards = kMaxShards;
+
+  for (UInt32 i = 0; i < theNumShards; i++) {
+    Shard &theShard = sShards[i];
+    outTotals->fRTPBytes += theShard.fRTPBytes.load(std::memory_order_relaxed);
+    outTotals->fRTPPackets += theShard.fRTPPackets.load(std::memory_order_relaxed);
+    outTotals->fRTPPacketsLost += theShard.fRTPPacketsLost.load(std::memory_order_relaxed);
+    outTotals->fTotalLate += theShard.fTotalLate.load(std::memory_order_relaxed);
+    outTotals->fTotalQuality += theShard.fTotalQuality.load(std::memory_order_relaxed);
+    outTotals->fNumThinned += theShard.fNumThinned.load(std::memory_order_relaxed);
+
+    for (UInt32 x = 0; x < kNumLateBuckets; x++)
+      outTotals->fLateBuckets[x] += theShard.fLateBuckets[x].load(std::memory_order_relaxed);
+
+    SInt64 theMaxLate = theShard.fMaxLate.load(std::memory_order_relaxed);
+    if (theMaxLate > outTotals->fMaxLate)
+      outTotals->fMaxLate = theMaxLate;
+
+    SInt64 theCurrentMaxLate = theShard.fCurrentMaxLate.load(std::memory_order_relaxed);
+    if (theCurrentMaxLate > outTotals->fCurrentMaxLate)
+      outTotals->fCurrentMaxLate = theCurrentMaxLate;
+  }
+}
+
+void QTSServerStats::SumHistograms(Histograms *outHistograms) {
+  outHistograms->fSendLatency.Clear();
+  outHistograms->fSendPassMicros.Clear();
+  outHistograms->fWouldBlocks.Clear();
+
+  UInt32 theNumShards = sNumShards.load();
+  if (theNumShards > kMaxShards)
+    theNumShards = kMaxShards;
+
+  for (UInt32 i = 0; i < theNumShards; i++) {
+    outHistograms->fSendLatency.Add(sShards[i].fSendLatency);
+    outHistograms->fSendPassMicros.Add(sShards[i].fSendPassMicros);
+    outHistograms->fWouldBlocks.Add(sShards[i].fWouldBlocks);
+  }
+}
+
+void QTSServerStats::ClearCurrentMaxLate() {
+  UInt32 theNumShards = sNumShards.load();
+  if (theNumShards > kMaxShards)
+    theNumShards = kMaxShards;
+
+  for (UInt32 i = 0; i < theNumShards; i++)
+    sShards[i].fCurrentMaxLate.store(0, std::memory_order_relaxed);
+}
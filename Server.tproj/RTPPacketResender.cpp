@@ -72,10 +72,8 @@ public:
 
 using namespace CF;
 
-static const UInt32 kPacketArrayIncreaseInterval = 32;// must be multiple of 2
-static const UInt32 kInitialPacketArraySize =
-    64;// must be multiple of kPacketArrayIncreaseInterval (Turns out this is as big as we typically need)
-//static const UInt32 kMaxPacketArraySize = 512;// must be multiple of kPacketArrayIncreaseInterval it would have to be a 3 mbit or more
+static const UInt32 kInitialPacketArraySize = 64;// must be a power of 2 (Turns out this is as big as we typically need)
+static const UInt32 kMaxPacketArraySize = 8192;// must be a power of 2, a window this big is way over 50 mbit
 
 static const UInt32 kMaxDataBufferSize = 1600;
 BufferPool RTPPacketResender::sBufferPool(kMaxDataBufferSize);
@@ -94,14 +92,16 @@ RTPPacketResender::RTPPacketResender()
       fNumSent(0),
       fPacketArray(NULL),
       fPacketArraySize(kInitialPacketArraySize),
-      fPacketArrayMask(0),
+      fPacketArrayMask(kInitialPacketArraySize - 1),
       fHighestSeqNum(0),
-      fLastUsed(0),
-      fPacketQMutex() {
+      fPacketQMutex(),
+      fWheelTick(0) {
   fPacketArray = (RTPResenderEntry *) new char[sizeof(RTPResenderEntry)
       * fPacketArraySize];
   ::memset(fPacketArray, 0, sizeof(RTPResenderEntry) * fPacketArraySize);
 
+  for (UInt32 x = 0; x < kWheelSize; x++)
+    fWheel[x] = kNoEntry;
 }
 
 RTPPacketResender::~RTPPacketResender() {
@@ -225,61 +225,41 @@ void RTPPacketResender::SetDestination(Net::UDPSocket *inOutputSocket,
   fDestPort = inDestPort;
 }
 
+RTPResenderEntry *RTPPacketResender::GetEntryBySeqNum(UInt16 inSeqNum) {
+  RTPResenderEntry *theEntry = &fPacketArray[inSeqNum & fPacketArrayMask];
+  if (theEntry->fPacketSize == 0 || theEntry->fSeqNum != inSeqNum)
+    return NULL;
+  return theEntry;
+}
+
 RTPResenderEntry *RTPPacketResender::GetEmptyEntry(UInt16 inSeqNum,
                                                    UInt32 inPacketSize) {
 
-  RTPResenderEntry *theEntry = NULL;
+  UInt32 packetIndex = inSeqNum & fPacketArrayMask;
+  RTPResenderEntry *theEntry = &fPacketArray[packetIndex];
 
-  for (UInt32 packetIndex = 0; packetIndex < fPacketsInList;
-       packetIndex++) // see if packet is already in the array
-  {
-    if (inSeqNum == fPacketArray[packetIndex].fSeqNum) {
+  if (theEntry->fPacketSize > 0) {
+    if (theEntry->fSeqNum == inSeqNum) // packet is already in the array
       return NULL;
+
+    // the window wrapped around the ring, make room or drop the old packet
+    if (fPacketArraySize < kMaxPacketArraySize) {
+      this->ReallocatePacketArray();
+      return this->GetEmptyEntry(inSeqNum, inPacketSize);
     }
-  }
 
-  if (fPacketsInList == fPacketArraySize) // allocate a new array
-  {
-    fPacketArraySize += kPacketArrayIncreaseInterval;
-    RTPResenderEntry *tempArray =
-        (RTPResenderEntry *) new char[sizeof(RTPResenderEntry)
-            * fPacketArraySize];
-    ::memset(tempArray, 0, sizeof(RTPResenderEntry) * fPacketArraySize);
-    ::memcpy(tempArray,
-             fPacketArray,
-             sizeof(RTPResenderEntry) * fPacketsInList);
-    delete[] fPacketArray;
-    fPacketArray = tempArray;
-    //s_printf("NewArray size=%" _S32BITARG_ " packetsInList=%" _S32BITARG_ "\n",fPacketArraySize, fPacketsInList);
+    //s_printf("array is full = %"   _U32BITARG_   " reusing index=%"   _U32BITARG_   "\n",fPacketsInList,packetIndex);
+    this->RemovePacket(packetIndex, true);
   }
 
-  if (fPacketsInList < fPacketArraySize) // have an open spot
-  {
-    theEntry = &fPacketArray[fPacketsInList];
-    fPacketsInList++;
-
-    if (fPacketsInList < fPacketArraySize)
-      fLastUsed = fPacketsInList;
-    else
-      fLastUsed = fPacketArraySize;
-  } else {
-    // nothing open so re-use
-    if (fLastUsed < fPacketArraySize - 1)
-      fLastUsed++;
-    else
-      fLastUsed = 0;
-
-    //s_printf("array is full = %"   _U32BITARG_   " reusing index=%"   _U32BITARG_   "\n",fPacketsInList,fLastUsed);
-    theEntry = &fPacketArray[fLastUsed];
-    RemovePacket(fLastUsed,
-                 false); // delete packet in place don't fill we will use the spot
-  }
+  fPacketsInList++;
+  if (fPacketsInList > fMaxPacketsInList)
+    fMaxPacketsInList = fPacketsInList;
 
   //
   // Check to see if this packet is too big for the buffer. If it is, then
   // we need to specially allocate a special buffer
   if (inPacketSize > kMaxDataBufferSize) {
-    //sBufferPool.Put(theEntry->fPacketData);
     theEntry->fIsSpecialBuffer = true;
     theEntry->fPacketData = new char[inPacketSize];
   } else// It is not special, it's from the buffer pool
@@ -291,16 +271,75 @@ RTPResenderEntry *RTPPacketResender::GetEmptyEntry(UInt16 inSeqNum,
   return theEntry;
 }
 
+void RTPPacketResender::ReallocatePacketArray() {
+  UInt32 theNewSize = fPacketArraySize * 2;
+  UInt32 theNewMask = theNewSize - 1;
+  auto *theNewArray = (RTPResenderEntry *) new char[sizeof(RTPResenderEntry) * theNewSize];
+  ::memset(theNewArray, 0, sizeof(RTPResenderEntry) * theNewSize);
+
+  // sequence numbers apart in the old ring are apart in the bigger one too
+  for (UInt32 x = 0; x < fPacketArraySize; x++) {
+    if (fPacketArray[x].fPacketSize > 0)
+      theNewArray[fPacketArray[x].fSeqNum & theNewMask] = fPacketArray[x];
+  }
+
+  delete[] (char *) fPacketArray;
+  fPacketArray = theNewArray;
+  fPacketArraySize = theNewSize;
+  fPacketArrayMask = theNewMask;
+  //s_printf("NewArray size=%" _S32BITARG_ " packetsInList=%" _S32BITARG_ "\n",fPacketArraySize, fPacketsInList);
+
+  // the wheel links are array indices, build them again
+  for (UInt32 x = 0; x < kWheelSize; x++)
+    fWheel[x] = kNoEntry;
+  for (UInt32 x = 0; x < fPacketArraySize; x++) {
+    if (fPacketArray[x].fPacketSize > 0)
+      this->ScheduleEntry(x, fPacketArray[x].fDueTime);
+  }
+}
+
+void RTPPacketResender::ScheduleEntry(UInt32 packetIndex, SInt64 inDueTime) {
+  RTPResenderEntry *theEntry = &fPacketArray[packetIndex];
+  theEntry->fDueTime = inDueTime;
+
+  // never behind the wheel, a tick already looked at would wait a whole lap
+  SInt64 theTick = inDueTime / kWheelTickMsec;
+  if (theTick < fWheelTick)
+    theTick = fWheelTick;
+
+  UInt32 theSlot = (UInt32) theTick & (kWheelSize - 1);
+  theEntry->fWheelSlot = theSlot;
+  theEntry->fWheelPrev = kNoEntry;
+  theEntry->fWheelNext = fWheel[theSlot];
+  if (fWheel[theSlot] != kNoEntry)
+    fPacketArray[fWheel[theSlot]].fWheelPrev = packetIndex;
+  fWheel[theSlot] = packetIndex;
+}
+
+void RTPPacketResender::UnscheduleEntry(UInt32 packetIndex) {
+  RTPResenderEntry *theEntry = &fPacketArray[packetIndex];
+  if (theEntry->fWheelSlot == kNoEntry)
+    return;
+
+  if (theEntry->fWheelPrev != kNoEntry)
+    fPacketArray[theEntry->fWheelPrev].fWheelNext = theEntry->fWheelNext;
+  else
+    fWheel[theEntry->fWheelSlot] = theEntry->fWheelNext;
+
+  if (theEntry->fWheelNext != kNoEntry)
+    fPacketArray[theEntry->fWheelNext].fWheelPrev = theEntry->fWheelPrev;
+
+  theEntry->fWheelSlot = kNoEntry;
+}
+
 void RTPPacketResender::ClearOutstandingPackets() {
   //OSMutexLocker packetQLocker(&fPacketQMutex);
-  //for (UInt16 packetIndex = 0; packetIndex < fPacketArraySize; packetIndex++) //Testing purposes
-  for (UInt16 packetIndex = 0; packetIndex < fPacketsInList; packetIndex++) {
-    this->RemovePacket(packetIndex, false);// don't move packets delete in place
+  for (UInt32 packetIndex = 0; packetIndex < fPacketArraySize && fPacketsInList > 0; packetIndex++) {
+    this->RemovePacket(packetIndex);
     Assert(fPacketArray[packetIndex].fPacketSize == 0);
   }
   if (fBandwidthTracker != NULL)
     fBandwidthTracker->EmptyWindow(fBandwidthTracker->BytesInList()); //clean it out
-  fPacketsInList = 0; // deleting in place doesn't decrement
 
   Assert(fPacketsInList == 0);
 }
@@ -336,6 +375,7 @@ void RTPPacketResender::AddPacket(void *inRTPPacket, UInt32 packetSize, SInt32 a
     theEntry->fExpireTime = theEntry->fAddedTime + ageLimit;
     theEntry->fNumResends = 0;
     theEntry->fSeqNum = theSeqNum;
+    this->ScheduleEntry(theSeqNum & fPacketArrayMask, theEntry->fAddedTime + theEntry->fOrigRetransTimeout + 1);
 
     //
     // Track the number of wasted bytes we have
@@ -360,19 +400,9 @@ void RTPPacketResender::AckPacket(UInt16 inSeqNum, SInt64 &inCurTimeInMsec) {
 
   //OSMutexLocker packetQLocker(&fPacketQMutex);
 
-  SInt32 foundIndex = -1;
-  for (UInt32 packetIndex = 0; packetIndex < fPacketsInList; packetIndex++) {
-    if (inSeqNum == fPacketArray[packetIndex].fSeqNum) {
-      foundIndex = packetIndex;
-      break;
-    }
-  }
-
-  RTPResenderEntry *theEntry = NULL;
-  if (foundIndex != -1)
-    theEntry = &fPacketArray[foundIndex];
+  RTPResenderEntry *theEntry = this->GetEntryBySeqNum(inSeqNum);
 
-  if (theEntry == NULL || theEntry->fPacketSize == 0) {   /*  we got an ack for a packet that has already expired or
+  if (theEntry == NULL) {   /*  we got an ack for a packet that has already expired or
 			for a packet whose re-transmit crossed with it's original ack
 
 		*/
@@ -425,11 +455,11 @@ void RTPPacketResender::AckPacket(UInt16 inSeqNum, SInt64 &inCurTimeInMsec) {
           , (SInt32)fTrackID, theEntry->fPacketSize, OS::Milliseconds());
 #endif
     }
-    this->RemovePacket(foundIndex);
+    this->RemovePacket(inSeqNum & fPacketArrayMask);
   }
 }
 
-void RTPPacketResender::RemovePacket(UInt32 packetIndex, bool reuseIndex) {
+void RTPPacketResender::RemovePacket(UInt32 packetIndex, bool keepWindow) {
   //OSMutexLocker packetQLocker(&fPacketQMutex);
 
   Assert(packetIndex < fPacketArraySize);
@@ -454,48 +484,60 @@ void RTPPacketResender::RemovePacket(UInt32 packetIndex, bool reuseIndex) {
   // Update our list information
   Assert(fPacketsInList > 0);
 
+  this->UnscheduleEntry(packetIndex);
+
   if (theEntry->fIsSpecialBuffer) {
     delete[](char *) theEntry->fPacketData;
   } else if (theEntry->fPacketData != NULL)
     sBufferPool.Put(theEntry->fPacketData);
 
-  if (reuseIndex) // we are re-using the space so keep array contiguous
-  {
-    fPacketArray[packetIndex] = fPacketArray[fPacketsInList - 1];
-    ::memset(&fPacketArray[fPacketsInList - 1], 0, sizeof(RTPResenderEntry));
-    fPacketsInList--;
-
-  } else    // the array is full
-  {
-    fBandwidthTracker->EmptyWindow(theEntry->fPacketSize,
-                                   false); // keep window available
-    ::memset(theEntry, 0, sizeof(RTPResenderEntry));
-  }
+  if (keepWindow) // the array is full, the packet is dropped unacked
+    fBandwidthTracker->EmptyWindow(theEntry->fPacketSize, false); // keep window available
 
+  ::memset(theEntry, 0, sizeof(RTPResenderEntry));
+  fPacketsInList--;
 }
 
 void RTPPacketResender::ResendDueEntries() {
   // 在 RTPStream::ReliableRTPWrite 函数(针对 qtssRTPTransportTypeReliableUDP )里,会调
   // 用该函数,重发或者丢弃那些过期的 RTP 包。
 
-  if (fPacketsInList <= 0)
+  SInt64 curTime = Core::Time::Milliseconds();
+  SInt64 curTick = curTime / kWheelTickMsec;
+
+  if (fPacketsInList <= 0) {
+    fWheelTick = curTick;
     return;
+  }
+
+  // after a long pause one lap visits every slot
+  if (curTick - fWheelTick >= kWheelSize)
+    fWheelTick = curTick - kWheelSize + 1;
 
   //OSMutexLocker packetQLocker(&fPacketQMutex);
   //
   SInt32 numResends = 0;
   RTPResenderEntry *theEntry = NULL;
-  SInt64 curTime = Core::Time::Milliseconds();
-  for (SInt32 packetIndex = fPacketsInList - 1;
-       packetIndex >= 0;
-       packetIndex--) { // walk backwards because remove packet moves array members forward
-    theEntry = &fPacketArray[packetIndex];
-
-    if (theEntry->fPacketSize == 0)
-      continue;
+  while (fWheelTick <= curTick) {
+    // take the whole slot, what is not due yet goes back in
+    UInt32 theSlot = (UInt32) fWheelTick & (kWheelSize - 1);
+    UInt32 packetIndex = fWheel[theSlot];
+    fWheel[theSlot] = kNoEntry;
+    fWheelTick++;
+
+    while (packetIndex != kNoEntry) {
+      theEntry = &fPacketArray[packetIndex];
+      UInt32 nextIndex = theEntry->fWheelNext;
+      theEntry->fWheelSlot = kNoEntry;
+
+      // the timeout may have grown since the packet was scheduled
+      SInt32 theRetransTimeout = fBandwidthTracker->CurRetransmitTimeout();
+      if ((curTime - theEntry->fAddedTime) <= theRetransTimeout) {
+        this->ScheduleEntry(packetIndex, theEntry->fAddedTime + theRetransTimeout + 1);
+        packetIndex = nextIndex;
+        continue;
+      }
 
-    if ((curTime - theEntry->fAddedTime)
-        > fBandwidthTracker->CurRetransmitTimeout()) {
       // Change:  Only expire packets after they were due to be resent. This gives the client
       // a chance to ack them and improves congestion avoidance and RTT calculation
       if (curTime > theEntry->fExpireTime) {
@@ -515,6 +557,7 @@ void RTPPacketResender::ResendDueEntries() {
         fBandwidthTracker->EmptyWindow(theEntry->fPacketSize);
         this->RemovePacket(packetIndex);
         //              s_printf("Expired packet %d\n", theEntry->fSeqNum);
+        packetIndex = nextIndex;
         continue;
       }
 
@@ -550,10 +593,8 @@ void RTPPacketResender::ResendDueEntries() {
       //          s_printf("Retransmitted packet %d\n", theEntry->fSeqNum);
       theEntry->fAddedTime = curTime;
       fBandwidthTracker->AdjustWindowForRetransmit();
-      continue;
+      this->ScheduleEntry(packetIndex, curTime + fBandwidthTracker->CurRetransmitTimeout() + 1);
+      packetIndex = nextIndex;
     }
-
   }
 }
-
-void RTPPacketResender::RemovePacket(RTPResenderEntry *inEntry) {Assert(0); }
@@ -31,6 +31,10 @@
     another timer for it's possible re-transmission.
     A duration timer is started to measure the RTT based on the client's ack.
 
+    Packets live in a power of 2 ring indexed by sequence number & fPacketArrayMask,
+    the re-transmit timers in a hashed timer wheel, so adding, acking and finding
+    the due packets cost O(1) per packet whatever the window size.
+
 */
 
 #ifndef __RTP_PACKET_RESENDER_H__
@@ -57,6 +61,12 @@ class RTPResenderEntry {
   SInt64 fOrigRetransTimeout;
   UInt32 fNumResends;
   UInt16 fSeqNum;
+
+  // timer wheel, fWheelNext/fWheelPrev are indices into the packet array
+  SInt64 fDueTime;
+  UInt32 fWheelSlot;
+  UInt32 fWheelNext;
+  UInt32 fWheelPrev;
 #if RTP_PACKET_RESENDER_DEBUGGING
   UInt32              fPacketArraySizeWhenAdded;
 #endif
@@ -151,25 +161,36 @@ class RTPPacketResender {
   DssDurationTimer    fInfoDisplayTimer;
 #endif
 
-  RTPResenderEntry *fPacketArray;
+  enum {
+    kNoEntry = 0xFFFFFFFF,
+    kWheelSize = 256,   // power of 2, the wheel spans 4 seconds, longer timeouts take more laps
+    kWheelTickMsec = 16
+  };
+
+  RTPResenderEntry *fPacketArray; // slot of a packet is its sequence number & fPacketArrayMask
   UInt16 fStartSeqNum;
   UInt32 fPacketArraySize;
   UInt32 fPacketArrayMask;
   UInt16 fHighestSeqNum;
-  UInt32 fLastUsed;
   CF::Core::Mutex fPacketQMutex;
 
-  RTPResenderEntry *GetEntryByIndex(UInt16 inIndex);
+  UInt32 fWheel[kWheelSize]; // first entry of each slot, kNoEntry if none
+  SInt64 fWheelTick;         // next tick ResendDueEntries looks at
 
   RTPResenderEntry *GetEntryBySeqNum(UInt16 inSeqNum);
 
+  // NULL if inSeqNum is already in the array
   RTPResenderEntry *GetEmptyEntry(UInt16 inSeqNum, UInt32 inPacketSize);
 
+  // doubles the ring, called when the window outgrows it
   void ReallocatePacketArray();
 
-  void RemovePacket(UInt32 packetIndex, bool reuse = true);
+  // keepWindow: the packet was neither acked nor expired, leave the window open
+  void RemovePacket(UInt32 packetIndex, bool keepWindow = false);
+
+  void ScheduleEntry(UInt32 packetIndex, SInt64 inDueTime);
 
-  void RemovePacket(RTPResenderEntry *inEntry);
+  void UnscheduleEntry(UInt32 packetIndex);
 
   static CF::BufferPool sBufferPool;
   static std::atomic_uint sNumWastedBytes;
@@ -31,6 +31,8 @@
 */
 
 #include "RTPSession.h"
+#include "RTPSessionPacer.h"
+#include "RTPSessionShedder.h"
 
 #define RTPSESSION_DEBUGGING 0
 
@@ -43,7 +45,16 @@ RTPSession::RTPSession() :
     fClosingReason(qtssCliSesCloseClientTeardown),
     fCurrentModule(0),
     fModuleDoingAsyncStuff(false),
-    fLastBandwidthTrackerStatsUpdate(0) {
+    fLastBandwidthTrackerStatsUpdate(0),
+    fPacer(nullptr),
+    fPaceNext(nullptr),
+    fPacePrev(nullptr),
+    fPaceSlot(RTPSessionPacer::kNoSlot),
+    fPaceTime(0),
+    fShedNewer(nullptr),
+    fShedOlder(nullptr),
+    fShedLinked(false),
+    fShedSignalled(false) {
 #if DEBUG
   fActivateCalled = false;
 #endif
@@ -173,6 +184,9 @@ QTSS_Error RTPSession::Activate(const StrPtrLen &inSessionID) {
   err = theServer->SetValue(qtssSvrClientSessions, theServer->GetNumRTPSessions(), &theSession, sizeof(theSession), QTSSDictionary::kDontObeyReadOnly);
   Assert(err == QTSS_NoErr);
 
+  // the bandwidth limit sheds the newest sessions first
+  RTPSessionShedder::Add(this);
+
 #if DEBUG
   fActivateCalled = true;
 #endif
@@ -383,8 +397,10 @@ void RTPSession::Teardown() {
   // Note that this function relies on the session mutex being grabbed, because
   // this fRTSPSession pointer could otherwise be being used simultaneously by
   // an RTP stream.
-  if (fRTSPSession != nullptr)
+  if (fRTSPSession != nullptr) {
+    fRTSPSession->RemoveIncomingDataHandlers(this);
     fRTSPSession->DecrementObjectHolderCount();
+  }
   fRTSPSession = nullptr;
   fState = qtssPausedState;
   this->Signal(kKillEvent);
@@ -483,13 +499,22 @@ SInt64 RTPSession::Run() {
 
       // We cannot block waiting to UnRegister, because we have to
       // give the RTSPSessionTask a chance to release the RTPSession.
-      RefTable *sessionTable = QTSServerInterface::GetServer()->GetRTPSessionMap();
+      ShardedRefTable *sessionTable = QTSServerInterface::GetServer()->GetRTPSessionMap();
       Assert(sessionTable != nullptr);
       if (!sessionTable->TryUnRegister(&fRTPMapElem)) {
         this->Signal(kKillEvent);// So that we get back to this place in the code
         return kCantGetMutexIdleTime;
       }
 
+      // no pacer wheel may call us once we are gone
+      RTPSessionPacer::Cancel(this);
+      RTPSessionShedder::Remove(this);
+
+      // nor an RTSP session pass us interleaved data, the closing modules
+      // free what the handlers push to. Unregistered, no Teardown can race this.
+      if (fRTSPSession != nullptr)
+        fRTSPSession->RemoveIncomingDataHandlers(this);
+
       // The ClientSessionClosing role is allowed to do async stuff
       fModuleState.curTask = this;
       fModuleDoingAsyncStuff = true;  // So that we know to jump back to the
@@ -535,50 +560,71 @@ SInt64 RTPSession::Run() {
   if ((fState == qtssPausedState) || (fModule == nullptr))
     return 0;  // 返回的是 0!
 
+  SInt64 theNextPacketTime = this->SendPackets(false);
+
+  // with pacing on a timer wheel calls us back, the task only runs for events
+  if (theNextPacketTime > 0 && RTPSessionPacer::IsEnabled()) {
+    RTPSessionPacer::Schedule(this, Core::Time::Milliseconds() + theNextPacketTime);
+    return 0;
+  }
+
+  return theNextPacketTime;  // 指定时间后被再度运行
+}
+
+SInt64 RTPSession::SendPackets(bool inTryLock) {
+  if ((fState == qtssPausedState) || (fModule == nullptr))
+    return 0;
+
+  QTSS_RoleParams theParams;
+  theParams.rtpSendPacketsParams.inClientSession = this;
+  theParams.rtpSendPacketsParams.outNextPacketTime = 0;
+
   // Make sure to grab the session mutex here, to protect the module against
   // RTSP requests coming in while it's sending packets
-  {
-    Core::MutexLocker locker(&fSessionMutex);
-
-    // just make sure we haven't been scheduled before our scheduled play
-    // time. If so, reschedule ourselves for the proper time. (if client
-    // sends a play while we are already playing, this may occur)
-    theParams.rtpSendPacketsParams.inCurrentTime = Core::Time::Milliseconds();
-    if (fNextSendPacketsTime > theParams.rtpSendPacketsParams.inCurrentTime) {
-      RTPStream **retransStream = nullptr;
-      UInt32 retransStreamLen = 0;
+  if (!inTryLock)
+    fSessionMutex.Lock();
+  else if (!fSessionMutex.TryLock())
+    return kSessionBusy;
+
+  // just make sure we haven't been scheduled before our scheduled play
+  // time. If so, reschedule ourselves for the proper time. (if client
+  // sends a play while we are already playing, this may occur)
+  theParams.rtpSendPacketsParams.inCurrentTime = Core::Time::Milliseconds();
+  if (fNextSendPacketsTime > theParams.rtpSendPacketsParams.inCurrentTime) {
+    RTPStream **retransStream = nullptr;
+    UInt32 retransStreamLen = 0;
 
-      //
-      // Send retransmits if we need to
-      for (UInt32 streamIter = 0; this->GetValuePtr(qtssCliSesStreamObjects, streamIter, (void **) &retransStream, &retransStreamLen) == QTSS_NoErr; streamIter++)
-        if (retransStream && *retransStream)
-          (*retransStream)->SendRetransmits();
+    //
+    // Send retransmits if we need to
+    for (UInt32 streamIter = 0; this->GetValuePtr(qtssCliSesStreamObjects, streamIter, (void **) &retransStream, &retransStreamLen) == QTSS_NoErr; streamIter++)
+      if (retransStream && *retransStream)
+        (*retransStream)->SendRetransmits();
 
-      theParams.rtpSendPacketsParams.outNextPacketTime = fNextSendPacketsTime - theParams.rtpSendPacketsParams.inCurrentTime;
-    } else {
+    theParams.rtpSendPacketsParams.outNextPacketTime = fNextSendPacketsTime - theParams.rtpSendPacketsParams.inCurrentTime;
+  } else {
 #if RTPSESSION_DEBUGGING
-      s_printf("RTPSession %" _S32BITARG_ ": about to call SendPackets\n", (SInt32)this);
+    s_printf("RTPSession %" _S32BITARG_ ": about to call SendPackets\n", (SInt32)this);
 #endif
-      if ((theParams.rtpSendPacketsParams.inCurrentTime - fLastBandwidthTrackerStatsUpdate) > 1000)
-        this->GetBandwidthTracker()->UpdateStats();
-
-      theParams.rtpSendPacketsParams.outNextPacketTime = 0;
-      // Async event registration is definitely allowed from this role.
-      fModuleState.eventRequested = false;
-      Assert(fModule != nullptr);
-      // 这里的 fModule 是在 RTSPSession::Run 函数里调用
-      // fRTPSession->SetPacketSendingModule 设置为找到的注册了 Role 的模块。
-      // QTSSFileModule 注册了 QTSS_RTPSendPackets_Role 的处理。
-      (void) fModule->CallDispatch(QTSS_RTPSendPackets_Role, &theParams);
+    if ((theParams.rtpSendPacketsParams.inCurrentTime - fLastBandwidthTrackerStatsUpdate) > 1000)
+      this->GetBandwidthTracker()->UpdateStats();
+
+    theParams.rtpSendPacketsParams.outNextPacketTime = 0;
+    // Async event registration is definitely allowed from this role.
+    fModuleState.eventRequested = false;
+    Assert(fModule != nullptr);
+    // 这里的 fModule 是在 RTSPSession::Run 函数里调用
+    // fRTPSession->SetPacketSendingModule 设置为找到的注册了 Role 的模块。
+    // QTSSFileModule 注册了 QTSS_RTPSendPackets_Role 的处理。
+    (void) fModule->CallDispatch(QTSS_RTPSendPackets_Role, &theParams);
 #if RTPSESSION_DEBUGGING
-      s_printf("RTPSession %" _S32BITARG_ ": back from sendPackets, nextPacketTime = %" _64BITARG_ "d\n", (SInt32)this, theParams.rtpSendPacketsParams.outNextPacketTime);
+    s_printf("RTPSession %" _S32BITARG_ ": back from sendPackets, nextPacketTime = %" _64BITARG_ "d\n", (SInt32)this, theParams.rtpSendPacketsParams.outNextPacketTime);
 #endif
-      //make sure not to get deleted accidently!
-      if (theParams.rtpSendPacketsParams.outNextPacketTime < 0)
-        theParams.rtpSendPacketsParams.outNextPacketTime = 0;
-      fNextSendPacketsTime = theParams.rtpSendPacketsParams.inCurrentTime + theParams.rtpSendPacketsParams.outNextPacketTime;
-    }
+    //make sure not to get deleted accidently!
+    if (theParams.rtpSendPacketsParams.outNextPacketTime < 0)
+      theParams.rtpSendPacketsParams.outNextPacketTime = 0;
+    fNextSendPacketsTime = theParams.rtpSendPacketsParams.inCurrentTime + theParams.rtpSendPacketsParams.outNextPacketTime;
   }
+  fSessionMutex.Unlock();
 
   //
   // Make sure the duration between calls to Run() isn't greater than the
@@ -602,6 +648,6 @@ SInt64 RTPSession::Run() {
     theParams.rtpSendPacketsParams.outNextPacketTime = theRetransDelayInMsec;
 
   Assert(theParams.rtpSendPacketsParams.outNextPacketTime >= 0);//we'd better not get deleted accidently!
-  return theParams.rtpSendPacketsParams.outNextPacketTime;  // 指定时间后被再度运行
+  return theParams.rtpSendPacketsParams.outNextPacketTime;
 }
 
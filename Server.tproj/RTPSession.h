@@ -47,6 +47,9 @@
 #include "RTPStream.h"
 #include "QTSSModule.h"
 
+class RTPSessionPacer;
+class RTPSessionShedder;
+
 class RTPSession : public RTPSessionInterface {
  public:
 
@@ -117,9 +120,17 @@ class RTPSession : public RTPSessionInterface {
 
  private:
 
+  friend class RTPSessionPacer;
+  friend class RTPSessionShedder;
+
   //where timeouts, deletion conditions get processed
   SInt64 Run() override;
 
+  // Calls the packet sending module (or only sends retransmits if it is not
+  // time yet), returns msec until the next call, 0 to wait for an event.
+  // With inTryLock it returns kSessionBusy rather than wait for the mutex.
+  SInt64 SendPackets(bool inTryLock);
+
   // Utility function used by Play
   UInt32 PowerOf2Floor(UInt32 inNumToFloor);
 
@@ -131,6 +142,10 @@ class RTPSession : public RTPSessionInterface {
     kCantGetMutexIdleTime = 10
   };
 
+  enum {
+    kSessionBusy = -1
+  };
+
   QTSSModule *fModule;
   bool fHasAnRTPStream;
   SInt32 fSessionQualityLevel;
@@ -161,6 +176,18 @@ class RTPSession : public RTPSessionInterface {
 #endif
   SInt64 fLastBandwidthTrackerStatsUpdate;
 
+  // owned by RTPSessionPacer, under the wheel's mutex
+  RTPSessionPacer *fPacer;
+  RTPSession *fPaceNext;
+  RTPSession *fPacePrev;
+  UInt32 fPaceSlot;
+  SInt64 fPaceTime;
+
+  // owned by RTPSessionShedder, under its mutex
+  RTPSession *fShedNewer;
+  RTPSession *fShedOlder;
+  bool fShedLinked;
+  bool fShedSignalled;
 };
 
 #endif //_RTPSESSION_H_
@@ -80,7 +80,8 @@ QTSSAttrInfoDict::AttrInfo  RTPSessionInterface::sAttributes[] =
         /* 34 */{"qtssCliSesRTCPPacketsRecv", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModePreempSafe},
         /* 35 */{"qtssCliSesRTCPBytesRecv", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModePreempSafe},
         /* 36 */{"qtssCliSesStartedThinning", NULL, qtssAttrDataTypeBool16, qtssAttrModeRead | qtssAttrModeWrite | qtssAttrModePreempSafe},
-        /* 37 */{"qtssCliSessLastRTSPBandwidth", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModePreempSafe}
+        /* 37 */{"qtssCliSessLastRTSPBandwidth", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModePreempSafe},
+        /* 38 */{"qtssCliSesTargetBitRate", NULL, qtssAttrDataTypeUInt32, qtssAttrModeRead | qtssAttrModeWrite | qtssAttrModePreempSafe}
     };
 
 void RTPSessionInterface::Initialize() {
@@ -131,7 +132,8 @@ RTPSessionInterface::RTPSessionInterface()
       fAuthQop(RTSPSessionInterface::kNoQop),
       fAuthNonceCount(0),
       fFramesSkipped(0),
-      fLastRTSPBandwidthHeaderBits(0) {
+      fLastRTSPBandwidthHeaderBits(0),
+      fTargetBitRate(0) {
   //don't actually setup the fTimeoutTask until the session has been bound!
   //(we don't want to get timeouts before the session gets bound)
 
@@ -190,6 +192,8 @@ RTPSessionInterface::RTPSessionInterface()
   this->SetVal(qtssCliSesStartedThinning, &fStartedThinning, sizeof(bool));
 
   this->SetVal(qtssCliSessLastRTSPBandwidth, &fLastRTSPBandwidthHeaderBits, sizeof(fLastRTSPBandwidthHeaderBits));
+
+  this->SetVal(qtssCliSesTargetBitRate, &fTargetBitRate, sizeof(fTargetBitRate));
 }
 
 void RTPSessionInterface::SetValueComplete(UInt32 inAttrIndex,
@@ -207,8 +211,10 @@ void RTPSessionInterface::SetValueComplete(UInt32 inAttrIndex,
 void RTPSessionInterface::UpdateRTSPSession(RTSPSessionInterface *inNewRTSPSession) {
   if (inNewRTSPSession != fRTSPSession) {
     // If there was an old session, let it know that we are done
-    if (fRTSPSession != NULL)
+    if (fRTSPSession != NULL) {
+      fRTSPSession->RemoveIncomingDataHandlers(this);
       fRTSPSession->DecrementObjectHolderCount();
+    }
 
     // Increment this count to prevent the RTSP session from being deleted
     fRTSPSession = inNewRTSPSession;
@@ -61,8 +61,10 @@ class RTPSessionInterface : public QTSSDictionary, public CF::Thread::Task {
   virtual ~RTPSessionInterface() {
     if (GetQualityLevel() != 0)
       QTSServerInterface::GetServer()->IncrementNumThinned(-1);
-    if (fRTSPSession != NULL)
+    if (fRTSPSession != NULL) {
+      fRTSPSession->RemoveIncomingDataHandlers(this);
       fRTSPSession->DecrementObjectHolderCount();
+    }
     delete[] fSRBuffer.Ptr;
     delete[] fAuthNonce.Ptr;
     delete[] fAuthOpaque.Ptr;
@@ -243,6 +245,9 @@ class RTPSessionInterface : public QTSSDictionary, public CF::Thread::Task {
     return maxRTSP;
   }
 
+  // qtssCliSesTargetBitRate, 0 without a flow control estimate
+  UInt32 GetTargetBitRate() { return fTargetBitRate; }
+
  protected:
   // These variables are setup by the derived RTPSession object when
   // Play and Pause get called
@@ -385,6 +390,7 @@ class RTPSessionInterface : public QTSSDictionary, public CF::Thread::Task {
   UInt32 fFramesSkipped;
 
   UInt32 fLastRTSPBandwidthHeaderBits;
+  UInt32 fTargetBitRate;
 };
 
 #endif //_RTPSESSIONINTERFACE_H_
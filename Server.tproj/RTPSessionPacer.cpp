@@ -0,0 +1,221 @@
+/*
+    File:       RTPSessionPacer.cpp
+
+    Contains:   Implementation of RTPSessionPacer
+*/
+
+#include <CF/Core/Time.h>
+
+#include "RTPSessionPacer.h"
+#include "RTPSession.h"
+
+using namespace CF;
+
+RTPSessionPacer **RTPSessionPacer::sWheels = nullptr;
+UInt32 RTPSessionPacer::sNumWheels = 0;
+UInt32 RTPSessionPacer::sTickMsec = 0;
+std::atomic_uint RTPSessionPacer::sNextWheel(0);
+
+void RTPSessionPacer::Initialize(UInt32 inNumWheels, UInt32 inTickMsec) {
+  if (inNumWheels == 0 || inTickMsec == 0)
+    return; // every session keeps its own timer
+
+  sTickMsec = inTickMsec;
+  sWheels = new RTPSessionPacer *[inNumWheels];
+  for (UInt32 x = 0; x < inNumWheels; x++)
+    sWheels[x] = new RTPSessionPacer(inTickMsec);
+  sNumWheels = inNumWheels;
+}
+
+RTPSessionPacer::RTPSessionPacer(UInt32 inTickMsec)
+    : Task(),
+      fMutex(),
+      fFireMutex(),
+      fFiringSession(nullptr),
+      fTickMsec(inTickMsec),
+      fWheelTick(0),
+      fNumSessions(0),
+      fRunMicros(0),
+      fFiring(nullptr) {
+  this->SetTaskName("RTPSessionPacer");
+  for (UInt32 x = 0; x < kWheelSize; x++)
+    fWheel[x] = nullptr;
+}
+
+void RTPSessionPacer::Schedule(RTPSession *inSession, SInt64 inSendTime) {
+  // only the session's own Run schedules it, fPacer needs no lock
+  RTPSessionPacer *theWheel = inSession->fPacer;
+  if (theWheel == nullptr) {
+    // a session stays on its wheel, round robin spreads them
+    theWheel = sWheels[sNextWheel.fetch_add(1) % sNumWheels];
+    inSession->fPacer = theWheel;
+  }
+
+  Core::MutexLocker locker(&theWheel->fMutex);
+  if (inSession->fPaceSlot != kNoSlot)
+    theWheel->Unlink(inSession);
+
+  bool wasIdle = (theWheel->fNumSessions == 0);
+  if (wasIdle) // the wheel stood still, start it at the current tick
+    theWheel->fWheelTick = Core::Time::Milliseconds() / theWheel->fTickMsec;
+
+  theWheel->Link(inSession, inSendTime);
+
+  if (wasIdle)
+    theWheel->Signal(kStartEvent);
+}
+
+void RTPSessionPacer::Cancel(RTPSession *inSession) {
+  RTPSessionPacer *theWheel = inSession->fPacer;
+  if (theWheel == nullptr)
+    return;
+
+  {
+    // the session may be in fFiring, Unlink finds it there too
+    Core::MutexLocker locker(&theWheel->fMutex);
+    if (theWheel->fFiringSession != inSession) {
+      if (inSession->fPaceSlot != kNoSlot)
+        theWheel->Unlink(inSession);
+      return;
+    }
+  }
+
+  // being sent right now, wait for that one send. The wheel may link it again after it.
+  Core::MutexLocker fireLocker(&theWheel->fFireMutex);
+  Core::MutexLocker locker(&theWheel->fMutex);
+  if (inSession->fPaceSlot != kNoSlot)
+    theWheel->Unlink(inSession);
+}
+
+void RTPSessionPacer::GetWheelStats(UInt32 inWheel, UInt32 *outNumSessions, UInt64 *outRunMicros) {
+  RTPSessionPacer *theWheel = sWheels[inWheel];
+  Core::MutexLocker locker(&theWheel->fMutex);
+  *outNumSessions = theWheel->fNumSessions;
+  *outRunMicros = theWheel->fRunMicros;
+}
+
+SInt64 RTPSessionPacer::AlignToTick(SInt64 inTime) {
+  if (sTickMsec == 0)
+    return inTime;
+  return ((inTime + sTickMsec - 1) / sTickMsec) * sTickMsec;
+}
+
+void RTPSessionPacer::Link(RTPSession *inSession, SInt64 inSendTime) {
+  // the first tick at or after inSendTime, never one already looked at
+  SInt64 theTick = (inSendTime + fTickMsec - 1) / fTickMsec;
+  if (theTick < fWheelTick)
+    theTick = fWheelTick;
+
+  UInt32 theSlot = (UInt32) theTick & (kWheelSize - 1);
+  inSession->fPaceTime = inSendTime;
+  inSession->fPaceSlot = theSlot;
+  inSession->fPacePrev = nullptr;
+  inSession->fPaceNext = fWheel[theSlot];
+  if (fWheel[theSlot] != nullptr)
+    fWheel[theSlot]->fPacePrev = inSession;
+  fWheel[theSlot] = inSession;
+  fNumSessions++;
+}
+
+void RTPSessionPacer::Unlink(RTPSession *inSession) {
+  RTPSession **theHead = (inSession->fPaceSlot == kFiringSlot) ? &fFiring : &fWheel[inSession->fPaceSlot];
+
+  if (inSession->fPacePrev != nullptr)
+    inSession->fPacePrev->fPaceNext = inSession->fPaceNext;
+  else
+    *theHead = inSession->fPaceNext;
+
+  if (inSession->fPaceNext != nullptr)
+    inSession->fPaceNext->fPacePrev = inSession->fPacePrev;
+
+  inSession->fPaceSlot = kNoSlot;
+  inSession->fPaceNext = inSession->fPacePrev = nullptr;
+  fNumSessions--;
+}
+
+SInt64 RTPSessionPacer::Fire(RTPSession *inSession, SInt64 inCurrentTime) {
+  // Some callbacks look for this struct in the thread object
+  Core::ThreadDataSetter theSetter(&inSession->fModuleState, NULL);
+
+  SInt64 theNextPacketTime = inSession->SendPackets(true);
+  if (theNextPacketTime == RTPSession::kSessionBusy)
+    return inCurrentTime + fTickMsec; // Run or an RTSP request has it, next tick
+
+  if (theNextPacketTime <= 0)
+    return 0; // paused, or the module waits for an event
+
+  return inCurrentTime + theNextPacketTime;
+}
+
+RTPSession *RTPSessionPacer::TakeDue(SInt64 inCurrentTime, SInt64 inCurrentTick) {
+  for (;;) {
+    while (fFiring != nullptr) {
+      RTPSession *theSession = fFiring;
+      SInt64 theSendTime = theSession->fPaceTime;
+      this->Unlink(theSession);
+
+      if (theSendTime <= inCurrentTime)
+        return theSession;
+
+      this->Link(theSession, theSendTime); // due on a later lap
+    }
+
+    if (fWheelTick > inCurrentTick)
+      return nullptr;
+
+    UInt32 theSlot = (UInt32) fWheelTick & (kWheelSize - 1);
+    fWheelTick++;
+
+    // take the slot, Cancel and Schedule can still find its sessions in fFiring
+    fFiring = fWheel[theSlot];
+    fWheel[theSlot] = nullptr;
+    for (RTPSession *theSession = fFiring; theSession != nullptr; theSession = theSession->fPaceNext)
+      theSession->fPaceSlot = kFiringSlot;
+  }
+}
+
+SInt64 RTPSessionPacer::Run() {
+  EventFlags theEvents = this->GetEvents();
+  if (theEvents & kKillEvent) return -1;
+
+  SInt64 theStartMicros = Core::Time::Microseconds();
+  SInt64 theCurrentTime = Core::Time::Milliseconds();
+  SInt64 theCurrentTick = theCurrentTime / fTickMsec;
+
+  {
+    Core::MutexLocker locker(&fMutex);
+    // after a stall one lap visits every slot
+    if (theCurrentTick - fWheelTick >= kWheelSize)
+      fWheelTick = theCurrentTick - kWheelSize + 1;
+  }
+
+  // One session at a time is taken off the wheel under fMutex and sent without it,
+  // so Schedule from other threads never waits for the sends of a tick.
+  for (;;) {
+    Core::MutexLocker fireLocker(&fFireMutex);
+    fMutex.Lock();
+
+    RTPSession *theSession = this->TakeDue(theCurrentTime, theCurrentTick);
+    if (theSession == nullptr) {
+      fRunMicros += (UInt64) (Core::Time::Microseconds() - theStartMicros);
+      UInt32 theNumSessions = fNumSessions;
+      fMutex.Unlock();
+
+      if (theNumSessions == 0)
+        return 0; // sleep until Schedule signals
+
+      return fTickMsec;
+    }
+
+    fFiringSession = theSession;
+    fMutex.Unlock();
+
+    SInt64 theSendTime = this->Fire(theSession, theCurrentTime);
+
+    Core::MutexLocker locker(&fMutex);
+    fFiringSession = nullptr;
+    // Schedule may have linked it meanwhile
+    if (theSendTime > 0 && theSession->fPaceSlot == kNoSlot)
+      this->Link(theSession, theSendTime);
+  }
+}
@@ -0,0 +1,96 @@
+/*
+    File:       RTPSessionPacer.h
+
+    Contains:   Timer wheels that pace packet sending for all RTPSessions.
+
+                Instead of every session returning its next packet time from
+                Run and getting a timer of its own in the task scheduler, a
+                playing session is linked into one of the wheels (one per
+                short task thread). Each wheel ticks every
+                rtp_pacing_tick_msec and calls the due sessions one after
+                another, so 20k sessions cost the scheduler one wakeup per
+                wheel and tick.
+
+                A single level is enough, RTPSession::Run caps the time to
+                the next send at max_retransmit_delay. Sessions further out
+                stay in their slot for more laps.
+*/
+
+#ifndef __RTP_SESSION_PACER_H__
+#define __RTP_SESSION_PACER_H__
+
+#include <atomic>
+
+#include <CF/Thread/Task.h>
+
+class RTPSession;
+
+class RTPSessionPacer : public CF::Thread::Task {
+ public:
+
+  // Creates inNumWheels wheels ticking every inTickMsec, 0 for either leaves pacing off
+  static void Initialize(UInt32 inNumWheels, UInt32 inTickMsec);
+
+  static bool IsEnabled() { return sNumWheels > 0; }
+
+  // Sends for inSession at inSendTime (absolute msec), moving it if it is already scheduled
+  static void Schedule(RTPSession *inSession, SInt64 inSendTime);
+
+  // After it returns no wheel touches inSession again, call before deleting it.
+  // Only waits when the wheel is sending for inSession at that moment.
+  static void Cancel(RTPSession *inSession);
+
+  // inTime rounded up to a tick, writers that block retry on the same tick
+  static SInt64 AlignToTick(SInt64 inTime);
+
+  static UInt32 GetNumWheels() { return sNumWheels; }
+
+  // Sessions on wheel inWheel and the total time its Run has taken so far
+  static void GetWheelStats(UInt32 inWheel, UInt32 *outNumSessions, UInt64 *outRunMicros);
+
+  enum {
+    kNoSlot = 0xFFFFFFFF         // RTPSession::fPaceSlot of a session in no wheel
+  };
+
+ private:
+
+  enum {
+    kWheelSize = 512,            // power of 2, 1 second at a 2 msec tick
+    kFiringSlot = 0xFFFFFFFE     // in fFiring, being called this tick
+  };
+
+  explicit RTPSessionPacer(UInt32 inTickMsec);
+
+  ~RTPSessionPacer() override = default;
+
+  SInt64 Run() override;
+
+  // call with fMutex held
+  void Link(RTPSession *inSession, SInt64 inSendTime);
+
+  void Unlink(RTPSession *inSession);
+
+  // The next session due by inCurrentTime, unlinked, nullptr once the slots up to
+  // inCurrentTick are done. Sessions due on a later lap are linked again. fMutex held.
+  RTPSession *TakeDue(SInt64 inCurrentTime, SInt64 inCurrentTick);
+
+  // Calls one due session, returns the absolute time to call it again, 0 for never
+  SInt64 Fire(RTPSession *inSession, SInt64 inCurrentTime);
+
+  CF::Core::Mutex fMutex;         // the wheel, never held while sending
+  CF::Core::Mutex fFireMutex;     // held by Run around each send, taken before fMutex
+  RTPSession *fFiringSession;     // being sent, under fMutex
+  UInt32 fTickMsec;
+  SInt64 fWheelTick;              // next tick Run looks at
+  UInt32 fNumSessions;
+  UInt64 fRunMicros;              // total time in Run
+  RTPSession *fWheel[kWheelSize]; // first session of each slot
+  RTPSession *fFiring;            // sessions taken off the current slot
+
+  static RTPSessionPacer **sWheels;
+  static UInt32 sNumWheels;
+  static UInt32 sTickMsec;
+  static std::atomic_uint sNextWheel;
+};
+
+#endif //__RTP_SESSION_PACER_H__
@@ -0,0 +1,76 @@
+/*
+    File:       RTPSessionShedder.cpp
+
+    Contains:   Implementation of RTPSessionShedder
+*/
+
+#include "RTPSessionShedder.h"
+#include "RTPSession.h"
+
+using namespace CF;
+
+Core::Mutex RTPSessionShedder::sMutex;
+RTPSession *RTPSessionShedder::sNewest = nullptr;
+
+void RTPSessionShedder::Add(RTPSession *inSession) {
+  Core::MutexLocker locker(&sMutex);
+
+  // sessions are activated about in creation order, this rarely walks at all
+  SInt64 theCreateTime = inSession->GetSessionCreateTime();
+  RTPSession *theNewer = nullptr;
+  RTPSession *theOlder = sNewest;
+  while (theOlder != nullptr && theOlder->GetSessionCreateTime() > theCreateTime) {
+    theNewer = theOlder;
+    theOlder = theOlder->fShedOlder;
+  }
+
+  inSession->fShedNewer = theNewer;
+  inSession->fShedOlder = theOlder;
+  if (theNewer != nullptr)
+    theNewer->fShedOlder = inSession;
+  else
+    sNewest = inSession;
+  if (theOlder != nullptr)
+    theOlder->fShedNewer = inSession;
+
+  inSession->fShedLinked = true;
+}
+
+void RTPSessionShedder::Remove(RTPSession *inSession) {
+  // waits for a Shed in progress, the session may be signalled from it
+  Core::MutexLocker locker(&sMutex);
+  if (!inSession->fShedLinked)
+    return;
+
+  if (inSession->fShedNewer != nullptr)
+    inSession->fShedNewer->fShedOlder = inSession->fShedOlder;
+  else
+    sNewest = inSession->fShedOlder;
+
+  if (inSession->fShedOlder != nullptr)
+    inSession->fShedOlder->fShedNewer = inSession->fShedNewer;
+
+  inSession->fShedNewer = inSession->fShedOlder = nullptr;
+  inSession->fShedLinked = false;
+}
+
+UInt32 RTPSessionShedder::Shed(SInt64 inCurrentTime, SInt64 inSafePlayMsec, UInt32 inMaxSessions) {
+  Core::MutexLocker locker(&sMutex);
+
+  UInt32 theNumShed = 0;
+  for (RTPSession *theSession = sNewest; theSession != nullptr && theNumShed < inMaxSessions;
+       theSession = theSession->fShedOlder) {
+    // all the sessions after this one have played for even longer
+    if (inCurrentTime - theSession->GetSessionCreateTime() >= inSafePlayMsec)
+      break;
+
+    if (theSession->fShedSignalled) // still closing
+      continue;
+
+    theSession->fShedSignalled = true;
+    theSession->Signal(Thread::Task::kKillEvent);
+    theNumShed++;
+  }
+
+  return theNumShed;
+}
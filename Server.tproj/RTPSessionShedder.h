@@ -0,0 +1,41 @@
+/*
+    File:       RTPSessionShedder.h
+
+    Contains:   Picks the client sessions to disconnect while the server is
+                over maximum_bandwidth.
+
+                Every activated RTPSession is linked into one list ordered
+                by creation time, newest first. The stats task takes its
+                victims from the head of the list instead of walking the
+                whole RTP session map under its mutex, and can shed several
+                sessions in one pass.
+*/
+
+#ifndef __RTP_SESSION_SHEDDER_H__
+#define __RTP_SESSION_SHEDDER_H__
+
+#include <CF/Core/Mutex.h>
+
+class RTPSession;
+
+class RTPSessionShedder {
+ public:
+
+  // Activate links the session, the kill path unlinks it before the
+  // ClientSessionClosing role runs
+  static void Add(RTPSession *inSession);
+
+  static void Remove(RTPSession *inSession);
+
+  // Signals kKillEvent to at most inMaxSessions sessions, newest first, that
+  // were created less than inSafePlayMsec before inCurrentTime. Sessions
+  // signalled by an earlier pass are skipped. Returns the number signalled.
+  static UInt32 Shed(SInt64 inCurrentTime, SInt64 inSafePlayMsec, UInt32 inMaxSessions);
+
+ private:
+
+  static CF::Core::Mutex sMutex;
+  static RTPSession *sNewest;
+};
+
+#endif //__RTP_SESSION_SHEDDER_H__
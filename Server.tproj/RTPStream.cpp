@@ -42,6 +42,8 @@
 #include <CF/Net/Socket/SocketUtils.h>
 
 #include "RTPStream.h"
+#include "UDPSendBatch.h"
+#include "RTPSessionPacer.h"
 
 #include "QTSSModuleUtils.h"
 
@@ -49,6 +51,7 @@
 #include "RTCPAPPQTSSPacket.h"
 #include "RTCPAckPacket.h"
 #include "RTCPAPPNADUPacket.h"
+#include "RTCPFeedbackPacket.h"
 
 #if DEBUG
 #define RTP_TCP_STREAM_DEBUG 1
@@ -214,6 +217,7 @@ RTPStream::RTPStream(UInt32 inSSRC, RTPSessionInterface *inSession)
       fStalePacketsDropped(0),
       fLastCurrentPacketDelay(0),
       fWaitOnLevelAdjustment(true),
+      fLastTargetBitRate(0),
       fBufferDelay(3.0),
       fLateToleranceInSec(0),
       fCurrentAckTimeout(0),
@@ -734,7 +738,8 @@ void RTPStream::UDPMonitorWrite(void *thePacketData, UInt32 inLen, bool isRTCP)
 */
 
 //ReliableRTPWrite must be called from a fSession mutex protected caller
-QTSS_Error RTPStream::InterleavedWrite(void *inBuffer, UInt32 inLen, UInt32 *outLenWritten, unsigned char channel) {
+QTSS_Error RTPStream::InterleavedWrite(void *inBuffer, UInt32 inLen, UInt32 *outLenWritten, unsigned char channel,
+                                      bool inQueue) {
 
   if (fSession->GetRTSPSession() == NULL) { // RTSPSession required for interleaved write
     return EAGAIN;
@@ -744,7 +749,13 @@ QTSS_Error RTPStream::InterleavedWrite(void *inBuffer, UInt32 inLen, UInt32 *out
 
   //char blahblah[2048];
 
-  QTSS_Error err = fSession->GetRTSPSession()->InterleavedWrite(inBuffer, inLen, outLenWritten, channel);
+  QTSS_Error err = QTSS_NoErr;
+  if (inQueue) {
+    err = fSession->GetRTSPSession()->QueueInterleavedWrite(inBuffer, inLen, channel);
+    if (err == QTSS_NoErr && outLenWritten != NULL)
+      *outLenWritten = inLen;
+  } else
+    err = fSession->GetRTSPSession()->InterleavedWrite(inBuffer, inLen, outLenWritten, channel);
   //QTSS_Error err = fSession->GetRTSPSession()->InterleavedWrite( blahblah, 2044, outLenWritten, channel);
 #if DEBUG
   //if (outLenWritten != NULL)
@@ -772,6 +783,17 @@ QTSS_Error RTPStream::InterleavedWrite(void *inBuffer, UInt32 inLen, UInt32 *out
   return err;
 }
 
+QTSS_Error RTPStream::Flush() {
+  if (fTransportType != qtssRTPTransportTypeTCP)
+    return QTSS_NoErr;
+
+  Core::MutexLocker locker(fSession->GetRTSPSessionMutex());
+  if (fSession->GetRTSPSession() == NULL) // the queue went with the connection
+    return QTSS_NoErr;
+
+  return fSession->GetRTSPSession()->FlushInterleaved();
+}
+
 // SendRetransmits must be called from a fSession mutex protected caller
 void RTPStream::SendRetransmits() {
   if (fTransportType == qtssRTPTransportTypeReliableUDP)
@@ -864,8 +886,11 @@ void RTPStream::SetThinningParams() {
 }
 
 void RTPStream::SetInitialMaxQualityLevel() {
+  this->SetMaxQualityForBandwidth(GetSession().GetMaxBandwidthBits());
+}
+
+void RTPStream::SetMaxQualityForBandwidth(UInt32 bandwidth) {
   UInt32 movieBitRate = GetSession().GetMovieAvgBitrate();
-  UInt32 bandwidth = GetSession().GetMaxBandwidthBits();
   if (bandwidth != 0 && movieBitRate != 0) {
     double ratio = movieBitRate / static_cast<double>(bandwidth);
 
@@ -886,6 +911,15 @@ bool RTPStream::UpdateQualityLevel(const SInt64 &inTransmitTime, const SInt64 &i
   if (inTransmitTime <= fSession->GetPlayTime())
     return true;
 
+  // the flow control module's estimate of the path caps the best quality level
+  if (fSession->GetTargetBitRate() != fLastTargetBitRate) {
+    fLastTargetBitRate = fSession->GetTargetBitRate();
+    UInt32 theBandwidth = fSession->GetMaxBandwidthBits();
+    if (fLastTargetBitRate != 0 && (theBandwidth == 0 || fLastTargetBitRate < theBandwidth))
+      theBandwidth = fLastTargetBitRate;
+    this->SetMaxQualityForBandwidth(theBandwidth);
+  }
+
   //->geyijyn@20150427
   //---视频流不进行thinning 算法丢帧
   //<-
@@ -1019,6 +1053,7 @@ QTSS_Error RTPStream::Write(void *inBuffer, UInt32 inLen, UInt32 *outLenWritten,
           fSession->GetOverbufferWindow()->CheckTransmitTime(thePacket->packetTransmitTime, theTime, inLen);
       if (thePacket->suggestedWakeupTime > theTime) {
         Assert(thePacket->suggestedWakeupTime >= fSession->GetOverbufferWindow()->GetSendInterval());
+        thePacket->suggestedWakeupTime = RTPSessionPacer::AlignToTick(thePacket->suggestedWakeupTime);
         fSession->GetSessionMutex()->Unlock();// Make sure to unlock the mutex
         return QTSS_WouldBlock;
       }
@@ -1048,6 +1083,8 @@ QTSS_Error RTPStream::Write(void *inBuffer, UInt32 inLen, UInt32 *outLenWritten,
 #endif
       //s_printf("Overbuffer window full. Returning: %qd\n", thePacket->suggestedWakeupTime - theTime);
 
+      // retry on a pacer tick, blocked writers of a reflector wake up together
+      thePacket->suggestedWakeupTime = RTPSessionPacer::AlignToTick(thePacket->suggestedWakeupTime);
       fSession->GetSessionMutex()->Unlock();// Make sure to unlock the mutex
       return QTSS_WouldBlock;
     }
@@ -1057,11 +1094,19 @@ QTSS_Error RTPStream::Write(void *inBuffer, UInt32 inLen, UInt32 *outLenWritten,
     // also tells us whether this packet is just too old to send
     if (this->UpdateQualityLevel(thePacket->packetTransmitTime, theCurrentPacketDelay, theTime, inLen)) {
       if (fTransportType == qtssRTPTransportTypeTCP) {   // write out in interleave format on the RTSP TCP channel.
-        err = this->InterleavedWrite(thePacket->packetData, inLen, outLenWritten, fRTPChannel);
+        // like the UDP batch, a buffered write queues the packet until the caller flushes this stream
+        bool theQueue = (inFlags & qtssWriteFlagsBufferData) && UDPSendBatch::IsInterleavedEnabled()
+            && UDPSendBatch::GetCurrent() != nullptr;
+        err = this->InterleavedWrite(thePacket->packetData, inLen, outLenWritten, fRTPChannel, theQueue);
       } else if (fTransportType == qtssRTPTransportTypeReliableUDP) {
         err = this->ReliableRTPWrite(thePacket->packetData, inLen, theCurrentPacketDelay);
       } else if (inLen > 0) {
-        (void) fSockets->GetSocketA()->SendTo(fRemoteAddr, fRemoteRTPPort, thePacket->packetData, inLen);
+        // the caller keeps packetData alive until its UDPSendBatch is flushed
+        UDPSendBatch *theBatch = (inFlags & qtssWriteFlagsBufferData) ? UDPSendBatch::GetCurrent() : nullptr;
+        if (theBatch != nullptr)
+          theBatch->Add(fSockets->GetSocketA()->GetSocketFD(), fRemoteAddr, fRemoteRTPPort, thePacket->packetData, inLen);
+        else
+          (void) fSockets->GetSocketA()->SendTo(fRemoteAddr, fRemoteRTPPort, thePacket->packetData, inLen);
 
         this->UDPMonitorWrite(thePacket->packetData, inLen, kIsRTPPacket);
       }
@@ -1520,6 +1565,29 @@ void RTPStream::ProcessIncomingRTCPPacket(StrPtrLen *inPacket) {
       }
         break;
 
+      case RTCPPacket::kTransportFeedbackPacketType: {
+        DEBUG_RTCP_PRINTF(("RTPStream::ProcessIncomingRTCPPacket kTransportFeedbackPacketType\n"));
+        // Generic NACKs are answered by the RTCP process modules (the reflector
+        // re-sends from its packet queue), other formats are ignored.
+#ifdef DEBUG_RTCP_PACKETS
+        RTCPNackPacket nackPacket;
+        if (nackPacket.ParseNackPacket((UInt8*)currentPtr.Ptr, currentPtr.Len))
+            nackPacket.Dump();
+#endif
+      }
+        break;
+
+      case RTCPPacket::kPayloadFeedbackPacketType: {
+        DEBUG_RTCP_PRINTF(("RTPStream::ProcessIncomingRTCPPacket kPayloadFeedbackPacketType\n"));
+        // PLI/FIR, the reflector asks its broadcaster for a keyframe
+#ifdef DEBUG_RTCP_PACKETS
+        RTCPPliPacket pliPacket;
+        if (pliPacket.ParsePliPacket((UInt8*)currentPtr.Ptr, currentPtr.Len))
+            pliPacket.Dump();
+#endif
+      }
+        break;
+
       default: DEBUG_RTCP_PRINTF(("RTPStream::ProcessIncomingRTCPPacket Unknown Packet Type\n"));
         //  WarnV(false, "Unknown RTCP Packet Type");
         break;
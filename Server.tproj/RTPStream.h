@@ -106,6 +106,9 @@ class RTPStream : public QTSSDictionary, public CF::Net::UDPDemuxerTask {
   // either qtssWriteFlagsIsRTP or qtssWriteFlagsIsRTCP
   QTSS_Error Write(void *inBuffer, UInt32 inLen, UInt32 *outLenWritten, QTSS_WriteFlags inFlags) override;
 
+  // Sends the RTP packets queued on the RTSP connection by batched interleaved
+  // writes, the caller's packet data is not referenced after it returns
+  QTSS_Error Flush() override;
 
   //UTILITY FUNCTIONS:
   //These are not necessary to call and do not manipulate the state of the
@@ -319,6 +322,7 @@ class RTPStream : public QTSSDictionary, public CF::Net::UDPDemuxerTask {
   UInt32 fStalePacketsDropped;
   SInt64 fLastCurrentPacketDelay;
   bool fWaitOnLevelAdjustment;
+  UInt32 fLastTargetBitRate; // qtssCliSesTargetBitRate the quality limit was set for
 
   Float32 fBufferDelay; // from the sdp
   Float32 fLateToleranceInSec;
@@ -358,7 +362,9 @@ class RTPStream : public QTSSDictionary, public CF::Net::UDPDemuxerTask {
 
   //-----------------------------------------------------------
   // acutally write the data out that way
-  QTSS_Error InterleavedWrite(void *inBuffer, UInt32 inLen, UInt32 *outLenWritten, unsigned char channel);
+  // inQueue leaves the packet in the RTSP session's writev queue until Flush
+  QTSS_Error InterleavedWrite(void *inBuffer, UInt32 inLen, UInt32 *outLenWritten, unsigned char channel,
+                              bool inQueue = false);
 
   // implements the ReliableRTP protocol
   QTSS_Error ReliableRTPWrite(void *inBuffer, UInt32 inLen, const SInt64 &curPacketDelay);
@@ -383,6 +389,9 @@ class RTPStream : public QTSSDictionary, public CF::Net::UDPDemuxerTask {
 
   void SetInitialMaxQualityLevel();
 
+  // Limits the quality level to what bandwidth (bits/sec) carries of the movie bit rate
+  void SetMaxQualityForBandwidth(UInt32 bandwidth);
+
   char *GetStreamTypeStr();
 
   enum {
@@ -40,13 +40,44 @@ RTSPRequestStream::RTSPRequestStream(CF::Net::TCPSocket *sock)
     : fSocket(sock),
       fRetreatBytes(0),
       fRetreatBytesRead(0),
+      fBuffer(fRequestBuffer),
+      fBufferSize(kRequestBufferSizeInBytes),
       fCurOffset(0),
+      fDecodeBuffer(NULL),
       fEncodedBytesRemaining(0),
       fRequest(fRequestBuffer, 0),
       fRequestPtr(NULL),
       fDecode(false),
+      fIsDataPacket(false),
       fPrintRTSP(false) {}
 
+void RTSPRequestStream::SetPushBufferSize(UInt32 inSize) {
+  // base64 decodes into a buffer of its own, and there must be room for a
+  // whole frame behind a compacted leftover
+  if (fDecode || (fBuffer != &fRequestBuffer[0]) || (inSize <= kRequestBufferSizeInBytes + kMaxInterleavedFrameSize))
+    return;
+
+  // the unread data keeps its offset, fRequest and the retreat bytes point into it
+  char *theBuffer = new char[inSize];
+  ::memcpy(theBuffer, fBuffer, fCurOffset);
+  fRequest.Ptr = theBuffer + (fRequest.Ptr - fBuffer);
+  fBuffer = theBuffer;
+  fBufferSize = inSize;
+}
+
+UInt32 RTSPRequestStream::GetFrameLen(char *inFrame, UInt32 inLen) {
+  if (inLen < 4)
+    return 0;
+
+  // frames follow each other at any offset, don't read the length as an aligned UInt16
+  UInt16 theDataLen;
+  ::memcpy(&theDataLen, &inFrame[2], 2);
+  UInt32 theFrameLen = ntohs(theDataLen) + 4;
+  if (theFrameLen > inLen)
+    return 0;
+  return theFrameLen;
+}
+
 void RTSPRequestStream::SnarfRetreat(RTSPRequestStream &fromRequest) {
   // Simplest thing to do is to just completely blow away everything in this current
   // stream, and replace it with the retreat bytes from the other stream.
@@ -67,7 +98,23 @@ QTSS_Error RTSPRequestStream::ReadRequest() {
     // with the request and want to move onto the next one. The first thing we should do
     // is check whether there is any lingering data in the stream. If there is, the parent
     // session believes that is part of a new request
-    if (fRequestPtr != NULL) {
+    if ((fRequestPtr != NULL) && (fBuffer != &fRequestBuffer[0])) {
+      fRequestPtr = NULL;
+
+      // With a push buffer the next request starts where this one ended. The
+      // leftover (at most a partial frame after a run of data packets) only
+      // goes back to the front when a whole frame may not fit behind it.
+      char *theLeftover = fRequest.Ptr + fRequest.Len + fRetreatBytesRead;
+      if ((fRetreatBytes == 0) || ((UInt32) (theLeftover - fBuffer) + kMaxInterleavedFrameSize >= fBufferSize)) {
+        ::memmove(fBuffer, theLeftover, fRetreatBytes);
+        theLeftover = fBuffer;
+        fCurOffset = fRetreatBytes;
+      }
+
+      fRequest.Ptr = theLeftover;
+      newOffset = fRequest.Len = fRetreatBytes;
+      fRetreatBytes = fRetreatBytesRead = 0;
+    } else if (fRequestPtr != NULL) {
       fRequestPtr = NULL; // flag that we no longer have a complete request
 
       // Take all the retreated leftover data and move it to the beginning of the buffer
@@ -110,7 +157,7 @@ QTSS_Error RTSPRequestStream::ReadRequest() {
       } else {
         // We don't have any new data, get some from the socket...
         // NOTE: the socket is non blocking
-        QTSS_Error sockErr = fSocket->Read(&fRequestBuffer[fCurOffset], (kRequestBufferSizeInBytes - fCurOffset) - 1, &newOffset);
+        QTSS_Error sockErr = fSocket->Read(&fBuffer[fCurOffset], (fBufferSize - fCurOffset) - 1, &newOffset);
         // assume the client is dead if we get an error back
         if (sockErr == EAGAIN)
           return QTSS_NoErr;
@@ -131,7 +178,7 @@ QTSS_Error RTSPRequestStream::ReadRequest() {
         if (decodeErr == QTSS_NoErr) Assert(fEncodedBytesRemaining < 4);
       } else
         fRequest.Len += newOffset;
-      Assert(fRequest.Len < kRequestBufferSizeInBytes);
+      Assert(fRequest.Len < fBufferSize);
       fCurOffset += newOffset;
     }
     Assert(newOffset > 0);
@@ -153,17 +200,20 @@ QTSS_Error RTSPRequestStream::ReadRequest() {
        * 按 data length 读取数据包，会对封装在同一个 TCP 包的多个 RTP 包进行分拆
        */
 
-      // check header length
-      if (fRequest.Len < 4)
+      // wait for the header and the whole packet
+      UInt32 interleavedPacketLen = GetFrameLen(fRequest.Ptr, fRequest.Len);
+      if (interleavedPacketLen == 0)
         continue;
 
-      // check packet length
-      UInt16 *dataLenP = (UInt16 *) fRequest.Ptr;
-      UInt32 interleavedPacketLen = ntohs(dataLenP[1]) + 4;
-      if (interleavedPacketLen > fRequest.Len)
-        continue;
+      // 一次读到的所有完整帧一起交出去，不再每帧走一遍 RTSPSession::Run
+      while ((interleavedPacketLen < fRequest.Len) && ('$' == fRequest.Ptr[interleavedPacketLen])) {
+        UInt32 theFrameLen = GetFrameLen(fRequest.Ptr + interleavedPacketLen, fRequest.Len - interleavedPacketLen);
+        if (theFrameLen == 0)
+          break;
+        interleavedPacketLen += theFrameLen;
+      }
 
-      // put back any data that is not part of the header
+      // put back any data that is not part of the frames
       fRetreatBytes += fRequest.Len - interleavedPacketLen;
       fRequest.Len = interleavedPacketLen;
 
@@ -252,7 +302,7 @@ QTSS_Error RTSPRequestStream::ReadRequest() {
     }
 
     // check for a full buffer
-    if (fCurOffset == kRequestBufferSizeInBytes - 1) {
+    if (fCurOffset == fBufferSize - 1) {
       fRequestPtr = &fRequest;
       return E2BIG;
     }
@@ -308,8 +358,9 @@ QTSS_Error RTSPRequestStream::DecodeIncomingData(char *inSrcData,
                                                  UInt32 inSrcDataLen) {
   Assert(fRetreatBytes == 0);
 
-  if (fRequest.Ptr == &fRequestBuffer[0]) {
-    fRequest.Ptr = new char[kRequestBufferSizeInBytes];
+  if (fDecodeBuffer == NULL) {
+    fDecodeBuffer = new char[kRequestBufferSizeInBytes];
+    fRequest.Ptr = fDecodeBuffer;
     fRequest.Len = 0;
   }
 
@@ -51,9 +51,11 @@ class RTSPRequestStream {
   explicit RTSPRequestStream(CF::Net::TCPSocket *sock);
 
   // We may have to delete this memory if it was allocated due to base64 decoding
+  // or for a pushing client
   ~RTSPRequestStream() {
-    if (fRequest.Ptr != &fRequestBuffer[0])
-      delete[] fRequest.Ptr;
+    delete[] fDecodeBuffer;
+    if (fBuffer != &fRequestBuffer[0])
+      delete[] fBuffer;
   }
 
   //ReadRequest
@@ -90,8 +92,16 @@ class RTSPRequestStream {
    */
   CF::StrPtrLen *GetRequestBuffer() { return fRequestPtr; }
 
+  // When true the request buffer holds one or more complete interleaved
+  // frames back to back, every one starting with its 4 byte '$' header.
   bool IsDataPacket() { return fIsDataPacket; }
 
+  // Reads into a buffer of inSize bytes from now on, for clients that push
+  // interleaved RTP (RECORD). All complete frames of a read come back as one
+  // data packet, and the leftover is moved to the front only when the room
+  // behind it gets smaller than a whole frame. Ignored for base64 tunnels.
+  void SetPushBufferSize(UInt32 inSize);
+
   void ShowRTSP(bool enable) { fPrintRTSP = enable; }
 
   void SnarfRetreat(RTSPRequestStream &fromRequest);
@@ -100,9 +110,13 @@ class RTSPRequestStream {
 
   // CONSTANTS:
   enum {
-    kRequestBufferSizeInBytes = QTSS_MAX_REQUEST_BUFFER_SIZE  // UInt32
+    kRequestBufferSizeInBytes = QTSS_MAX_REQUEST_BUFFER_SIZE,  // UInt32
+    kMaxInterleavedFrameSize = 4 + 65535                        // header and the largest 16 bit length
   };
 
+  // Length of the complete '$' frame at inFrame, 0 if it is not all in the buffer yet
+  static UInt32 GetFrameLen(char *inFrame, UInt32 inLen);
+
   // Base64 decodes into fRequest.Ptr, updates fRequest.Len, and returns the amount
   // of data left undecoded in inSrcData
   QTSS_Error DecodeIncomingData(char *inSrcData, UInt32 inSrcDataLen);
@@ -112,7 +126,10 @@ class RTSPRequestStream {
   UInt32 fRetreatBytesRead; // Used by Read() when it is reading RetreatBytes
 
   char fRequestBuffer[kRequestBufferSizeInBytes];
+  char *fBuffer;       // fRequestBuffer, or the push buffer once SetPushBufferSize was called
+  UInt32 fBufferSize;
   UInt32 fCurOffset; // tracks how much valid data is in the above buffer
+  char *fDecodeBuffer; // base64 decoded requests
   UInt32 fEncodedBytesRemaining; // If we are decoding, tracks how many encoded bytes are in the buffer
 
   CF::StrPtrLen fRequest;     // received request data
@@ -1048,6 +1048,12 @@ SInt64 RTSPSession::Run() {
           }
         }
 
+        // A client that started recording pushes its media over this connection
+        // from now on, give it the large input buffer
+        if (!fInputStream.IsDataPacket() && (fRequest != nullptr) &&
+            (fRequest->GetMethod() == qtssRecordMethod) && (fRequest->GetStatus() == qtssSuccessOK))
+          fInputStream.SetPushBufferSize(QTSServerInterface::GetServer()->GetPrefs()->GetRTSPPushBufferSize());
+
         // If we've gotten here, we've flushed all the data. Cleanup,
         // and wait for our next request!
         // 置空fRTPSession、fRequest!调用 fSessionMutex.Unlock()、fReadMutex.Unlock() ;
@@ -1063,7 +1069,7 @@ SInt64 RTSPSession::Run() {
 
   //fObjectHolders--
   if (!IsLiveSession() && fObjectHolders > 0) {
-    RefTable *theMap = QTSServerInterface::GetServer()->GetRTPSessionMap();
+    ShardedRefTable *theMap = QTSServerInterface::GetServer()->GetRTPSessionMap();
     Ref *theRef = theMap->Resolve(&fLastRTPSessionIDPtr);
     if (theRef != nullptr) {
       fRTPSession = (RTPSession *) theRef->GetObject();
@@ -1567,7 +1573,7 @@ void RTSPSession::SetupRequest() {
   // let's also refresh RTP session timeout so that it's kept alive in sync with the RTSP session.
   //
   // Attempt to find the RTP session for this request.
-  RefTable *theMap = QTSServerInterface::GetServer()->GetRTPSessionMap();
+  ShardedRefTable *theMap = QTSServerInterface::GetServer()->GetRTPSessionMap();
   theErr = this->FindRTPSession(theMap);
 
   if (fRTPSession != nullptr) {
@@ -1691,7 +1697,7 @@ void RTSPSession::SetupRequest() {
 void RTSPSession::CleanupRequest() {
   if (fRTPSession != nullptr) {
     // Release the ref.
-    RefTable *theMap = QTSServerInterface::GetServer()->GetRTPSessionMap();
+    ShardedRefTable *theMap = QTSServerInterface::GetServer()->GetRTPSessionMap();
     theMap->Release(fRTPSession->GetRef());
 
     // nullptr out any references to this RTP session
@@ -1726,7 +1732,7 @@ void RTSPSession::CleanupRequest() {
   this->SetRequestBodyLength(-1);
 }
 
-QTSS_Error RTSPSession::FindRTPSession(RefTable *inRefTable) {
+QTSS_Error RTSPSession::FindRTPSession(ShardedRefTable *inRefTable) {
   // This function attempts to locate the appropriate RTP session for this RTSP
   // Request. It uses an RTSP session ID as a key to finding the correct RTP session,
   // and it looks for this session ID in two places. First, the RTSP session ID header
@@ -1747,7 +1753,7 @@ QTSS_Error RTSPSession::FindRTPSession(RefTable *inRefTable) {
   return QTSS_NoErr;
 }
 
-QTSS_Error RTSPSession::CreateNewRTPSession(RefTable *inRefTable) {
+QTSS_Error RTSPSession::CreateNewRTPSession(ShardedRefTable *inRefTable) {
   Assert(fLastRTPSessionIDPtr.Ptr == &fLastRTPSessionID[0]);
 
   // This is a brand spanking new session. At this point, we need to create
@@ -1859,8 +1865,11 @@ UInt32 RTSPSession::GenerateNewSessionID(char *ioBuffer) {
   QTSServerInterface *theServer = QTSServerInterface::GetServer();
 
   {
-    Core::MutexLocker locker(theServer->GetRTPSessionMap()->GetMutex());
-    RefHashTable *theHashTable = theServer->GetRTPSessionMap()->GetHashTable();
+    // a random shard is as good as the whole map here
+    ShardedRefTable *theMap = theServer->GetRTPSessionMap();
+    RefTable *theTable = theMap->GetShard(theFirstRandom & (theMap->GetNumShards() - 1));
+    Core::MutexLocker locker(theTable->GetMutex());
+    RefHashTable *theHashTable = theTable->GetHashTable();
     if (theHashTable->GetNumEntries() > 0) {
       theFirstRandom %= theHashTable->GetNumEntries();
       theFirstRandom >>= 2;
@@ -2005,36 +2014,101 @@ QTSS_Error RTSPSession::DumpRequestData() {
  */
 void RTSPSession::HandleIncomingDataPacket() {
 
-  // Attempt to find the RTP session for this request.
-  UInt8 packetChannel = (UInt8) fInputStream.GetRequestBuffer()->Ptr[1];
-  StrPtrLen *theSessionID = this->GetSessionIDForChannelNum(packetChannel);
-  if (theSessionID == nullptr) {
+  // The request buffer holds all complete frames of the last read. Frames in a
+  // row of one bound channel go to its handler together, the other frames of
+  // one RTP session to the modules.
+  StrPtrLen *theFrames = fInputStream.GetRequestBuffer();
+  StrPtrLen theRun(theFrames->Ptr, 0);
+  StrPtrLen *theRunSessionID = nullptr;
+  SInt32 theRunChannel = -1;
+
+  for (UInt32 theOffset = 0; theOffset + 4 <= theFrames->Len;) {
+    char *theFrame = theFrames->Ptr + theOffset;
+    UInt8 packetChannel = (UInt8) theFrame[1];
+    UInt16 theDataLen;
+    ::memcpy(&theDataLen, &theFrame[2], 2);
+    UInt32 theFrameLen = ntohs(theDataLen) + 4;
+
+    StrPtrLen *theSessionID = nullptr;
+    SInt32 theChannel = -1;
+    bool isSameRun;
+    if (this->HasIncomingDataHandler(packetChannel)) {
+      theChannel = packetChannel;
+      isSameRun = (theChannel == theRunChannel);
+    } else {
+      // every SETUP has its own entry, compare the IDs themselves
+      theSessionID = this->GetSessionIDForChannelNum(packetChannel);
+      isSameRun = (theRunChannel < 0) && ((theSessionID == theRunSessionID) ||
+          ((theSessionID != nullptr) && (theRunSessionID != nullptr) && theSessionID->Equal(*theRunSessionID)));
+    }
+
+    if (!isSameRun) {
+      this->HandleIncomingDataRun(theRunChannel, theRunSessionID, &theRun);
+      theRun.Set(theFrame, 0);
+      theRunSessionID = theSessionID;
+      theRunChannel = theChannel;
+    }
+
+    theRun.Len += theFrameLen;
+    theOffset += theFrameLen;
+  }
+
+  this->HandleIncomingDataRun(theRunChannel, theRunSessionID, &theRun);
+}
+
+void RTSPSession::HandleIncomingDataRun(SInt32 inChannel, StrPtrLen *inSessionID, StrPtrLen *inFrames) {
+  if (inFrames->Len == 0)
+    return;
+
+  // a bound channel needs neither the session map nor the modules
+  if (inChannel >= 0) {
+    if (this->CallIncomingDataHandler((UInt8) inChannel, inFrames->Ptr, inFrames->Len))
+      return;
+    inSessionID = this->GetSessionIDForChannelNum((UInt8) inChannel); // unbound in the meantime
+  }
+
+  if (inSessionID == nullptr) {
     Assert(0);
     return;  // TODO(james): filter invalid packet?
-    theSessionID = &fLastRTPSessionIDPtr;
   }
 
-  RefTable *theMap = QTSServerInterface::GetServer()->GetRTPSessionMap();
-  Ref *theRef = theMap->Resolve(theSessionID);
+  // Attempt to find the RTP session for these frames, CleanupRequest releases the last one
+  ShardedRefTable *theMap = QTSServerInterface::GetServer()->GetRTPSessionMap();
+  if (fRTPSession != nullptr) {
+    theMap->Release(fRTPSession->GetRef());
+    fRTPSession = nullptr;
+  }
+
+  Ref *theRef = theMap->Resolve(inSessionID);
 
   if (theRef != nullptr) fRTPSession = (RTPSession *) theRef->GetObject();
 
   if (fRTPSession == nullptr) return;
 
-  StrPtrLen packetWithoutHeaders(fInputStream.GetRequestBuffer()->Ptr + 4, fInputStream.GetRequestBuffer()->Len - 4);
-
   Core::MutexLocker locker(fRTPSession->GetMutex());
   fRTPSession->RefreshTimeout();
-  RTPStream *theStream = fRTPSession->FindRTPStreamForChannelNum(packetChannel);
-  theStream->ProcessIncomingInterleavedData(packetChannel, this, &packetWithoutHeaders);
+
+  for (UInt32 theOffset = 0; theOffset < inFrames->Len;) {
+    char *theFrame = inFrames->Ptr + theOffset;
+    UInt8 packetChannel = (UInt8) theFrame[1];
+    UInt16 theDataLen;
+    ::memcpy(&theDataLen, &theFrame[2], 2);
+    theOffset += ntohs(theDataLen) + 4;
+
+    StrPtrLen packetWithoutHeaders(theFrame + 4, ntohs(theDataLen));
+    RTPStream *theStream = fRTPSession->FindRTPStreamForChannelNum(packetChannel);
+    if (theStream != nullptr)
+      theStream->ProcessIncomingInterleavedData(packetChannel, this, &packetWithoutHeaders);
+  }
 
   //
-  // We currently don't support async notifications from within this role
+  // We currently don't support async notifications from within this role.
+  // inPacketData holds one or more '$' frames back to back.
   QTSS_RoleParams packetParams;
   packetParams.rtspIncomingDataParams.inRTSPSession = this;
   packetParams.rtspIncomingDataParams.inClientSession = fRTPSession;
-  packetParams.rtspIncomingDataParams.inPacketData = fInputStream.GetRequestBuffer()->Ptr;
-  packetParams.rtspIncomingDataParams.inPacketLen = fInputStream.GetRequestBuffer()->Len;
+  packetParams.rtspIncomingDataParams.inPacketData = inFrames->Ptr;
+  packetParams.rtspIncomingDataParams.inPacketLen = inFrames->Len;
 
   UInt32 numModules = QTSServerInterface::GetNumModulesInRole(QTSSModule::kRTSPIncomingDataRole);
   for (; fCurrentModule < numModules; fCurrentModule++) {
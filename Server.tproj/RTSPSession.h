@@ -120,9 +120,9 @@ class RTSPSession : public RTSPSessionInterface {
   SInt64 Run() override;
 
   // Gets & creates RTP session for this request.
-  QTSS_Error FindRTPSession(RefTable *inTable);
+  QTSS_Error FindRTPSession(ShardedRefTable *inTable);
 
-  QTSS_Error CreateNewRTPSession(RefTable *inTable);
+  QTSS_Error CreateNewRTPSession(ShardedRefTable *inTable);
 
   void SetupClientSessionAttrs();
 
@@ -165,6 +165,8 @@ class RTSPSession : public RTSPSessionInterface {
   QTSS_Error PreFilterForHTTPProxyTunnel();              // prefilter for HTTP proxies
   bool ParseProxyTunnelHTTP();                     // use by PreFilterForHTTPProxyTunnel
   void HandleIncomingDataPacket();
+  // frames of one RTP session, or of one channel with an incoming data handler (inChannel >= 0)
+  void HandleIncomingDataRun(SInt32 inChannel, StrPtrLen *inSessionID, StrPtrLen *inFrames);
 
   static RefTable *sHTTPProxyTunnelMap;    // a map of available partners.
 
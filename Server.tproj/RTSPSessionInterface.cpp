@@ -31,6 +31,7 @@
 #include <CF/Core/Time.h>
 
 #include "RTSPSessionInterface.h"
+#include "RTPSessionInterface.h"
 
 #include "QTSServerInterface.h"
 #include "RTSPProtocol.h"
@@ -86,6 +87,12 @@ RTSPSessionInterface::RTSPSessionInterface()
       fSessionMutex(),
       fTCPCoalesceBuffer(nullptr),
       fNumInCoalesceBuffer(0),
+      fNumInterleaved(0),
+      fNumInterleavedCopied(0),
+      fInterleavedBytes(0),
+      fInterleavedCopyLen(0),
+      fInterleavedCopy(nullptr),
+      fIncomingDataHandlers(nullptr),
       fSocket(nullptr, CF::Net::Socket::kNonBlockingSocketType),
       fOutputSocketP(&fSocket),
       fInputSocketP(&fSocket),
@@ -125,6 +132,8 @@ RTSPSessionInterface::~RTSPSessionInterface() {
     delete fInputSocketP;
 
   delete[] fTCPCoalesceBuffer;
+  delete[] fInterleavedCopy;
+  delete[] fIncomingDataHandlers;
 
   for (UInt8 x = 0; x < (fCurChannelNum >> 1); x++)
     delete[] fChNumToSessIDMap[x].Ptr;
@@ -261,6 +270,15 @@ RTSPSessionInterface::InterleavedWrite(void *inBuffer, UInt32 inLen, UInt32 *out
   struct iovec iov[3];
   QTSS_Error err = QTSS_NoErr;
 
+  { // the queued packets go first
+    CF::Core::MutexLocker locker(&fInterleavedMutex);
+    err = this->SendInterleavedQueue();
+  }
+  if (err != QTSS_NoErr) {
+    this->GetSessionMutex()->Unlock();
+    return err;
+  }
+
   // flush rules
   if (fNumInCoalesceBuffer > 0 && (inLen == 0 || inLen > kTCPCoalesceDirectWriteSize ||
       inLen + fNumInCoalesceBuffer + kInteleaveHeaderSize > kTCPCoalesceBufferSize)) {
@@ -341,6 +359,147 @@ RTSPSessionInterface::InterleavedWrite(void *inBuffer, UInt32 inLen, UInt32 *out
 
 }
 
+QTSS_Error RTSPSessionInterface::QueueInterleavedWrite(void *inBuffer, UInt32 inLen, unsigned char channel) {
+  CF::Core::MutexLocker locker(&fInterleavedMutex);
+
+  if (fNumInterleaved == kMaxQueuedInterleaved
+      || fInterleavedBytes + kInteleaveHeaderSize + inLen > kMaxQueuedInterleavedBytes) {
+    // same rule as InterleavedWrite, never wait for an RTSP request in progress
+    if (!this->GetSessionMutex()->TryLock())
+      return EAGAIN;
+
+    QTSS_Error err = this->SendInterleavedQueue();
+    this->GetSessionMutex()->Unlock();
+    if (err != QTSS_NoErr)
+      return err;
+  }
+
+  if (kInteleaveHeaderSize + inLen > kMaxQueuedInterleavedBytes)
+    return QTSS_BadArgument;
+
+  InterleavedHeader &theHeader = fInterleavedHeaders[fNumInterleaved];
+  theHeader.fDollar = '$';
+  theHeader.fChannel = channel;
+  theHeader.fLen = htons((UInt16) inLen);
+
+  // iovec 0 belongs to WriteV
+  fInterleavedVec[2 * fNumInterleaved + 1].iov_base = (char *) &theHeader;
+  fInterleavedVec[2 * fNumInterleaved + 1].iov_len = kInteleaveHeaderSize;
+  fInterleavedVec[2 * fNumInterleaved + 2].iov_base = (char *) inBuffer;
+  fInterleavedVec[2 * fNumInterleaved + 2].iov_len = inLen;
+
+  fNumInterleaved++;
+  fInterleavedBytes += kInteleaveHeaderSize + inLen;
+  return QTSS_NoErr;
+}
+
+QTSS_Error RTSPSessionInterface::FlushInterleaved() {
+  CF::Core::MutexLocker locker(&fInterleavedMutex);
+  if (fNumInterleaved == 0)
+    return QTSS_NoErr;
+
+  QTSS_Error err = EAGAIN;
+  if (this->GetSessionMutex()->TryLock()) {
+    err = this->SendInterleavedQueue();
+    this->GetSessionMutex()->Unlock();
+  }
+
+  // the socket is full or a request holds the session, keep our own copy
+  if (err != QTSS_NoErr)
+    this->CopyInterleavedQueue();
+
+  return err;
+}
+
+QTSS_Error RTSPSessionInterface::SetIncomingDataHandler(RTPSessionInterface *inClientSession, UInt8 inChannel,
+                                                        QTSS_IncomingDataHandlerPtr inHandler, void *inCookie) {
+  // RemoveIncomingDataHandlers is called through the client session's RTSP session
+  if (inClientSession->GetRTSPSession() != this)
+    return QTSS_BadArgument;
+
+  CF::Core::MutexLocker locker(&fIncomingDataMutex);
+  if (fIncomingDataHandlers == nullptr) {
+    if (inHandler == nullptr)
+      return QTSS_NoErr;
+    fIncomingDataHandlers = new IncomingDataHandler[kNumInterleavedChannels];
+    ::memset(fIncomingDataHandlers, 0, sizeof(IncomingDataHandler) * kNumInterleavedChannels);
+  }
+
+  IncomingDataHandler &theHandler = fIncomingDataHandlers[inChannel];
+  theHandler.fClientSession = (inHandler != nullptr) ? inClientSession : nullptr;
+  theHandler.fHandler = inHandler;
+  theHandler.fCookie = (inHandler != nullptr) ? inCookie : nullptr;
+  return QTSS_NoErr;
+}
+
+void RTSPSessionInterface::RemoveIncomingDataHandlers(RTPSessionInterface *inClientSession) {
+  // only the RTSP session thread binds, a session that never did has nothing to wait for
+  if (fIncomingDataHandlers == nullptr)
+    return;
+
+  CF::Core::MutexLocker locker(&fIncomingDataMutex);
+  for (UInt32 x = 0; x < kNumInterleavedChannels; x++) {
+    if (fIncomingDataHandlers[x].fClientSession == inClientSession)
+      ::memset(&fIncomingDataHandlers[x], 0, sizeof(IncomingDataHandler));
+  }
+}
+
+bool RTSPSessionInterface::CallIncomingDataHandler(UInt8 inChannel, char *inFrames, UInt32 inFramesLen) {
+  CF::Core::MutexLocker locker(&fIncomingDataMutex);
+  if (fIncomingDataHandlers == nullptr)
+    return false;
+
+  IncomingDataHandler &theHandler = fIncomingDataHandlers[inChannel];
+  if (theHandler.fHandler == nullptr)
+    return false;
+
+  // the client session stays registered and alive until it removes its handlers
+  theHandler.fClientSession->RefreshTimeout();
+  theHandler.fHandler(theHandler.fCookie, inChannel, inFrames, inFramesLen);
+  return true;
+}
+
+QTSS_Error RTSPSessionInterface::SendInterleavedQueue() {
+  if (fNumInterleaved == 0)
+    return QTSS_NoErr;
+
+  // all or nothing: a partly sent queue leaves its tail in the response stream
+  // buffer, an RTSP response can't get between the halves of a packet
+  UInt32 theLenWritten = 0;
+  QTSS_Error err = this->GetOutputStream()->WriteV(fInterleavedVec, 2 * fNumInterleaved + 1, fInterleavedBytes,
+                                                    &theLenWritten, RTSPResponseStream::kAllOrNothing);
+
+#if RTSP_SESSION_INTERFACE_DEBUGGING
+  s_printf("InterleavedWrite: writev %" _U32BITARG_ " packets %" _U32BITARG_ " bytes err=%d\n",
+           fNumInterleaved, fInterleavedBytes, (int) err);
+#endif
+
+  if (err == QTSS_NoErr) {
+    fNumInterleaved = 0;
+    fNumInterleavedCopied = 0;
+    fInterleavedBytes = 0;
+    fInterleavedCopyLen = 0;
+  }
+
+  return err;
+}
+
+void RTSPSessionInterface::CopyInterleavedQueue() {
+  if (fNumInterleavedCopied == fNumInterleaved)
+    return;
+
+  if (fInterleavedCopy == nullptr)
+    fInterleavedCopy = new char[kMaxQueuedInterleavedBytes];
+
+  // fInterleavedBytes bounds what the queue holds, the copies always fit
+  for (; fNumInterleavedCopied < fNumInterleaved; fNumInterleavedCopied++) {
+    struct iovec &thePayload = fInterleavedVec[2 * fNumInterleavedCopied + 2];
+    ::memcpy(&fInterleavedCopy[fInterleavedCopyLen], thePayload.iov_base, thePayload.iov_len);
+    thePayload.iov_base = &fInterleavedCopy[fInterleavedCopyLen];
+    fInterleavedCopyLen += (UInt32) thePayload.iov_len;
+  }
+}
+
 /*
 	take the TCP socket away from a RTSP session that's
 	waiting to be snarfed.
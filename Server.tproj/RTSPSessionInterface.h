@@ -42,6 +42,7 @@
 #include "QTSS.h"
 #include "QTSSDictionary.h"
 
+class RTPSessionInterface;
 
 class RTSPSessionInterface : public QTSSDictionary, public CF::Thread::Task {
  public:
@@ -123,6 +124,22 @@ class RTSPSessionInterface : public QTSSDictionary, public CF::Thread::Task {
   // performs RTP over RTSP
   QTSS_Error InterleavedWrite(void *inBuffer, UInt32 inLen, UInt32 *outLenWritten, unsigned char channel);
 
+  // Queues an RTP packet for FlushInterleaved without copying it, inBuffer must
+  // stay valid until then. Returns EAGAIN when the queue is full and can't be sent.
+  QTSS_Error QueueInterleavedWrite(void *inBuffer, UInt32 inLen, unsigned char channel);
+
+  // Sends the queued packets with one writev. What the socket doesn't take
+  // now is copied, the buffers passed to QueueInterleavedWrite are free after it.
+  QTSS_Error FlushInterleaved();
+
+  // Frames arriving on inChannel go to inHandler instead of the RTSPIncomingData
+  // role (QTSS_SetIncomingDataHandler). A NULL handler unbinds the channel.
+  QTSS_Error SetIncomingDataHandler(RTPSessionInterface *inClientSession, UInt8 inChannel,
+                                    QTSS_IncomingDataHandlerPtr inHandler, void *inCookie);
+
+  // Unbinds the channels of inClientSession, none of its handlers runs after this returns
+  void RemoveIncomingDataHandlers(RTPSessionInterface *inClientSession);
+
   // OPTIONS request
   void SaveOutputStream();
 
@@ -185,6 +202,55 @@ class RTSPSessionInterface : public QTSSDictionary, public CF::Thread::Task {
   char *fTCPCoalesceBuffer;  // 合并缓冲
   SInt32 fNumInCoalesceBuffer;
 
+  // zero copy interleaved writes: the queue references the packets and holds
+  // their '$' headers, iovec 0 is left to RTSPResponseStream::WriteV
+  enum {
+    kMaxQueuedInterleaved = 64,         // packets, a writev takes 2 iovecs each
+    kMaxQueuedInterleavedBytes = 65536
+  };
+
+  struct InterleavedHeader {
+    UInt8 fDollar;
+    UInt8 fChannel;
+    UInt16 fLen;                        // network byte order
+  };
+
+  // call with fSessionMutex and fInterleavedMutex held, NoErr once the queue is empty
+  QTSS_Error SendInterleavedQueue();
+
+  // call with fInterleavedMutex held, moves the packets still referenced into fInterleavedCopy
+  void CopyInterleavedQueue();
+
+  CF::Core::Mutex fInterleavedMutex;    // taken after fSessionMutex
+  struct iovec fInterleavedVec[2 * kMaxQueuedInterleaved + 1];
+  InterleavedHeader fInterleavedHeaders[kMaxQueuedInterleaved];
+  UInt32 fNumInterleaved;
+  UInt32 fNumInterleavedCopied;         // the first packets of the queue, they are in fInterleavedCopy
+  UInt32 fInterleavedBytes;             // headers included
+  UInt32 fInterleavedCopyLen;
+  char *fInterleavedCopy;               // kMaxQueuedInterleavedBytes, allocated on the first copy
+
+  // channels bound by a module, their frames skip the RTP session lookup and the role
+  enum {
+    kNumInterleavedChannels = 256
+  };
+
+  struct IncomingDataHandler {
+    RTPSessionInterface *fClientSession;
+    QTSS_IncomingDataHandlerPtr fHandler;
+    void *fCookie;
+  };
+
+  bool HasIncomingDataHandler(UInt8 inChannel) {
+    return (fIncomingDataHandlers != nullptr) && (fIncomingDataHandlers[inChannel].fHandler != nullptr);
+  }
+
+  // Hands inFrames, all of inChannel, to its handler. false if the channel is not bound (any more).
+  bool CallIncomingDataHandler(UInt8 inChannel, char *inFrames, UInt32 inFramesLen);
+
+  CF::Core::Mutex fIncomingDataMutex;   // held while a handler runs
+  IncomingDataHandler *fIncomingDataHandlers; // by channel, allocated on the first bind
+
   //+rt  socket we get from "accept()"
   CF::Net::TCPSocket fSocket;
   CF::Net::TCPSocket *fOutputSocketP;
@@ -35,6 +35,7 @@
 
 #include "RunServer.h"
 #include "QTSSRollingLog.h"
+#include "RTPSessionPacer.h"
 
 #ifndef __Win32__
 
@@ -151,6 +152,9 @@ QTSS_ServerState StartServer(XMLPrefsParser *inPrefsSource,
     CF::Thread::TimeoutTask::Initialize();     // The TimeoutTask mechanism is task based,
     // we therefore must do this after adding task threads
     // this be done before starting the sockets and server tasks
+
+    // one pacing wheel per short task thread
+    RTPSessionPacer::Initialize(numShortTaskThreads, sServer->GetPrefs()->GetRTPPacingTickInMsec());
   }
 
   //Make sure to do this stuff last. Because these are all the threads that
@@ -0,0 +1,50 @@
+/*
+    File:       ShardedRefTable.cpp
+
+    Contains:   Implementation of ShardedRefTable
+*/
+
+#include "ShardedRefTable.h"
+
+using namespace CF;
+
+ShardedRefTable::ShardedRefTable(UInt32 inTableSize, UInt32 inNumShards)
+    : fShards(nullptr),
+      fNumShards(1) {
+  // GetShardIndex masks the hash
+  while (fNumShards < inNumShards)
+    fNumShards <<= 1;
+
+  UInt32 theShardSize = inTableSize / fNumShards;
+  if (theShardSize < 64)
+    theShardSize = 64;
+
+  fShards = new RefTable *[fNumShards];
+  for (UInt32 x = 0; x < fNumShards; x++)
+    fShards[x] = new RefTable(theShardSize);
+}
+
+ShardedRefTable::~ShardedRefTable() {
+  for (UInt32 x = 0; x < fNumShards; x++)
+    delete fShards[x];
+  delete[] fShards;
+}
+
+UInt32 ShardedRefTable::GetNumRefsInTable() {
+  UInt32 theNumRefs = 0;
+  for (UInt32 x = 0; x < fNumShards; x++) {
+    Core::MutexLocker locker(fShards[x]->GetMutex());
+    theNumRefs += (UInt32) fShards[x]->GetHashTable()->GetNumEntries();
+  }
+  return theNumRefs;
+}
+
+UInt32 ShardedRefTable::GetShardIndex(StrPtrLen *inString) {
+  // FNV-1a, the session IDs and stream names are short
+  UInt32 theHash = 2166136261U;
+  for (UInt32 x = 0; x < inString->Len; x++) {
+    theHash ^= (UInt8) inString->Ptr[x];
+    theHash *= 16777619U;
+  }
+  return (theHash ^ (theHash >> 16)) & (fNumShards - 1);
+}
@@ -0,0 +1,216 @@
+/*
+    File:       UDPSendBatch.cpp
+
+    Contains:   Implementation of UDPSendBatch
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#if __linux__
+#include <netinet/udp.h>
+#endif
+
+#include "UDPSendBatch.h"
+
+std::atomic<bool> UDPSendBatch::sSendMmsgEnabled(true);
+std::atomic<bool> UDPSendBatch::sGSOEnabled(false);
+std::atomic<bool> UDPSendBatch::sInterleavedEnabled(true);
+std::atomic<UInt64> UDPSendBatch::sTotalPackets(0);
+std::atomic<UInt64> UDPSendBatch::sTotalSyscalls(0);
+
+static thread_local UDPSendBatch *sCurrentBatch = nullptr;
+
+#if __linux__ && defined(UDP_SEGMENT)
+enum {
+  kMaxGSOSegments = 64,          // UDP_MAX_SEGMENTS of the kernel
+  kMaxGSOBytes = 65000           // keep the super packet below the 64K IP limit
+};
+#endif
+
+UDPSendBatch::UDPSendBatch()
+    : fNumPackets(0),
+      fPrevious(sCurrentBatch) {
+  sCurrentBatch = this;
+}
+
+UDPSendBatch::~UDPSendBatch() {
+  this->Flush();
+  sCurrentBatch = fPrevious;
+}
+
+UDPSendBatch *UDPSendBatch::GetCurrent() {
+  return sCurrentBatch;
+}
+
+void UDPSendBatch::Add(int inFD, UInt32 inRemoteAddr, UInt16 inRemotePort, void *inData, UInt32 inLen) {
+  if (fNumPackets == kMaxPackets)
+    this->Flush();
+
+  Packet &thePacket = fPackets[fNumPackets++];
+  thePacket.fFD = inFD;
+  thePacket.fRemoteAddr = inRemoteAddr;
+  thePacket.fRemotePort = inRemotePort;
+  thePacket.fData = inData;
+  thePacket.fLen = inLen;
+}
+
+/**
+ * 按 socket 分组，保持组内原有顺序，每组一次 sendmmsg
+ */
+void UDPSendBatch::Flush() {
+  if (fNumPackets == 0)
+    return;
+
+  bool theSent[kMaxPackets];
+  ::memset(theSent, 0, sizeof(theSent));
+
+  UInt32 theGroup[kMaxPackets];
+  for (UInt32 i = 0; i < fNumPackets; i++) {
+    if (theSent[i]) continue;
+
+    UInt32 theCount = 0;
+    for (UInt32 j = i; j < fNumPackets; j++) {
+      if (!theSent[j] && fPackets[j].fFD == fPackets[i].fFD) {
+        theGroup[theCount++] = j;
+        theSent[j] = true;
+      }
+    }
+
+    this->SendGroup(theGroup, theCount);
+  }
+
+  sTotalPackets += fNumPackets;
+  fNumPackets = 0;
+}
+
+void UDPSendBatch::SendGroup(UInt32 *inIndexes, UInt32 inCount) {
+#if __linux__
+  if (!sSendMmsgEnabled.load(std::memory_order_relaxed) || inCount == 1) {
+    this->SendOneByOne(inIndexes, inCount);
+    return;
+  }
+
+  bool theUseGSO = sGSOEnabled.load(std::memory_order_relaxed);
+
+  struct mmsghdr theMsgs[kMaxPackets];
+  struct iovec theIovecs[kMaxPackets];
+  struct sockaddr_in theAddrs[kMaxPackets];
+  UInt32 theFirstPackets[kMaxPackets]; // index into inIndexes of each message's first packet
+#ifdef UDP_SEGMENT
+  char theControls[kMaxPackets][CMSG_SPACE(sizeof(UInt16))];
+#endif
+
+  ::memset(theMsgs, 0, sizeof(struct mmsghdr) * inCount);
+  UInt32 theNumMsgs = 0;
+
+  for (UInt32 i = 0; i < inCount;) {
+    Packet &thePacket = fPackets[inIndexes[i]];
+
+    struct sockaddr_in &theAddr = theAddrs[theNumMsgs];
+    ::memset(&theAddr, 0, sizeof(theAddr));
+    theAddr.sin_family = AF_INET;
+    theAddr.sin_port = htons(thePacket.fRemotePort);
+    theAddr.sin_addr.s_addr = htonl(thePacket.fRemoteAddr);
+
+    struct msghdr &theHdr = theMsgs[theNumMsgs].msg_hdr;
+    theHdr.msg_name = &theAddr;
+    theHdr.msg_namelen = sizeof(theAddr);
+    theHdr.msg_iov = &theIovecs[i];
+
+    theIovecs[i].iov_base = thePacket.fData;
+    theIovecs[i].iov_len = thePacket.fLen;
+    UInt32 theNumSegments = 1;
+
+#ifdef UDP_SEGMENT
+    if (theUseGSO) {
+      // GSO: following packets to the same client with the same size (the last one may be
+      // shorter) become segments of one super packet
+      UInt32 theTotal = thePacket.fLen;
+      while (i + theNumSegments < inCount && theNumSegments < kMaxGSOSegments) {
+        Packet &theNext = fPackets[inIndexes[i + theNumSegments]];
+        if (theNext.fRemoteAddr != thePacket.fRemoteAddr || theNext.fRemotePort != thePacket.fRemotePort ||
+            theNext.fLen > thePacket.fLen || theTotal + theNext.fLen > kMaxGSOBytes)
+          break;
+
+        theIovecs[i + theNumSegments].iov_base = theNext.fData;
+        theIovecs[i + theNumSegments].iov_len = theNext.fLen;
+        theTotal += theNext.fLen;
+        theNumSegments++;
+
+        if (theNext.fLen < thePacket.fLen)
+          break; // a short segment must be the last one
+      }
+
+      if (theNumSegments > 1) {
+        theHdr.msg_control = theControls[theNumMsgs];
+        theHdr.msg_controllen = CMSG_SPACE(sizeof(UInt16));
+        struct cmsghdr *theCmsg = CMSG_FIRSTHDR(&theHdr);
+        theCmsg->cmsg_level = SOL_UDP;
+        theCmsg->cmsg_type = UDP_SEGMENT;
+        theCmsg->cmsg_len = CMSG_LEN(sizeof(UInt16));
+        auto theSegmentSize = static_cast<UInt16>(thePacket.fLen);
+        ::memcpy(CMSG_DATA(theCmsg), &theSegmentSize, sizeof(UInt16));
+      }
+    }
+#endif
+
+    theHdr.msg_iovlen = theNumSegments;
+    theFirstPackets[theNumMsgs] = i;
+    theNumMsgs++;
+    i += theNumSegments;
+  }
+
+  int theFD = fPackets[inIndexes[0]].fFD;
+  UInt32 theDone = 0;
+  while (theDone < theNumMsgs) {
+    int theResult = ::sendmmsg(theFD, &theMsgs[theDone], theNumMsgs - theDone, 0);
+    sTotalSyscalls++;
+
+    if (theResult > 0) {
+      theDone += theResult;
+      continue;
+    }
+
+    UInt32 theFirstUnsent = theFirstPackets[theDone];
+    if (errno == ENOSYS) {
+      sSendMmsgEnabled.store(false, std::memory_order_relaxed);
+      this->SendOneByOne(&inIndexes[theFirstUnsent], inCount - theFirstUnsent);
+      break;
+    } else if (theUseGSO && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+      // no GSO on this kernel or nic, don't try again
+      sGSOEnabled.store(false, std::memory_order_relaxed);
+      this->SendOneByOne(&inIndexes[theFirstUnsent], inCount - theFirstUnsent);
+      break;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      // a full socket buffer drops the rest, as UDPSocket::SendTo would drop each of them
+      break;
+    }
+
+    // the socket is shared by many clients, one unreachable address (EHOSTUNREACH,
+    // ENETUNREACH, EPERM...) only loses its own message, like a failed sendto
+    theDone++;
+  }
+#else
+  this->SendOneByOne(inIndexes, inCount);
+#endif
+}
+
+void UDPSendBatch::SendOneByOne(UInt32 *inIndexes, UInt32 inCount) {
+  for (UInt32 i = 0; i < inCount; i++) {
+    Packet &thePacket = fPackets[inIndexes[i]];
+
+    struct sockaddr_in theAddr;
+    ::memset(&theAddr, 0, sizeof(theAddr));
+    theAddr.sin_family = AF_INET;
+    theAddr.sin_port = htons(thePacket.fRemotePort);
+    theAddr.sin_addr.s_addr = htonl(thePacket.fRemoteAddr);
+
+    (void) ::sendto(thePacket.fFD, thePacket.fData, thePacket.fLen, 0,
+                    (struct sockaddr *) &theAddr, sizeof(theAddr));
+    sTotalSyscalls++;
+  }
+}
@@ -0,0 +1,72 @@
+/*
+    File:       LatencyHistogram.h
+
+    Contains:   Log-linear (HDR style) histogram of non negative integers,
+                for latencies on the packet path. Every power of 2 is split
+                into 4 linear sub-buckets, so a recorded value is known to
+                within 25% from 4 up to 2^32, and exactly below 4.
+                Recording is one relaxed atomic add for the bucket and one
+                for the sum, any thread may record while another reads.
+
+                A reader takes a Snapshot, which can add up several
+                histograms (per thread shards, streams) before asking it
+                for percentiles.
+*/
+
+#ifndef __LATENCY_HISTOGRAM_H__
+#define __LATENCY_HISTOGRAM_H__
+
+#include <atomic>
+
+#include <CF/Types.h>
+
+class LatencyHistogram {
+ public:
+
+  enum {
+    kSubBucketBits = 2,
+    kSubBuckets = 1 << kSubBucketBits,
+    kNumBuckets = kSubBuckets + (32 - kSubBucketBits) * kSubBuckets // values up to 2^32 - 1
+  };
+
+  struct Snapshot {
+    UInt64 fCounts[kNumBuckets];
+    UInt64 fCount;
+    UInt64 fSum;
+
+    void Clear();
+
+    void Add(const LatencyHistogram &inHistogram);
+
+    void Add(const Snapshot &inSnapshot);
+
+    // Upper bound of the bucket holding the inPercentile (0-100) value, 0 if empty
+    UInt64 GetPercentile(Float64 inPercentile) const;
+
+    // Upper bound of the highest bucket in use, 0 if empty
+    UInt64 GetMax() const;
+  };
+
+  LatencyHistogram() { this->Reset(); }
+
+  void Record(UInt64 inValue) {
+    fCounts[GetBucketIndex(inValue)].fetch_add(1, std::memory_order_relaxed);
+    fSum.fetch_add(inValue, std::memory_order_relaxed);
+  }
+
+  // Not atomic as a whole, records racing with it may survive
+  void Reset();
+
+  // Bucket inValue falls into, values past the last bucket are clamped into it
+  static UInt32 GetBucketIndex(UInt64 inValue);
+
+  // Largest value that goes into bucket inIndex
+  static UInt64 GetBucketUpperBound(UInt32 inIndex);
+
+ private:
+
+  std::atomic<UInt64> fCounts[kNumBuckets];
+  std::atomic<UInt64> fSum;
+};
+
+#endif //__LATENCY_HISTOGRAM_H__
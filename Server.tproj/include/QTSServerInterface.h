@@ -46,6 +46,8 @@
 #include "QTSS.h"
 #include "QTSSDictionary.h"
 #include "QTSServerPrefs.h"
+#include "QTSServerStats.h"
+#include "ShardedRefTable.h"
 #include "QTSSMessages.h"
 #include "QTSSModule.h"
 
@@ -107,23 +109,17 @@ class QTSServerInterface : public QTSSDictionary {
     fNumRTSPHTTPSessions++;
   }
 
+  // The per packet statistics below go to the calling thread's shard of
+  // QTSServerStats and never take fMutex.
+
   // total rtp bytes sent by the server
-  void IncrementTotalRTPBytes(UInt32 bytes) {
-    //(void)atomic_add(&fPeriodicRTPBytes, bytes);
-    fPeriodicRTPBytes.fetch_add(bytes);
-  }
+  void IncrementTotalRTPBytes(UInt32 bytes) { QTSServerStats::AddRTPBytes(bytes); }
 
   // total rtp packets sent by the server
-  void IncrementTotalPackets() {
-    //(void)atomic_add(&fPeriodicRTPPackets, 1);
-    ++fPeriodicRTPPackets;
-  }
+  void IncrementTotalPackets() { QTSServerStats::AddRTPPackets(1); }
 
   // total rtp bytes reported as lost by the clients
-  void IncrementTotalRTPPacketsLost(UInt32 packets) {
-    //(void)atomic_add(&fPeriodicRTPPacketsLost, packets);
-    fPeriodicRTPPacketsLost.fetch_add(packets);
-  }
+  void IncrementTotalRTPPacketsLost(UInt32 packets) { QTSServerStats::AddRTPPacketsLost(packets); }
 
   // Also increments current RTP session count
   void IncrementTotalRTPSessions() {
@@ -161,36 +157,23 @@ class QTSServerInterface : public QTSSDictionary {
     fNumRTPPlayingSessions += inDifference;
   }
 
-  void IncrementTotalLate(SInt64 milliseconds) {
-    CF::Core::MutexLocker locker(&fMutex);
-    fTotalLate += milliseconds;
-    if (milliseconds > fCurrentMaxLate) fCurrentMaxLate = milliseconds;
-    if (milliseconds > fMaxLate) fMaxLate = milliseconds;
-  }
+  void IncrementTotalLate(SInt64 milliseconds) { QTSServerStats::AddLate(milliseconds); }
 
-  void IncrementTotalQuality(SInt32 level) {
-    CF::Core::MutexLocker locker(&fMutex);
-    fTotalQuality += level;
-  }
+  void IncrementTotalQuality(SInt32 level) { QTSServerStats::AddQuality(level); }
 
-  void IncrementNumThinned(SInt32 inDifference) {
-    CF::Core::MutexLocker locker(&fMutex);
-    fNumThinned += inDifference;
-  }
+  void IncrementNumThinned(SInt32 inDifference) { QTSServerStats::AddThinned(inDifference); }
 
+  // The shards are only ever added to, clearing moves the base line instead
   void ClearTotalLate() {
     CF::Core::MutexLocker locker(&fMutex);
-    fTotalLate = 0;
+    fTotalLateBase = this->GetStatsTotals().fTotalLate;
   }
 
-  void ClearCurrentMaxLate() {
-    CF::Core::MutexLocker locker(&fMutex);
-    fCurrentMaxLate = 0;
-  }
+  void ClearCurrentMaxLate() { QTSServerStats::ClearCurrentMaxLate(); }
 
   void ClearTotalQuality() {
     CF::Core::MutexLocker locker(&fMutex);
-    fTotalQuality = 0;
+    fTotalQualityBase = this->GetStatsTotals().fTotalQuality;
   }
 
   void InitNumThreads(UInt32 numThreads) { fNumThreads = numThreads; }
@@ -215,11 +198,11 @@ class QTSServerInterface : public QTSSDictionary {
 
   UInt32 GetRTPPacketsPerSec() { return fRTPPacketsPerSecond; }
 
-  UInt64 GetTotalRTPBytes() { return fTotalRTPBytes; }
+  UInt64 GetTotalRTPBytes() { return this->GetStatsTotals().fRTPBytes; }
 
-  UInt64 GetTotalRTPPacketsLost() { return fTotalRTPPacketsLost; }
+  UInt64 GetTotalRTPPacketsLost() { return this->GetStatsTotals().fRTPPacketsLost; }
 
-  UInt64 GetTotalRTPPackets() { return fTotalRTPPackets; }
+  UInt64 GetTotalRTPPackets() { return this->GetStatsTotals().fRTPPackets; }
 
   Float32 GetCPUPercent() { return fCPUPercent; }
 
@@ -235,18 +218,30 @@ class QTSServerInterface : public QTSSDictionary {
 
   void SetDebugOptions(UInt32 debugOptions) { fDebugOptions = debugOptions; }
 
-  SInt64 GetMaxLate() { return fMaxLate; };
+  SInt64 GetMaxLate() { return this->GetStatsTotals().fMaxLate; };
+
+  SInt64 GetTotalLate() { return this->GetStatsTotals().fTotalLate - fTotalLateBase; };
 
-  SInt64 GetTotalLate() { return fTotalLate; };
+  SInt64 GetCurrentMaxLate() { return this->GetStatsTotals().fCurrentMaxLate; };
 
-  SInt64 GetCurrentMaxLate() { return fCurrentMaxLate; };
+  SInt64 GetTotalQuality() { return this->GetStatsTotals().fTotalQuality - fTotalQualityBase; };
 
-  SInt64 GetTotalQuality() { return fTotalQuality; };
+  SInt32 GetNumThinned() { return this->GetStatsTotals().fNumThinned; };
 
-  SInt32 GetNumThinned() { return fNumThinned; };
+  // sums the per thread shards, every call walks all of them
+  static QTSServerStats::Totals GetStatsTotals() {
+    QTSServerStats::Totals theTotals;
+    QTSServerStats::Sum(&theTotals);
+    return theTotals;
+  }
 
   UInt32 GetNumThreads() { return fNumThreads; };
 
+  // RTP pacing wheels, one per short task thread, 0 if pacing is off
+  static UInt32 GetNumPacerWheels();
+
+  static void GetPacerWheelStats(UInt32 inWheel, UInt32 *outNumSessions, UInt64 *outRunMicros);
+
   //
   //
   // GLOBAL OBJECTS REPOSITORY
@@ -255,9 +250,9 @@ class QTSServerInterface : public QTSSDictionary {
   static QTSServerInterface *GetServer() { return sServer; }
 
   //Allows you to map RTP session IDs (strings) to actual RTP session objects
-  CF::RefTable *GetRTPSessionMap() { return fRTPMap; }
+  ShardedRefTable *GetRTPSessionMap() { return fRTPMap; }
 
-  CF::RefTable *GetReflectorSessionMap() { return fReflectorSessionMap; }
+  ShardedRefTable *GetReflectorSessionMap() { return fReflectorSessionMap; }
 
   //Server provides a statically created & bound UDPSocket / Demuxer pair
   //for each IP address setup to serve RTP. You access those pairs through
@@ -355,8 +350,8 @@ class QTSServerInterface : public QTSSDictionary {
   CF::Net::UDPSocketPool *fSocketPool;
 
   // All RTP sessions are put into this map
-  CF::RefTable *fRTPMap;
-  CF::RefTable *fReflectorSessionMap;
+  ShardedRefTable *fRTPMap;
+  ShardedRefTable *fReflectorSessionMap;
 
   QTSServerPrefs *fSrvrPrefs;
   QTSSMessages *fSrvrMessages;
@@ -417,19 +412,11 @@ class QTSServerInterface : public QTSSDictionary {
 
   //stores the total number of connections since startup.
   UInt32 fTotalRTPSessions;
+  // Storage for the attributes computed from QTSServerStats at read time
   //stores the total number of bytes served since startup
   UInt64 fTotalRTPBytes;
   //total number of rtp packets sent since startup
   UInt64 fTotalRTPPackets;
-  //stores the total number of bytes lost (as reported by clients) since startup
-  UInt64 fTotalRTPPacketsLost;
-
-  // because there is no 64 bit atomic add (for obvious reasons), we efficiently
-  // implement total byte counting by atomic adding to this variable, then every
-  // once in awhile updating the sTotalBytes.
-  std::atomic_uint fPeriodicRTPBytes;
-  std::atomic_uint fPeriodicRTPPacketsLost;
-  std::atomic_uint fPeriodicRTPPackets;
 
   // stores the current served bandwidth in BITS per second
   UInt32 fCurrentRTPBandwidthInBits;
@@ -459,13 +446,19 @@ class QTSServerInterface : public QTSSDictionary {
   UInt32 fDebugLevel;
   UInt32 fDebugOptions;
 
-  SInt64 fMaxLate;
-  SInt64 fTotalLate;
-  SInt64 fCurrentMaxLate;
-  SInt64 fTotalQuality;
+  // values of the late/quality totals at the last Clear call
+  SInt64 fTotalLateBase;
+  SInt64 fTotalQualityBase;
   SInt32 fNumThinned;
   UInt32 fNumThreads;
 
+  // Storage for the packet path histogram attributes
+  UInt32 fSendLatencyP50;
+  UInt32 fSendLatencyP99;
+  UInt32 fSendLatencyMax;
+  UInt32 fSendPassP99;
+  UInt64 fSendWouldBlocks;
+
   // Param retrieval functions
   static void *CurrentUnixTimeMilli(QTSSDictionary *inServer, UInt32 *outLen);
 
@@ -477,6 +470,22 @@ class QTSServerInterface : public QTSSDictionary {
 
   static void *GetNumWastedBytes(QTSSDictionary *inServer, UInt32 *outLen);
 
+  static void *SumTotalRTPBytes(QTSSDictionary *inServer, UInt32 *outLen);
+
+  static void *SumTotalRTPPackets(QTSSDictionary *inServer, UInt32 *outLen);
+
+  static void *SumNumThinned(QTSSDictionary *inServer, UInt32 *outLen);
+
+  static void *GetSendLatencyP50(QTSSDictionary *inServer, UInt32 *outLen);
+
+  static void *GetSendLatencyP99(QTSSDictionary *inServer, UInt32 *outLen);
+
+  static void *GetSendLatencyMax(QTSSDictionary *inServer, UInt32 *outLen);
+
+  static void *GetSendPassP99(QTSSDictionary *inServer, UInt32 *outLen);
+
+  static void *SumSendWouldBlocks(QTSSDictionary *inServer, UInt32 *outLen);
+
   static QTSServerInterface *sServer;
   static QTSSAttrInfoDict::AttrInfo sAttributes[];
   static QTSSAttrInfoDict::AttrInfo sConnectedUserAttributes[];
@@ -497,13 +506,15 @@ class RTPStatsUpdaterTask : public CF::Thread::Task {
 
   SInt64 Run() override;
 
-  RTPSessionInterface *GetNewestSession(CF::RefTable *inRTPSessionMap);
-
   Float32 GetCPUTimeInSeconds();
 
   SInt64 fLastBandwidthTime;
   SInt64 fLastBandwidthAvg;
   SInt64 fLastBytesSent;
+
+  // totals at the previous run, the difference is this period's traffic
+  UInt64 fLastTotalBytes;
+  UInt64 fLastTotalPackets;
 };
 
 #endif // __QTSSERVERINTERFACE_H__
\ No newline at end of file
@@ -233,6 +233,10 @@ class QTSServerPrefs : public QTSSPrefs {
   char *GetServiceWANIP() { return this->GetStringPref(easyPrefsServiceWANIPAddr); }
   UInt16 GetRTSPWANPort() const { return fRTSPWANPort; }
 
+  UInt32 GetRTPPacingTickInMsec() { return fRTPPacingTickInMsec; }
+  UInt32 GetRTSPPushBufferSize() { return fRTSPPushBufferSize; }
+  UInt32 GetBandwidthShedMaxSessions() { return fBandwidthShedMaxSessions; }
+
   char *GetMovieFolder() { return this->GetStringPref(qtssPrefsMovieFolder); }
   char *GetNginxWebPath() { return this->GetStringPref(easyPrefsNginxRTMPServer); }
 
@@ -326,6 +330,10 @@ class QTSServerPrefs : public QTSSPrefs {
   char fRTSPWANAddr[20];
   UInt16 fRTSPWANPort;
 
+  UInt32 fRTPPacingTickInMsec;
+  UInt32 fRTSPPushBufferSize;
+  UInt32 fBandwidthShedMaxSessions;
+
   enum //fPacketHeaderPrintfOptions
   {
     kRTPALL = 1 << 0,
@@ -0,0 +1,142 @@
+/*
+    File:       QTSServerStats.h
+
+    Contains:   Hot path server statistics (RTP bytes/packets sent, packets
+                lost, lateness, quality, thinning). Every thread adds into
+                its own cache line sized shard with relaxed atomics, so
+                RTPStream::Write no longer takes the server mutex per
+                packet. Readers (RTPStatsUpdaterTask, the server dictionary
+                attributes, the status printers) sum the shards on demand.
+
+                Shards are handed out on a thread's first update and never
+                released, threads live as long as the server does and the
+                totals must not go backwards when one exits. Threads past
+                kMaxShards share the last shard, which is still correct,
+                only slower.
+
+                The packet path latency histograms (ingest to send, send
+                pass duration, WouldBlocks per pass) are kept per shard the
+                same way, but summed separately by SumHistograms, they are
+                much larger than the counters.
+*/
+
+#ifndef __QTSSERVER_STATS_H__
+#define __QTSSERVER_STATS_H__
+
+#include <atomic>
+
+#include <CF/Types.h>
+
+#include "LatencyHistogram.h"
+
+class QTSServerStats {
+ public:
+
+  enum {
+    kCacheLineSize = 64,
+    kMaxShards = 256,
+    kNumLateBuckets = 12
+  };
+
+  // upper bounds (msec, inclusive) of the lateness histogram buckets, the last
+  // bucket takes everything above kLateBucketBounds[kNumLateBuckets - 2]
+  static const SInt64 kLateBucketBounds[kNumLateBuckets - 1];
+
+  struct Totals {
+    UInt64 fRTPBytes;
+    UInt64 fRTPPackets;
+    UInt64 fRTPPacketsLost;
+    SInt64 fTotalLate;
+    SInt64 fMaxLate;
+    SInt64 fCurrentMaxLate;
+    SInt64 fTotalQuality;
+    SInt32 fNumThinned;
+    UInt64 fLateBuckets[kNumLateBuckets]; // packets per bucket, not cumulative
+  };
+
+  //
+  // WRITERS, called on the hot path of any thread
+
+  static void AddRTPBytes(UInt32 inBytes) {
+    GetShard()->fRTPBytes.fetch_add(inBytes, std::memory_order_relaxed);
+  }
+
+  static void AddRTPPackets(UInt32 inPackets) {
+    GetShard()->fRTPPackets.fetch_add(inPackets, std::memory_order_relaxed);
+  }
+
+  static void AddRTPPacketsLost(UInt32 inPackets) {
+    GetShard()->fRTPPacketsLost.fetch_add(inPackets, std::memory_order_relaxed);
+  }
+
+  static void AddLate(SInt64 inMilliseconds);
+
+  static void AddQuality(SInt32 inLevel) {
+    GetShard()->fTotalQuality.fetch_add(inLevel, std::memory_order_relaxed);
+  }
+
+  static void AddThinned(SInt32 inDifference) {
+    GetShard()->fNumThinned.fetch_add(inDifference, std::memory_order_relaxed);
+  }
+
+  // msec from the arrival of a packet at the reflector to its first send to a client
+  static void AddSendLatency(SInt64 inMilliseconds) {
+    GetShard()->fSendLatency.Record(inMilliseconds > 0 ? (UInt64) inMilliseconds : 0);
+  }
+
+  // one send pass of a reflector stream over its outputs, usec
+  static void AddSendPass(SInt64 inMicroseconds, UInt32 inNumWouldBlocks) {
+    Shard *theShard = GetShard();
+    theShard->fSendPassMicros.Record(inMicroseconds > 0 ? (UInt64) inMicroseconds : 0);
+    theShard->fWouldBlocks.Record(inNumWouldBlocks);
+  }
+
+  //
+  // READERS, O(number of threads)
+
+  static void Sum(Totals *outTotals);
+
+  struct Histograms {
+    LatencyHistogram::Snapshot fSendLatency;    // msec
+    LatencyHistogram::Snapshot fSendPassMicros; // usec
+    LatencyHistogram::Snapshot fWouldBlocks;    // per send pass
+  };
+
+  static void SumHistograms(Histograms *outHistograms);
+
+  // resets the per thread maxima behind Totals::fCurrentMaxLate
+  static void ClearCurrentMaxLate();
+
+ private:
+
+  struct Shard {
+    std::atomic<UInt64> fRTPBytes;
+    std::atomic<UInt64> fRTPPackets;
+    std::atomic<UInt64> fRTPPacketsLost;
+    std::atomic<SInt64> fTotalLate;
+    std::atomic<SInt64> fMaxLate;
+    std::atomic<SInt64> fCurrentMaxLate;
+    std::atomic<SInt64> fTotalQuality;
+    std::atomic<SInt32> fNumThinned;
+    std::atomic<UInt64> fLateBuckets[kNumLateBuckets];
+    LatencyHistogram fSendLatency;
+    LatencyHistogram fSendPassMicros;
+    LatencyHistogram fWouldBlocks;
+  };
+
+  // one shard per cache line, so two threads never write the same line
+  struct alignas(kCacheLineSize) PaddedShard : Shard {};
+
+  static Shard *GetShard() {
+    Shard *theShard = sThreadShard;
+    return theShard != nullptr ? theShard : AttachShard();
+  }
+
+  static Shard *AttachShard();
+
+  static PaddedShard sShards[kMaxShards];
+  static std::atomic_uint sNumShards;
+  static thread_local Shard *sThreadShard;
+};
+
+#endif //__QTSSERVER_STATS_H__
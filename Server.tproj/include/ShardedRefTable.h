@@ -0,0 +1,66 @@
+/*
+    File:       ShardedRefTable.h
+
+    Contains:   A RefTable split into lock striped shards by a hash of the
+                key. Resolve, Release and (Try)UnRegister only take the
+                mutex of the key's shard, so RTSP requests, session
+                teardowns and the reflector's session setup for different
+                sessions no longer wait on one table mutex.
+
+                Whole table work goes shard by shard. An iteration sees a
+                consistent snapshot of each shard under its mutex, never of
+                the whole table at once.
+*/
+
+#ifndef __SHARDED_REF_TABLE_H__
+#define __SHARDED_REF_TABLE_H__
+
+#include <CF/Ref.h>
+
+#include "QTSS.h"
+
+class ShardedRefTable {
+ public:
+
+  enum {
+    kDefaultNumShards = 16      // power of 2
+  };
+
+  // inTableSize is the hash table size of the whole table, split over the shards
+  ShardedRefTable(UInt32 inTableSize, UInt32 inNumShards = kDefaultNumShards);
+
+  ~ShardedRefTable();
+
+  // Same as the CF::RefTable calls, on the key's shard
+  CF::Core::Mutex *GetMutex(CF::StrPtrLen *inString) { return this->GetShard(inString)->GetMutex(); }
+
+  QTSS_Error Register(CF::Ref *ref) { return this->GetShard(ref->GetString())->Register(ref); }
+
+  CF::Ref *Resolve(CF::StrPtrLen *inString) { return this->GetShard(inString)->Resolve(inString); }
+
+  void Release(CF::Ref *inRef) { this->GetShard(inRef->GetString())->Release(inRef); }
+
+  void UnRegister(CF::Ref *ref, UInt32 refCount = 0) { this->GetShard(ref->GetString())->UnRegister(ref, refCount); }
+
+  bool TryUnRegister(CF::Ref *ref, UInt32 refCount = 0) {
+    return this->GetShard(ref->GetString())->TryUnRegister(ref, refCount);
+  }
+
+  UInt32 GetNumRefsInTable();
+
+  // For iterations: lock a shard's mutex, then walk its hash table
+  UInt32 GetNumShards() { return fNumShards; }
+
+  CF::RefTable *GetShard(UInt32 inIndex) { return fShards[inIndex]; }
+
+  CF::RefTable *GetShard(CF::StrPtrLen *inString) { return fShards[GetShardIndex(inString)]; }
+
+ private:
+
+  UInt32 GetShardIndex(CF::StrPtrLen *inString);
+
+  CF::RefTable **fShards;
+  UInt32 fNumShards;
+};
+
+#endif //__SHARDED_REF_TABLE_H__
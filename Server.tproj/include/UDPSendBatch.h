@@ -0,0 +1,89 @@
+/*
+    File:       UDPSendBatch.h
+
+    Contains:   Collects the UDP RTP sends that RTPStream::Write makes on the
+                current thread and flushes them with sendmmsg, one syscall per
+                socket instead of one per packet per client. Consecutive
+                packets to the same client can optionally be coalesced with
+                UDP GSO (UDP_SEGMENT).
+
+                Only writes flagged with qtssWriteFlagsBufferData are
+                batched, the caller must keep the packet data alive until
+                Flush() (or the destructor) returns.
+
+                RTP over RTSP writes flagged the same way while a batch is
+                current are queued on the RTSP connection and go out with
+                one writev, the caller must QTSS_Flush every TCP RTP stream
+                it wrote to before the batch ends.
+
+                Usage:
+                  UDPSendBatch theBatch;  // becomes current for this thread
+                  ... QTSS_Write(..., qtssWriteFlagsBufferData) ...
+                  theBatch.Flush();       // also done by the destructor
+*/
+
+#ifndef __UDP_SEND_BATCH_H__
+#define __UDP_SEND_BATCH_H__
+
+#include <atomic>
+
+#include <CF/Types.h>
+
+class UDPSendBatch {
+ public:
+
+  enum {
+    kMaxPackets = 64 // flushed when full
+  };
+
+  UDPSendBatch();
+  ~UDPSendBatch();
+
+  // The innermost batch of this thread, nullptr if nobody is batching
+  static UDPSendBatch *GetCurrent();
+
+  // Queues one datagram, inRemoteAddr/inRemotePort in host byte order
+  void Add(int inFD, UInt32 inRemoteAddr, UInt16 inRemotePort, void *inData, UInt32 inLen);
+
+  void Flush();
+
+  static void SetSendMmsgEnabled(bool enabled) { sSendMmsgEnabled.store(enabled, std::memory_order_relaxed); }
+
+  static void SetGSOEnabled(bool enabled) { sGSOEnabled.store(enabled, std::memory_order_relaxed); }
+
+  static void SetInterleavedEnabled(bool enabled) { sInterleavedEnabled.store(enabled, std::memory_order_relaxed); }
+
+  static bool IsInterleavedEnabled() { return sInterleavedEnabled.load(std::memory_order_relaxed); }
+
+  // totals over all batches, for statistics
+  static UInt64 GetTotalPackets() { return sTotalPackets; }
+
+  static UInt64 GetTotalSyscalls() { return sTotalSyscalls; }
+
+ private:
+
+  struct Packet {
+    int fFD;
+    UInt32 fRemoteAddr;
+    UInt16 fRemotePort;
+    void *fData;
+    UInt32 fLen;
+  };
+
+  void SendGroup(UInt32 *inIndexes, UInt32 inCount);
+
+  void SendOneByOne(UInt32 *inIndexes, UInt32 inCount);
+
+  Packet fPackets[kMaxPackets];
+  UInt32 fNumPackets;
+  UDPSendBatch *fPrevious; // outer batch on this thread, restored by the destructor
+
+  // read by every sending thread, turned off by whichever one finds them unsupported
+  static std::atomic<bool> sSendMmsgEnabled;
+  static std::atomic<bool> sGSOEnabled;
+  static std::atomic<bool> sInterleavedEnabled;
+  static std::atomic<UInt64> sTotalPackets;
+  static std::atomic<UInt64> sTotalSyscalls;
+};
+
+#endif //__UDP_SEND_BATCH_H__
@@ -0,0 +1,61 @@
+/*
+    File:       RTCPFeedbackPacket.cpp
+
+    Contains:   RTCP feedback message de-packetizing classes (RFC 4585)
+
+*/
+
+#include "RTCPFeedbackPacket.h"
+
+bool RTCPFeedbackPacket::ParseFeedbackPacket(UInt8 *inPacketBuffer, UInt32 inPacketLength,
+                                             UInt8 inPacketType, UInt8 inFormat) {
+  if (!this->ParsePacket(inPacketBuffer, inPacketLength))
+    return false;
+
+  if (this->GetPacketType() != inPacketType || this->GetFormat() != inFormat)
+    return false;
+
+  // length counts the words after the header, the two SSRCs must be there
+  UInt32 thePacketLen = (this->GetPacketLength() * 4) + kRTCPHeaderSizeInBytes;
+  if (thePacketLen < kFCIOffset)
+    return false;
+
+  fFCILen = thePacketLen - kFCIOffset;
+  return true;
+}
+
+UInt32 RTCPNackPacket::GetLostSeqNums(UInt16 *outSeqNums, UInt32 inMaxSeqNums) {
+  UInt32 theCount = 0;
+
+  for (UInt32 theEntry = 0; theEntry < this->GetNumEntries(); theEntry++) {
+    UInt16 thePID = this->GetPID(theEntry);
+    UInt16 theBLP = this->GetBLP(theEntry);
+
+    if (theCount == inMaxSeqNums)
+      break;
+    outSeqNums[theCount++] = thePID;
+
+    for (UInt16 theBit = 0; theBit < 16 && theCount < inMaxSeqNums; theBit++) {
+      if (theBLP & (1 << theBit))
+        outSeqNums[theCount++] = (UInt16) (thePID + theBit + 1);
+    }
+  }
+
+  return theCount;
+}
+
+void RTCPNackPacket::Dump() {
+  RTCPPacket::Dump();
+  s_printf(" H_media_ssrc=%" _U32BITARG_ "\n", this->GetMediaSSRC());
+  for (UInt32 theEntry = 0; theEntry < this->GetNumEntries(); theEntry++)
+    s_printf("              RTCP NACK[%" _U32BITARG_ "] H_pid=%u, H_blp=0x%04x\n",
+             theEntry, this->GetPID(theEntry), this->GetBLP(theEntry));
+}
+
+void RTCPPliPacket::WritePliPacket(UInt8 *ioBuffer, UInt32 inSenderSSRC, UInt32 inMediaSSRC) {
+  auto *theWriter = (UInt32 *) ioBuffer;
+  // V=2, FMT=1, PT=PSFB, length=2
+  *theWriter++ = htonl(0x80000000 | (kPliFormat << 24) | (kPayloadFeedbackPacketType << 16) | 2);
+  *theWriter++ = htonl(inSenderSSRC);
+  *theWriter = htonl(inMediaSSRC);
+}
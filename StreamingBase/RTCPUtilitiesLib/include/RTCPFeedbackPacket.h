@@ -0,0 +1,167 @@
+/*
+    File:       RTCPFeedbackPacket.h
+
+    Contains:   RTCP feedback message de-packetizing classes (RFC 4585)
+
+*/
+
+#ifndef _RTCPFEEDBACKPACKET_H_
+#define _RTCPFEEDBACKPACKET_H_
+
+#include "RTCPPacket.h"
+
+/**
+ * Common packet format for feedback messages:
+ *
+ *     0                   1                   2                   3
+ *     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *    |V=2|P|   FMT   |       PT      |          length               |
+ *    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *    |                  SSRC of packet sender                        |
+ *    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *    |                  SSRC of media source                         |
+ *    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *    :            Feedback Control Information (FCI)                 :
+ *
+ * FMT takes the place of the report count, PT is RTPFB (205) for transport
+ * layer feedback and PSFB (206) for payload specific feedback.
+ */
+class RTCPFeedbackPacket : public RTCPPacket {
+ public:
+
+  RTCPFeedbackPacket() : RTCPPacket(), fFCILen(0) {}
+  ~RTCPFeedbackPacket() override = default;
+
+  // Returns true if this is a feedback packet of the given type and format
+  bool ParseFeedbackPacket(UInt8 *inPacketBuffer, UInt32 inPacketLength, UInt8 inPacketType, UInt8 inFormat);
+
+  UInt8 GetFormat() { return (UInt8) this->GetReportCount(); }
+
+  UInt32 GetMediaSSRC() { return ntohl(*(UInt32 *) &fReceiverPacketBuffer[kMediaSourceIDOffset]); }
+
+  UInt8 *GetFCI() { return &fReceiverPacketBuffer[kFCIOffset]; }
+
+  UInt32 GetFCILength() { return fFCILen; }
+
+ protected:
+
+  enum {
+    kMediaSourceIDOffset = 8,
+    kFCIOffset = 12
+  };
+
+  UInt32 fFCILen; // in bytes
+};
+
+/**
+ * Generic NACK, RTPFB FMT=1. The FCI is a list of:
+ *
+ *     0                   1                   2                   3
+ *     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *    |            PID                |             BLP               |
+ *    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * PID is a lost sequence number, bit i of BLP reports PID + i + 1 lost too.
+ */
+class RTCPNackPacket : public RTCPFeedbackPacket {
+ public:
+
+  enum {
+    kNackFormat = 1,
+    kMaxLostPerEntry = 17 // PID and the 16 bits of BLP
+  };
+
+  RTCPNackPacket() : RTCPFeedbackPacket() {}
+  ~RTCPNackPacket() override = default;
+
+  // Returns true if this is a generic NACK packet
+  bool ParseNackPacket(UInt8 *inPacketBuffer, UInt32 inPacketLength) {
+    return this->ParseFeedbackPacket(inPacketBuffer, inPacketLength, kTransportFeedbackPacketType, kNackFormat);
+  }
+
+  UInt32 GetNumEntries() { return fFCILen / kEntrySizeInBytes; }
+
+  UInt16 GetPID(UInt32 inEntry) { return ntohs(*(UInt16 *) &this->GetFCI()[inEntry * kEntrySizeInBytes]); }
+
+  UInt16 GetBLP(UInt32 inEntry) { return ntohs(*(UInt16 *) &this->GetFCI()[inEntry * kEntrySizeInBytes + 2]); }
+
+  // Expands every entry into the lost sequence numbers, oldest request first.
+  // Returns the number written to outSeqNums, at most inMaxSeqNums.
+  UInt32 GetLostSeqNums(UInt16 *outSeqNums, UInt32 inMaxSeqNums);
+
+  void Dump() override;
+
+ private:
+
+  enum {
+    kEntrySizeInBytes = 4
+  };
+};
+
+/**
+ * Picture Loss Indication, PSFB FMT=1 (RFC 4585 6.3.1). There is no FCI, the
+ * media source SSRC names the stream that needs a new keyframe.
+ */
+class RTCPPliPacket : public RTCPFeedbackPacket {
+ public:
+
+  enum {
+    kPliFormat = 1,
+    kPliPacketSizeInBytes = 12
+  };
+
+  RTCPPliPacket() : RTCPFeedbackPacket() {}
+  ~RTCPPliPacket() override = default;
+
+  // Returns true if this is a PLI packet
+  bool ParsePliPacket(UInt8 *inPacketBuffer, UInt32 inPacketLength) {
+    return this->ParseFeedbackPacket(inPacketBuffer, inPacketLength, kPayloadFeedbackPacketType, kPliFormat);
+  }
+
+  // Writes a PLI of kPliPacketSizeInBytes to ioBuffer, the SSRCs in host order
+  static void WritePliPacket(UInt8 *ioBuffer, UInt32 inSenderSSRC, UInt32 inMediaSSRC);
+};
+
+/**
+ * Full Intra Request, PSFB FMT=4 (RFC 5104 4.3.1). The media source SSRC of
+ * the header is unused, the FCI is a list of:
+ *
+ *     0                   1                   2                   3
+ *     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *    |                              SSRC                             |
+ *    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *    | Seq nr.       |    Reserved                                   |
+ *    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ */
+class RTCPFirPacket : public RTCPFeedbackPacket {
+ public:
+
+  enum {
+    kFirFormat = 4
+  };
+
+  RTCPFirPacket() : RTCPFeedbackPacket() {}
+  ~RTCPFirPacket() override = default;
+
+  // Returns true if this is a FIR packet
+  bool ParseFirPacket(UInt8 *inPacketBuffer, UInt32 inPacketLength) {
+    return this->ParseFeedbackPacket(inPacketBuffer, inPacketLength, kPayloadFeedbackPacketType, kFirFormat);
+  }
+
+  UInt32 GetNumEntries() { return fFCILen / kEntrySizeInBytes; }
+
+  UInt32 GetSSRC(UInt32 inEntry) { return ntohl(*(UInt32 *) &this->GetFCI()[inEntry * kEntrySizeInBytes]); }
+
+  UInt8 GetSeqNum(UInt32 inEntry) { return this->GetFCI()[inEntry * kEntrySizeInBytes + 4]; }
+
+ private:
+
+  enum {
+    kEntrySizeInBytes = 8
+  };
+};
+
+#endif //_RTCPFEEDBACKPACKET_H_
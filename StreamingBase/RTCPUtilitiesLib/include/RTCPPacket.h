@@ -62,7 +62,9 @@ class RTCPPacket {
   enum {
     kReceiverPacketType = 201,  //UInt32
     kSDESPacketType = 202,  //UInt32
-    kAPPPacketType = 204   //UInt32
+    kAPPPacketType = 204,   //UInt32
+    kTransportFeedbackPacketType = 205, // RTPFB, RFC 4585
+    kPayloadFeedbackPacketType = 206    // PSFB, RFC 4585
   };
 
   RTCPPacket() : fReceiverPacketBuffer(nullptr) {}
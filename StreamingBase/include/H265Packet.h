@@ -0,0 +1,89 @@
+//
+// H.265/HEVC RTP payload, see H264Packet.h for H.264
+//
+
+#ifndef _EDSS2_H265PACKET_H_
+#define _EDSS2_H265PACKET_H_
+
+#include <CF/Types.h>
+
+/**
+ * H.265 Packet
+ *
+ * NAL Unit Header (2 bytes, fields cross the byte boundary so they are
+ * read with accessors instead of bit fields):
+ *
+ *    +---------------+---------------+
+ *    |0|1|2|3|4|5|6|7|0|1|2|3|4|5|6|7|
+ *    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *    |F|   Type    |  LayerId  | TID |
+ *    +-------------+-----------------+
+ *
+ * @see  rfc7798(section 1.1.4)
+ *
+ */
+struct H265NALUHeader {
+  unsigned char byte0;
+  unsigned char byte1;
+
+  UInt8 GetType() const { return static_cast<UInt8>((byte0 >> 1) & 0x3F); }
+
+  UInt8 GetLayerId() const { return static_cast<UInt8>(((byte0 & 0x01) << 5) | (byte1 >> 3)); }
+
+  UInt8 GetTID() const { return static_cast<UInt8>(byte1 & 0x07); }
+};
+
+/**
+ * NAL unit types used by the reflector
+ *
+ * @see  ITU-T H.265 (table 7-1), rfc7798(section 4.4)
+ */
+enum {
+  kH265NALURSVVCLN14 = 14,  // last sub-layer non-reference type, the even types up to it are _N
+  kH265NALUBLAWLP = 16,     // first IRAP type (BLA, IDR, CRA)
+  kH265NALUCRA = 21,        // last IRAP type in use
+  kH265NALUVPS = 32,
+  kH265NALUSPS = 33,
+  kH265NALUPPS = 34,
+  kH265NALUAP = 48,         // aggregation packet
+  kH265NALUFU = 49,         // fragmentation unit
+  kH265NALUPACI = 50
+};
+
+/**
+ * AP:
+ *
+ *    PayloadHdr (Type=48) | [DONL] | NALU size | NALU | NALU size | NALU ...
+ *
+ * @see  rfc7798(4.4.2)
+ *
+ *
+ * FU:
+ *
+ *    PayloadHdr (Type=49) | FU header | [DONL] | FU payload
+ *
+ * @see  rfc7798(4.4.3)
+ *
+ *
+ * FU header:
+ *
+ *    +---------------+
+ *    |0|1|2|3|4|5|6|7|
+ *    +-+-+-+-+-+-+-+-+
+ *    |S|E|  FuType   |
+ *    +---------------+
+ *
+ */
+struct H265FUHeader {
+#if BIGENDIAN
+  unsigned char s : 1;
+  unsigned char e : 1;
+  unsigned char type : 6;
+#else
+  unsigned char type : 6; //little 6 bit
+  unsigned char e : 1;
+  unsigned char s : 1; //high bit
+#endif
+};
+
+#endif // _EDSS2_H265PACKET_H_